@@ -0,0 +1,159 @@
+#ifndef CDR_H
+#define CDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Call detail records.
+ *
+ * A fixed-size record of every call (who called whom, when it was dialed,
+ * answered and hung up, and how it ended) is appended to a file.  As with
+ * the log, a call transition only copies its record into a ring owned by
+ * the calling thread and returns: it never takes a lock, makes a system
+ * call or waits for the disk.  A background thread started by cdr_start()
+ * drains the rings of all threads every CDR_FLUSH_MS milliseconds, or as
+ * soon as a ring is half full, copies the records, in order of hangup
+ * time, into the file, which it keeps mapped into memory, and then syncs
+ * the pages it wrote with one msync().  A record that finds its thread's
+ * ring full is dropped and counted.
+ *
+ * The file is a CDR_HEADER followed by CDR_RECORDs, and is created at its
+ * full size (sparse), so the records end at the first one whose outcome
+ * is 0.  Once it is full, it is truncated to the records written, and the
+ * next record starts a new file.  A file is started by moving whatever is
+ * at the path aside to "<path>.<time it was started>", so the path always
+ * holds the newest file; this is also done when the server starts, e.g.
+ * after a hot restart, while the old server finishes its own file.  The
+ * records are read by util/pbx_cdr.c.
+ *
+ * While a call is in progress, each of its TUs keeps its part of the
+ * record in a CDR_LEG, which only the TU's own commands write; the record
+ * is assembled from both legs by whichever command ends the call.
+ */
+#define CDR_MAGIC "PBXCDR1"
+
+/*
+ * Outcomes of a call.
+ */
+#define CDR_ANSWERED 1          // Answered, then hung up by either side
+#define CDR_CANCELLED 2         // Hung up by the caller before it was answered
+#define CDR_REJECTED 3          // Hung up by the callee while ringing
+#define CDR_BUSY 4              // The callee was busy (BUSY SIGNAL)
+#define CDR_ERROR 5             // No TU at the extension dialed (ERROR)
+
+/*
+ * Flags of a record.
+ */
+#define CDR_FLAG_CALLEE_ENDED 0x1   // The callee ended the call
+#define CDR_FLAG_DISCONNECTED 0x2   // Ended by a client disconnecting
+
+typedef struct cdr_header
+{
+    char magic[8];              // CDR_MAGIC
+    uint32_t header_size;       // sizeof(CDR_HEADER)
+    uint32_t record_size;       // sizeof(CDR_RECORD)
+    uint64_t created;           // When the file was started, in ns since the epoch
+    char reserved[40];
+} CDR_HEADER;
+
+/*
+ * Times are in nanoseconds since the epoch.
+ */
+typedef struct cdr_record
+{
+    uint64_t setup;             // When the call was dialed
+    uint64_t answer;            // When it was answered, or 0
+    uint64_t hangup;            // When it ended
+    int32_t caller;
+    int32_t callee;             // The extension dialed
+    uint16_t outcome;           // A CDR_xxx outcome; 0 in the unused space
+    uint16_t flags;             // CDR_FLAG_xxx
+    uint32_t reserved;
+} CDR_RECORD;
+
+/*
+ * Part of the record of a call kept by one of its TUs.
+ */
+typedef struct cdr_leg
+{
+    int callee;                 // Extension dialed by the caller, 0 for the callee
+    uint64_t setup;             // When the caller dialed
+    uint64_t answer;            // When the callee answered
+} CDR_LEG;
+
+#define CDR_RING_RECORDS 1024
+#define CDR_FLUSH_MS 10
+
+/*
+ * Default size at which a file is rotated.
+ */
+#define CDR_DEFAULT_MAX_BYTES (64 << 20)
+
+/*
+ * Nonzero once cdr_start() has been called; records are only kept then.
+ */
+extern int cdr_enabled;
+
+/*
+ * Start recording calls, in a file at the given path, and start the
+ * background thread that writes the records.  Records still staged at
+ * exit() are written too.
+ *
+ * @param path  The path of the file.
+ * @param max_bytes  The size at which a file is rotated.
+ * @return 0 if successful, -1 if the file could not be created.
+ */
+int cdr_start(const char *path, size_t max_bytes);
+
+/*
+ * Write every record staged so far, and sync it.  Called by the
+ * background thread, and at exit().
+ */
+void cdr_flush(void);
+
+/*
+ * Stage a record in the calling thread's ring.
+ */
+void cdr_write(const CDR_RECORD *r);
+
+/*
+ * Start the caller's leg of a call, when it dials.
+ */
+void cdr_dial(CDR_LEG *leg, int callee);
+
+/*
+ * Start the callee's leg of a call, when it answers.
+ */
+void cdr_answer(CDR_LEG *leg);
+
+/*
+ * Record the end of a call that rang.
+ *
+ * @param caller  The extension of the caller.
+ * @param leg  The caller's leg.
+ * @param callee_leg  The callee's leg if the call was answered, else NULL.
+ * @param outcome  CDR_ANSWERED, CDR_CANCELLED or CDR_REJECTED.
+ * @param flags  CDR_FLAG_xxx.
+ */
+void cdr_end(int caller, const CDR_LEG *leg, const CDR_LEG *callee_leg, int outcome, int flags);
+
+/*
+ * Record a call that failed when it was dialed.
+ *
+ * @param outcome  CDR_BUSY or CDR_ERROR.
+ */
+void cdr_failed(int caller, int callee, int outcome);
+
+/*
+ * Number of records dropped because their thread's ring was full, or
+ * because the file could not be written.
+ */
+uint64_t cdr_dropped(void);
+
+/*
+ * Number of records written to files.
+ */
+uint64_t cdr_written(void);
+
+#endif
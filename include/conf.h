@@ -0,0 +1,92 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+#include "outq.h"
+
+/*
+ * Conference bridges.
+ *
+ * A bridge joins any number of TUs into one call, in which a chat from any
+ * member is delivered to every other member.  Bridges are numbered by the
+ * clients that join them, independently of extensions, and exist while
+ * they have members: a bridge is created by the first TU to join it and
+ * freed when the last one leaves.  A member is in the TU_CONNECTED state,
+ * with the number of the bridge in place of the extension of a peer.
+ *
+ * A chat is serialized once for the whole fan-out (see PROTO_MSG), and
+ * every member's queue sends it from that shared buffer, or keeps a
+ * reference to it, rather than a copy of its own.  A member costs the
+ * bridge one entry of a dense array, holding its extension, protocol and
+ * output queue, so the fan-out is a linear scan.
+ *
+ * The bridges are found through a hash table with a lock of its own, which
+ * is taken only to join and leave.  Each bridge has a lock that protects
+ * its members, and is held while a chat is fanned out, so that a member
+ * gets no chat after it has left.  It is taken after the locks of the PBX
+ * engine and before those of the output queues.
+ */
+typedef struct conf CONF;
+
+/*
+ * Highest number of a bridge; numbers start at 1.
+ */
+#define CONF_MAX_BRIDGE 0x7fffffff
+
+/*
+ * Add a member to a bridge, creating the bridge if it has none.  The
+ * member's protocol must not change while it is in the bridge.
+ *
+ * @param number  The number of the bridge.
+ * @param ext  The extension of the member.
+ * @param out  The output queue of the member, used until it leaves.
+ * @param protocol  The protocol of the member.
+ * @return the bridge.
+ */
+CONF *conf_join(int number, int ext, OUTQ *out, int protocol);
+
+/*
+ * Remove a member from a bridge, freeing the bridge if it was the last.
+ * Nothing is sent to the member once this returns.
+ *
+ * @param c  The bridge, which must not be used by the caller again.
+ * @param ext  The extension of the member.
+ */
+void conf_leave(CONF *c, int ext);
+
+/*
+ * Get the number of a bridge.
+ */
+int conf_number(CONF *c);
+
+/*
+ * Send a chat to every member of a bridge but its sender.
+ *
+ * @param c  The bridge.
+ * @param ext  The extension of the sender.
+ * @param msg  The message.
+ * @param len  Its length.
+ * @return the number of members the chat was sent to.
+ */
+int conf_chat(CONF *c, int ext, const char *msg, size_t len);
+
+/*
+ * Join a TU to a conference bridge.  Implemented by the PBX engine.
+ *
+ *   If the TU is in the TU_DIAL_TONE state, it joins the bridge and goes
+ *     to the TU_CONNECTED state, unless the number of the bridge is out of
+ *     range, in which case it goes to the TU_ERROR state.
+ *   If the TU is in any other state, there is no change of state.
+ *
+ * In all cases, the TU is notified of its state.  The other members are
+ * not notified.  A member leaves the bridge by hanging up.
+ *
+ * @param tu  The TU.
+ * @param number  The number of the bridge.
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_join(TU *tu, int number);
+
+#endif
@@ -35,6 +35,19 @@
 #define SUCCESS
 #endif
 
+/*
+ * In the server, which links the asynchronous logger (log.h), these go to
+ * the log instead of being written to stderr as they are made.
+ */
+#ifdef PBX_ASYNC_LOG
+#include "log.h"
+#define debug(S, ...) log_debug(S, ##__VA_ARGS__)
+#define info(S, ...) log_info(S, ##__VA_ARGS__)
+#define success(S, ...) log_info(S, ##__VA_ARGS__)
+#define warn(S, ...) log_warn(S, ##__VA_ARGS__)
+#define error(S, ...) log_error(S, ##__VA_ARGS__)
+#else
+
 #ifdef DEBUG
 #define debug(S, ...)                                                          \
   do {                                                                         \
@@ -85,4 +98,6 @@
 #define error(S, ...)
 #endif
 
+#endif /* PBX_ASYNC_LOG */
+
 #endif /* DEBUG_H */
@@ -0,0 +1,130 @@
+#ifndef DIALPLAN_H
+#define DIALPLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Dial plan.
+ *
+ * The dial plan maps the digits dialed to where the call goes: an
+ * extension (an alias, e.g. "0042" or "100" for extension 4), a group of
+ * extensions, which are rung in turn by successive calls, or a trunk to
+ * another switch.  It is loaded from a file of one route per line:
+ *
+ *   # Comment
+ *   100   ext 4
+ *   200   group 4 5 6
+ *   9*    trunk 1
+ *
+ * A route whose digits end in '*' is a prefix route, which matches any
+ * number that starts with its digits; the longest route that matches a
+ * number wins, and a route for the number itself wins over a prefix
+ * route for it.  Numbers that no route matches are dialed as extension
+ * numbers, as they are without a dial plan.
+ *
+ * The routes are compiled into a digit trie, whose nodes are laid out
+ * breadth-first in one array, with the children of a node next to each
+ * other: a node holds a bitmap of the digits for which it has a child, and
+ * the index of its first child, so that the child for a digit is found by
+ * counting the bits below the digit's.  A lookup thus takes one node per
+ * digit dialed, whatever the number of routes, and a node takes 16 bytes.
+ *
+ * A compiled plan is never changed, except for the rotation of its
+ * groups.  A new plan is installed with one atomic store, without pausing
+ * calls: lookups in progress finish in the plan they started in, which is
+ * freed once the last of them has finished.
+ */
+typedef struct dialplan DIALPLAN;
+
+#define DIALPLAN_MAX_DIGITS 32
+#define DIALPLAN_MAX_MEMBERS 64     // Of a group
+
+/*
+ * Kinds of route.
+ */
+#define DIALPLAN_EXTENSION 1
+#define DIALPLAN_GROUP 2
+#define DIALPLAN_TRUNK 3
+
+/*
+ * Where a number goes.
+ */
+typedef struct dialplan_route
+{
+    int kind;                   // DIALPLAN_xxx
+    int target;                 // Extension (the member rung, for a group) or trunk
+    int matched;                // Digits matched by the route; a trunk gets the rest
+} DIALPLAN_ROUTE;
+
+/*
+ * Compile a dial plan from its text.  Errors are reported on stderr with
+ * their line number.
+ *
+ * @param text  The routes, in the format of the file.
+ * @param len  The length of the text.
+ * @return the plan, or NULL if the text has an error.
+ */
+DIALPLAN *dialplan_compile(const char *text, size_t len);
+
+/*
+ * Compile the dial plan in a file.
+ *
+ * @return the plan, or NULL if the file cannot be read or has an error.
+ */
+DIALPLAN *dialplan_load(const char *path);
+
+/*
+ * Free a plan that is not installed.
+ */
+void dialplan_free(DIALPLAN *plan);
+
+/*
+ * Look a number up in a plan.
+ *
+ * @param digits  The number dialed.
+ * @param len  Its length.
+ * @param route  Set to where the number goes, if a route matches it.
+ * @return 0 if a route matches the number, -1 otherwise.
+ */
+int dialplan_lookup(DIALPLAN *plan, const char *digits, size_t len, DIALPLAN_ROUTE *route);
+
+/*
+ * Get the memory a plan takes.
+ *
+ * @param routes  Set to the number of routes in the plan, if not NULL.
+ * @return the number of bytes.
+ */
+size_t dialplan_footprint(DIALPLAN *plan, size_t *routes);
+
+/*
+ * Install a plan in place of the current one, if any, which is freed once
+ * no lookup is using it.  The plan may not be used by the caller after.
+ *
+ * @param plan  The new plan, or NULL for none.
+ */
+void dialplan_install(DIALPLAN *plan);
+
+/*
+ * Find where a number dialed by a client goes, as the installed plan
+ * routes it.  Without a plan, or if no route matches it, the number is
+ * that of an extension.
+ *
+ * @param dialed  The number, NUL-terminated, possibly preceded by spaces.
+ * @param route  Set to where the number goes.
+ * @return the digits of the number that follow those matched by the
+ * route, which are passed on by a trunk (see trunk.h).
+ */
+const char *dialplan_resolve(const char *dialed, DIALPLAN_ROUTE *route);
+
+/*
+ * Get the extension to dial for a number dialed by a client, as the
+ * installed plan routes it.  A number routed to a trunk gives -1, which
+ * is no extension.
+ *
+ * @param dialed  The number, NUL-terminated, possibly preceded by spaces.
+ * @return the extension.
+ */
+int dialplan_extension(const char *dialed);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+#include "cdr.h"
+
+/*
+ * Hot restart.
+ *
+ * A running server can hand everything it serves over to a new server
+ * process, so that it can be replaced without disconnecting any client or
+ * dropping any call.  The running server listens for a successor on a Unix
+ * socket (see handoff_listen()).  When a successor connects, the running
+ * server stops accepting connections and reading commands, and sends it
+ * over that socket:
+ *
+ *   - its listening sockets and every client connection, as descriptors
+ *     passed with SCM_RIGHTS;
+ *   - for each client, the extension, state and peer (or conference
+ *     bridge) of its TU, the protocol it speaks, the output still queued for it and any partial
+ *     command it has sent.
+ *
+ * Once the successor confirms that it has received everything, the old
+ * server exits and the successor carries on from the same state.  If the
+ * handoff fails before that, the old server resumes service.
+ *
+ * Handoff is only supported when clients are serviced by reactor threads.
+ */
+
+/*
+ * Maximum number of client connections whose descriptors are passed in
+ * one message (the kernel accepts at most SCM_MAX_FD, 253, per message).
+ */
+#define HANDOFF_BATCH 200
+
+/*
+ * Time, in milliseconds, that either side waits for the other.
+ */
+#define HANDOFF_TIMEOUT_MS 5000
+
+/*
+ * State of a registered TU, as transferred to a successor.
+ */
+typedef struct tu_snapshot
+{
+    int ext;                    // Extension number
+    int fd;                     // Client connection
+    int state;                  // A TU_STATE value
+    int peer;                   // Extension of the peer, or -1 if none
+    int bridge;                 // Conference bridge joined, or 0 if none
+    CDR_LEG call;               // Part of the record of the call in progress
+    int protocol;               // PROTO_xxx spoken by the client
+    const char *output;         // Output still queued for the client
+    size_t output_len;
+} TU_SNAPSHOT;
+
+/*
+ * Take a snapshot of a TU and stop sending output to its client, which
+ * is left queued (see outq_freeze()).  The caller must make sure that
+ * no commands are being carried out meanwhile.
+ *
+ * @param tu  The TU.
+ * @param snap  Filled in with the state of the TU.
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_freeze(TU *tu, TU_SNAPSHOT *snap);
+
+/*
+ * Resume output to the client of a TU after an aborted handoff.
+ */
+void tu_thaw(TU *tu);
+
+/*
+ * Register TUs with the states recorded in a set of snapshots, at the
+ * same extensions, and reconnect the peers among them and rejoin their
+ * conference bridges.  No notifications
+ * are sent, other than the output recorded in the snapshots; a TU whose
+ * peer could not be restored is hung up as if the peer had gone away.
+ *
+ * @param pbx  The PBX.
+ * @param snaps  The snapshots.
+ * @param n  The number of snapshots.
+ * @param tus  Set to the TU restored from each snapshot, or NULL if its
+ * extension could not be registered.
+ * @return the number of TUs restored.
+ */
+int pbx_adopt(PBX *pbx, TU_SNAPSHOT *snaps, int n, TU **tus);
+
+/*
+ * Start a thread that waits for a successor to connect on a Unix socket
+ * and hands the server over to it.  Any stale socket at the path is
+ * replaced.  The process exits once a handoff has succeeded.
+ *
+ * @param path  Path of the Unix socket.
+ * @return 0 if the socket is being listened on, otherwise -1.
+ */
+int handoff_listen(char *path);
+
+/*
+ * Take over from the server listening for a successor at a path.  The
+ * reactor threads must have been started; the clients received are
+ * registered with the PBX and handed to them.
+ *
+ * @param path  Path of the Unix socket of the running server.
+ * @param listenfds  Set to the listening sockets received.
+ * @param max  Size of the listenfds array.
+ * @return the number of listening sockets, or -1 if the handoff failed.
+ */
+int handoff_receive(char *path, int *listenfds, int max);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef IOSTATS_H
+#define IOSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Counters of client commands and of the system calls made to serve them.
+ *
+ * Each thread counts into its own set of counters, so counting costs no
+ * more than an increment and never contends between threads.  The sets
+ * are summed when a report is requested; the counts of threads that have
+ * exited are folded into a running total.
+ */
+typedef struct iostats
+{
+    uint64_t commands;          // Commands dispatched
+    uint64_t reads;             // read() calls on client connections
+    uint64_t sends;             // send()/write() calls on client connections
+    uint64_t epoll_ctls;        // epoll_ctl() calls for output queues
+    uint64_t epoll_waits;       // epoll_wait() calls of the reactor threads
+    uint64_t enters;            // io_uring_enter() calls of the ring threads
+    struct iostats *next;
+    struct iostats *prev;
+} IOSTATS;
+
+/*
+ * Get the calling thread's counters.
+ */
+IOSTATS *iostats_local(void);
+
+/*
+ * Increment one of the calling thread's counters, e.g. IOSTATS_COUNT(reads).
+ */
+#define IOSTATS_COUNT(field) (iostats_local()->field++)
+
+/*
+ * Sum the counters of all threads.
+ *
+ * @param total  Set to the sums; the list links are not meaningful.
+ */
+void iostats_snapshot(IOSTATS *total);
+
+/*
+ * Print the summed counters, including the number of system calls per
+ * command.
+ */
+void iostats_report(FILE *out);
+
+#endif
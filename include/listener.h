@@ -0,0 +1,91 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * Connection acceptors.
+ *
+ * The server can run several acceptor threads, each with its own listening
+ * socket bound to the same port with SO_REUSEPORT, so that the kernel
+ * spreads incoming connections over them.  Each acceptor drains its
+ * backlog in batches with accept4() whenever the socket becomes readable,
+ * which keeps up with registration storms (every handset reconnecting at
+ * once) better than a single thread looping on accept().
+ */
+
+/*
+ * Maximum number of acceptor threads.
+ */
+#define LISTENER_MAX_ACCEPTORS 64
+
+/*
+ * Maximum number of connections accepted in one batch before the
+ * acceptor polls its socket again.
+ */
+#define LISTENER_BATCH 64
+
+/*
+ * Function called with each accepted connection.
+ * It takes ownership of the descriptor.
+ *
+ * @param connfd  The accepted connection.
+ * @return 0 if the connection was taken on, -1 if it was refused.
+ */
+typedef int listener_handler(int connfd);
+
+/*
+ * Open the listening sockets and start the acceptor threads.
+ *
+ * @param port  Port to listen on; "0" selects an ephemeral port, which is
+ * then shared by all acceptors.
+ * @param nacceptors  Number of acceptor threads (and listening sockets).
+ * @param handler  Function to which accepted connections are passed.
+ * @return the port number being listened on, or -1 on failure.
+ */
+int listener_start(char *port, int nacceptors, listener_handler *handler);
+
+/*
+ * Open listening sockets bound to the same port without starting acceptor
+ * threads, for an engine that accepts connections itself (see uring.h).
+ * The sockets are non-blocking, with SO_REUSEPORT set if n > 1.
+ *
+ * @param port  Port to listen on, or "0" for an ephemeral port.
+ * @param n  Number of sockets.
+ * @param fds  Set to the sockets.
+ * @return the port number being listened on, or -1 on failure.
+ */
+int listener_open(char *port, int n, int *fds);
+
+/*
+ * Start acceptor threads on listening sockets that are already open, e.g.
+ * ones inherited from another server process.  One acceptor is started
+ * per socket.
+ *
+ * @param fds  The listening sockets.
+ * @param n  The number of sockets.
+ * @param handler  Function to which accepted connections are passed.
+ * @return 0 if the acceptors were started, otherwise -1.
+ */
+int listener_adopt(int *fds, int n, listener_handler *handler);
+
+/*
+ * Get the listening sockets of the running acceptors.
+ *
+ * @param fds  Set to the sockets.
+ * @param max  Size of the fds array.
+ * @return the number of sockets.
+ */
+int listener_sockets(int *fds, int max);
+
+/*
+ * Stop accepting connections.  Returns once every acceptor has finished
+ * the batch it was working on, so no connection is being handed to the
+ * handler any more; connections that arrive meanwhile wait in the backlog.
+ */
+void listener_pause(void);
+
+/*
+ * Resume accepting connections after listener_pause().
+ */
+void listener_resume(void);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <semaphore.h>
+
+/*
+ * Lock contention profiling.
+ *
+ * The locks of the switch are taken with LOCK() and released with UNLOCK()
+ * instead of P() and V().  While profiling is off, these cost one test of
+ * a global more than P() and V().  Once a sampling period N has been set
+ * with lockprof_set_period(), each thread profiles one in N of its
+ * acquisitions: it measures how long it waited for the lock, and how long
+ * it held it until the matching UNLOCK().
+ *
+ * Samples are accumulated per call site of LOCK(), and each site belongs
+ * to a lock class, so that both "which kind of lock" and "which code path"
+ * can be answered from one report.
+ */
+typedef enum lock_class
+{
+    LOCK_CLASS_REGISTRY,        // Extension registry
+    LOCK_CLASS_TU,              // Per-TU state (semaphore engine)
+    LOCK_CLASS_FREELIST,        // Free objects of a pool
+    LOCK_CLASS_OUTQ,            // Output queues
+    LOCK_CLASS_CONNS,           // Connection list of a reactor
+    LOCK_CLASS_CONF,            // Conference bridges
+    LOCK_CLASS_TRUNK,           // Calls of a trunk
+    LOCK_CLASS_SHARD,           // Messages of a PBX shard (semaphore engine)
+    NUM_LOCK_CLASSES
+} LOCK_CLASS;
+
+/*
+ * Call site of LOCK(), with the samples taken there.  The counters are
+ * updated with atomic adds, which only sampled acquisitions pay for.
+ */
+typedef struct lock_site
+{
+    LOCK_CLASS class;
+    const char *file;
+    int line;
+    const char *func;
+    int registered;             // Set once the site is on the list of sites
+    uint64_t samples;           // Acquisitions sampled
+    uint64_t contended;         // Sampled acquisitions that had to wait
+    uint64_t wait_ns;           // Total time waited in sampled acquisitions
+    uint64_t max_wait_ns;
+    uint64_t holds;             // Sampled acquisitions whose release was seen
+    uint64_t hold_ns;           // Total time held after sampled acquisitions
+    uint64_t max_hold_ns;
+    struct lock_site *next;
+} LOCK_SITE;
+
+/*
+ * Maximum number of sampled locks a thread can hold at once and still have
+ * their hold times measured.
+ */
+#define LOCKPROF_MAX_HELD 8
+
+extern int lockprof_period;
+extern __thread int lockprof_countdown;
+extern __thread int lockprof_held;
+
+/*
+ * Acquire a lock, profiling the acquisition if it is sampled.
+ *
+ * @param sem  The semaphore.
+ * @param cls  Its LOCK_CLASS.
+ */
+#define LOCK(sem, cls)                                                                       \
+    do                                                                                       \
+    {                                                                                        \
+        static LOCK_SITE lockprof_site_ = {.class = (cls), .file = __FILE__,                 \
+                                           .line = __LINE__, .func = __func__};              \
+        if (lockprof_period != 0 && --lockprof_countdown <= 0)                               \
+            lockprof_acquire((sem), &lockprof_site_);                                        \
+        else                                                                                 \
+            P(sem);                                                                          \
+    } while (0)
+
+/*
+ * Release a lock taken with LOCK().
+ */
+#define UNLOCK(sem)                                                                          \
+    do                                                                                       \
+    {                                                                                        \
+        if (lockprof_held != 0)                                                              \
+            lockprof_release(sem);                                                           \
+        V(sem);                                                                              \
+    } while (0)
+
+/*
+ * Profile one in every period acquisitions of each thread; 0 turns
+ * profiling off.  Should be set before the threads taking locks start.
+ */
+void lockprof_set_period(int period);
+
+/*
+ * Slow paths of LOCK() and UNLOCK() for sampled acquisitions.
+ */
+void lockprof_acquire(sem_t *sem, LOCK_SITE *site);
+void lockprof_release(sem_t *sem);
+
+/*
+ * Print the samples of each lock class and call site, the sites with the
+ * most time spent waiting first.  Acquisitions are estimated from the
+ * samples and the sampling period.
+ */
+void lockprof_report(FILE *out);
+
+#endif
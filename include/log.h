@@ -0,0 +1,101 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/*
+ * Asynchronous logging.
+ *
+ * A log call formats its message into a ring buffer owned by the calling
+ * thread and returns; it never takes a lock or makes a system call.  A
+ * background thread started by log_start() drains the rings of all
+ * threads every LOG_FLUSH_MS milliseconds, orders the records by time and
+ * writes them out with one write().  A record that finds its thread's ring
+ * full is dropped and counted rather than waited for, and the number of
+ * records dropped is logged in their place.
+ *
+ * Levels below LOG_LEVEL are compiled out.  Of the rest, those below the
+ * level passed to log_start() are skipped at the cost of a test.  Until
+ * log_start() has been called, records are written synchronously to
+ * stderr, as debug() used to be.
+ *
+ * Messages are meant to be one line of "key=value" pairs, so that they can
+ * be parsed, e.g. log_info("event=connect ext=%d peer=%d", ...).
+ */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+/*
+ * Records in each thread's ring, and the largest message kept in one
+ * (longer ones are truncated).
+ */
+#define LOG_RING_RECORDS 256
+#define LOG_MESSAGE_SIZE 160
+
+#define LOG_FLUSH_MS 10
+
+extern int log_threshold;
+
+#define LOG_AT(level, S, ...)                                                          \
+    do                                                                                 \
+    {                                                                                  \
+        if ((level) >= LOG_LEVEL && (level) >= log_threshold)                          \
+            log_write((level), __FILE__, __func__, __LINE__, S, ##__VA_ARGS__);        \
+    } while (0)
+
+#define log_debug(S, ...) LOG_AT(LOG_LEVEL_DEBUG, S, ##__VA_ARGS__)
+#define log_info(S, ...) LOG_AT(LOG_LEVEL_INFO, S, ##__VA_ARGS__)
+#define log_warn(S, ...) LOG_AT(LOG_LEVEL_WARN, S, ##__VA_ARGS__)
+#define log_error(S, ...) LOG_AT(LOG_LEVEL_ERROR, S, ##__VA_ARGS__)
+
+/*
+ * Start the background thread that writes the log.  Records logged at
+ * exit() are flushed too.
+ *
+ * @param fd  The file descriptor to write to.
+ * @param level  The lowest level logged from now on.
+ */
+void log_start(int fd, int level);
+
+/*
+ * Set the lowest level logged, without starting the background thread.
+ */
+void log_set_level(int level);
+
+/*
+ * Get the level with a given name ("debug", "info", "warn", "error" or
+ * "off").
+ *
+ * @return the level, or -1 if there is no level of that name.
+ */
+int log_level_named(char *name);
+
+/*
+ * Write everything logged so far.  Called by the background thread, and
+ * at exit().
+ */
+void log_flush(void);
+
+/*
+ * Log a record; use the log_xxx() macros rather than calling this.
+ */
+void log_write(int level, const char *file, const char *func, int line, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+/*
+ * Number of records dropped because their thread's ring was full.
+ */
+uint64_t log_dropped(void);
+
+#endif
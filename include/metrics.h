@@ -0,0 +1,105 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * Metrics of the switch: latency histograms of the PBX operations and
+ * gauges of the number of TUs in each state.
+ *
+ * As with iostats, each thread records into its own set of metrics, which
+ * is padded to a whole number of cache lines so that threads never write
+ * to the same line.  Recording takes no lock; the sets are summed when the
+ * metrics are read, and the metrics of threads that have exited are folded
+ * into a running total.
+ *
+ * Latencies are kept in log-linear buckets (METRICS_SUB_BITS bits of
+ * precision per power of two, as in HDR histograms) of nanoseconds.
+ */
+typedef enum metric_op
+{
+    METRIC_PICKUP,
+    METRIC_HANGUP,
+    METRIC_DIAL,
+    METRIC_CHAT,
+    METRIC_JOIN,
+    METRIC_REGISTER,
+    METRIC_UNREGISTER,
+    NUM_METRIC_OPS
+} METRIC_OP;
+
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+
+/*
+ * Latencies of up to 2^METRICS_MAX_BITS ns (about 68 s) are told apart;
+ * longer ones are counted in the last bucket.
+ */
+#define METRICS_MAX_BITS 36
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+
+/*
+ * Number of TU states counted by the gauges.
+ */
+#define METRICS_STATES (TU_ERROR + 1)
+
+typedef struct metrics
+{
+    uint64_t buckets[NUM_METRIC_OPS][METRICS_BUCKETS];
+    uint64_t sum_ns[NUM_METRIC_OPS];
+    int64_t tus[METRICS_STATES];    // Net change in the number of TUs in each state
+    struct metrics *next;
+    struct metrics *prev;
+} __attribute__((aligned(64))) METRICS;
+
+/*
+ * Get the current time, to be passed to metrics_record() when the
+ * operation completes.
+ *
+ * @return the time in nanoseconds on the monotonic clock.
+ */
+uint64_t metrics_now(void);
+
+/*
+ * Record the latency of an operation.
+ *
+ * @param op  The operation.
+ * @param start  The time at which the operation started (see metrics_now()).
+ */
+void metrics_record(METRIC_OP op, uint64_t start);
+
+/*
+ * Record that a TU has changed state.
+ *
+ * @param from  The state it has left, or -1 if it has just been registered.
+ * @param to  The state it has entered, or -1 if it has been unregistered.
+ * Values outside the TU_STATE range are treated as -1.
+ */
+void metrics_state_change(int from, int to);
+
+/*
+ * Sum the metrics of all threads.
+ *
+ * @param total  Set to the sums; the list links are not meaningful.
+ */
+void metrics_snapshot(METRICS *total);
+
+/*
+ * Write all metrics, including the iostats counters, in the Prometheus
+ * text exposition format.
+ */
+void metrics_write(FILE *out);
+
+/*
+ * Start a thread that serves the metrics over HTTP on the loopback
+ * interface; any request receives the output of metrics_write().
+ *
+ * @param port  The port to listen on.
+ * @return 0 if the port is being listened on, otherwise -1.
+ */
+int metrics_listen(char *port);
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Non-blocking outbound queue for a client connection.
+ *
+ * Output is first attempted directly with a non-blocking send.  Whatever
+ * the socket does not accept immediately is appended to the queue and
+ * drained asynchronously by a flusher thread when the socket becomes
+ * writable, so a writer never blocks on a slow client.  If the amount
+ * of queued output exceeds the high-water mark, the client is considered
+ * a slow consumer and its connection is shut down.
+ *
+ * Output can be batched: between outq_batch_begin() and outq_batch_end(),
+ * every queue written by the calling thread is corked, so that all the
+ * messages sent to a connection during the batch go out together in one
+ * call when the batch ends.
+ */
+typedef struct outq OUTQ;
+
+/*
+ * Default high-water mark, in bytes of queued output per connection.
+ */
+#define OUTQ_DEFAULT_HIGH_WATER (256 * 1024)
+
+/*
+ * Set the high-water mark used for all queues.
+ *
+ * @param bytes  Maximum number of bytes that may be queued for a connection.
+ */
+void outq_set_high_water(size_t bytes);
+
+/*
+ * Create an outbound queue for a file descriptor.
+ *
+ * @param fd  The descriptor to which output is sent.
+ * @return the new queue.
+ */
+OUTQ *outq_create(int fd);
+
+/*
+ * Destroy an outbound queue.  Any output still queued is discarded.
+ * The file descriptor itself is not closed.
+ *
+ * @param q  The queue to destroy; it must not be used again.
+ */
+void outq_destroy(OUTQ *q);
+
+/*
+ * Send data on the connection underlying a queue, queueing whatever
+ * cannot be sent immediately.
+ *
+ * @param q  The queue.
+ * @param data  The bytes to send.
+ * @param len  The number of bytes to send.
+ * @return len if the data was sent or queued, -1 if the connection has
+ * failed or has been shut down for exceeding the high-water mark.
+ */
+int outq_send(OUTQ *q, const void *data, size_t len);
+
+/*
+ * Send the concatenation of several buffers as with outq_send(), in one
+ * call if it is sent directly, so that a message need not be assembled
+ * in a buffer of its own first.
+ *
+ * @param q  The queue.
+ * @param iov  The buffers.
+ * @param iovcnt  The number of buffers.
+ * @return the total number of bytes sent or queued, or -1 on failure.
+ */
+int outq_sendv(OUTQ *q, const struct iovec *iov, int iovcnt);
+
+/*
+ * Reference-counted buffer holding output sent to many queues, such as a
+ * message fanned out to every member of a conference.  A queue that must
+ * keep such output keeps a reference to the buffer rather than a copy,
+ * provided nothing else is queued ahead of it.
+ */
+typedef struct outq_buf
+{
+    int refs;
+    size_t len;
+    char data[];
+} OUTQ_BUF;
+
+/*
+ * Create a shared buffer, whose contents are filled in by the caller.
+ *
+ * @param len  The size of the contents.
+ * @return the buffer, with one reference held by the caller.
+ */
+OUTQ_BUF *outq_buf_create(size_t len);
+
+/*
+ * Take an additional reference to a shared buffer.
+ */
+void outq_buf_ref(OUTQ_BUF *b);
+
+/*
+ * Drop a reference to a shared buffer, which is freed once the last one
+ * is gone.  NULL is ignored.
+ */
+void outq_buf_release(OUTQ_BUF *b);
+
+/*
+ * Send the contents of a shared buffer as with outq_send().  The buffer
+ * must not be changed afterwards.
+ *
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int outq_send_buf(OUTQ *q, OUTQ_BUF *b);
+
+/*
+ * Open a stream on a queue, for a message sent in parts as they become
+ * available (e.g. a long chat relayed as it is received).  While the
+ * stream is open, output sent to the queue other than with
+ * outq_stream_write() is held back, so that it is not interleaved with the
+ * message, and is sent once the stream is closed.  Opening another stream,
+ * or freezing the queue, closes the open one early.  A stream is closed by
+ * sending the given end bytes, which must complete the message.
+ *
+ * @param q  The queue, which is referenced until the stream is closed.
+ * @param end  The bytes that close the stream.
+ * @param end_len  Their number, at most 8.
+ * @return a non-zero token for the stream, or 0 if the queue has failed.
+ */
+unsigned outq_stream_open(OUTQ *q, const void *end, size_t end_len);
+
+/*
+ * Send part of the output of a stream.  Unlike other output, it is sent
+ * at once even during a batch.
+ *
+ * @param stream  The token of the stream.
+ * @param wait  Whether to wait, while more than half the high-water mark
+ * is queued, for the queue to drain before sending; only for threads that
+ * may block, e.g. not reactors.
+ * @return 0 if the output was sent or queued, -1 if the stream has been
+ * closed or the queue has failed.
+ */
+int outq_stream_write(OUTQ *q, unsigned stream, const struct iovec *iov, int iovcnt, int wait);
+
+/*
+ * Close a stream unless it has already been closed, and drop the
+ * reference to the queue taken by outq_stream_open().
+ */
+void outq_stream_close(OUTQ *q, unsigned stream);
+
+/*
+ * Start a batch of output on the calling thread.  Batches may be nested;
+ * output is flushed when the outermost batch ends.
+ */
+void outq_batch_begin(void);
+
+/*
+ * End a batch of output, sending everything queued during the batch on
+ * each of the queues it wrote to.
+ */
+void outq_batch_end(void);
+
+/*
+ * Function that sends output on behalf of a queue, e.g. by submitting it
+ * to an io_uring, instead of send().  It must copy the data, and call
+ * outq_sent() once the data has been sent.
+ *
+ * @param q  The queue.
+ * @param fd  The descriptor of the queue.
+ * @param data  The output to send.
+ * @param len  The number of bytes to send.
+ */
+typedef void outq_submitter(OUTQ *q, int fd, const void *data, size_t len);
+
+/*
+ * Have the output of the batches of the calling thread sent by a
+ * submitter, so that it can be sent with fewer system calls.  A queue
+ * has at most one submission in flight; output sent to it meanwhile is
+ * queued and submitted once the first is done.
+ *
+ * @param submit  The submitter, or NULL to send output directly.
+ */
+void outq_set_submitter(outq_submitter *submit);
+
+/*
+ * Descriptors from OUTQ_VIRTUAL_FD up are not open: the output of their
+ * queues goes to the sink, if one is set.
+ */
+#define OUTQ_VIRTUAL_FD (1 << 20)
+
+/*
+ * Function that takes the output of queues in place of their descriptors,
+ * e.g. to drive the PBX in-process without sockets.  It is called with the
+ * queue's mutex held, so the output of each queue reaches it whole and in
+ * order, and it must take all of it; as it never leaves any behind, every
+ * write to the queue reaches it whole.
+ *
+ * @param fd  The descriptor of the queue.
+ * @param iov  The output.
+ * @param iovcnt  The number of buffers.
+ */
+typedef void outq_sink(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Send the output of the queues of descriptors from OUTQ_VIRTUAL_FD up to
+ * a sink, so that those descriptors need not be open.  Such queues are
+ * never handed to a submitter.  Must be set before any of them is
+ * created.
+ *
+ * @param sink  The sink, or NULL to send output to the descriptors.
+ */
+void outq_set_sink(outq_sink *sink);
+
+/*
+ * Report that output handed to a submitter has been sent.  Must be called
+ * by a thread with the same submitter, which is handed whatever was
+ * queued meanwhile.
+ *
+ * @param q  The queue.
+ * @param len  The number of bytes submitted.
+ * @param res  The number of bytes sent, or a negative error; the
+ * connection fails unless all of them were sent.
+ */
+void outq_sent(OUTQ *q, size_t len, ssize_t res);
+
+/*
+ * Stop sending the output of a queue, e.g. while its connection is being
+ * handed over to another process.  Output sent to a frozen queue is only
+ * queued (subject to the high-water mark) until the queue is thawed.
+ *
+ * @param q  The queue.
+ * @param data  Set to the output still queued, which remains valid until
+ * the queue is written to, thawed or destroyed.
+ * @return the number of bytes queued.
+ */
+size_t outq_freeze(OUTQ *q, const char **data);
+
+/*
+ * Resume sending the output of a queue stopped by outq_freeze().
+ */
+void outq_thaw(OUTQ *q);
+
+/*
+ * Format a message and send it as with outq_send().
+ *
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int outq_printf(OUTQ *q, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
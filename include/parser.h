@@ -0,0 +1,110 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Incremental line parser for client connections.
+ *
+ * Input is read directly from the connection in large chunks into the
+ * parser's buffer.  Complete lines are located in place by searching for
+ * the end-of-line sequence and handed out without being copied; partial
+ * lines are kept until the rest of the line arrives, and several lines
+ * arriving in a single read are returned one after the other.  Frames of
+ * the binary protocol (see proto.h) are handed out the same way.
+ */
+
+/*
+ * Size of the parser buffer, which bounds the length of a line.  Longer
+ * lines are discarded, except chats, which are relayed in parts (see
+ * parser_partial()).
+ */
+#define PARSER_BUFSIZE 8192
+
+struct chat_stream;
+
+typedef struct parser
+{
+    int fd;
+    int protocol;               // PROTO_xxx, decided by the first byte read
+    int discarding;             // Line (or bytes of a frame) being dropped
+    int held;                   // Byte replaced by the NUL after a frame, or -1
+    struct chat_stream *chat;   // Chat being relayed in parts, or NULL
+    size_t start;
+    size_t end;
+    char buf[PARSER_BUFSIZE + 1];  // Room for the NUL after a frame
+} PARSER;
+
+/*
+ * Initialize a parser reading from a file descriptor.
+ */
+void parser_init(PARSER *p, int fd);
+
+/*
+ * Read the next chunk of input from the parser's file descriptor.
+ * Blocks if the descriptor is blocking and no input is available.
+ *
+ * @return the number of bytes read, 0 on EOF, or -1 on error (with errno
+ * set; EAGAIN is returned unchanged for non-blocking descriptors).
+ */
+ssize_t parser_fill(PARSER *p);
+
+/*
+ * Append input that was received other than by reading the parser's
+ * descriptor, e.g. through io_uring.  Like parser_fill(), this invalidates
+ * any line previously returned.
+ *
+ * @param data  The input.
+ * @param len  Its length.
+ * @return the number of bytes taken, which is less than len if the buffer
+ * fills up; the rest must be fed once the buffered input is consumed.
+ */
+size_t parser_feed(PARSER *p, const char *data, size_t len);
+
+/*
+ * Get the next complete line from the parser's buffer.  The line is
+ * NUL-terminated in place, with the "\r\n" (or "\n") terminator and any
+ * leading whitespace removed; empty lines are skipped.  The line remains
+ * valid until the next call to parser_fill().
+ *
+ * @param len  Set to the length of the returned line.
+ * @return the line, or NULL if no complete line is buffered.
+ */
+char *parser_next(PARSER *p, size_t *len);
+
+/*
+ * Get a partial line that fills the whole buffer, so that it can be
+ * handled in parts rather than discarded.  Leading whitespace is skipped;
+ * the line is not NUL-terminated.
+ *
+ * @param len  Set to the length of the line buffered.
+ * @return the line, or NULL if the buffer is not filled by a partial line.
+ */
+char *parser_partial(PARSER *p, size_t *len);
+
+/*
+ * Get the input buffered for the line being handled in parts, up to its
+ * end, which is consumed.  A CR at the end of the input is kept back, as
+ * it may start the end-of-line sequence.  The part is not NUL-terminated,
+ * and remains valid until the next call to parser_fill().
+ *
+ * @param len  Set to the length of the part.
+ * @param last  Set to 1 if the part ends the line, otherwise to 0.
+ * @return the part, or NULL if none is buffered.
+ */
+char *parser_next_part(PARSER *p, size_t *len, int *last);
+
+/*
+ * Get the next complete frame of the binary protocol from the parser's
+ * buffer.  The payload is NUL-terminated in place, and remains valid until
+ * the next call to parser_next_frame() or parser_fill().  A frame whose
+ * payload exceeds PROTO_MAX_PAYLOAD is skipped.
+ *
+ * @param op  Set to the opcode of the frame.
+ * @param len  Set to the length of the payload.
+ * @return the payload, or NULL if no complete frame is buffered.
+ */
+char *parser_next_frame(PARSER *p, int *op, size_t *len);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Pools of fixed-size objects, such as TUs, output queues, connections
+ * and notification buffers, so that serving calls and connections does
+ * not go to the general-purpose allocator once the pools are warm.
+ *
+ * A pool carves its objects out of slabs of POOL_SLAB_BYTES and never
+ * returns them to the system.  Each thread keeps a cache of up to
+ * POOL_CACHE_OBJECTS free objects of each pool, so that getting and
+ * putting an object is normally a matter of a few instructions; a cache
+ * that runs empty or full exchanges half its objects with the pool's
+ * shared list, under the pool's lock, and the cache of a thread that
+ * exits is given back to the pool.
+ *
+ * The pool keeps no link inside a free object, so the contents of an
+ * object are left as they were when it was put back, and an object is
+ * only ever reused by the same pool: memory that once held an object
+ * holds an object of the same kind as long as the process lives.  An
+ * object is cleared to zeros and passed to the pool's init function, if
+ * it has one, once only, when its slab is carved.
+ */
+typedef struct pool POOL;
+
+#define POOL_MAX 16
+#define POOL_CACHE_OBJECTS 32
+#define POOL_SLAB_BYTES (64 * 1024)
+
+/*
+ * Default number of connections for which the pools are preallocated.
+ */
+#define POOL_DEFAULT_RESERVE 1024
+
+/*
+ * Create a pool.  At most POOL_MAX pools may be created.
+ *
+ * @param name  Name of the pool in reports.
+ * @param size  The size of an object.
+ * @param align  The alignment of an object, a power of two.
+ * @param init  Function called on each object when its slab is carved,
+ * or NULL.
+ * @return the new pool, holding the objects reserved with pool_reserve().
+ */
+POOL *pool_create(char *name, size_t size, size_t align, void (*init)(void *obj));
+
+/*
+ * Get an object from a pool.
+ */
+void *pool_get(POOL *p);
+
+/*
+ * Give an object back to the pool it was taken from.
+ */
+void pool_put(POOL *p, void *obj);
+
+/*
+ * Preallocate every pool, including those created later, with enough
+ * objects for the given number of connections: one object of each pool
+ * per connection.
+ */
+void pool_reserve(size_t connections);
+
+/*
+ * Print the objects of each pool: the number carved, the number free in
+ * the shared list and the memory taken.
+ */
+void pool_report(FILE *out);
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pbx.h"
+#include "outq.h"
+#include "parser.h"
+
+/*
+ * Client protocols.
+ *
+ * A connection speaks the text protocol ("dial 12\r\n", "CONNECTED 12\r\n")
+ * unless the first byte its client sends is PROTO_MAGIC, which can never
+ * start a text command.  The client then speaks the binary protocol, in
+ * which commands and notifications are frames made of a fixed header
+ *
+ *   byte 0     opcode
+ *   byte 1     0
+ *   bytes 2-3  length of the payload, in network byte order
+ *
+ * followed by the payload.  Integers in payloads are 32 bits, in network
+ * byte order.
+ *
+ *   PROTO_OP_PICKUP, PROTO_OP_HANGUP  no payload
+ *   PROTO_OP_DIAL                     the extension dialed
+ *   PROTO_OP_CHAT                     the message (also sent to the peer)
+ *   PROTO_OP_CHAT_PART                part of a message, whose other parts
+ *                                     follow in consecutive CHAT_PART
+ *                                     frames up to a final CHAT frame
+ *   PROTO_OP_JOIN                     the conference bridge joined
+ *   PROTO_OP_STATE + state            the extension of the TU in TU_ON_HOOK,
+ *                                     that of the peer (or the number of
+ *                                     the bridge) in TU_CONNECTED, 0 in
+ *                                     any other state
+ *
+ * The ON HOOK notification sent when a client connects, and any other
+ * notification sent before its first byte is read, are in text.  The
+ * server answers PROTO_MAGIC with PROTO_MAGIC followed by a notification
+ * of the current state, so a binary client skips everything up to the
+ * first PROTO_MAGIC it receives.
+ */
+#define PROTO_UNKNOWN -1        // No input read from the client yet
+#define PROTO_TEXT 0
+#define PROTO_BINARY 1
+
+#define PROTO_MAGIC 0xB1
+
+#define PROTO_OP_PICKUP 0x01
+#define PROTO_OP_HANGUP 0x02
+#define PROTO_OP_DIAL 0x03
+#define PROTO_OP_CHAT 0x04
+#define PROTO_OP_CHAT_PART 0x05
+#define PROTO_OP_JOIN 0x06
+#define PROTO_OP_STATE 0x10
+
+#define PROTO_HEADER_SIZE 4
+
+/*
+ * Largest payload of a command.  A longer frame is discarded, as an
+ * overlong line is in the text protocol.
+ */
+#define PROTO_MAX_PAYLOAD (PARSER_BUFSIZE - PROTO_HEADER_SIZE)
+
+/*
+ * Largest payload of a notification; longer chats are sent in parts.
+ */
+#define PROTO_MAX_NOTIFY 65535
+
+/*
+ * Send a state notification to a client.
+ *
+ * @param q  The output queue of the client.
+ * @param protocol  The protocol of the client.
+ * @param state  The state notified.
+ * @param ext  The extension sent with TU_ON_HOOK and TU_CONNECTED.
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int proto_send_state(OUTQ *q, int protocol, TU_STATE state, int ext);
+
+/*
+ * Send a chat to a client, straight from the buffer holding the message.
+ * In the text protocol, the message is cut at the first end of line, so
+ * that it stays one line.
+ *
+ * @param msg  The message.
+ * @param len  Its length.
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int proto_send_chat(OUTQ *q, int protocol, const char *msg, size_t len);
+
+/*
+ * A chat sent to many clients, e.g. the members of a conference.  It is
+ * serialized once for each protocol in which it is sent, into a shared
+ * buffer (see outq_send_buf()), rather than once per client.
+ */
+typedef struct proto_msg
+{
+    const char *msg;
+    size_t len;
+    OUTQ_BUF *encoded[2];       // Indexed by protocol, made on first use
+} PROTO_MSG;
+
+/*
+ * Prepare a chat for sending to many clients.
+ *
+ * @param msg  The message, which must remain valid until proto_msg_release().
+ * @param len  Its length.
+ */
+void proto_msg_init(PROTO_MSG *m, const char *msg, size_t len);
+
+/*
+ * Send a chat prepared with proto_msg_init() to a client.
+ *
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int proto_send_msg(OUTQ *q, int protocol, PROTO_MSG *m);
+
+/*
+ * Drop the references to the serialized chat held by a PROTO_MSG.  Queues
+ * that have yet to send it keep their own.
+ */
+void proto_msg_release(PROTO_MSG *m);
+
+/*
+ * A chat relayed to the peer as it is received, in parts, so that its
+ * length is not bounded by the parser's buffer.  The message goes out on a
+ * stream of the peer's output queue (see outq_stream_open()), as a single
+ * line in the text protocol, or as CHAT_PART frames ended by an empty
+ * CHAT frame in the binary protocol.
+ */
+typedef struct chat_stream
+{
+    OUTQ *q;                    // Output queue of the peer
+    unsigned token;             // Stream token, 0 if the stream failed
+    int protocol;               // Protocol of the peer
+    int peer;                   // Extension of the peer
+    int cut;                    // End of line sent, the rest is dropped
+    int wait;                   // See outq_stream_write()
+} CHAT_STREAM;
+
+/*
+ * Open a chat stream to a client.
+ *
+ * @param s  The stream; its wait field must be set.
+ * @param q  The output queue of the client.
+ * @param protocol  The protocol of the client.
+ * @return 0 if successful, -1 if the client's connection has failed.
+ */
+int proto_chat_open(CHAT_STREAM *s, OUTQ *q, int protocol);
+
+/*
+ * Send the next part of a chat stream.
+ *
+ * @return 0 if successful, -1 if the stream has been closed or the
+ * connection has failed.
+ */
+int proto_chat_part(CHAT_STREAM *s, const char *data, size_t len);
+
+/*
+ * End the message of a chat stream and close it.
+ */
+void proto_chat_close(CHAT_STREAM *s);
+
+/*
+ * Chat with the length of the message given, so that it need not be
+ * scanned for it.  Otherwise as tu_chat().  Implemented by the PBX engine.
+ *
+ * @return 0 if the chat was sent, -1 if there is no call in progress.
+ */
+int tu_chat_send(TU *tu, const char *msg, size_t len);
+
+/*
+ * Start a chat to be relayed in parts.  If the TU is connected, a chat
+ * stream is opened to its peer, in order with the peer's notifications.
+ * Otherwise the TU is notified of its state, as by tu_chat().  Implemented
+ * by the PBX engine.
+ *
+ * @param s  The stream, whose wait field must be set.
+ * @return 0 if the stream is open, -1 if there is no call in progress.
+ */
+int tu_chat_open(TU *tu, CHAT_STREAM *s);
+
+/*
+ * Relay the next part of a chat, if the call in which it was started is
+ * still in progress.  Implemented by the PBX engine.
+ *
+ * @return 0 if the part was sent, -1 if it was dropped.
+ */
+int tu_chat_write(TU *tu, CHAT_STREAM *s, const char *data, size_t len);
+
+/*
+ * Finish a chat relayed in parts, and notify the TU of its current state.
+ * Implemented by the PBX engine.
+ *
+ * @return 0 if the TU is still connected, otherwise -1.
+ */
+int tu_chat_close(TU *tu, CHAT_STREAM *s);
+
+/*
+ * Switch the notifications of a TU to another protocol, and notify its
+ * client of its current state in that protocol, preceded by PROTO_MAGIC
+ * for the binary protocol.  Implemented by the PBX engine.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_set_protocol(TU *tu, int protocol);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "pbx.h"
+#include "parser.h"
+
+/*
+ * Event-driven client service engine.
+ *
+ * Instead of dedicating a thread to every client connection, a small fixed
+ * set of reactor threads each own an epoll instance.  Accepted connections
+ * are handed to one of the reactors, which reads from them as data arrives
+ * and dispatches the parsed commands to the PBX module.
+ */
+
+/*
+ * Maximum number of reactor threads that can be started.
+ */
+#define REACTOR_MAX_THREADS 64
+
+/*
+ * Start the reactor threads.
+ *
+ * @param nthreads  Number of event-loop threads to start.
+ * @return 0 if the reactors were started, otherwise -1.
+ */
+int reactor_start(int nthreads);
+
+/*
+ * Hand an accepted client connection to one of the reactor threads.
+ * The client is registered with the PBX and from then on is serviced
+ * by the reactor; the connection is closed when the client disconnects.
+ *
+ * @param connfd  File descriptor of the accepted connection.
+ * @return 0 if the connection was accepted by a reactor, otherwise -1.
+ */
+int reactor_add(int connfd);
+
+/*
+ * Hand a client connection whose TU has already been registered (e.g. one
+ * received from another server process) to one of the reactor threads.
+ *
+ * @param connfd  File descriptor of the connection.
+ * @param tu  The TU registered for the connection.
+ * @param parser  Parser state to resume from, holding any partial command
+ * line already received; it is copied.
+ * @return 0 if the connection was accepted by a reactor, otherwise -1.
+ */
+int reactor_adopt(int connfd, TU *tu, PARSER *parser);
+
+/*
+ * Function called by reactor_foreach() for each connection.
+ */
+typedef void reactor_visitor(void *arg, int connfd, TU *tu, PARSER *parser);
+
+/*
+ * Call a function for every connection serviced by the reactors.
+ *
+ * @return the number of connections visited.
+ */
+int reactor_foreach(reactor_visitor *visit, void *arg);
+
+/*
+ * Stop servicing connections.  Returns once every reactor has finished the
+ * event it was handling, so no command is being carried out any more;
+ * input that arrives meanwhile is left unread.
+ */
+void reactor_pause(void);
+
+/*
+ * Resume servicing connections after reactor_pause().
+ */
+void reactor_resume(void);
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+
+/*
+ * Extension registry.
+ *
+ * Maps extension numbers to registered objects (TUs) through a dense,
+ * growable table of slots.  The extension number of an object is derived
+ * from the index of its slot, so lookup by extension is a direct index.
+ * The table grows in fixed-size chunks that are never moved, up to
+ * REGISTRY_MAX_SLOTS entries.
+ *
+ * Each slot carries a generation counter that is incremented whenever its
+ * object is removed.  A handle combines a slot index with the generation
+ * at the time of insertion, so a handle that outlives its object is
+ * detected rather than silently resolving to whatever object later
+ * reuses the slot.  Freed slots are reused in FIFO order, so a number
+ * that has just been released is the last one to be handed out again.
+ *
+ * The table is split into shards, each with its own lock, free list and
+ * chunks, so that registrations and lookups on different shards do not
+ * contend.  Extensions are dealt out to the shards in turn: with N shards,
+ * shard s holds the extensions REGISTRY_FIRST_EXTENSION + s, + s + N, and
+ * so on, so the shard of an extension is found without a lookup.  A
+ * thread can be given a home shard in which the objects it registers are
+ * placed, e.g. that of the worker thread that serves their clients; the
+ * objects registered by other threads are spread over the shards in turn.
+ * With one shard, the registry behaves as a single table.
+ */
+typedef struct registry REGISTRY;
+
+/*
+ * Handle that identifies one particular registration.
+ */
+typedef uint64_t REGISTRY_HANDLE;
+
+#define REGISTRY_INVALID_HANDLE ((REGISTRY_HANDLE)0)
+
+/*
+ * Extension number corresponding to the first slot.  Extensions used to be
+ * the client file descriptors, the lowest of which was 4; starting there
+ * keeps existing dial ranges (e.g. the tester's default of 4-5) meaningful.
+ */
+#define REGISTRY_FIRST_EXTENSION 4
+
+#define REGISTRY_CHUNK_SLOTS 4096
+#define REGISTRY_MAX_CHUNKS 256
+#define REGISTRY_MAX_SLOTS (REGISTRY_CHUNK_SLOTS * REGISTRY_MAX_CHUNKS)    // Per shard
+#define REGISTRY_MAX_SHARDS 64
+
+/*
+ * Set the number of shards of the registries created from now on.  The
+ * default is 1.
+ *
+ * @param shards  The number of shards, which is limited to the range 1 to
+ * REGISTRY_MAX_SHARDS.
+ */
+void registry_set_shards(int shards);
+
+/*
+ * Make a shard the home of the objects registered by the calling thread
+ * with registry_insert().
+ *
+ * @param shard  The shard, taken modulo the number of shards of the
+ * registry, or -1 to spread the objects over the shards in turn.
+ */
+void registry_set_home(int shard);
+
+/*
+ * Create an empty registry.
+ */
+REGISTRY *registry_create(void);
+
+/*
+ * Free a registry.  Objects still registered are not freed.
+ */
+void registry_destroy(REGISTRY *r);
+
+/*
+ * Register an object at the next free extension of the calling thread's
+ * home shard (see registry_set_home()).
+ *
+ * @param obj  The object to register.
+ * @param handle  If not NULL, set to the handle of the new registration.
+ * @return the assigned extension number, or -1 if the shard is full.
+ */
+int registry_insert(REGISTRY *r, void *obj, REGISTRY_HANDLE *handle);
+
+/*
+ * Register an object at a specific extension, if it is free.
+ *
+ * @return the extension number, or -1 if it is in use or out of range.
+ */
+int registry_insert_at(REGISTRY *r, int ext, void *obj, REGISTRY_HANDLE *handle);
+
+/*
+ * Remove the registration of an object.
+ *
+ * @param ext  The extension at which the object is registered.
+ * @param obj  The object, which must be the one registered at ext.
+ * @return 0 if the object was removed, otherwise -1.
+ */
+int registry_remove(REGISTRY *r, int ext, void *obj);
+
+/*
+ * Look up the object registered at an extension.  The hold function, if
+ * given, is called on the object before the shard's lock is released, so
+ * that the caller can take a reference that keeps it alive.
+ *
+ * @return the object, or NULL if the extension is not in use.
+ */
+void *registry_lookup(REGISTRY *r, int ext, void (*hold)(void *));
+
+/*
+ * Look up the object registered at an extension without taking the
+ * shard's lock.  Nothing keeps the object from being removed while the
+ * caller uses it, so this is only suitable for objects whose memory is
+ * never freed, and the caller must check that the object it gets is
+ * still registered at ext.
+ *
+ * @return the object, or NULL if the extension is not in use.
+ */
+void *registry_peek(REGISTRY *r, int ext);
+
+/*
+ * Look up the object for a handle, as with registry_lookup().
+ *
+ * @return the object, or NULL if the handle is stale or invalid.
+ */
+void *registry_resolve(REGISTRY *r, REGISTRY_HANDLE handle, void (*hold)(void *));
+
+/*
+ * Get the extension number designated by a handle.
+ */
+int registry_handle_extension(REGISTRY_HANDLE handle);
+
+/*
+ * Get the number of objects currently registered.
+ */
+int registry_count(REGISTRY *r);
+
+/*
+ * Get the number of shards of a registry.
+ */
+int registry_shards(REGISTRY *r);
+
+/*
+ * Get the shard that holds an extension.
+ *
+ * @return the shard, from 0 to registry_shards() - 1, or -1 if the
+ * extension is below REGISTRY_FIRST_EXTENSION.
+ */
+int registry_shard(REGISTRY *r, int ext);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "parser.h"
+
+/*
+ * Server-side helpers shared by the different client service engines
+ * (thread-per-connection in server.c and the event-driven reactor).
+ */
+
+/*
+ * Command to join a conference bridge ("join 7"; see conf.h), which
+ * follows the commands of TU_COMMAND.
+ */
+#define TU_JOIN_CMD (TU_CHAT_CMD + 1)
+
+/*
+ * Get the argument of pbx_client_service() for an accepted connection: a
+ * pointer to its file descriptor, taken from a pool to which
+ * pbx_client_service() gives it back.
+ *
+ * @param connfd  File descriptor of the connection.
+ */
+int *pbx_client_arg(int connfd);
+
+/*
+ * Parse a single command line received from a client.
+ * The line must not contain the "\r\n" terminator.
+ *
+ * @param line  NUL-terminated command text.
+ * @param len  Length of the command text.
+ * @param cmd  Set to the command that was recognized, a TU_COMMAND or
+ * TU_JOIN_CMD.
+ * @param arg  Set to the argument text of a dial, chat or join command.
+ * @return 0 if a command was recognized, otherwise -1.
+ */
+int pbx_parse_command(char *line, size_t len, int *cmd, char **arg);
+
+/*
+ * Parse a single command line received from a client and carry it out
+ * on the given TU.  The line must not contain the "\r\n" terminator.
+ *
+ * @param tu  The TU on whose behalf the command is issued.
+ * @param line  NUL-terminated command text.
+ * @param len  Length of the command text.
+ * @return the status returned by the tu_xxx function that was called,
+ * or -1 if the command was not recognized.
+ */
+int pbx_dispatch_command(TU *tu, char *line, size_t len);
+
+/*
+ * Carry out a single command frame of the binary protocol (see proto.h)
+ * on the given TU.
+ *
+ * @param tu  The TU on whose behalf the command is issued.
+ * @param op  The opcode of the frame.
+ * @param payload  The payload, NUL-terminated.
+ * @param len  Length of the payload.
+ * @return the status returned by the tu_xxx function that was called,
+ * or -1 if the command was not recognized.
+ */
+int pbx_dispatch_frame(TU *tu, int op, char *payload, size_t len);
+
+/*
+ * Carry out every complete command buffered by a parser, as one batch of
+ * output (see outq_batch_begin()).  The first byte received decides
+ * whether the client speaks the text or the binary protocol.
+ *
+ * @param tu  The TU on whose behalf the commands are issued.
+ * @param parser  The parser holding the input from the TU's client.
+ */
+void pbx_dispatch_lines(TU *tu, PARSER *parser);
+
+/*
+ * End a chat that a parser's client was sending in parts, if any, before
+ * its connection is closed.  The peer gets the part of the message that
+ * was received.
+ *
+ * @param tu  The TU on whose behalf the commands were issued.
+ * @param parser  The parser holding the input from the TU's client.
+ */
+void pbx_dispatch_end(TU *tu, PARSER *parser);
+
+#endif
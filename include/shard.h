@@ -0,0 +1,60 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "pbx.h"
+
+/*
+ * Shards of the PBX.
+ *
+ * The TUs are divided among the shards of the registry of extensions (see
+ * registry.h), each of which is a lock domain of its own: a transition
+ * between two TUs of the same shard locks both, as before, but no thread
+ * ever holds the locks of TUs of two different shards.  A dial, answer,
+ * hangup or chat that involves a TU of another shard is instead carried
+ * out on the TU of its own shard and posted as a message to the other
+ * shard, which applies it to its TU under that TU's lock alone.
+ *
+ * A shard may be claimed by a worker thread, e.g. the reactor whose
+ * clients are registered in it, which then handles every message posted
+ * to it: the shard's doorbell, an eventfd, becomes readable when messages
+ * are posted to it, and the worker reads the doorbell and calls
+ * pbx_shard_run().  The messages posted to a shard that has no owner are
+ * handled by the thread that posted them, before its command returns.
+ *
+ * The lock-free engine (pbx_cas.c) has no locks to divide, and its shards
+ * never have messages.
+ */
+
+/*
+ * Get the shard of a TU.
+ *
+ * @return the shard, or -1 if the TU is not registered.
+ */
+int pbx_shard_of(PBX *pbx, TU *tu);
+
+/*
+ * Make the calling thread the owner of a shard.
+ *
+ * @param shard  The shard.
+ * @return the shard's doorbell, or -1 if there is no such shard or its
+ * messages need no owner.
+ */
+int pbx_shard_claim(PBX *pbx, int shard);
+
+/*
+ * Handle the messages posted to a shard, and those that they cause to be
+ * posted to shards that have no owner.  Called by the owner of the shard
+ * once it has read its doorbell, or at any time to poll for messages.
+ *
+ * @param shard  The shard.
+ */
+void pbx_shard_run(PBX *pbx, int shard);
+
+/*
+ * Handle every message posted to any shard, until none is left.  Called
+ * while the owners are paused, e.g. before a handoff takes a snapshot of
+ * the TUs.
+ */
+void pbx_shard_drain_all(PBX *pbx);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef TRUNK_H
+#define TRUNK_H
+
+#include "pbx.h"
+
+/*
+ * Trunks between switches.
+ *
+ * Several server processes can be joined into one telephone network by
+ * trunks: TCP connections between switches, over which calls are set up
+ * and carried.  A switch connects its outgoing trunks, numbered from 1,
+ * to the trunk ports of other switches, and accepts incoming trunks on a
+ * trunk port of its own; calls are placed only from the side that
+ * connected the trunk, so two switches that call each other connect a
+ * trunk each way.  The dial plan (see dialplan.h) routes numbers to a
+ * trunk, which passes on the digits that follow those matched by the
+ * route, to be dialed on the other switch as if by one of its own
+ * clients: through its dial plan, and possibly through another trunk.
+ *
+ * Each end of a call carried by a trunk is a proxy: a TU of its switch,
+ * registered for the call with a virtual descriptor (see OUTQ_VIRTUAL_FD)
+ * whose output, in the binary protocol, is taken by the trunk.  The
+ * switch placing the call has its client dial the proxy, which rings;
+ * the other switch has its proxy pick up and dial the number.  From then
+ * on, each proxy is driven by the messages from the other end and its
+ * notifications become the messages to it, so calls across switches go
+ * through the same transitions as calls within one, with the proxy
+ * standing in for the remote TU:
+ *
+ *   caller    proxy    ====    proxy    callee
+ *   RING BACK RINGING  SETUP   RING BACK RINGING
+ *                      ALERT
+ *   CONNECTED CONNECTED ANSWER CONNECTED CONNECTED
+ *       chat ---> CHAT ---> CHAT ---> chat
+ *
+ * A call the other switch cannot complete (its callee busy or not
+ * registered) is released, which leaves the caller as a callee that
+ * hangs up while ringing does: in TU_DIAL_TONE.
+ *
+ * Messages are frames of the binary protocol (see proto.h), whose payload
+ * starts with the 32-bit reference given to the call by the switch that
+ * placed it:
+ *
+ *   TRUNK_OP_SETUP     the digits to dial
+ *   TRUNK_OP_ALERT     the callee is ringing
+ *   TRUNK_OP_ANSWER    the callee has answered
+ *   TRUNK_OP_CHAT      a chat, or its last part
+ *   TRUNK_OP_CHAT_PART a part of a chat continued by the next frame
+ *   TRUNK_OP_RELEASE   the call is over, with the state that ended it
+ *   TRUNK_OP_RELEASED  the call is over at the other end too, and its
+ *                      reference may be reused
+ *
+ * Either end may release a call, and both may do so at once; a RELEASE
+ * received for a call already released stands for RELEASED.  When a trunk
+ * fails, its calls are released at both ends, and an outgoing trunk is
+ * connected again.
+ */
+#define TRUNK_MAX 64                // Outgoing trunks are numbered 1 to TRUNK_MAX - 1
+#define TRUNK_MAX_CALLS 65536       // Calls carried at once by all trunks
+#define TRUNK_RETRY_MS 500          // Between attempts to connect a trunk
+
+#define TRUNK_OP_SETUP 0x20
+#define TRUNK_OP_ALERT 0x21
+#define TRUNK_OP_ANSWER 0x22
+#define TRUNK_OP_CHAT 0x23
+#define TRUNK_OP_CHAT_PART 0x24
+#define TRUNK_OP_RELEASE 0x25
+#define TRUNK_OP_RELEASED 0x26
+
+/*
+ * Accept incoming trunks on a port.
+ *
+ * @param port  The port, or "0" for an ephemeral port.
+ * @return the port number being listened on, or -1 on failure.
+ */
+int trunk_listen(char *port);
+
+/*
+ * Connect an outgoing trunk to the trunk port of another switch, now and
+ * whenever the connection is lost.  Calls routed to the trunk while it is
+ * not connected fail with TU_ERROR.
+ *
+ * @param number  The number of the trunk, which the dial plan routes to.
+ * @param host  The host of the other switch.
+ * @param port  Its trunk port.
+ * @return 0 if successful, -1 if the number is out of range or in use.
+ */
+int trunk_connect(int number, char *host, char *port);
+
+/*
+ * Get the extension for a TU to dial for a number dialed by its client.
+ * A number the dial plan routes to a trunk is dialed on the other switch:
+ * if the TU is in TU_DIAL_TONE and the trunk is connected, a proxy is
+ * registered for the call, and it is the proxy's extension that the TU
+ * dials, which places the call when the proxy rings.
+ *
+ * @param tu  The TU dialing.
+ * @param dialed  The number, NUL-terminated, possibly preceded by spaces.
+ * @return the extension, -1 if there is none.
+ */
+int trunk_dial(TU *tu, const char *dialed);
+
+/*
+ * As trunk_dial(), for an extension number dialed in a frame of the
+ * binary protocol, whose digits are routed as those of the text protocol.
+ */
+int trunk_dial_number(TU *tu, int number);
+
+/*
+ * Get the state of a TU.  Implemented by the PBX engine.
+ *
+ * @return the state, or -1 if the TU is not registered.
+ */
+int tu_state(TU *tu);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * io_uring-based client service engine.
+ *
+ * Each ring thread owns an io_uring instance and its own listening socket,
+ * bound to the server port with SO_REUSEPORT.  Connections are accepted by
+ * a multishot accept, and read by a multishot recv that picks its buffers
+ * from a ring of buffers provided to the kernel, so that neither needs a
+ * system call per connection or per read.  The output of every command
+ * handled in one pass over the completions is submitted as send requests
+ * (see outq_set_submitter()), which go to the kernel together with the
+ * next wait for completions.  A loaded ring thus makes one system call per
+ * pass, however many clients it serves in it.
+ *
+ * Commands are carried out by the same tu_xxx functions as with the other
+ * engines.  Hot restart is not supported.
+ */
+
+/*
+ * Maximum number of ring threads that can be started.
+ */
+#define URING_MAX_THREADS 64
+
+/*
+ * Open the listening sockets and start the ring threads.
+ *
+ * @param port  Port to listen on, or "0" for an ephemeral port.
+ * @param nthreads  Number of ring threads.
+ * @return the port number being listened on, or -1 on failure (e.g. if the
+ * kernel does not support the io_uring features used).
+ */
+int uring_start(char *port, int nthreads);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdio.h>
+
+/*
+ * Synthetic call workload, run by the server against itself with -T.
+ *
+ * WORKLOAD_PAIRS threads each connect a pair of clients to the server
+ * over the loopback interface and have one call the other in a loop:
+ * pickup, dial, answer, a chat each way, hang up on both sides.  Every
+ * notification is checked.  It serves as the training run of the
+ * profile-guided build ("make pgo"), and to compare the builds of the
+ * server ("make compare").
+ */
+#define WORKLOAD_PAIRS 16
+
+/*
+ * Run the workload against the server listening on a port of the
+ * loopback interface, and report the rate of calls and the CPU time the
+ * server took per call: that of the whole process, less that of the
+ * workload's own threads.
+ *
+ * @param port  The port on which the server listens.
+ * @param calls  The number of calls made, shared out among the pairs.
+ * @param out  Where the report is printed.
+ * @return 0 if every call went as expected, otherwise -1.
+ */
+int workload_run(int port, long calls, FILE *out);
+
+#endif
@@ -0,0 +1,468 @@
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cdr.h"
+#include "log.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Ring of records staged by one thread, as in log.c.  The producer only
+ * advances head and the writer only advances tail.
+ */
+typedef struct cdr_ring
+{
+    CDR_RECORD records[CDR_RING_RECORDS];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped_seen;      // Part of dropped already counted
+    int closed;                 // Set when the thread has exited
+    struct cdr_ring *next;
+} CDR_RING;
+
+/*
+ * A staged record, with its position in its ring to keep the records of
+ * a thread in order.
+ */
+struct staged
+{
+    CDR_RECORD r;
+    uint64_t seq;
+};
+
+int cdr_enabled;
+
+static pthread_once_t cdr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cdr_key;
+static sem_t cdr_mutex;         // Protects the rings list and the file
+static sem_t cdr_wakeup;
+static CDR_RING *rings;
+static __thread CDR_RING *local;
+
+static struct staged *batch;
+static size_t batch_size;
+
+static char *cdr_path;
+static size_t cdr_max_bytes;
+static int cdr_fd = -1;
+static char *map;               // The file, mapped
+static size_t map_len;
+static size_t used;             // Records in the file
+static size_t capacity;         // Records the file can hold
+static uint64_t total_dropped;
+static uint64_t total_written;
+
+static void cdr_init(void);
+static void cdr_retire(void *arg);
+static CDR_RING *cdr_local(void);
+static void *cdr_thread(void *arg);
+static void cdr_at_exit(void);
+static uint64_t cdr_now(void);
+static int file_start(void);
+static void file_finish(void);
+static void set_aside(void);
+static int compare_staged(const void *a, const void *b);
+
+/*
+ * Start recording calls and the background thread that writes the
+ * records.
+ */
+int cdr_start(const char *path, size_t max_bytes)
+{
+    pthread_t tid;
+
+    Pthread_once(&cdr_once, cdr_init);
+
+    cdr_path = strdup(path);
+    cdr_max_bytes = max_bytes;
+    if (file_start() < 0)
+        return -1;
+
+    atexit(cdr_at_exit);
+    Pthread_create(&tid, NULL, cdr_thread, NULL);
+    Pthread_detach(tid);
+    __atomic_store_n(&cdr_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Stage a record.  The writer is woken early when the ring is half full,
+ * which costs a system call only if it is asleep.
+ */
+void cdr_write(const CDR_RECORD *r)
+{
+    CDR_RING *ring = cdr_local();
+    uint64_t head = ring->head;
+    uint64_t staged = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (staged == CDR_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring->records[head % CDR_RING_RECORDS] = *r;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (staged + 1 == CDR_RING_RECORDS / 2)
+        V(&cdr_wakeup);
+}
+
+/*
+ * Start the caller's leg of a call.
+ */
+void cdr_dial(CDR_LEG *leg, int callee)
+{
+    if (!cdr_enabled)
+        return;
+    leg->callee = callee;
+    leg->setup = cdr_now();
+    leg->answer = 0;
+}
+
+/*
+ * Start the callee's leg of a call.
+ */
+void cdr_answer(CDR_LEG *leg)
+{
+    if (!cdr_enabled)
+        return;
+    leg->callee = 0;
+    leg->setup = 0;
+    leg->answer = cdr_now();
+}
+
+/*
+ * Record the end of a call that rang.
+ */
+void cdr_end(int caller, const CDR_LEG *leg, const CDR_LEG *callee_leg, int outcome, int flags)
+{
+    if (!cdr_enabled)
+        return;
+
+    CDR_RECORD r = {.setup = leg->setup, .answer = callee_leg != NULL ? callee_leg->answer : 0,
+                    .hangup = cdr_now(), .caller = caller, .callee = leg->callee,
+                    .outcome = outcome, .flags = flags};
+    cdr_write(&r);
+}
+
+/*
+ * Record a call that failed when it was dialed.
+ */
+void cdr_failed(int caller, int callee, int outcome)
+{
+    if (!cdr_enabled)
+        return;
+
+    uint64_t now = cdr_now();
+    CDR_RECORD r = {.setup = now, .hangup = now, .caller = caller, .callee = callee, .outcome = outcome};
+    cdr_write(&r);
+}
+
+/*
+ * Write every record staged so far to the file, in order of hangup time,
+ * rotating the file as it fills, and sync the pages written.
+ */
+void cdr_flush(void)
+{
+    size_t n = 0;
+    uint64_t dropped = 0;
+
+    Pthread_once(&cdr_once, cdr_init);
+
+    P(&cdr_mutex);
+
+    CDR_RING **prev = &rings;
+    for (CDR_RING *ring = rings; ring != NULL;)
+    {
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        if (n + (head - tail) > batch_size)
+        {
+            batch_size = 2 * (n + (head - tail));
+            batch = Realloc(batch, batch_size * sizeof(struct staged));
+        }
+        for (; tail != head; tail++, n++)
+        {
+            batch[n].r = ring->records[tail % CDR_RING_RECORDS];
+            batch[n].seq = tail;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t ring_dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        dropped += ring_dropped - ring->dropped_seen;
+        ring->dropped_seen = ring_dropped;
+
+        CDR_RING *next = ring->next;
+        if (closed)
+        {
+            *prev = next;
+            Free(ring);
+        }
+        else
+        {
+            prev = &ring->next;
+        }
+        ring = next;
+    }
+
+    qsort(batch, n, sizeof(struct staged), compare_staged);
+
+    size_t first = used;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (map == NULL || used == capacity)
+        {
+            file_finish();
+            if (file_start() < 0)
+            {
+                dropped += n - i;
+                break;
+            }
+            first = 0;
+        }
+        memcpy(map + sizeof(CDR_HEADER) + used * sizeof(CDR_RECORD), &batch[i].r, sizeof(CDR_RECORD));
+        used++;
+        total_written++;
+    }
+
+    if (map != NULL && used > first)
+    {
+        size_t start = (sizeof(CDR_HEADER) + first * sizeof(CDR_RECORD)) & ~(size_t)(getpagesize() - 1);
+        msync(map + start, sizeof(CDR_HEADER) + used * sizeof(CDR_RECORD) - start, MS_SYNC);
+    }
+
+    if (dropped > 0)
+    {
+        total_dropped += dropped;
+        log_warn("event=cdr_dropped records=%llu", (unsigned long long)dropped);
+    }
+
+    V(&cdr_mutex);
+}
+
+/*
+ * Number of records dropped.
+ */
+uint64_t cdr_dropped(void)
+{
+    uint64_t dropped;
+
+    Pthread_once(&cdr_once, cdr_init);
+
+    P(&cdr_mutex);
+    dropped = total_dropped;
+    for (CDR_RING *ring = rings; ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) - ring->dropped_seen;
+    V(&cdr_mutex);
+
+    return dropped;
+}
+
+/*
+ * Number of records written to files.
+ */
+uint64_t cdr_written(void)
+{
+    uint64_t written;
+
+    Pthread_once(&cdr_once, cdr_init);
+
+    P(&cdr_mutex);
+    written = total_written;
+    V(&cdr_mutex);
+
+    return written;
+}
+
+static void cdr_init(void)
+{
+    Sem_init(&cdr_mutex, 0, 1);
+    Sem_init(&cdr_wakeup, 0, 0);
+    if (pthread_key_create(&cdr_key, cdr_retire) != 0)
+        app_error("pthread_key_create error");
+}
+
+/*
+ * Get the calling thread's ring, creating it on first use.
+ */
+static CDR_RING *cdr_local(void)
+{
+    if (local != NULL)
+        return local;
+
+    Pthread_once(&cdr_once, cdr_init);
+
+    if (posix_memalign((void **)&local, 64, sizeof(CDR_RING)) != 0)
+        unix_error("posix_memalign error");
+    local->head = local->tail = 0;
+    local->dropped = local->dropped_seen = 0;
+    local->closed = 0;
+    pthread_setspecific(cdr_key, local);
+
+    P(&cdr_mutex);
+    local->next = rings;
+    rings = local;
+    V(&cdr_mutex);
+
+    return local;
+}
+
+/*
+ * Thread-exit destructor: the ring is left for the writer to drain and
+ * free.
+ */
+static void cdr_retire(void *arg)
+{
+    CDR_RING *ring = arg;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Thread function of the writer.
+ */
+static void *cdr_thread(void *arg)
+{
+    while (1)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CDR_FLUSH_MS * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&cdr_wakeup, &deadline) < 0 && errno == EINTR)
+            ;
+        cdr_flush();
+    }
+    return NULL;
+}
+
+/*
+ * The file is left truncated to the records written.
+ */
+static void cdr_at_exit(void)
+{
+    cdr_flush();
+    P(&cdr_mutex);
+    file_finish();
+    V(&cdr_mutex);
+}
+
+static uint64_t cdr_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Start a new file at the path, after setting aside whatever is there,
+ * and map it.  cdr_mutex must be held, except by cdr_start().
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int file_start(void)
+{
+    int fd = -1;
+
+    capacity = (cdr_max_bytes > sizeof(CDR_HEADER) ? cdr_max_bytes - sizeof(CDR_HEADER) : 0) / sizeof(CDR_RECORD);
+    if (capacity == 0)
+        capacity = 1;
+    map_len = sizeof(CDR_HEADER) + capacity * sizeof(CDR_RECORD);
+
+    // Another server may be starting a file at the same path.
+    for (int tries = 0; fd < 0 && tries < 3; tries++)
+    {
+        set_aside();
+        fd = open(cdr_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0 || ftruncate(fd, map_len) < 0 ||
+        (map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        log_error("event=cdr_failed path=%s error=\"%s\"", cdr_path, strerror(errno));
+        fprintf(stderr, "Unable to create call detail records at %s: %s\n", cdr_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        map = NULL;
+        return -1;
+    }
+
+    CDR_HEADER *h = (CDR_HEADER *)map;
+    memcpy(h->magic, CDR_MAGIC, sizeof(h->magic));
+    h->header_size = sizeof(CDR_HEADER);
+    h->record_size = sizeof(CDR_RECORD);
+    h->created = cdr_now();
+
+    cdr_fd = fd;
+    used = 0;
+    debug("Started call detail records at %s (%zu records)", cdr_path, capacity);
+    return 0;
+}
+
+/*
+ * Unmap the current file, if any, and truncate it to the records written.
+ */
+static void file_finish(void)
+{
+    if (map == NULL)
+        return;
+
+    munmap(map, map_len);
+    map = NULL;
+    if (ftruncate(cdr_fd, sizeof(CDR_HEADER) + used * sizeof(CDR_RECORD)) < 0 || fsync(cdr_fd) < 0)
+        log_error("event=cdr_finish error=\"%s\"", strerror(errno));
+    close(cdr_fd);
+    cdr_fd = -1;
+}
+
+/*
+ * Move the file at the path, if any, to a name of its own, taken from the
+ * time it was started.
+ */
+static void set_aside(void)
+{
+    CDR_HEADER h;
+    int fd = open(cdr_path, O_RDONLY);
+
+    if (fd < 0)
+        return;
+
+    uint64_t created = cdr_now();
+    if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, CDR_MAGIC, sizeof(h.magic)) == 0)
+        created = h.created;
+    close(fd);
+
+    time_t secs = created / 1000000000;
+    struct tm tm;
+    char stamp[32];
+    gmtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &tm);
+
+    size_t len = strlen(cdr_path) + 64;
+    char *aside = Malloc(len);
+    snprintf(aside, len, "%s.%s.%06u", cdr_path, stamp, (unsigned)(created % 1000000000 / 1000));
+    if (rename(cdr_path, aside) == 0)
+        log_info("event=cdr_rotate path=%s", aside);
+    Free(aside);
+}
+
+/*
+ * Order records by hangup time, keeping the records of each thread in the
+ * order they were staged.
+ */
+static int compare_staged(const void *a, const void *b)
+{
+    const struct staged *sa = a, *sb = b;
+
+    if (sa->r.hangup != sb->r.hangup)
+        return sa->r.hangup < sb->r.hangup ? -1 : 1;
+    return sa->seq < sb->seq ? -1 : sa->seq > sb->seq ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+#include "conf.h"
+#include "proto.h"
+#include "lockprof.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define CONF_BUCKETS 256
+#define CONF_INITIAL_MEMBERS 8
+
+struct member
+{
+    int ext;
+    int protocol;
+    OUTQ *out;
+};
+
+struct conf
+{
+    int number;
+    sem_t mutex;
+    struct member *members;
+    int count;
+    int cap;
+    CONF *next;                 // In its hash bucket
+};
+
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static sem_t table_mutex;
+static CONF *table[CONF_BUCKETS];
+
+static void table_init(void);
+
+/*
+ * Add a member to a bridge, creating the bridge if it has none.
+ *
+ * @return the bridge.
+ */
+CONF *conf_join(int number, int ext, OUTQ *out, int protocol)
+{
+    Pthread_once(&table_once, table_init);
+
+    CONF **bucket = &table[(unsigned)number % CONF_BUCKETS];
+    CONF *c;
+
+    LOCK(&table_mutex, LOCK_CLASS_CONF);
+    for (c = *bucket; c != NULL && c->number != number; c = c->next)
+        ;
+    if (c == NULL)
+    {
+        c = Calloc(1, sizeof(CONF));
+        c->number = number;
+        Sem_init(&c->mutex, 0, 1);
+        c->next = *bucket;
+        *bucket = c;
+        debug("Created bridge %d", number);
+    }
+
+    LOCK(&c->mutex, LOCK_CLASS_CONF);
+    if (c->count == c->cap)
+    {
+        c->cap = c->cap ? 2 * c->cap : CONF_INITIAL_MEMBERS;
+        c->members = Realloc(c->members, c->cap * sizeof(struct member));
+    }
+    c->members[c->count++] = (struct member){.ext = ext, .protocol = protocol, .out = out};
+    UNLOCK(&c->mutex);
+
+    UNLOCK(&table_mutex);
+    return c;
+}
+
+/*
+ * Remove a member from a bridge, freeing the bridge if it was the last.
+ * Members are kept in the order they joined, so the fan-out order stays
+ * the same for everyone who remains.
+ */
+void conf_leave(CONF *c, int ext)
+{
+    LOCK(&table_mutex, LOCK_CLASS_CONF);
+    LOCK(&c->mutex, LOCK_CLASS_CONF);
+
+    for (int i = 0; i < c->count; i++)
+    {
+        if (c->members[i].ext == ext)
+        {
+            memmove(&c->members[i], &c->members[i + 1], (c->count - i - 1) * sizeof(struct member));
+            c->count--;
+            break;
+        }
+    }
+    int empty = c->count == 0;
+
+    UNLOCK(&c->mutex);
+
+    if (empty)
+    {
+        CONF **link = &table[(unsigned)c->number % CONF_BUCKETS];
+        while (*link != c)
+            link = &(*link)->next;
+        *link = c->next;
+        debug("Freeing bridge %d", c->number);
+        sem_destroy(&c->mutex);
+        Free(c->members);
+        Free(c);
+    }
+
+    UNLOCK(&table_mutex);
+}
+
+/*
+ * Get the number of a bridge.
+ */
+int conf_number(CONF *c)
+{
+    return c->number;
+}
+
+/*
+ * Send a chat to every member of a bridge but its sender, from one
+ * serialized copy per protocol.
+ *
+ * @return the number of members the chat was sent to.
+ */
+int conf_chat(CONF *c, int ext, const char *msg, size_t len)
+{
+    PROTO_MSG m;
+    int sent = 0;
+
+    proto_msg_init(&m, msg, len);
+
+    LOCK(&c->mutex, LOCK_CLASS_CONF);
+    for (int i = 0; i < c->count; i++)
+    {
+        if (c->members[i].ext != ext && proto_send_msg(c->members[i].out, c->members[i].protocol, &m) >= 0)
+            sent++;
+    }
+    UNLOCK(&c->mutex);
+
+    proto_msg_release(&m);
+    debug("Chat on bridge %d from %d sent to %d members", c->number, ext, sent);
+    return sent;
+}
+
+/*
+ * Initialize the table of bridges.
+ */
+static void table_init(void)
+{
+    Sem_init(&table_mutex, 0, 1);
+}
@@ -0,0 +1,537 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dialplan.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * A node of the trie.  Targets are encoded with their kind in the top
+ * bits, and 0 for none.
+ */
+typedef struct node
+{
+    uint32_t first;             // Index of the child for the lowest digit
+    uint16_t digits;            // Bit d set if there is a child for digit d
+    uint16_t pad;
+    uint32_t exact;             // Target of the number ending here
+    uint32_t prefix;            // Target of the numbers starting here
+} NODE;
+
+#define TARGET_SHIFT 28
+#define TARGET_MAX ((1u << TARGET_SHIFT) - 1)
+#define TARGET(kind, value) ((uint32_t)(kind) << TARGET_SHIFT | (value))
+
+typedef struct group
+{
+    uint32_t first;             // Index of the first member
+    uint32_t count;
+    uint32_t next;              // Turn, advanced atomically by each call
+} GROUP;
+
+struct dialplan
+{
+    NODE *nodes;
+    size_t num_nodes;
+    GROUP *groups;
+    size_t num_groups;
+    int *members;
+    size_t num_members;
+    size_t num_routes;
+};
+
+/*
+ * A route as parsed, before it is placed in the trie.
+ */
+struct entry
+{
+    char digits[DIALPLAN_MAX_DIGITS];
+    uint8_t len;
+    uint8_t prefix;
+    int line;
+    uint32_t target;
+};
+
+/*
+ * A thread that looks numbers up in the installed plan.  Its sequence is
+ * odd while it is in a lookup, which only it writes, on a cache line of
+ * its own: lookups from different threads share nothing but the plan.
+ */
+typedef struct reader
+{
+    unsigned long seq __attribute__((aligned(64)));
+    int closed;                 // Set when the thread has exited
+    struct reader *next;
+} READER;
+
+static DIALPLAN *installed;
+
+static pthread_once_t dialplan_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static sem_t install_mutex;     // Protects the readers list; one installer at a time
+static READER *readers;
+static __thread READER *local;
+
+static int parse_line(char *line, int lineno, struct entry *e, DIALPLAN *plan, size_t *members_size);
+static int compare_entries(const void *a, const void *b);
+static DIALPLAN *build(DIALPLAN *plan, struct entry *entries, size_t n);
+static void dialplan_init(void);
+static void reader_retire(void *arg);
+static READER *reader_local(void);
+
+/*
+ * Compile a dial plan from its text.
+ */
+DIALPLAN *dialplan_compile(const char *text, size_t len)
+{
+    DIALPLAN *plan = Calloc(1, sizeof(DIALPLAN));
+    struct entry *entries = NULL;
+    size_t n = 0, size = 0, members_size = 0;
+    const char *end = text + len;
+    int lineno = 0;
+
+    while (text < end)
+    {
+        const char *eol = memchr(text, '\n', end - text);
+        size_t line_len = (eol != NULL ? eol : end) - text;
+        char line[256];
+
+        lineno++;
+        if (line_len >= sizeof(line))
+        {
+            fprintf(stderr, "Dial plan line %d is too long\n", lineno);
+            goto fail;
+        }
+        memcpy(line, text, line_len);
+        line[line_len] = '\0';
+        text += line_len + (eol != NULL);
+
+        if (n == size)
+        {
+            size = size ? 2 * size : 1024;
+            entries = Realloc(entries, size * sizeof(struct entry));
+        }
+        int rc = parse_line(line, lineno, &entries[n], plan, &members_size);
+        if (rc < 0)
+            goto fail;
+        n += rc;
+    }
+
+    qsort(entries, n, sizeof(struct entry), compare_entries);
+    for (size_t i = 1; i < n; i++)
+    {
+        if (compare_entries(&entries[i - 1], &entries[i]) == 0)
+        {
+            fprintf(stderr, "Dial plan line %d duplicates line %d\n", entries[i].line, entries[i - 1].line);
+            goto fail;
+        }
+    }
+
+    plan = build(plan, entries, n);
+    Free(entries);
+    return plan;
+
+fail:
+    Free(entries);
+    dialplan_free(plan);
+    return NULL;
+}
+
+/*
+ * Compile the dial plan in a file.
+ */
+DIALPLAN *dialplan_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char *text = NULL;
+    size_t len = 0, size = 0, got;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "Unable to read dial plan %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    do
+    {
+        if (len == size)
+        {
+            size = size ? 2 * size : 65536;
+            text = Realloc(text, size);
+        }
+        got = fread(text + len, 1, size - len, f);
+        len += got;
+    } while (got > 0);
+    if (ferror(f))
+    {
+        fprintf(stderr, "Unable to read dial plan %s: %s\n", path, strerror(errno));
+        fclose(f);
+        Free(text);
+        return NULL;
+    }
+    fclose(f);
+
+    DIALPLAN *plan = dialplan_compile(text, len);
+    Free(text);
+    if (plan == NULL)
+        fprintf(stderr, "Dial plan %s not loaded\n", path);
+    return plan;
+}
+
+/*
+ * Free a plan that is not installed.
+ */
+void dialplan_free(DIALPLAN *plan)
+{
+    if (plan == NULL)
+        return;
+    Free(plan->nodes);
+    Free(plan->groups);
+    Free(plan->members);
+    Free(plan);
+}
+
+/*
+ * Look a number up in a plan, one node per digit, remembering the last
+ * prefix route passed.
+ */
+int dialplan_lookup(DIALPLAN *plan, const char *digits, size_t len, DIALPLAN_ROUTE *route)
+{
+    const NODE *nodes = plan->nodes, *node = nodes;
+    uint32_t target = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        unsigned d = (unsigned char)digits[i] - '0';
+
+        if (node->prefix)
+        {
+            target = node->prefix;
+            route->matched = i;
+        }
+        if (d > 9 || !(node->digits & 1u << d))
+            break;
+        node = &nodes[node->first + __builtin_popcount(node->digits & ((1u << d) - 1))];
+    }
+    if (i == len && (node->exact || node->prefix))
+    {
+        target = node->exact ? node->exact : node->prefix;
+        route->matched = len;
+    }
+    if (!target)
+        return -1;
+
+    route->kind = target >> TARGET_SHIFT;
+    route->target = target & TARGET_MAX;
+    if (route->kind == DIALPLAN_GROUP)
+    {
+        GROUP *g = &plan->groups[route->target];
+        uint32_t turn = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+        route->target = plan->members[g->first + turn % g->count];
+    }
+    return 0;
+}
+
+/*
+ * Get the memory a plan takes.
+ */
+size_t dialplan_footprint(DIALPLAN *plan, size_t *routes)
+{
+    if (routes != NULL)
+        *routes = plan->num_routes;
+    return sizeof(DIALPLAN) + plan->num_nodes * sizeof(NODE) + plan->num_groups * sizeof(GROUP) +
+           plan->num_members * sizeof(int);
+}
+
+/*
+ * Install a plan in place of the current one.  A reader that was not in a
+ * lookup when the plan was replaced will find the new one; the old plan is
+ * freed once every reader that was in a lookup has left it.
+ */
+void dialplan_install(DIALPLAN *plan)
+{
+    Pthread_once(&dialplan_once, dialplan_init);
+
+    P(&install_mutex);
+    DIALPLAN *old = __atomic_exchange_n(&installed, plan, __ATOMIC_SEQ_CST);
+    for (READER *reader = readers; reader != NULL; reader = reader->next)
+    {
+        unsigned long seq = __atomic_load_n(&reader->seq, __ATOMIC_SEQ_CST);
+        if (seq & 1)
+        {
+            while (__atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE) == seq)
+                sched_yield();
+        }
+    }
+    V(&install_mutex);
+
+    if (old != NULL)
+        debug("Dial plan of %zu routes replaced", old->num_routes);
+    dialplan_free(old);
+}
+
+/*
+ * Resolve a number dialed by a client.  Without a plan, this costs no
+ * more than atoi().
+ */
+const char *dialplan_resolve(const char *dialed, DIALPLAN_ROUTE *route)
+{
+    route->kind = DIALPLAN_EXTENSION;
+    route->matched = 0;
+    if (__atomic_load_n(&installed, __ATOMIC_RELAXED) == NULL)
+    {
+        route->target = atoi(dialed);
+        return "";
+    }
+
+    const char *digits = dialed;
+    while (isspace((unsigned char)*digits))
+        digits++;
+    size_t len = strspn(digits, "0123456789");
+    if (len == 0 || len > DIALPLAN_MAX_DIGITS || digits[len] != '\0')
+    {
+        route->target = atoi(dialed);
+        return "";
+    }
+
+    READER *reader = reader_local();
+    unsigned long seq = reader->seq;
+
+    __atomic_store_n(&reader->seq, seq + 1, __ATOMIC_SEQ_CST);
+    DIALPLAN *plan = __atomic_load_n(&installed, __ATOMIC_SEQ_CST);
+    if (plan == NULL || dialplan_lookup(plan, digits, len, route) < 0)
+    {
+        route->kind = DIALPLAN_EXTENSION;
+        route->target = atoi(digits);
+        route->matched = len;
+    }
+    __atomic_store_n(&reader->seq, seq + 2, __ATOMIC_RELEASE);
+    return digits + route->matched;
+}
+
+/*
+ * Get the extension to dial for a number dialed by a client.
+ */
+int dialplan_extension(const char *dialed)
+{
+    DIALPLAN_ROUTE route;
+
+    dialplan_resolve(dialed, &route);
+    return route.kind == DIALPLAN_TRUNK ? -1 : route.target;
+}
+
+/*
+ * Parse one line of a plan.
+ *
+ * @return 1 if the line holds a route, 0 if it is blank, -1 if it has an
+ * error.
+ */
+static int parse_line(char *line, int lineno, struct entry *e, DIALPLAN *plan, size_t *members_size)
+{
+    char *save, *digits, *kind, *arg, *end;
+    int values[DIALPLAN_MAX_MEMBERS];
+    int count = 0;
+
+    char *hash = strchr(line, '#');
+    if (hash != NULL)
+        *hash = '\0';
+    if ((digits = strtok_r(line, " \t\r", &save)) == NULL)
+        return 0;
+
+    size_t len = strspn(digits, "0123456789");
+    e->prefix = digits[len] == '*' && digits[len + 1] == '\0';
+    if ((digits[len] != '\0' && !e->prefix) || (len == 0 && !e->prefix) || len > DIALPLAN_MAX_DIGITS)
+    {
+        fprintf(stderr, "Dial plan line %d: bad number '%s'\n", lineno, digits);
+        return -1;
+    }
+    memcpy(e->digits, digits, len);
+    e->len = len;
+    e->line = lineno;
+
+    if ((kind = strtok_r(NULL, " \t\r", &save)) == NULL)
+    {
+        fprintf(stderr, "Dial plan line %d: no target\n", lineno);
+        return -1;
+    }
+    while ((arg = strtok_r(NULL, " \t\r", &save)) != NULL)
+    {
+        long value = strtol(arg, &end, 10);
+        if (*end != '\0' || end == arg || value < 0 || value > TARGET_MAX)
+        {
+            fprintf(stderr, "Dial plan line %d: bad value '%s'\n", lineno, arg);
+            return -1;
+        }
+        if (count == DIALPLAN_MAX_MEMBERS)
+        {
+            fprintf(stderr, "Dial plan line %d: more than %d values\n", lineno, DIALPLAN_MAX_MEMBERS);
+            return -1;
+        }
+        values[count++] = value;
+    }
+
+    if (!strcmp(kind, "ext") && count == 1)
+        e->target = TARGET(DIALPLAN_EXTENSION, values[0]);
+    else if (!strcmp(kind, "trunk") && count == 1)
+        e->target = TARGET(DIALPLAN_TRUNK, values[0]);
+    else if (!strcmp(kind, "group") && count > 0)
+    {
+        if (plan->num_groups % 1024 == 0)
+            plan->groups = Realloc(plan->groups, (plan->num_groups + 1024) * sizeof(GROUP));
+        if (plan->num_members + count > *members_size)
+        {
+            *members_size = 2 * (plan->num_members + count);
+            plan->members = Realloc(plan->members, *members_size * sizeof(int));
+        }
+        plan->groups[plan->num_groups] = (GROUP){.first = plan->num_members, .count = count};
+        memcpy(&plan->members[plan->num_members], values, count * sizeof(int));
+        plan->num_members += count;
+        e->target = TARGET(DIALPLAN_GROUP, plan->num_groups++);
+    }
+    else
+    {
+        fprintf(stderr, "Dial plan line %d: bad target '%s'\n", lineno, kind);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Order routes by their digits, a number before those it is a prefix of,
+ * and an exact route before the prefix route for the same digits.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+    int c = memcmp(x->digits, y->digits, x->len < y->len ? x->len : y->len);
+
+    if (c != 0)
+        return c;
+    if (x->len != y->len)
+        return x->len - y->len;
+    return x->prefix - y->prefix;
+}
+
+/*
+ * Build the trie of the sorted routes.  Each node stands for the range of
+ * routes that start with its digits; as the nodes are numbered in the
+ * order they are created, breadth first, the children of a node are next
+ * to each other, in the order of their digits.
+ */
+static DIALPLAN *build(DIALPLAN *plan, struct entry *entries, size_t n)
+{
+    size_t max_nodes = 1;
+    for (size_t i = 0; i < n; i++)
+        max_nodes += entries[i].len;
+
+    NODE *nodes = Calloc(max_nodes, sizeof(NODE));
+    struct
+    {
+        uint32_t lo, hi;
+    } *ranges = Malloc(max_nodes * sizeof(*ranges));
+    size_t count = 1;
+
+    ranges[0].lo = 0;
+    ranges[0].hi = n;
+    for (size_t i = 0, depth_end = 1, depth = 0; i < count; i++)
+    {
+        if (i == depth_end)
+        {
+            depth_end = count;
+            depth++;
+        }
+
+        size_t j = ranges[i].lo, hi = ranges[i].hi;
+        for (; j < hi && entries[j].len == depth; j++)
+        {
+            if (entries[j].prefix)
+                nodes[i].prefix = entries[j].target;
+            else
+                nodes[i].exact = entries[j].target;
+        }
+
+        nodes[i].first = count;
+        while (j < hi)
+        {
+            char digit = entries[j].digits[depth];
+            size_t k = j;
+            while (k < hi && entries[k].digits[depth] == digit)
+                k++;
+            nodes[i].digits |= 1u << (digit - '0');
+            ranges[count].lo = j;
+            ranges[count].hi = k;
+            count++;
+            j = k;
+        }
+    }
+    Free(ranges);
+
+    plan->nodes = Realloc(nodes, count * sizeof(NODE));
+    plan->num_nodes = count;
+    plan->num_routes = n;
+    if (plan->num_groups > 0)
+        plan->groups = Realloc(plan->groups, plan->num_groups * sizeof(GROUP));
+    if (plan->num_members > 0)
+        plan->members = Realloc(plan->members, plan->num_members * sizeof(int));
+    return plan;
+}
+
+static void dialplan_init(void)
+{
+    Sem_init(&install_mutex, 0, 1);
+    if (pthread_key_create(&reader_key, reader_retire) != 0)
+        app_error("pthread_key_create error");
+}
+
+/*
+ * Get the calling thread's reader, taking over that of a thread that has
+ * exited or creating one on first use.
+ */
+static READER *reader_local(void)
+{
+    if (local != NULL)
+        return local;
+
+    Pthread_once(&dialplan_once, dialplan_init);
+
+    P(&install_mutex);
+    for (READER *reader = readers; reader != NULL && local == NULL; reader = reader->next)
+    {
+        if (reader->closed)
+        {
+            reader->closed = 0;
+            local = reader;
+        }
+    }
+    if (local == NULL)
+    {
+        if (posix_memalign((void **)&local, 64, sizeof(READER)) != 0)
+            unix_error("posix_memalign error");
+        local->seq = 0;
+        local->closed = 0;
+        local->next = readers;
+        readers = local;
+    }
+    V(&install_mutex);
+
+    pthread_setspecific(reader_key, local);
+    return local;
+}
+
+/*
+ * Thread-exit destructor: the reader, which is not in a lookup, is left
+ * for another thread to take over.
+ */
+static void reader_retire(void *arg)
+{
+    READER *reader = arg;
+
+    P(&install_mutex);
+    reader->closed = 1;
+    V(&install_mutex);
+}
@@ -0,0 +1,565 @@
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "listener.h"
+#include "reactor.h"
+#include "shard.h"
+#include "parser.h"
+#include "proto.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Protocol, over a SOCK_SEQPACKET Unix socket so that each message keeps
+ * its boundaries and the descriptors passed with it:
+ *
+ *   1. the old server sends a header, with the listening sockets;
+ *   2. it sends the client records in messages of up to HANDOFF_BATCH
+ *      records, each with the descriptors of those clients;
+ *   3. it sends the payload, i.e. the queued output and then the buffered
+ *      input of each client in turn, in messages of up to HANDOFF_CHUNK bytes;
+ *   4. the successor replies with a single HANDOFF_ACK byte once it has
+ *      received everything, after which the old server exits.
+ */
+#define HANDOFF_MAGIC 0x50425848 // "PBXH"
+#define HANDOFF_CHUNK 65536
+#define HANDOFF_ACK 'A'
+
+struct handoff_header
+{
+    uint32_t magic;
+    uint32_t nlisten;
+    uint32_t nconns;
+    uint32_t reserved;
+    uint64_t payload;
+};
+
+struct handoff_record
+{
+    int32_t ext;
+    int32_t state;
+    int32_t peer;
+    int32_t bridge;
+    uint32_t output_len;
+    uint32_t input_len;
+    uint32_t discarding;
+    int32_t protocol;
+    int32_t call_callee;        // The TU's CDR_LEG
+    uint32_t reserved;
+    uint64_t call_setup;
+    uint64_t call_answer;
+};
+
+/*
+ * The connections collected from the reactors by the old server.
+ */
+struct export
+{
+    int n;
+    int cap;
+    TU **tus;
+    int *fds;
+    struct handoff_record *recs;
+    const char **outputs;
+    const char **inputs;
+    uint64_t payload;
+};
+
+static void *handoff_loop(void *arg);
+static int handoff_send(int sock);
+static void export_conn(void *arg, int connfd, TU *tu, PARSER *parser);
+static int send_payload(int sock, struct export *ex);
+static int send_fds(int sock, void *data, size_t len, int *fds, int nfds);
+static ssize_t recv_fds(int sock, void *data, size_t len, int *fds, int *nfds, int max);
+static int open_unix_socket(char *path, struct sockaddr_un *addr);
+static void set_timeouts(int sock);
+
+/*
+ * Start a thread that waits for a successor and hands the server over to it.
+ *
+ * @return 0 if the socket is being listened on, otherwise -1.
+ */
+int handoff_listen(char *path)
+{
+    struct sockaddr_un addr;
+    int sock = open_unix_socket(path, &addr);
+    pthread_t tid;
+
+    if (sock < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0)
+    {
+        fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int *sockp = Malloc(sizeof(int));
+    *sockp = sock;
+    Pthread_create(&tid, NULL, handoff_loop, sockp);
+    Pthread_detach(tid);
+
+    debug("Listening for a successor on %s", path);
+    return 0;
+}
+
+/*
+ * Take over from the server listening for a successor at a path.
+ *
+ * @return the number of listening sockets, or -1 if the handoff failed.
+ */
+int handoff_receive(char *path, int *listenfds, int max)
+{
+    struct sockaddr_un addr;
+    struct handoff_header header;
+    int sock = open_unix_socket(path, &addr);
+    int nlisten = 0, received = 0;
+    struct handoff_record *recs = NULL;
+    int *fds = NULL;
+    char *payload = NULL;
+
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Unable to connect to %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    if (recv_fds(sock, &header, sizeof(header), listenfds, &nlisten, max) != sizeof(header) ||
+        header.magic != HANDOFF_MAGIC || nlisten != header.nlisten || nlisten < 1)
+    {
+        fprintf(stderr, "Bad handoff header from %s\n", path);
+        goto fail;
+    }
+
+    debug("Receiving %u connections and %lu bytes of payload", header.nconns, (unsigned long)header.payload);
+
+    recs = Malloc((header.nconns + 1) * sizeof(struct handoff_record));
+    fds = Malloc((header.nconns + 1) * sizeof(int));
+    while (received < header.nconns)
+    {
+        int nfds = 0;
+        int want = header.nconns - received < HANDOFF_BATCH ? header.nconns - received : HANDOFF_BATCH;
+        ssize_t n = recv_fds(sock, recs + received, want * sizeof(struct handoff_record),
+                             fds + received, &nfds, want);
+        if (n <= 0 || n % sizeof(struct handoff_record) != 0 || n / sizeof(struct handoff_record) != nfds)
+        {
+            fprintf(stderr, "Bad handoff records from %s\n", path);
+            for (int i = 0; i < nfds; i++)
+                close(fds[received + i]);
+            goto fail;
+        }
+        received += nfds;
+    }
+
+    uint64_t expected = 0;
+    for (int i = 0; i < received; i++)
+    {
+        if (recs[i].input_len > PARSER_BUFSIZE)
+        {
+            fprintf(stderr, "Bad handoff record for extension %d\n", recs[i].ext);
+            goto fail;
+        }
+        expected += recs[i].output_len + recs[i].input_len;
+    }
+
+    payload = Malloc(header.payload + 1);
+    for (uint64_t got = 0; got < header.payload;)
+    {
+        ssize_t n = recv(sock, payload + got, header.payload - got, 0);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Handoff payload truncated\n");
+            goto fail;
+        }
+        got += n;
+    }
+    if (expected != header.payload)
+    {
+        fprintf(stderr, "Handoff payload size mismatch\n");
+        goto fail;
+    }
+
+    char ack = HANDOFF_ACK;
+    if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1)
+    {
+        perror("handoff ack");
+        goto fail;
+    }
+    close(sock);
+
+    // The old server is gone, so from here on the clients are ours.
+    TU_SNAPSHOT *snaps = Malloc((received + 1) * sizeof(TU_SNAPSHOT));
+    TU **tus = Malloc((received + 1) * sizeof(TU *));
+    char *bytes = payload;
+
+    for (int i = 0; i < received; i++)
+    {
+        snaps[i].ext = recs[i].ext;
+        snaps[i].fd = fds[i];
+        snaps[i].state = recs[i].state;
+        snaps[i].peer = recs[i].peer;
+        snaps[i].bridge = recs[i].bridge;
+        snaps[i].call = (CDR_LEG){.callee = recs[i].call_callee, .setup = recs[i].call_setup,
+                                  .answer = recs[i].call_answer};
+        snaps[i].protocol = recs[i].protocol == PROTO_BINARY ? PROTO_BINARY : PROTO_TEXT;
+        snaps[i].output = bytes;
+        snaps[i].output_len = recs[i].output_len;
+        bytes += recs[i].output_len + recs[i].input_len;
+    }
+
+    int restored = pbx_adopt(pbx, snaps, received, tus);
+
+    for (int i = 0; i < received; i++)
+    {
+        if (tus[i] == NULL)
+        {
+            close(fds[i]);
+            continue;
+        }
+
+        PARSER parser;
+        parser_init(&parser, fds[i]);
+        memcpy(parser.buf, snaps[i].output + snaps[i].output_len, recs[i].input_len);
+        parser.end = recs[i].input_len;
+        parser.discarding = recs[i].discarding;
+        parser.protocol = recs[i].protocol;
+        reactor_adopt(fds[i], tus[i], &parser);
+    }
+
+    if (restored < received)
+        fprintf(stderr, "Only %d of %d clients could be taken over\n", restored, received);
+    debug("Took over %d connections and %d listening sockets", restored, nlisten);
+
+    Free(snaps);
+    Free(tus);
+    Free(payload);
+    Free(recs);
+    Free(fds);
+    return nlisten;
+
+fail:
+    for (int i = 0; i < received; i++)
+        close(fds[i]);
+    for (int i = 0; i < nlisten; i++)
+        close(listenfds[i]);
+    Free(payload);
+    Free(recs);
+    Free(fds);
+    close(sock);
+    return -1;
+}
+
+/*
+ * Thread function that serves successors.  A failed handoff leaves the
+ * server running and waiting for another attempt.
+ */
+static void *handoff_loop(void *arg)
+{
+    int sock = *(int *)arg;
+    Free(arg);
+
+    while (1)
+    {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        set_timeouts(conn);
+
+        if (handoff_send(conn) == 0)
+        {
+            debug("Handed over to successor, exiting");
+            exit(EXIT_SUCCESS);
+        }
+
+        fprintf(stderr, "Handoff to successor failed, resuming service\n");
+        close(conn);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand the server over on a connection from a successor.  Service is
+ * paused while the state is collected and sent, and resumed if the
+ * successor does not confirm receipt.
+ *
+ * @return 0 if the successor has taken over, otherwise -1.
+ */
+static int handoff_send(int sock)
+{
+    struct export ex = {0};
+    int listenfds[LISTENER_MAX_ACCEPTORS];
+    int status = -1;
+    char ack;
+
+    debug("Successor connected, pausing service");
+
+    listener_pause();
+    reactor_pause();
+    // Calls across shards may be half made, with the message that makes
+    // the other half waiting in an inbox.
+    pbx_shard_drain_all(pbx);
+    reactor_foreach(export_conn, &ex);
+
+    int nlisten = listener_sockets(listenfds, LISTENER_MAX_ACCEPTORS);
+    struct handoff_header header = {.magic = HANDOFF_MAGIC, .nlisten = nlisten, .nconns = ex.n,
+                                    .payload = ex.payload};
+
+    if (send_fds(sock, &header, sizeof(header), listenfds, nlisten) < 0)
+        goto done;
+
+    for (int i = 0; i < ex.n; i += HANDOFF_BATCH)
+    {
+        int k = ex.n - i < HANDOFF_BATCH ? ex.n - i : HANDOFF_BATCH;
+        if (send_fds(sock, ex.recs + i, k * sizeof(struct handoff_record), ex.fds + i, k) < 0)
+            goto done;
+    }
+
+    if (send_payload(sock, &ex) < 0)
+        goto done;
+
+    if (recv(sock, &ack, 1, 0) == 1 && ack == HANDOFF_ACK)
+        status = 0;
+
+done:
+    if (status < 0)
+    {
+        for (int i = 0; i < ex.n; i++)
+            tu_thaw(ex.tus[i]);
+        reactor_resume();
+        listener_resume();
+    }
+
+    Free(ex.tus);
+    Free(ex.fds);
+    Free(ex.recs);
+    Free(ex.outputs);
+    Free(ex.inputs);
+    return status;
+}
+
+/*
+ * Visitor for reactor_foreach() that takes a snapshot of a connection.
+ */
+static void export_conn(void *arg, int connfd, TU *tu, PARSER *parser)
+{
+    struct export *ex = arg;
+    TU_SNAPSHOT snap;
+
+    if (tu_freeze(tu, &snap) < 0)
+        return;
+
+    if (ex->n == ex->cap)
+    {
+        ex->cap = ex->cap ? 2 * ex->cap : 1024;
+        ex->tus = Realloc(ex->tus, ex->cap * sizeof(TU *));
+        ex->fds = Realloc(ex->fds, ex->cap * sizeof(int));
+        ex->recs = Realloc(ex->recs, ex->cap * sizeof(struct handoff_record));
+        ex->outputs = Realloc(ex->outputs, ex->cap * sizeof(char *));
+        ex->inputs = Realloc(ex->inputs, ex->cap * sizeof(char *));
+    }
+
+    struct handoff_record *rec = &ex->recs[ex->n];
+    rec->ext = snap.ext;
+    rec->state = snap.state;
+    rec->peer = snap.peer;
+    rec->bridge = snap.bridge;
+    rec->call_callee = snap.call.callee;
+    rec->reserved = 0;
+    rec->call_setup = snap.call.setup;
+    rec->call_answer = snap.call.answer;
+    rec->output_len = snap.output_len;
+    rec->input_len = parser->end - parser->start;
+    rec->discarding = parser->discarding;
+    // Freezing the peer ended a chat being relayed to it; the rest of the
+    // line is dropped by the new server.
+    if (parser->chat != NULL && parser->protocol != PROTO_BINARY)
+        rec->discarding = 1;
+    rec->protocol = parser->protocol;
+
+    ex->tus[ex->n] = tu;
+    ex->fds[ex->n] = connfd;
+    ex->outputs[ex->n] = snap.output;
+    ex->inputs[ex->n] = parser->buf + parser->start;
+    ex->payload += rec->output_len + rec->input_len;
+    ex->n++;
+}
+
+/*
+ * Send the queued output and buffered input of every connection, packed
+ * into messages of HANDOFF_CHUNK bytes.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+static int send_payload(int sock, struct export *ex)
+{
+    char *chunk = Malloc(HANDOFF_CHUNK);
+    size_t used = 0;
+    int status = 0;
+
+    for (int i = 0; i < ex->n && status == 0; i++)
+    {
+        for (int part = 0; part < 2 && status == 0; part++)
+        {
+            const char *data = part == 0 ? ex->outputs[i] : ex->inputs[i];
+            size_t len = part == 0 ? ex->recs[i].output_len : ex->recs[i].input_len;
+
+            while (len > 0)
+            {
+                size_t n = HANDOFF_CHUNK - used < len ? HANDOFF_CHUNK - used : len;
+                memcpy(chunk + used, data, n);
+                used += n;
+                data += n;
+                len -= n;
+
+                if (used == HANDOFF_CHUNK)
+                {
+                    if (send(sock, chunk, used, MSG_NOSIGNAL) != used)
+                    {
+                        status = -1;
+                        break;
+                    }
+                    used = 0;
+                }
+            }
+        }
+    }
+
+    if (status == 0 && used > 0 && send(sock, chunk, used, MSG_NOSIGNAL) != used)
+        status = -1;
+
+    Free(chunk);
+    return status;
+}
+
+/*
+ * Send a message together with a set of descriptors.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+static int send_fds(int sock, void *data, size_t len, int *fds, int nfds)
+{
+    char control[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != len)
+    {
+        perror("handoff sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Receive a message together with the descriptors passed with it.
+ *
+ * @param nfds  Set to the number of descriptors received.
+ * @param max  The maximum number of descriptors expected.
+ * @return the length of the message, or -1 on error (including the
+ * descriptors or the message having been truncated).
+ */
+static ssize_t recv_fds(int sock, void *data, size_t len, int *fds, int *nfds, int max)
+{
+    char control[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+
+    *nfds = 0;
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0)
+    {
+        perror("handoff recvmsg");
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++)
+        {
+            if (*nfds < max)
+                fds[(*nfds)++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+    {
+        fprintf(stderr, "Handoff message truncated\n");
+        for (int i = 0; i < *nfds; i++)
+            close(fds[i]);
+        *nfds = 0;
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * Create a Unix sequenced-packet socket and the address for a path.
+ *
+ * @return the socket, or -1 on error.
+ */
+static int open_unix_socket(char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    set_timeouts(sock);
+    return sock;
+}
+
+/*
+ * Make sends and receives on a socket time out after HANDOFF_TIMEOUT_MS,
+ * so that neither side of a handoff can hang the other.
+ */
+static void set_timeouts(int sock)
+{
+    struct timeval tv = {.tv_sec = HANDOFF_TIMEOUT_MS / 1000, .tv_usec = HANDOFF_TIMEOUT_MS % 1000 * 1000};
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
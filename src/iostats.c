@@ -0,0 +1,111 @@
+#include "iostats.h"
+#include "csapp.h"
+
+static pthread_once_t iostats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t iostats_key;
+static sem_t iostats_mutex;
+static IOSTATS *live;
+static IOSTATS retired;
+static __thread IOSTATS *local;
+
+static void iostats_init(void);
+static void iostats_retire(void *arg);
+static void iostats_add(IOSTATS *total, IOSTATS *s);
+
+/*
+ * Get the calling thread's counters, creating them on first use.
+ */
+IOSTATS *iostats_local(void)
+{
+    if (local != NULL)
+        return local;
+
+    Pthread_once(&iostats_once, iostats_init);
+
+    local = Calloc(1, sizeof(IOSTATS));
+    pthread_setspecific(iostats_key, local);
+
+    P(&iostats_mutex);
+    local->next = live;
+    if (live != NULL)
+        live->prev = local;
+    live = local;
+    V(&iostats_mutex);
+
+    return local;
+}
+
+/*
+ * Sum the counters of all threads.
+ */
+void iostats_snapshot(IOSTATS *total)
+{
+    Pthread_once(&iostats_once, iostats_init);
+
+    memset(total, 0, sizeof(IOSTATS));
+
+    P(&iostats_mutex);
+    iostats_add(total, &retired);
+    for (IOSTATS *s = live; s != NULL; s = s->next)
+        iostats_add(total, s);
+    V(&iostats_mutex);
+}
+
+/*
+ * Print the summed counters.
+ */
+void iostats_report(FILE *out)
+{
+    IOSTATS total;
+    iostats_snapshot(&total);
+
+    uint64_t syscalls = total.reads + total.sends + total.epoll_ctls + total.epoll_waits + total.enters;
+    fprintf(out, "commands %llu, reads %llu, sends %llu, epoll_ctl %llu, epoll_wait %llu, io_uring_enter %llu, "
+                 "syscalls/command %.2f\n",
+            (unsigned long long)total.commands, (unsigned long long)total.reads,
+            (unsigned long long)total.sends, (unsigned long long)total.epoll_ctls,
+            (unsigned long long)total.epoll_waits, (unsigned long long)total.enters,
+            total.commands ? (double)syscalls / total.commands : 0.0);
+}
+
+static void iostats_init(void)
+{
+    Sem_init(&iostats_mutex, 0, 1);
+    if (pthread_key_create(&iostats_key, iostats_retire) != 0)
+        app_error("pthread_key_create error");
+}
+
+/*
+ * Thread-exit destructor: fold the thread's counters into the total of
+ * retired threads and free them.
+ */
+static void iostats_retire(void *arg)
+{
+    IOSTATS *s = arg;
+
+    P(&iostats_mutex);
+    iostats_add(&retired, s);
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        live = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+    V(&iostats_mutex);
+
+    Free(s);
+}
+
+/*
+ * The counters of other threads are read without synchronization; a
+ * report may be off by the increments in flight, which is harmless.
+ */
+static void iostats_add(IOSTATS *total, IOSTATS *s)
+{
+    total->commands += s->commands;
+    total->reads += s->reads;
+    total->sends += s->sends;
+    total->epoll_ctls += s->epoll_ctls;
+    total->epoll_waits += s->epoll_waits;
+    total->enters += s->enters;
+}
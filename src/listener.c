@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "listener.h"
+#include "debug.h"
+
+/*
+ * csapp.h is not included here: its gai_error() conflicts with the
+ * declaration that _GNU_SOURCE (needed for accept4) exposes in netdb.h.
+ */
+
+/*
+ * Listen backlog requested for each socket (the kernel caps it at
+ * net.core.somaxconn).  Registration storms need more than LISTENQ.
+ */
+#define LISTENER_BACKLOG 4096
+
+struct acceptor
+{
+    int listenfd;
+    listener_handler *handler;
+    pthread_t tid;
+};
+
+static struct acceptor acceptors[LISTENER_MAX_ACCEPTORS];
+static int num_acceptors;
+
+/*
+ * Pausing: pause_fd is an eventfd polled by every acceptor along with its
+ * socket.  While it is signalled, each acceptor posts "parked" and waits
+ * on "resumed".
+ */
+static int pause_fd = -1;
+static sem_t parked;
+static sem_t resumed;
+
+static int open_reuseport_listenfd(char *port, int reuseport);
+static int start_acceptors(int nacceptors, listener_handler *handler);
+static void *acceptor_loop(void *arg);
+
+/*
+ * Open the listening sockets and start the acceptor threads.
+ *
+ * @param port  Port to listen on, or "0" for an ephemeral port.
+ * @param nacceptors  Number of acceptor threads.
+ * @param handler  Function to which accepted connections are passed.
+ * @return the port number being listened on, or -1 on failure.
+ */
+int listener_start(char *port, int nacceptors, listener_handler *handler)
+{
+    int fds[LISTENER_MAX_ACCEPTORS];
+
+    debug("Entered listener_start | port: %s | acceptors: %d", port, nacceptors);
+
+    int bound = listener_open(port, nacceptors, fds);
+    if (bound < 0)
+        return -1;
+
+    for (int i = 0; i < nacceptors; i++)
+        acceptors[i].listenfd = fds[i];
+    if (start_acceptors(nacceptors, handler) < 0)
+        return -1;
+
+    debug("Exiting listener_start | port: %d", bound);
+    return bound;
+}
+
+/*
+ * Open listening sockets bound to the same port, without starting any
+ * acceptor threads.
+ *
+ * @return the port number being listened on, or -1 on failure.
+ */
+int listener_open(char *port, int n, int *fds)
+{
+    char portbuf[16];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (n < 1 || n > LISTENER_MAX_ACCEPTORS)
+        return -1;
+
+    for (int i = 0; i < n; i++)
+    {
+        if ((fds[i] = open_reuseport_listenfd(port, n > 1)) < 0)
+        {
+            fprintf(stderr, "Unable to listen on port %s: %s\n", port, strerror(errno));
+            while (--i >= 0)
+                close(fds[i]);
+            return -1;
+        }
+
+        // Every socket must share the port chosen for the first one.
+        if (i == 0)
+        {
+            getsockname(fds[0], (struct sockaddr *)&addr, &addrlen);
+            snprintf(portbuf, sizeof(portbuf), "%d",
+                     ntohs(((struct sockaddr_in *)&addr)->sin_port));
+            port = portbuf;
+        }
+    }
+
+    return atoi(port);
+}
+
+/*
+ * Start acceptor threads on listening sockets that are already open.
+ *
+ * @return 0 if the acceptors were started, otherwise -1.
+ */
+int listener_adopt(int *fds, int n, listener_handler *handler)
+{
+    debug("Entered listener_adopt | sockets: %d", n);
+
+    if (n < 1 || n > LISTENER_MAX_ACCEPTORS)
+        return -1;
+
+    for (int i = 0; i < n; i++)
+        acceptors[i].listenfd = fds[i];
+    return start_acceptors(n, handler);
+}
+
+/*
+ * Get the listening sockets of the running acceptors.
+ *
+ * @return the number of sockets.
+ */
+int listener_sockets(int *fds, int max)
+{
+    int n = num_acceptors < max ? num_acceptors : max;
+
+    for (int i = 0; i < n; i++)
+        fds[i] = acceptors[i].listenfd;
+    return n;
+}
+
+/*
+ * Stop accepting connections, waiting until every acceptor is parked.
+ */
+void listener_pause(void)
+{
+    uint64_t one = 1;
+
+    if (write(pause_fd, &one, sizeof(one)) < 0)
+        perror("listener_pause");
+    for (int i = 0; i < num_acceptors; i++)
+        sem_wait(&parked);
+}
+
+/*
+ * Resume accepting connections.  The eventfd is reset before any acceptor
+ * is released, so none of them sees it still signalled.
+ */
+void listener_resume(void)
+{
+    uint64_t count;
+
+    if (read(pause_fd, &count, sizeof(count)) < 0)
+        perror("listener_resume");
+    for (int i = 0; i < num_acceptors; i++)
+        sem_post(&resumed);
+}
+
+/*
+ * Start one acceptor thread for each of the first nacceptors entries of
+ * the acceptors table, whose sockets have been set.
+ *
+ * @return 0 if the threads were started, otherwise -1.
+ */
+static int start_acceptors(int nacceptors, listener_handler *handler)
+{
+    if ((pause_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd");
+        return -1;
+    }
+    sem_init(&parked, 0, 0);
+    sem_init(&resumed, 0, 0);
+
+    for (int i = 0; i < nacceptors; i++)
+    {
+        acceptors[i].handler = handler;
+        if ((errno = pthread_create(&acceptors[i].tid, NULL, acceptor_loop, &acceptors[i])) != 0)
+        {
+            perror("pthread_create");
+            return -1;
+        }
+        num_acceptors++;
+    }
+    return 0;
+}
+
+/*
+ * Open a non-blocking listening socket, optionally with SO_REUSEPORT set so
+ * that several such sockets can be bound to the same port.  Otherwise this
+ * follows open_listenfd().  SO_REUSEPORT is left off for a single acceptor,
+ * so that a second server started on the same port fails as it used to.
+ *
+ * @return the listening socket, or -1 on error.
+ */
+static int open_reuseport_listenfd(char *port, int reuseport)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+        return -1;
+
+    for (p = listp; p; p = p->ai_next)
+    {
+        listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (listenfd < 0)
+            continue;
+
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (reuseport)
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 && listen(listenfd, LISTENER_BACKLOG) == 0)
+            break;
+
+        close(listenfd);
+        listenfd = -1;
+    }
+
+    freeaddrinfo(listp);
+    return listenfd;
+}
+
+/*
+ * Thread function for an acceptor.  Waits for its socket to become
+ * readable, then accepts up to LISTENER_BATCH connections before waiting
+ * again.  A pause takes effect between batches.
+ */
+static void *acceptor_loop(void *arg)
+{
+    struct acceptor *a = arg;
+    struct pollfd pfd[2] = {{.fd = a->listenfd, .events = POLLIN}, {.fd = pause_fd, .events = POLLIN}};
+
+    while (1)
+    {
+        if (poll(pfd, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN)
+        {
+            sem_post(&parked);
+            sem_wait(&resumed);
+            continue;
+        }
+
+        for (int i = 0; i < LISTENER_BATCH; i++)
+        {
+            int connfd = accept4(a->listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if (connfd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno == EMFILE || errno == ENFILE)
+                {
+                    // Out of descriptors: back off rather than spin.
+                    debug("accept4: %s", strerror(errno));
+                    usleep(1000);
+                }
+                break;
+            }
+            // Output is already batched into whole messages (see outq.c),
+            // so Nagle's algorithm would only hold back a notification
+            // sent right after another one until the client's delayed ACK.
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+            a->handler(connfd);
+        }
+    }
+
+    return NULL;
+}
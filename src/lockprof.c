@@ -0,0 +1,225 @@
+#include <time.h>
+
+#include "lockprof.h"
+#include "csapp.h"
+
+/*
+ * A sampled lock held by the calling thread.
+ */
+typedef struct held_lock
+{
+    sem_t *sem;
+    LOCK_SITE *site;
+    uint64_t acquired;
+} HELD_LOCK;
+
+int lockprof_period;
+__thread int lockprof_countdown;
+__thread int lockprof_held;
+
+static __thread HELD_LOCK held[LOCKPROF_MAX_HELD];
+
+static pthread_once_t lockprof_once = PTHREAD_ONCE_INIT;
+static sem_t lockprof_mutex;
+static LOCK_SITE *sites;
+static int num_sites;
+
+static char *class_names[NUM_LOCK_CLASSES] = {
+    [LOCK_CLASS_REGISTRY] "registry",
+    [LOCK_CLASS_TU] "tu",
+    [LOCK_CLASS_FREELIST] "freelist",
+    [LOCK_CLASS_OUTQ] "outq",
+    [LOCK_CLASS_CONNS] "conns",
+    [LOCK_CLASS_CONF] "conf",
+    [LOCK_CLASS_TRUNK] "trunk",
+    [LOCK_CLASS_SHARD] "shard",
+};
+
+static void lockprof_init(void);
+static void register_site(LOCK_SITE *site);
+static void record_max(uint64_t *max, uint64_t value);
+static int compare_wait(const void *a, const void *b);
+static uint64_t now_ns(void);
+
+/*
+ * Profile one in every period acquisitions of each thread.
+ */
+void lockprof_set_period(int period)
+{
+    Pthread_once(&lockprof_once, lockprof_init);
+    lockprof_period = period < 0 ? 0 : period;
+}
+
+/*
+ * Acquire a lock whose acquisition is sampled.  An uncontended
+ * acquisition is recognized with sem_trywait(), so that only contended
+ * ones need their wait timed.
+ */
+void lockprof_acquire(sem_t *sem, LOCK_SITE *site)
+{
+    uint64_t acquired;
+
+    lockprof_countdown = lockprof_period;
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE))
+        register_site(site);
+
+    if (sem_trywait(sem) == 0)
+    {
+        acquired = now_ns();
+    }
+    else
+    {
+        uint64_t start = now_ns();
+        P(sem);
+        acquired = now_ns();
+
+        uint64_t wait = acquired - start;
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->wait_ns, wait, __ATOMIC_RELAXED);
+        record_max(&site->max_wait_ns, wait);
+    }
+    __atomic_fetch_add(&site->samples, 1, __ATOMIC_RELAXED);
+
+    // Remember the lock so that UNLOCK() can time how long it was held.
+    if (lockprof_held < LOCKPROF_MAX_HELD)
+        held[lockprof_held++] = (HELD_LOCK){sem, site, acquired};
+}
+
+/*
+ * Release a lock while sampled locks are held: if it is one of them,
+ * record how long it was held.
+ */
+void lockprof_release(sem_t *sem)
+{
+    for (int i = lockprof_held - 1; i >= 0; i--)
+    {
+        if (held[i].sem != sem)
+            continue;
+
+        LOCK_SITE *site = held[i].site;
+        uint64_t hold = now_ns() - held[i].acquired;
+        __atomic_fetch_add(&site->holds, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->hold_ns, hold, __ATOMIC_RELAXED);
+        record_max(&site->max_hold_ns, hold);
+
+        held[i] = held[--lockprof_held];
+        return;
+    }
+}
+
+/*
+ * Print the samples of each lock class and call site.
+ */
+void lockprof_report(FILE *out)
+{
+    Pthread_once(&lockprof_once, lockprof_init);
+
+    if (lockprof_period == 0)
+    {
+        fprintf(out, "lock profiling is off\n");
+        return;
+    }
+
+    P(&lockprof_mutex);
+    int n = num_sites;
+    LOCK_SITE **sorted = Malloc((n + 1) * sizeof(LOCK_SITE *));
+    int i = 0;
+    for (LOCK_SITE *s = sites; s != NULL; s = s->next)
+        sorted[i++] = s;
+    V(&lockprof_mutex);
+
+    qsort(sorted, n, sizeof(LOCK_SITE *), compare_wait);
+
+    fprintf(out, "lock profile, 1 in %d acquisitions sampled (times in us)\n", lockprof_period);
+    fprintf(out, "%-9s %-32s %12s %10s %10s %10s %10s %10s\n", "class", "site", "~acquired",
+            "contended", "avg wait", "max wait", "avg hold", "max hold");
+
+    LOCK_SITE classes[NUM_LOCK_CLASSES] = {0};
+    for (int c = 0; c < NUM_LOCK_CLASSES; c++)
+        classes[c].class = c;
+    for (i = 0; i < n; i++)
+    {
+        LOCK_SITE *s = sorted[i];
+        LOCK_SITE *c = &classes[s->class];
+        c->samples += s->samples;
+        c->contended += s->contended;
+        c->wait_ns += s->wait_ns;
+        c->holds += s->holds;
+        c->hold_ns += s->hold_ns;
+        if (s->max_wait_ns > c->max_wait_ns)
+            c->max_wait_ns = s->max_wait_ns;
+        if (s->max_hold_ns > c->max_hold_ns)
+            c->max_hold_ns = s->max_hold_ns;
+    }
+
+    for (i = -NUM_LOCK_CLASSES; i < n; i++)
+    {
+        LOCK_SITE *s = i < 0 ? &classes[i + NUM_LOCK_CLASSES] : sorted[i];
+        char where[64];
+
+        if (s->samples == 0)
+            continue;
+        if (i < 0)
+            snprintf(where, sizeof(where), "(all)");
+        else
+        {
+            const char *file = strrchr(s->file, '/') != NULL ? strrchr(s->file, '/') + 1 : s->file;
+            snprintf(where, sizeof(where), "%s:%d %s", file, s->line, s->func);
+        }
+
+        fprintf(out, "%-9s %-32.32s %12llu %9.1f%% %10.2f %10.2f %10.2f %10.2f\n",
+                class_names[s->class], where, (unsigned long long)s->samples * lockprof_period,
+                100.0 * s->contended / s->samples, s->wait_ns / 1e3 / s->samples, s->max_wait_ns / 1e3,
+                s->holds ? s->hold_ns / 1e3 / s->holds : 0.0, s->max_hold_ns / 1e3);
+    }
+
+    Free(sorted);
+}
+
+static void lockprof_init(void)
+{
+    Sem_init(&lockprof_mutex, 0, 1);
+}
+
+/*
+ * Add a call site to the list of sites the first time it is sampled.
+ */
+static void register_site(LOCK_SITE *site)
+{
+    Pthread_once(&lockprof_once, lockprof_init);
+
+    P(&lockprof_mutex);
+    if (!site->registered)
+    {
+        site->next = sites;
+        sites = site;
+        num_sites++;
+        __atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+    }
+    V(&lockprof_mutex);
+}
+
+static void record_max(uint64_t *max, uint64_t value)
+{
+    uint64_t seen = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(max, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Order call sites by decreasing time spent waiting.
+ */
+static int compare_wait(const void *a, const void *b)
+{
+    uint64_t wa = (*(LOCK_SITE **)a)->wait_ns;
+    uint64_t wb = (*(LOCK_SITE **)b)->wait_ns;
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
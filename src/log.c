@@ -0,0 +1,350 @@
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "debug.h"
+#include "csapp.h"
+
+#ifdef DEBUG
+#define LOG_DEFAULT_THRESHOLD LOG_LEVEL_DEBUG
+#else
+#define LOG_DEFAULT_THRESHOLD LOG_LEVEL_WARN
+#endif
+
+typedef struct log_record
+{
+    uint64_t time;              // Nanoseconds since the epoch
+    const char *file;
+    const char *func;
+    int line;
+    int level;
+    int tid;
+    uint64_t seq;               // Position in its thread's ring
+    char message[LOG_MESSAGE_SIZE];
+} LOG_RECORD;
+
+/*
+ * Ring of records written by one thread and read by whichever thread
+ * flushes the log.  The producer only advances head and the consumer only
+ * advances tail, so neither needs a lock; they are kept on separate cache
+ * lines.
+ */
+typedef struct log_ring
+{
+    LOG_RECORD records[LOG_RING_RECORDS];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped_seen;      // Part of dropped already reported
+    int tid;
+    int closed;                 // Set when the thread has exited
+    struct log_ring *next;
+} LOG_RING;
+
+int log_threshold = LOG_DEFAULT_THRESHOLD;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static sem_t log_mutex;
+static LOG_RING *rings;
+static int log_fd = -1;
+static uint64_t total_dropped;
+static __thread LOG_RING *local;
+
+static LOG_RECORD *batch;
+static size_t batch_size;
+
+static char *level_names[] = {
+    [LOG_LEVEL_DEBUG] "debug",
+    [LOG_LEVEL_INFO] "info",
+    [LOG_LEVEL_WARN] "warn",
+    [LOG_LEVEL_ERROR] "error",
+    [LOG_LEVEL_OFF] "off",
+};
+
+static char *level_labels[] = {
+    [LOG_LEVEL_DEBUG] KMAG "DEBUG" KNRM,
+    [LOG_LEVEL_INFO] KBLU "INFO " KNRM,
+    [LOG_LEVEL_WARN] KYEL "WARN " KNRM,
+    [LOG_LEVEL_ERROR] KRED "ERROR" KNRM,
+};
+
+static void log_init(void);
+static void log_retire(void *arg);
+static LOG_RING *log_local(void);
+static void *log_thread(void *arg);
+static void log_at_exit(void);
+static void format_record(FILE *out, LOG_RECORD *r);
+static int compare_records(const void *a, const void *b);
+
+/*
+ * Start the background thread that writes the log.
+ */
+void log_start(int fd, int level)
+{
+    pthread_t tid;
+
+    Pthread_once(&log_once, log_init);
+
+    log_fd = fd;
+    log_set_level(level);
+    atexit(log_at_exit);
+
+    Pthread_create(&tid, NULL, log_thread, NULL);
+    Pthread_detach(tid);
+}
+
+/*
+ * Set the lowest level logged.
+ */
+void log_set_level(int level)
+{
+    log_threshold = level;
+}
+
+/*
+ * Get the level with a given name.
+ */
+int log_level_named(char *name)
+{
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++)
+    {
+        if (strcmp(name, level_names[level]) == 0)
+            return level;
+    }
+    return -1;
+}
+
+/*
+ * Log a record.  Before log_start(), it is written to stderr at once.
+ */
+void log_write(int level, const char *file, const char *func, int line, const char *fmt, ...)
+{
+    struct timespec ts;
+    va_list ap;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (log_fd < 0)
+    {
+        LOG_RECORD r = {.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, .file = file,
+                        .func = func, .line = line, .level = level, .tid = syscall(SYS_gettid)};
+        va_start(ap, fmt);
+        vsnprintf(r.message, sizeof(r.message), fmt, ap);
+        va_end(ap);
+        format_record(stderr, &r);
+        return;
+    }
+
+    LOG_RING *ring = log_local();
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LOG_RECORD *r = &ring->records[head % LOG_RING_RECORDS];
+    r->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->file = file;
+    r->func = func;
+    r->line = line;
+    r->level = level;
+    r->tid = ring->tid;
+    r->seq = head;
+    va_start(ap, fmt);
+    vsnprintf(r->message, sizeof(r->message), fmt, ap);
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write everything logged so far, in order of time, and free the rings of
+ * threads that have exited once they are drained.
+ */
+void log_flush(void)
+{
+    size_t n = 0;
+    uint64_t dropped = 0;
+
+    Pthread_once(&log_once, log_init);
+    if (log_fd < 0)
+        return;
+
+    P(&log_mutex);
+
+    LOG_RING **prev = &rings;
+    for (LOG_RING *ring = rings; ring != NULL;)
+    {
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        if (n + (head - tail) > batch_size)
+        {
+            batch_size = 2 * (n + (head - tail));
+            batch = Realloc(batch, batch_size * sizeof(LOG_RECORD));
+        }
+        for (; tail != head; tail++)
+            batch[n++] = ring->records[tail % LOG_RING_RECORDS];
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t ring_dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        dropped += ring_dropped - ring->dropped_seen;
+        ring->dropped_seen = ring_dropped;
+
+        // A closed ring receives no more records, so it is done with.
+        LOG_RING *next = ring->next;
+        if (closed)
+        {
+            *prev = next;
+            Free(ring);
+        }
+        else
+        {
+            prev = &ring->next;
+        }
+        ring = next;
+    }
+
+    if (n > 0 || dropped > 0)
+    {
+        char *buf;
+        size_t len;
+        FILE *out = open_memstream(&buf, &len);
+
+        qsort(batch, n, sizeof(LOG_RECORD), compare_records);
+        for (size_t i = 0; i < n; i++)
+            format_record(out, &batch[i]);
+        if (dropped > 0)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            total_dropped += dropped;
+            LOG_RECORD r = {.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, .file = __FILE__,
+                            .func = __func__, .line = __LINE__, .level = LOG_LEVEL_WARN,
+                            .tid = syscall(SYS_gettid)};
+            snprintf(r.message, sizeof(r.message), "event=log_dropped records=%llu", (unsigned long long)dropped);
+            format_record(out, &r);
+        }
+        fclose(out);
+
+        rio_writen(log_fd, buf, len);
+        free(buf);
+    }
+
+    V(&log_mutex);
+}
+
+/*
+ * Number of records dropped because their thread's ring was full.
+ */
+uint64_t log_dropped(void)
+{
+    uint64_t dropped;
+
+    Pthread_once(&log_once, log_init);
+
+    P(&log_mutex);
+    dropped = total_dropped;
+    for (LOG_RING *ring = rings; ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) - ring->dropped_seen;
+    V(&log_mutex);
+
+    return dropped;
+}
+
+static void log_init(void)
+{
+    Sem_init(&log_mutex, 0, 1);
+    if (pthread_key_create(&log_key, log_retire) != 0)
+        app_error("pthread_key_create error");
+}
+
+/*
+ * Get the calling thread's ring, creating it on first use.
+ */
+static LOG_RING *log_local(void)
+{
+    if (local != NULL)
+        return local;
+
+    Pthread_once(&log_once, log_init);
+
+    if (posix_memalign((void **)&local, 64, sizeof(LOG_RING)) != 0)
+        unix_error("posix_memalign error");
+    local->head = local->tail = 0;
+    local->dropped = local->dropped_seen = 0;
+    local->tid = syscall(SYS_gettid);
+    local->closed = 0;
+    pthread_setspecific(log_key, local);
+
+    P(&log_mutex);
+    local->next = rings;
+    rings = local;
+    V(&log_mutex);
+
+    return local;
+}
+
+/*
+ * Thread-exit destructor: the ring is left for the flusher to drain and
+ * free.
+ */
+static void log_retire(void *arg)
+{
+    LOG_RING *ring = arg;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Thread function of the flusher.
+ */
+static void *log_thread(void *arg)
+{
+    struct timespec period = {.tv_nsec = LOG_FLUSH_MS * 1000000};
+
+    while (1)
+    {
+        nanosleep(&period, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+static void log_at_exit(void)
+{
+    log_flush();
+}
+
+/*
+ * Format a record as one line:
+ *
+ *   2026-01-31T12:00:00.000000 INFO  <tid> pbx.c:123 tu_dial: event=...
+ */
+static void format_record(FILE *out, LOG_RECORD *r)
+{
+    time_t secs = r->time / 1000000000;
+    struct tm tm;
+    char stamp[32];
+    const char *file = strrchr(r->file, '/') != NULL ? strrchr(r->file, '/') + 1 : r->file;
+
+    gmtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(out, "%s.%06u %s %d %s:%d %s: %s\n", stamp, (unsigned)(r->time % 1000000000 / 1000),
+            level_labels[r->level], r->tid, file, r->line, r->func, r->message);
+}
+
+/*
+ * Order records by time, keeping the records of each thread in the order
+ * they were logged.
+ */
+static int compare_records(const void *a, const void *b)
+{
+    const LOG_RECORD *ra = a, *rb = b;
+
+    if (ra->time != rb->time)
+        return ra->time < rb->time ? -1 : 1;
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq ? 1 : 0;
+}
@@ -1,9 +1,29 @@
 #include "pbx.h"
 #include "server.h"
+#include "service.h"
+#include "reactor.h"
+#include "uring.h"
+#include "listener.h"
+#include "outq.h"
+#include "iostats.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "log.h"
+#include "cdr.h"
+#include "pool.h"
+#include "workload.h"
+#include "dialplan.h"
+#include "trunk.h"
+#include "registry.h"
 #include "debug.h"
 #include "csapp.h"
 
 static void terminate(int status);
+static int spawn_service_thread(int connfd);
+
+static volatile sig_atomic_t report_requested;
+static volatile sig_atomic_t reload_requested;
 
 void handle_sighup(int signal)
 {
@@ -11,10 +31,73 @@ void handle_sighup(int signal)
     terminate(EXIT_SUCCESS);
 }
 
+void handle_sigusr1(int signal)
+{
+    report_requested = 1;
+}
+
+void handle_sigusr2(int signal)
+{
+    reload_requested = 1;
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-a <acceptors>] [-r <reactor threads>] [-i <ring threads>]
+ *            [-q <high-water bytes>] [-s <socket>] [-u <socket>] [-m <port>] [-l <period>] [-L <level>]
+ *            [-c <file>] [-C <bytes>] [-P <connections>] [-T <calls>] [-D <file>]
+ *            [-k <port>] [-t <trunk>=<host>:<port>]... [-S <shards>]
+ *
+ *   -p <port>     Port on which the server listens (required unless -u
+ *                 is given).
+ *   -a <count>    Number of acceptor threads, each with its own listening
+ *                 socket bound to the port with SO_REUSEPORT.
+ *   -r <threads>  Service clients with the given number of event-driven
+ *                 reactor threads instead of one thread per connection.
+ *   -i <threads>  Service clients with the given number of io_uring
+ *                 threads, each of which accepts connections on its own
+ *                 listening socket, instead of one thread per connection.
+ *   -q <bytes>    Maximum output that may be queued for a client before it
+ *                 is disconnected as a slow consumer.
+ *   -s <socket>   Listen on the given Unix socket for a successor to hand
+ *                 the server over to (hot restart).
+ *   -u <socket>   Take over the listening sockets, clients and calls of
+ *                 the server listening for a successor on the given socket.
+ *   -m <port>     Serve metrics in the Prometheus text format over HTTP on
+ *                 the given port of the loopback interface.
+ *   -l <period>   Profile one in every <period> lock acquisitions.
+ *   -L <level>    Log at the given level or above to stderr: debug, info
+ *                 (call events), warn (the default), error or off.
+ *   -c <file>     Record every call in the given file (see cdr.h).
+ *   -C <bytes>    Size at which the call record file is rotated.
+ *   -P <count>    Number of connections for which TUs, output queues and
+ *                 connection state are preallocated (see pool.h).
+ *   -T <calls>    Make the given number of calls through the server with
+ *                 a synthetic workload (see workload.h), report the rate
+ *                 and exit.  The port defaults to an ephemeral one.
+ *   -D <file>     Route the numbers dialed by the dial plan in the given
+ *                 file (see dialplan.h).
+ *   -k <port>     Accept trunks from other switches on the given port
+ *                 (see trunk.h).
+ *   -t <trunk>=<host>:<port>
+ *                 Connect the trunk of the given number, to which the dial
+ *                 plan routes calls, to the trunk port of another switch.
+ *                 May be repeated.
+ *   -S <shards>   Number of shards of the PBX, each a lock domain of its
+ *                 own, with calls between shards made by messages (see
+ *                 shard.h).  Defaults to the number of reactor or io_uring
+ *                 threads, whose clients are each registered in the shard
+ *                 of their thread, which handles its messages, or else to 1.
+ *
+ * Hot restart (-s and -u) requires reactor threads and cannot be combined
+ * with -T, -k or -t.  -a, -r and hot restart cannot be combined with -i.
+ *
+ * SIGUSR1 prints the number of commands served and of system calls made
+ * to serve them on stderr, and the objects in each pool, followed by the
+ * lock profile if -l was given.  SIGUSR2 loads the dial plan file again
+ * and puts the new plan in place without pausing calls; if the file has an
+ * error, the old plan is kept.
  */
 int main(int argc, char *argv[])
 {
@@ -23,14 +106,134 @@ int main(int argc, char *argv[])
     // on which the server should listen.
 
     char *port = NULL;
-    if (argc == 3 && (strcmp(argv[1], "-p") == 0))
-        port = argv[2];
-    else
+    int acceptors = 1;
+    int reactor_threads = 0;
+    int ring_threads = 0;
+    long high_water = OUTQ_DEFAULT_HIGH_WATER;
+    char *handoff_path = NULL;
+    char *takeover_path = NULL;
+    char *metrics_port = NULL;
+    int lock_period = 0;
+    int log_level = log_threshold;
+    char *cdr_path = NULL;
+    long cdr_max_bytes = CDR_DEFAULT_MAX_BYTES;
+    long reserve = POOL_DEFAULT_RESERVE;
+    long workload_calls = 0;
+    char *dialplan_path = NULL;
+    char *trunk_port = NULL;
+    char *trunk_specs[TRUNK_MAX];
+    int ntrunks = 0;
+    int shards = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "p:a:r:i:q:s:u:m:l:L:c:C:P:T:D:k:t:S:")) != EOF)
     {
-        fprintf(stderr, "Usage: bin/pbx -p <port>\n");
+        switch (option)
+        {
+        case 'p':
+            port = optarg;
+            break;
+        case 'a':
+            acceptors = atoi(optarg);
+            break;
+        case 'r':
+            reactor_threads = atoi(optarg);
+            break;
+        case 'i':
+            ring_threads = atoi(optarg);
+            break;
+        case 'q':
+            high_water = atol(optarg);
+            break;
+        case 's':
+            handoff_path = optarg;
+            break;
+        case 'u':
+            takeover_path = optarg;
+            break;
+        case 'm':
+            metrics_port = optarg;
+            break;
+        case 'l':
+            lock_period = atoi(optarg);
+            break;
+        case 'L':
+            log_level = log_level_named(optarg);
+            break;
+        case 'c':
+            cdr_path = optarg;
+            break;
+        case 'C':
+            cdr_max_bytes = atol(optarg);
+            break;
+        case 'P':
+            reserve = atol(optarg);
+            break;
+        case 'T':
+            workload_calls = atol(optarg);
+            if (port == NULL)
+                port = "0";
+            break;
+        case 'D':
+            dialplan_path = optarg;
+            break;
+        case 'k':
+            trunk_port = optarg;
+            break;
+        case 't':
+            if (ntrunks < TRUNK_MAX)
+                trunk_specs[ntrunks++] = optarg;
+            else
+            {
+                // More trunks than there are numbers for.
+                port = NULL;
+                optind = argc;
+            }
+            break;
+        case 'S':
+            shards = atoi(optarg);
+            break;
+        default:
+            port = NULL;
+            optind = argc;
+            break;
+        }
+    }
+
+    if ((port == NULL && takeover_path == NULL) || optind != argc ||
+        ((handoff_path != NULL || takeover_path != NULL) && reactor_threads == 0) || acceptors < 1 || acceptors > LISTENER_MAX_ACCEPTORS || reactor_threads < 0 || reactor_threads > REACTOR_MAX_THREADS ||
+        ring_threads < 0 || ring_threads > URING_MAX_THREADS ||
+        (ring_threads > 0 && (reactor_threads > 0 || acceptors > 1)) ||
+        high_water < 1 || shards < 0 || shards > REGISTRY_MAX_SHARDS || lock_period < 0 || log_level < 0 ||
+        cdr_max_bytes < (long)(sizeof(CDR_HEADER) + sizeof(CDR_RECORD)) || reserve < 0 || workload_calls < 0 ||
+        (workload_calls > 0 && (handoff_path != NULL || takeover_path != NULL)) ||
+        ((trunk_port != NULL || ntrunks > 0) && (handoff_path != NULL || takeover_path != NULL)))
+    {
+        fprintf(stderr, "Usage: bin/pbx -p <port> [-a <acceptors>] [-r <reactor threads>] [-i <ring threads>]\n"
+                        "               [-q <high-water bytes>] [-s <socket>] [-u <socket>] [-m <port>]\n"
+                        "               [-l <period>] [-L <level>] [-c <file>] [-C <bytes>] [-P <connections>]\n"
+                        "               [-T <calls>] [-D <file>] [-k <port>] [-t <trunk>=<host>:<port>]...\n"
+                        "               [-S <shards>]\n");
         exit(EXIT_FAILURE);
     }
 
+    if (shards == 0)
+        shards = reactor_threads > 0 ? reactor_threads : ring_threads > 0 ? ring_threads : 1;
+    registry_set_shards(shards);
+    outq_set_high_water(high_water);
+    lockprof_set_period(lock_period);
+    pool_reserve(reserve);
+    log_start(STDERR_FILENO, log_level);
+    if (cdr_path != NULL && cdr_start(cdr_path, cdr_max_bytes) < 0)
+        exit(EXIT_FAILURE);
+    if (dialplan_path != NULL)
+    {
+        DIALPLAN *plan = dialplan_load(dialplan_path);
+        if (plan == NULL)
+            exit(EXIT_FAILURE);
+        dialplan_install(plan);
+    }
+
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
     // run function pbx_client_service().  In addition, you should install
@@ -48,24 +251,107 @@ int main(int argc, char *argv[])
     }
 
     Signal(SIGHUP, handle_sighup);
+    Signal(SIGUSR1, handle_sigusr1);
+    Signal(SIGUSR2, handle_sigusr2);
 
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
-    listenfd = Open_listenfd(port);
+    // Trunks carry calls from the start, so the PBX must be up.
+    if (trunk_port != NULL && trunk_listen(trunk_port) < 0)
+        exit(EXIT_FAILURE);
+    for (int i = 0; i < ntrunks; i++)
+    {
+        char *host = strchr(trunk_specs[i], '=');
+        char *colon = host != NULL ? strrchr(host, ':') : NULL;
+        if (colon == NULL)
+        {
+            fprintf(stderr, "Invalid trunk: %s\n", trunk_specs[i]);
+            exit(EXIT_FAILURE);
+        }
+        *host++ = '\0';
+        *colon = '\0';
+        if (trunk_connect(atoi(trunk_specs[i]), host, colon + 1) < 0)
+            exit(EXIT_FAILURE);
+    }
 
+    listener_handler *handler = spawn_service_thread;
+
+    if (reactor_threads > 0)
+    {
+        if (reactor_start(reactor_threads) < 0)
+        {
+            fprintf(stderr, "Failed to start reactor threads\n");
+            exit(EXIT_FAILURE);
+        }
+        handler = reactor_add;
+    }
+
+    int bound = -1;
+    if (ring_threads > 0)
+    {
+        if ((bound = uring_start(port, ring_threads)) < 0)
+            exit(EXIT_FAILURE);
+    }
+    else if (takeover_path != NULL)
+    {
+        int listenfds[LISTENER_MAX_ACCEPTORS];
+        int nlisten = handoff_receive(takeover_path, listenfds, LISTENER_MAX_ACCEPTORS);
+        if (nlisten < 0 || listener_adopt(listenfds, nlisten, handler) < 0)
+        {
+            fprintf(stderr, "Unable to take over from %s\n", takeover_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if ((bound = listener_start(port, acceptors, handler)) < 0)
+        exit(EXIT_FAILURE);
+
+    // The PBX is not shut down under the service threads of the workload's
+    // connections, which may still be unregistering their TUs.
+    if (workload_calls > 0)
+        exit(workload_run(bound, workload_calls, stdout) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    if (handoff_path != NULL && handoff_listen(handoff_path) < 0)
+        exit(EXIT_FAILURE);
+
+    if (metrics_port != NULL && metrics_listen(metrics_port) < 0)
+        exit(EXIT_FAILURE);
+
+    // The acceptor threads do the rest; wait here for SIGHUP.
     while (1)
     {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, pbx_client_service, connfdp);
+        pause();
+        if (report_requested)
+        {
+            report_requested = 0;
+            iostats_report(stderr);
+            pool_report(stderr);
+            if (lock_period > 0)
+                lockprof_report(stderr);
+        }
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            DIALPLAN *plan = dialplan_path != NULL ? dialplan_load(dialplan_path) : NULL;
+            if (plan != NULL)
+            {
+                dialplan_install(plan);
+                log_info("event=dialplan_reload path=%s", dialplan_path);
+            }
+        }
     }
 
     terminate(EXIT_FAILURE);
 }
 
+/*
+ * Start a client service thread for an accepted connection.
+ */
+static int spawn_service_thread(int connfd)
+{
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, pbx_client_service, pbx_client_arg(connfd));
+    return 0;
+}
+
 /*
  * Function called to cleanly shut down the server.
  */
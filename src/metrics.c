@@ -0,0 +1,346 @@
+#include <time.h>
+
+#include "metrics.h"
+#include "iostats.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_BIND_TRIES 20
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static sem_t metrics_mutex;
+static METRICS *live;
+static METRICS retired;
+static __thread METRICS *local;
+
+static char *op_names[NUM_METRIC_OPS] = {
+    [METRIC_PICKUP] "pickup",
+    [METRIC_HANGUP] "hangup",
+    [METRIC_DIAL] "dial",
+    [METRIC_CHAT] "chat",
+    [METRIC_JOIN] "join",
+    [METRIC_REGISTER] "register",
+    [METRIC_UNREGISTER] "unregister",
+};
+
+static char *state_labels[METRICS_STATES] = {
+    [TU_ON_HOOK] "on_hook",
+    [TU_RINGING] "ringing",
+    [TU_DIAL_TONE] "dial_tone",
+    [TU_RING_BACK] "ring_back",
+    [TU_BUSY_SIGNAL] "busy_signal",
+    [TU_CONNECTED] "connected",
+    [TU_ERROR] "error",
+};
+
+static METRICS *metrics_local(void);
+static void metrics_init(void);
+static void metrics_retire(void *arg);
+static void metrics_add(METRICS *total, METRICS *m);
+static int bucket_of(uint64_t ns);
+static uint64_t bucket_lower(int bucket);
+static void *metrics_loop(void *arg);
+
+/*
+ * Get the current time in nanoseconds on the monotonic clock.
+ */
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Record the latency of an operation.
+ */
+void metrics_record(METRIC_OP op, uint64_t start)
+{
+    METRICS *m = metrics_local();
+    uint64_t ns = metrics_now() - start;
+
+    m->buckets[op][bucket_of(ns)]++;
+    m->sum_ns[op] += ns;
+}
+
+/*
+ * Record that a TU has changed state.
+ */
+void metrics_state_change(int from, int to)
+{
+    if (from == to)
+        return;
+
+    METRICS *m = metrics_local();
+    if (from >= 0 && from < METRICS_STATES)
+        m->tus[from]--;
+    if (to >= 0 && to < METRICS_STATES)
+        m->tus[to]++;
+}
+
+/*
+ * Sum the metrics of all threads.
+ */
+void metrics_snapshot(METRICS *total)
+{
+    Pthread_once(&metrics_once, metrics_init);
+
+    memset(total, 0, sizeof(METRICS));
+
+    P(&metrics_mutex);
+    metrics_add(total, &retired);
+    for (METRICS *m = live; m != NULL; m = m->next)
+        metrics_add(total, m);
+    V(&metrics_mutex);
+}
+
+/*
+ * Write all metrics in the Prometheus text exposition format.  The
+ * histograms are exposed with a bucket per power of two from 1us, whose
+ * cumulative counts are exact since they fall on bucket boundaries.
+ */
+void metrics_write(FILE *out)
+{
+    METRICS *total = Malloc(sizeof(METRICS));
+    IOSTATS io;
+
+    metrics_snapshot(total);
+    iostats_snapshot(&io);
+
+    fprintf(out, "# HELP pbx_operation_duration_seconds Time taken by PBX operations.\n");
+    fprintf(out, "# TYPE pbx_operation_duration_seconds histogram\n");
+    for (int op = 0; op < NUM_METRIC_OPS; op++)
+    {
+        uint64_t count = 0;
+        int b = 0;
+
+        for (int bits = 10; bits <= METRICS_MAX_BITS; bits++)
+        {
+            for (; b < METRICS_BUCKETS && bucket_lower(b + 1) <= (1ULL << bits); b++)
+                count += total->buckets[op][b];
+            fprintf(out, "pbx_operation_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                    op_names[op], (double)(1ULL << bits) / 1e9, (unsigned long long)count);
+        }
+        for (; b < METRICS_BUCKETS; b++)
+            count += total->buckets[op][b];
+
+        fprintf(out, "pbx_operation_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                op_names[op], (unsigned long long)count);
+        fprintf(out, "pbx_operation_duration_seconds_sum{op=\"%s\"} %.9f\n",
+                op_names[op], total->sum_ns[op] / 1e9);
+        fprintf(out, "pbx_operation_duration_seconds_count{op=\"%s\"} %llu\n",
+                op_names[op], (unsigned long long)count);
+    }
+
+    int64_t registered = 0;
+    fprintf(out, "# HELP pbx_tus Registered TUs by state.\n");
+    fprintf(out, "# TYPE pbx_tus gauge\n");
+    for (int s = 0; s < METRICS_STATES; s++)
+    {
+        fprintf(out, "pbx_tus{state=\"%s\"} %lld\n", state_labels[s], (long long)total->tus[s]);
+        registered += total->tus[s];
+    }
+
+    fprintf(out, "# HELP pbx_registered_tus Registered TUs.\n");
+    fprintf(out, "# TYPE pbx_registered_tus gauge\n");
+    fprintf(out, "pbx_registered_tus %lld\n", (long long)registered);
+    fprintf(out, "# HELP pbx_active_calls Calls in progress (pairs of connected TUs).\n");
+    fprintf(out, "# TYPE pbx_active_calls gauge\n");
+    fprintf(out, "pbx_active_calls %lld\n", (long long)total->tus[TU_CONNECTED] / 2);
+
+    fprintf(out, "# HELP pbx_commands_total Commands dispatched.\n");
+    fprintf(out, "# TYPE pbx_commands_total counter\n");
+    fprintf(out, "pbx_commands_total %llu\n", (unsigned long long)io.commands);
+    fprintf(out, "# HELP pbx_syscalls_total System calls made to serve clients.\n");
+    fprintf(out, "# TYPE pbx_syscalls_total counter\n");
+    fprintf(out, "pbx_syscalls_total{call=\"read\"} %llu\n", (unsigned long long)io.reads);
+    fprintf(out, "pbx_syscalls_total{call=\"send\"} %llu\n", (unsigned long long)io.sends);
+    fprintf(out, "pbx_syscalls_total{call=\"epoll_ctl\"} %llu\n", (unsigned long long)io.epoll_ctls);
+
+    Free(total);
+}
+
+/*
+ * Start a thread that serves the metrics over HTTP on the loopback
+ * interface.
+ *
+ * @return 0 if the port is being listened on, otherwise -1.
+ */
+int metrics_listen(char *port)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(atoi(port)),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int optval = 1;
+    pthread_t tid;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+
+    // After a hot restart, the port is released when the old server exits.
+    int rc, tries = 0;
+    while ((rc = bind(sock, (struct sockaddr *)&addr, sizeof(addr))) < 0 && errno == EADDRINUSE &&
+           ++tries < METRICS_BIND_TRIES)
+        usleep(100000);
+    if (rc < 0 || listen(sock, LISTENQ) < 0)
+    {
+        fprintf(stderr, "Unable to serve metrics on port %s: %s\n", port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int *sockp = Malloc(sizeof(int));
+    *sockp = sock;
+    Pthread_create(&tid, NULL, metrics_loop, sockp);
+    Pthread_detach(tid);
+
+    debug("Serving metrics on port %s", port);
+    return 0;
+}
+
+/*
+ * Thread function of the metrics endpoint.  Requests are served one at a
+ * time; the request itself is read but not interpreted.
+ */
+static void *metrics_loop(void *arg)
+{
+    int sock = *(int *)arg;
+    char request[METRICS_REQUEST_SIZE];
+    struct timeval tv = {.tv_sec = 1};
+
+    Free(arg);
+
+    while (1)
+    {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        // A client that never sends its request must not stall the endpoint.
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (read(conn, request, sizeof(request)) >= 0)
+        {
+            char *body;
+            size_t len;
+            FILE *out = open_memstream(&body, &len);
+            metrics_write(out);
+            fclose(out);
+
+            dprintf(conn, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+            rio_writen(conn, body, len);
+            free(body);
+        }
+        close(conn);
+    }
+
+    return NULL;
+}
+
+/*
+ * Get the calling thread's metrics, creating them on first use.
+ */
+static METRICS *metrics_local(void)
+{
+    if (local != NULL)
+        return local;
+
+    Pthread_once(&metrics_once, metrics_init);
+
+    if (posix_memalign((void **)&local, 64, sizeof(METRICS)) != 0)
+        unix_error("posix_memalign error");
+    memset(local, 0, sizeof(METRICS));
+    pthread_setspecific(metrics_key, local);
+
+    P(&metrics_mutex);
+    local->next = live;
+    if (live != NULL)
+        live->prev = local;
+    live = local;
+    V(&metrics_mutex);
+
+    return local;
+}
+
+static void metrics_init(void)
+{
+    Sem_init(&metrics_mutex, 0, 1);
+    if (pthread_key_create(&metrics_key, metrics_retire) != 0)
+        app_error("pthread_key_create error");
+}
+
+/*
+ * Thread-exit destructor: fold the thread's metrics into the total of
+ * retired threads and free them.
+ */
+static void metrics_retire(void *arg)
+{
+    METRICS *m = arg;
+
+    P(&metrics_mutex);
+    metrics_add(&retired, m);
+    if (m->prev != NULL)
+        m->prev->next = m->next;
+    else
+        live = m->next;
+    if (m->next != NULL)
+        m->next->prev = m->prev;
+    V(&metrics_mutex);
+
+    free(m);
+}
+
+/*
+ * The metrics of other threads are read without synchronization, as in
+ * iostats_add(); a reading may miss the updates in flight.
+ */
+static void metrics_add(METRICS *total, METRICS *m)
+{
+    for (int op = 0; op < NUM_METRIC_OPS; op++)
+    {
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+            total->buckets[op][b] += m->buckets[op][b];
+        total->sum_ns[op] += m->sum_ns[op];
+    }
+    for (int s = 0; s < METRICS_STATES; s++)
+        total->tus[s] += m->tus[s];
+}
+
+/*
+ * Get the bucket of a latency: values below METRICS_SUB_BUCKETS have a
+ * bucket each, and every power of two above is split into
+ * METRICS_SUB_BUCKETS equal buckets.
+ */
+static int bucket_of(uint64_t ns)
+{
+    if (ns < METRICS_SUB_BUCKETS)
+        return ns;
+
+    int bits = 63 - __builtin_clzll(ns);
+    if (bits > METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+
+    int sub = (ns >> (bits - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (bits - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/*
+ * Get the smallest latency counted in a bucket.
+ */
+static uint64_t bucket_lower(int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+        return bucket;
+
+    int bits = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    int sub = bucket % METRICS_SUB_BUCKETS;
+    return (uint64_t)(METRICS_SUB_BUCKETS + sub) << (bits - METRICS_SUB_BITS);
+}
@@ -0,0 +1,1068 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+#include "iostats.h"
+#include "lockprof.h"
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define OUTQ_INITIAL_SIZE 512
+#define FLUSHER_MAX_EVENTS 256
+#define BATCH_MAX_QUEUES 64
+#define STREAM_END_MAX 8
+
+/*
+ * Output at least this large is sent at once if nothing is queued, even
+ * on a corked queue: it is not worth holding back to save a system call,
+ * and sending it straight from the caller's buffer saves copying it.
+ */
+#define OUTQ_CORK_BYPASS 4096
+
+struct outq
+{
+    int fd;
+    int armed;
+    int failed;
+    int destroyed;
+    int corked;
+    int frozen;
+    int refs;
+    size_t inflight;            // Bytes handed to the submitter and not yet sent
+    sem_t mutex;
+    char *buf;
+    size_t head;
+    size_t len;
+    size_t cap;
+    OUTQ_BUF *shared;           // Output queued by reference, ahead of buf
+    size_t shared_head;
+    unsigned stream;            // Token of the open stream, or 0
+    unsigned last_stream;
+    char stream_end[STREAM_END_MAX];
+    size_t stream_end_len;
+    char *held;                 // Output sent by others while a stream is open
+    size_t held_len;
+    size_t held_cap;
+    int waiting;                // Stream writer waiting for the queue to drain
+    sem_t drained;
+    OUTQ *next_zombie;
+};
+
+/*
+ * The flusher thread waits for queued connections to become writable and
+ * drains them.  A queue is registered with the flusher's epoll instance
+ * (armed) only while it holds queued output.
+ *
+ * A queue destroyed while armed may still be referenced by an event that
+ * the flusher has already retrieved, so it is put on the zombie list and
+ * freed by the flusher once the batch of events that might mention it has
+ * been processed.
+ */
+static size_t high_water = OUTQ_DEFAULT_HIGH_WATER;
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Queues come from one pool, and buffers of OUTQ_INITIAL_SIZE from
+ * another: the first buffer of each queue, and shared buffers that fit.
+ * Larger buffers are allocated.
+ */
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+static POOL *queue_pool;
+static POOL *buffer_pool;
+static int flusher_epfd;
+static int flusher_wakeup;
+static sem_t zombie_mutex;
+static OUTQ *zombies;
+
+/*
+ * Queues written by the calling thread during the current batch.  Each of
+ * them is corked, and referenced, until the batch ends.
+ */
+static __thread struct
+{
+    int depth;
+    int count;
+    OUTQ *queues[BATCH_MAX_QUEUES];
+} batch;
+
+/*
+ * Function that sends the output of the calling thread's batches, if any.
+ */
+static __thread outq_submitter *submitter;
+
+/*
+ * Function that takes the output of virtual descriptors, if any.
+ */
+static outq_sink *output_sink;
+
+static void pools_init(void);
+static char *buffer_grow(char *buf, size_t *cap, size_t need);
+static void buffer_free(char *buf, size_t cap);
+static void flusher_init(void);
+static void *flusher_loop(void *arg);
+static void flush_queue(OUTQ *q);
+static ssize_t raw_send(int fd, const void *buf, size_t len);
+static ssize_t raw_sendv(int fd, struct iovec *iov, int iovcnt);
+static int queue_write(OUTQ *q, const struct iovec *iov, int iovcnt, int cork, OUTQ_BUF *b);
+static void queue_append(OUTQ *q, const char *data, size_t len);
+static size_t queue_pending(OUTQ *q);
+static ssize_t queue_send(OUTQ *q);
+static void queue_consume(OUTQ *q, size_t n);
+static void queue_unshare(OUTQ *q);
+static void queue_hold(OUTQ *q, const struct iovec *iov, int iovcnt);
+static void stream_end(OUTQ *q);
+static void queue_wake(OUTQ *q);
+static void queue_fail(OUTQ *q);
+static int queue_arm(OUTQ *q);
+static void queue_cork(OUTQ *q);
+static void queue_uncork(OUTQ *q);
+static void queue_submit(OUTQ *q);
+static void queue_release(OUTQ *q);
+
+/*
+ * Set the high-water mark used for all queues.
+ */
+void outq_set_high_water(size_t bytes)
+{
+    high_water = bytes;
+}
+
+/*
+ * Create an outbound queue for a file descriptor.
+ */
+OUTQ *outq_create(int fd)
+{
+    Pthread_once(&flusher_once, flusher_init);
+    Pthread_once(&pools_once, pools_init);
+
+    OUTQ *q = pool_get(queue_pool);
+    memset(q, 0, sizeof(OUTQ));
+    q->fd = fd;
+    q->refs = 1;
+    Sem_init(&q->mutex, 0, 1);
+    Sem_init(&q->drained, 0, 0);
+    return q;
+}
+
+/*
+ * Destroy an outbound queue, discarding any output still queued.
+ */
+void outq_destroy(OUTQ *q)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+    q->destroyed = 1;
+    queue_wake(q);
+
+    if (!q->armed)
+    {
+        UNLOCK(&q->mutex);
+        queue_release(q);
+        return;
+    }
+
+    epoll_ctl(flusher_epfd, EPOLL_CTL_DEL, q->fd, NULL);
+    IOSTATS_COUNT(epoll_ctls);
+    UNLOCK(&q->mutex);
+
+    uint64_t one = 1;
+    LOCK(&zombie_mutex, LOCK_CLASS_OUTQ);
+    q->next_zombie = zombies;
+    zombies = q;
+    UNLOCK(&zombie_mutex);
+    if (write(flusher_wakeup, &one, sizeof(one)) < 0)
+        debug("Unable to wake flusher: %s", strerror(errno));
+}
+
+/*
+ * Start a batch of output on the calling thread.
+ */
+void outq_batch_begin(void)
+{
+    batch.depth++;
+}
+
+/*
+ * End a batch of output, flushing every queue written during it.
+ */
+void outq_batch_end(void)
+{
+    if (--batch.depth > 0)
+        return;
+
+    for (int i = 0; i < batch.count; i++)
+    {
+        queue_uncork(batch.queues[i]);
+        queue_release(batch.queues[i]);
+    }
+    batch.count = 0;
+}
+
+/*
+ * Send data on the connection underlying a queue, queueing whatever
+ * cannot be sent immediately.
+ */
+int outq_send(OUTQ *q, const void *data, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+
+    return outq_sendv(q, &iov, 1);
+}
+
+/*
+ * Send the concatenation of several buffers, as with outq_send().  Output
+ * is only sent directly when nothing is queued and the queue is not
+ * corked, so that the order of messages is preserved.  While a stream is
+ * open on the queue, the output is held until the stream is closed.
+ */
+int outq_sendv(OUTQ *q, const struct iovec *iov, int iovcnt)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    int status;
+    if (q->failed || q->destroyed)
+    {
+        status = -1;
+    }
+    else if (q->stream != 0)
+    {
+        queue_hold(q, iov, iovcnt);
+        status = q->failed ? -1 : 0;
+    }
+    else
+    {
+        status = queue_write(q, iov, iovcnt, 1, NULL);
+    }
+
+    UNLOCK(&q->mutex);
+    if (status < 0)
+        return -1;
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/*
+ * Create a shared buffer, with one reference held by the caller.  One that
+ * fits in OUTQ_INITIAL_SIZE comes from the pool of buffers.
+ */
+OUTQ_BUF *outq_buf_create(size_t len)
+{
+    Pthread_once(&pools_once, pools_init);
+
+    OUTQ_BUF *b;
+    if (sizeof(OUTQ_BUF) + len <= OUTQ_INITIAL_SIZE)
+        b = pool_get(buffer_pool);
+    else
+        b = Malloc(sizeof(OUTQ_BUF) + len);
+    b->refs = 1;
+    b->len = len;
+    return b;
+}
+
+/*
+ * Take an additional reference to a shared buffer.
+ */
+void outq_buf_ref(OUTQ_BUF *b)
+{
+    __atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop a reference to a shared buffer, freeing it with the last one.
+ */
+void outq_buf_release(OUTQ_BUF *b)
+{
+    if (b != NULL && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if (sizeof(OUTQ_BUF) + b->len <= OUTQ_INITIAL_SIZE)
+            pool_put(buffer_pool, b);
+        else
+            Free(b);
+    }
+}
+
+/*
+ * Send the contents of a shared buffer, as with outq_send().  Whatever
+ * cannot be sent at once is queued by reference if nothing else is
+ * queued, and copied otherwise.
+ */
+int outq_send_buf(OUTQ *q, OUTQ_BUF *b)
+{
+    struct iovec iov = {.iov_base = b->data, .iov_len = b->len};
+
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    int status;
+    if (q->failed || q->destroyed)
+    {
+        status = -1;
+    }
+    else if (q->stream != 0)
+    {
+        queue_hold(q, &iov, 1);
+        status = q->failed ? -1 : 0;
+    }
+    else
+    {
+        status = queue_write(q, &iov, 1, 1, b);
+    }
+
+    UNLOCK(&q->mutex);
+    return status < 0 ? -1 : (int)b->len;
+}
+
+/*
+ * Open a stream on a queue, closing any stream already open.
+ */
+unsigned outq_stream_open(OUTQ *q, const void *end, size_t end_len)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    if (q->failed || q->destroyed || end_len > STREAM_END_MAX)
+    {
+        UNLOCK(&q->mutex);
+        return 0;
+    }
+
+    if (q->stream != 0)
+    {
+        debug("Stream %u on fd %d cut short by another", q->stream, q->fd);
+        stream_end(q);
+    }
+    if (++q->last_stream == 0)
+        q->last_stream = 1;
+    q->stream = q->last_stream;
+    memcpy(q->stream_end, end, end_len);
+    q->stream_end_len = end_len;
+    __atomic_fetch_add(&q->refs, 1, __ATOMIC_RELAXED);
+
+    unsigned stream = q->stream;
+    UNLOCK(&q->mutex);
+    return stream;
+}
+
+/*
+ * Send part of the output of a stream.  Stream output is not held back by
+ * the batch of the calling thread.
+ */
+int outq_stream_write(OUTQ *q, unsigned stream, const struct iovec *iov, int iovcnt, int wait)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    // Output held by a cork would never drain while its batch waits here.
+    while (wait && q->stream == stream && !q->failed && !q->destroyed && !q->corked &&
+           queue_pending(q) + q->inflight > high_water / 2)
+    {
+        q->waiting = 1;
+        UNLOCK(&q->mutex);
+        P(&q->drained);
+        LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+        q->waiting = 0;
+    }
+
+    int status = -1;
+    if (q->stream == stream && !q->failed && !q->destroyed)
+        status = queue_write(q, iov, iovcnt, 0, NULL);
+
+    UNLOCK(&q->mutex);
+    return status;
+}
+
+/*
+ * Close a stream, releasing the output held while it was open.
+ */
+void outq_stream_close(OUTQ *q, unsigned stream)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    if (q->stream == stream && !q->failed && !q->destroyed)
+        stream_end(q);
+
+    UNLOCK(&q->mutex);
+    queue_release(q);
+}
+
+/*
+ * Have the output of the calling thread's batches sent by a submitter.
+ */
+void outq_set_submitter(outq_submitter *submit)
+{
+    submitter = submit;
+}
+
+/*
+ * Send the output of virtual descriptors to a sink.
+ */
+void outq_set_sink(outq_sink *sink)
+{
+    output_sink = sink;
+}
+
+/*
+ * Account for output handed to a submitter having been sent, and hand it
+ * whatever was queued meanwhile.
+ */
+void outq_sent(OUTQ *q, size_t len, ssize_t res)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    q->inflight = 0;
+    if (res != len && !q->failed && !q->destroyed)
+    {
+        debug("Send of %zu bytes on fd %d: %zd", len, q->fd, res);
+        queue_fail(q);
+    }
+    else if (queue_pending(q) > 0 && !q->corked && !q->frozen && !q->failed && !q->destroyed)
+    {
+        if (submitter != NULL)
+            queue_submit(q);
+        else
+            queue_arm(q);
+    }
+
+    UNLOCK(&q->mutex);
+    queue_release(q);
+}
+
+/*
+ * Stop sending the output of a queue and get what is queued.
+ */
+size_t outq_freeze(OUTQ *q, const char **data)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    q->frozen = 1;
+    if (q->stream != 0 && !q->failed && !q->destroyed)
+        stream_end(q);
+    if (q->armed)
+    {
+        epoll_ctl(flusher_epfd, EPOLL_CTL_DEL, q->fd, NULL);
+        IOSTATS_COUNT(epoll_ctls);
+        q->armed = 0;
+    }
+    queue_unshare(q);
+    *data = q->buf + q->head;
+    size_t len = q->len;
+
+    UNLOCK(&q->mutex);
+    return len;
+}
+
+/*
+ * Resume sending the output of a frozen queue.
+ */
+void outq_thaw(OUTQ *q)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    q->frozen = 0;
+    if (queue_pending(q) > 0 && !q->failed && !q->destroyed && !q->corked && q->inflight == 0)
+        queue_arm(q);
+
+    UNLOCK(&q->mutex);
+}
+
+/*
+ * Format a message and send it as with outq_send().
+ */
+int outq_printf(OUTQ *q, const char *fmt, ...)
+{
+    char local[256];
+    char *msg = local;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(local, sizeof(local), fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return -1;
+
+    if (n >= sizeof(local))
+    {
+        msg = Malloc(n + 1);
+        va_start(ap, fmt);
+        vsnprintf(msg, n + 1, fmt, ap);
+        va_end(ap);
+    }
+
+    int status = outq_send(q, msg, n);
+
+    if (msg != local)
+        Free(msg);
+    return status;
+}
+
+/*
+ * Start the flusher thread.
+ */
+static void flusher_init(void)
+{
+    pthread_t tid;
+
+    Sem_init(&zombie_mutex, 0, 1);
+    if ((flusher_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    if ((flusher_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+        unix_error("eventfd error");
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(flusher_epfd, EPOLL_CTL_ADD, flusher_wakeup, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    Pthread_create(&tid, NULL, flusher_loop, NULL);
+    Pthread_detach(tid);
+}
+
+/*
+ * Thread function for the flusher.
+ */
+static void *flusher_loop(void *arg)
+{
+    struct epoll_event events[FLUSHER_MAX_EVENTS];
+
+    while (1)
+    {
+        // Queues on this list were removed from the epoll instance before
+        // the wait below, so no event retrieved by it can refer to them.
+        LOCK(&zombie_mutex, LOCK_CLASS_OUTQ);
+        OUTQ *dead = zombies;
+        zombies = NULL;
+        UNLOCK(&zombie_mutex);
+
+        int n = epoll_wait(flusher_epfd, events, FLUSHER_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_wait error");
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                uint64_t count;
+                if (read(flusher_wakeup, &count, sizeof(count)) < 0)
+                    debug("Unable to reset flusher wakeup: %s", strerror(errno));
+                continue;
+            }
+            flush_queue(events[i].data.ptr);
+        }
+
+        while (dead != NULL)
+        {
+            OUTQ *next = dead->next_zombie;
+            queue_release(dead);
+            dead = next;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Drain as much queued output as the connection will accept, rearming the
+ * writable notification if anything remains.
+ */
+static void flush_queue(OUTQ *q)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    if (q->destroyed || q->frozen)
+    {
+        UNLOCK(&q->mutex);
+        return;
+    }
+
+    while (queue_pending(q) > 0)
+    {
+        ssize_t n = queue_send(q);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                queue_fail(q);
+            break;
+        }
+        queue_consume(q, n);
+    }
+
+    if (queue_pending(q) <= high_water / 2)
+        queue_wake(q);
+
+    if (queue_pending(q) == 0 || q->failed)
+    {
+        epoll_ctl(flusher_epfd, EPOLL_CTL_DEL, q->fd, NULL);
+        IOSTATS_COUNT(epoll_ctls);
+        q->armed = 0;
+        q->head = 0;
+    }
+    else
+    {
+        struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = q};
+        epoll_ctl(flusher_epfd, EPOLL_CTL_MOD, q->fd, &ev);
+        IOSTATS_COUNT(epoll_ctls);
+    }
+
+    UNLOCK(&q->mutex);
+}
+
+/*
+ * Non-blocking send that does not raise SIGPIPE.  Descriptors that are not
+ * sockets (e.g. files used by the benchmarks) fall back to write().
+ */
+static ssize_t raw_send(int fd, const void *buf, size_t len)
+{
+    if (output_sink != NULL && fd >= OUTQ_VIRTUAL_FD)
+    {
+        output_sink(fd, &(struct iovec){.iov_base = (void *)buf, .iov_len = len}, 1);
+        return len;
+    }
+
+    IOSTATS_COUNT(sends);
+    ssize_t n = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK)
+        n = write(fd, buf, len);
+    return n;
+}
+
+/*
+ * Gathering version of raw_send().  The vector may be modified.
+ */
+static ssize_t raw_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+
+    if (output_sink != NULL && fd >= OUTQ_VIRTUAL_FD)
+    {
+        size_t len = 0;
+        output_sink(fd, iov, iovcnt);
+        for (int i = 0; i < iovcnt; i++)
+            len += iov[i].iov_len;
+        return len;
+    }
+
+    IOSTATS_COUNT(sends);
+    ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK)
+        n = writev(fd, iov, iovcnt);
+    return n;
+}
+
+/*
+ * Send output on a queue that is not failed, destroyed or holding output
+ * for a stream, queueing whatever cannot be sent immediately.  The
+ * queue's mutex must be held.
+ *
+ * @param cork  Whether the queue is added to the calling thread's batch.
+ * @param b  The shared buffer that the output (a single buffer) is taken
+ * from, or NULL.
+ * @return 0 if the output was sent or queued, -1 if the queue has failed.
+ */
+static int queue_write(OUTQ *q, const struct iovec *iov, int iovcnt, int cork, OUTQ_BUF *b)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (cork && batch.depth > 0)
+        queue_cork(q);
+
+    size_t sent = 0;
+    size_t pending = queue_pending(q);
+    if (pending == 0 && q->inflight == 0 && !q->frozen && (!q->corked || total >= OUTQ_CORK_BYPASS))
+    {
+        struct iovec local[8];
+        ssize_t n;
+        if (iovcnt == 1)
+        {
+            n = raw_send(q->fd, iov[0].iov_base, iov[0].iov_len);
+        }
+        else
+        {
+            int count = iovcnt < 8 ? iovcnt : 8;
+            memcpy(local, iov, count * sizeof(struct iovec));
+            n = raw_sendv(q->fd, local, count);
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            queue_fail(q);
+            return -1;
+        }
+        if (n > 0)
+            sent = n;
+    }
+
+    if (sent == total)
+        return 0;
+
+    if (pending + q->inflight + (total - sent) > high_water)
+    {
+        debug("Slow consumer on fd %d: %zu bytes queued", q->fd, pending + q->inflight + total - sent);
+        queue_fail(q);
+        return -1;
+    }
+
+    if (b != NULL && pending == 0)
+    {
+        outq_buf_ref(b);
+        q->shared = b;
+        q->shared_head = sent;
+        iovcnt = 0;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (sent >= iov[i].iov_len)
+        {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        queue_append(q, (const char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+
+    // Output sent meanwhile is passed on when the submitter is done.
+    if (!q->corked && !q->frozen && q->inflight == 0 && queue_arm(q) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Append data to the queue's buffer, compacting or growing it as needed.
+ */
+static void queue_append(OUTQ *q, const char *data, size_t len)
+{
+    if (q->head + q->len + len > q->cap)
+    {
+        if (q->head > 0)
+        {
+            memmove(q->buf, q->buf + q->head, q->len);
+            q->head = 0;
+        }
+        if (q->len + len > q->cap)
+            q->buf = buffer_grow(q->buf, &q->cap, q->len + len);
+    }
+
+    memcpy(q->buf + q->head + q->len, data, len);
+    q->len += len;
+}
+
+/*
+ * Get the number of bytes queued, by reference or copied.
+ */
+static size_t queue_pending(OUTQ *q)
+{
+    return q->len + (q->shared != NULL ? q->shared->len - q->shared_head : 0);
+}
+
+/*
+ * Send as much of the queued output as the connection accepts, without
+ * consuming it.
+ *
+ * @return the number of bytes sent, or -1 with errno set.
+ */
+static ssize_t queue_send(OUTQ *q)
+{
+    if (q->shared == NULL)
+        return raw_send(q->fd, q->buf + q->head, q->len);
+
+    struct iovec iov[2] = {{.iov_base = q->shared->data + q->shared_head,
+                            .iov_len = q->shared->len - q->shared_head},
+                           {.iov_base = q->buf + q->head, .iov_len = q->len}};
+    return raw_sendv(q->fd, iov, q->len > 0 ? 2 : 1);
+}
+
+/*
+ * Consume bytes sent from the front of the queue, dropping the reference
+ * to a shared buffer once it has all been sent.
+ */
+static void queue_consume(OUTQ *q, size_t n)
+{
+    if (q->shared != NULL)
+    {
+        size_t rest = q->shared->len - q->shared_head;
+        if (n < rest)
+        {
+            q->shared_head += n;
+            return;
+        }
+        outq_buf_release(q->shared);
+        q->shared = NULL;
+        n -= rest;
+    }
+    q->head += n;
+    q->len -= n;
+}
+
+/*
+ * Copy the output queued by reference into the queue's own buffer, ahead
+ * of what is there, so that all of it is contiguous.
+ */
+static void queue_unshare(OUTQ *q)
+{
+    if (q->shared == NULL)
+        return;
+
+    OUTQ_BUF *b = q->shared;
+    size_t n = b->len - q->shared_head;
+
+    q->shared = NULL;
+    if (q->len + n > q->cap)
+        q->buf = buffer_grow(q->buf, &q->cap, q->len + n);
+    memmove(q->buf + n, q->buf + q->head, q->len);
+    memcpy(q->buf, b->data + q->shared_head, n);
+    q->head = 0;
+    q->len += n;
+    outq_buf_release(b);
+}
+
+/*
+ * Keep output sent by others while a stream is open, counting it against
+ * the high-water mark.  The queue's mutex must be held.
+ */
+static void queue_hold(OUTQ *q, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (queue_pending(q) + q->inflight + q->held_len + total > high_water)
+    {
+        debug("Slow consumer on fd %d: %zu bytes held", q->fd, q->held_len + total);
+        queue_fail(q);
+        return;
+    }
+
+    if (q->held_len + total > q->held_cap)
+        q->held = buffer_grow(q->held, &q->held_cap, q->held_len + total);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(q->held + q->held_len, iov[i].iov_base, iov[i].iov_len);
+        q->held_len += iov[i].iov_len;
+    }
+}
+
+/*
+ * Close the open stream of a queue: send the bytes that end it, then the
+ * output held meanwhile.  The reference taken when the stream was opened
+ * is left to the caller.  The queue's mutex must be held.
+ */
+static void stream_end(OUTQ *q)
+{
+    struct iovec iov[2] = {{.iov_base = q->stream_end, .iov_len = q->stream_end_len},
+                           {.iov_base = q->held, .iov_len = q->held_len}};
+
+    q->stream = 0;
+    queue_write(q, iov, q->held_len > 0 ? 2 : 1, 1, NULL);
+    q->held_len = 0;
+}
+
+/*
+ * Wake the stream writer waiting for a queue to drain, if any.  The
+ * queue's mutex must be held.
+ */
+static void queue_wake(OUTQ *q)
+{
+    if (q->waiting)
+    {
+        q->waiting = 0;
+        V(&q->drained);
+    }
+}
+
+/*
+ * Mark a queue as failed, discard its output and shut the connection down,
+ * which causes the service loop reading from it to see EOF.
+ */
+static void queue_fail(OUTQ *q)
+{
+    q->failed = 1;
+    q->len = 0;
+    q->head = 0;
+    q->held_len = 0;
+    outq_buf_release(q->shared);
+    q->shared = NULL;
+    queue_wake(q);
+    shutdown(q->fd, SHUT_RDWR);
+}
+
+/*
+ * Register a queue with the flusher, so that its output is drained once
+ * the connection becomes writable.  The queue's mutex must be held.
+ *
+ * @return 0 if the queue is armed, -1 if it has failed.
+ */
+static int queue_arm(OUTQ *q)
+{
+    if (q->armed)
+        return 0;
+
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = q};
+    IOSTATS_COUNT(epoll_ctls);
+    if (epoll_ctl(flusher_epfd, EPOLL_CTL_ADD, q->fd, &ev) < 0)
+    {
+        queue_fail(q);
+        return -1;
+    }
+    q->armed = 1;
+    return 0;
+}
+
+/*
+ * Add a queue to the calling thread's batch, unless it is already part of
+ * it.  The queue's mutex must be held.  If the batch is full, the queue is
+ * simply not corked and its output is sent as usual.
+ */
+static void queue_cork(OUTQ *q)
+{
+    for (int i = 0; i < batch.count; i++)
+    {
+        if (batch.queues[i] == q)
+            return;
+    }
+
+    if (batch.count == BATCH_MAX_QUEUES)
+        return;
+
+    batch.queues[batch.count++] = q;
+    q->corked++;
+    __atomic_fetch_add(&q->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Remove one cork from a queue.  Once the last cork is removed, everything
+ * queued meanwhile is sent with a single call, and whatever the connection
+ * does not accept is left to the flusher.
+ */
+static void queue_uncork(OUTQ *q)
+{
+    LOCK(&q->mutex, LOCK_CLASS_OUTQ);
+
+    if (--q->corked > 0 || q->failed || q->destroyed || q->frozen || q->armed || queue_pending(q) == 0 ||
+        q->inflight > 0)
+    {
+        UNLOCK(&q->mutex);
+        return;
+    }
+
+    if (submitter != NULL && q->fd < OUTQ_VIRTUAL_FD)
+    {
+        queue_submit(q);
+        UNLOCK(&q->mutex);
+        return;
+    }
+
+    ssize_t n = queue_send(q);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        queue_fail(q);
+        UNLOCK(&q->mutex);
+        return;
+    }
+    if (n > 0)
+        queue_consume(q, n);
+
+    if (queue_pending(q) == 0)
+        q->head = 0;
+    else
+        queue_arm(q);
+
+    UNLOCK(&q->mutex);
+}
+
+/*
+ * Hand everything queued to the calling thread's submitter, which copies
+ * it.  Output queued by reference alone is handed over as it is, and
+ * otherwise first copied into the queue's buffer.  The queue is
+ * referenced until outq_sent() is called, and nothing more is sent on it
+ * until then, so that its output stays in order.  The queue's mutex must
+ * be held.
+ */
+static void queue_submit(OUTQ *q)
+{
+    if (q->shared != NULL && q->len == 0)
+    {
+        q->inflight = q->shared->len - q->shared_head;
+        __atomic_fetch_add(&q->refs, 1, __ATOMIC_RELAXED);
+        submitter(q, q->fd, q->shared->data + q->shared_head, q->inflight);
+        outq_buf_release(q->shared);
+        q->shared = NULL;
+        return;
+    }
+
+    queue_unshare(q);
+    q->inflight = q->len;
+    __atomic_fetch_add(&q->refs, 1, __ATOMIC_RELAXED);
+    submitter(q, q->fd, q->buf + q->head, q->len);
+    q->head = 0;
+    q->len = 0;
+}
+
+/*
+ * Drop a reference to a queue, freeing it when the last one is gone.
+ * References are held by the owner until outq_destroy(), by each batch
+ * the queue is part of, and by its submission in flight.
+ */
+static void queue_release(OUTQ *q)
+{
+    if (__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    outq_buf_release(q->shared);
+    buffer_free(q->buf, q->cap);
+    buffer_free(q->held, q->held_cap);
+    pool_put(queue_pool, q);
+}
+
+static void pools_init(void)
+{
+    queue_pool = pool_create("outq", sizeof(OUTQ), __alignof__(OUTQ), NULL);
+    buffer_pool = pool_create("outq_buffer", OUTQ_INITIAL_SIZE, 64, NULL);
+}
+
+/*
+ * Grow a buffer of a queue to hold at least need bytes, keeping its
+ * contents.  A buffer starts at OUTQ_INITIAL_SIZE, from the pool, and
+ * doubles.
+ *
+ * @param cap  The size of the buffer, 0 if there is none; updated.
+ * @return the grown buffer.
+ */
+static char *buffer_grow(char *buf, size_t *cap, size_t need)
+{
+    size_t size = *cap ? *cap : OUTQ_INITIAL_SIZE;
+    while (size < need)
+        size *= 2;
+
+    if (*cap > OUTQ_INITIAL_SIZE)
+        buf = Realloc(buf, size);
+    else if (size > OUTQ_INITIAL_SIZE)
+    {
+        char *grown = Malloc(size);
+        if (buf != NULL)
+        {
+            memcpy(grown, buf, *cap);
+            pool_put(buffer_pool, buf);
+        }
+        buf = grown;
+    }
+    else
+        buf = pool_get(buffer_pool);
+
+    *cap = size;
+    return buf;
+}
+
+/*
+ * Free a buffer of a queue, of the given size (0 if there is none).
+ */
+static void buffer_free(char *buf, size_t cap)
+{
+    if (cap == OUTQ_INITIAL_SIZE)
+        pool_put(buffer_pool, buf);
+    else if (cap > 0)
+        Free(buf);
+}
@@ -0,0 +1,240 @@
+#include "parser.h"
+#include "proto.h"
+#include "iostats.h"
+#include "debug.h"
+#include "csapp.h"
+
+static void make_room(PARSER *p);
+static void restore_held(PARSER *p);
+
+/*
+ * Initialize a parser reading from a file descriptor.
+ */
+void parser_init(PARSER *p, int fd)
+{
+    p->fd = fd;
+    p->protocol = PROTO_UNKNOWN;
+    p->discarding = 0;
+    p->held = -1;
+    p->chat = NULL;
+    p->start = 0;
+    p->end = 0;
+}
+
+/*
+ * Read the next chunk of input from the parser's file descriptor.
+ * Unconsumed input is first moved to the front of the buffer, which
+ * invalidates any line previously returned by parser_next().
+ *
+ * @return the number of bytes read, 0 on EOF, or -1 on error.
+ */
+ssize_t parser_fill(PARSER *p)
+{
+    make_room(p);
+
+    ssize_t n;
+    do
+    {
+        IOSTATS_COUNT(reads);
+        n = read(p->fd, p->buf + p->end, PARSER_BUFSIZE - p->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        p->end += n;
+    return n;
+}
+
+/*
+ * Append input received other than by reading the parser's descriptor.
+ * Like parser_fill(), this invalidates any line previously returned.
+ *
+ * @return the number of bytes taken.
+ */
+size_t parser_feed(PARSER *p, const char *data, size_t len)
+{
+    make_room(p);
+
+    size_t n = PARSER_BUFSIZE - p->end < len ? PARSER_BUFSIZE - p->end : len;
+    memcpy(p->buf + p->end, data, n);
+    p->end += n;
+    return n;
+}
+
+/*
+ * Get the next complete line from the parser's buffer.
+ *
+ * @param len  Set to the length of the returned line.
+ * @return the line, NUL-terminated in place, or NULL if none is buffered.
+ */
+char *parser_next(PARSER *p, size_t *len)
+{
+    char *eol;
+
+    while ((eol = memchr(p->buf + p->start, '\n', p->end - p->start)) != NULL)
+    {
+        char *line = p->buf + p->start;
+        p->start = eol + 1 - p->buf;
+
+        if (p->discarding)
+        {
+            p->discarding = 0;
+            continue;
+        }
+
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        *eol = '\0';
+
+        while (line < eol && isspace((unsigned char)*line))
+            line++;
+        if (line == eol)
+            continue;
+
+        *len = eol - line;
+        return line;
+    }
+
+    return NULL;
+}
+
+/*
+ * Get a partial line that fills the whole buffer.
+ *
+ * @return the line, or NULL if the buffer is not filled by a partial line.
+ */
+char *parser_partial(PARSER *p, size_t *len)
+{
+    if (p->start > 0 || p->end < PARSER_BUFSIZE || p->discarding)
+        return NULL;
+
+    char *line = p->buf;
+    while (line < p->buf + p->end && isspace((unsigned char)*line))
+        line++;
+
+    *len = p->buf + p->end - line;
+    return line;
+}
+
+/*
+ * Get the input buffered for the line being handled in parts, up to its
+ * end.
+ *
+ * @return the part, or NULL if none is buffered.
+ */
+char *parser_next_part(PARSER *p, size_t *len, int *last)
+{
+    char *part = p->buf + p->start;
+    size_t avail = p->end - p->start;
+    char *eol = memchr(part, '\n', avail);
+
+    if (eol != NULL)
+    {
+        p->start = eol + 1 - p->buf;
+        if (eol > part && eol[-1] == '\r')
+            eol--;
+        *len = eol - part;
+        *last = 1;
+        return part;
+    }
+
+    if (avail > 0 && part[avail - 1] == '\r')
+        avail--;
+    if (avail == 0)
+        return NULL;
+
+    p->start += avail;
+    *len = avail;
+    *last = 0;
+    return part;
+}
+
+/*
+ * Get the next complete frame of the binary protocol from the parser's
+ * buffer.  The byte following the payload, which is overwritten by its
+ * NUL terminator, is put back on the next call.
+ *
+ * @param op  Set to the opcode of the frame.
+ * @param len  Set to the length of the payload.
+ * @return the payload, or NULL if no complete frame is buffered.
+ */
+char *parser_next_frame(PARSER *p, int *op, size_t *len)
+{
+    restore_held(p);
+
+    while (1)
+    {
+        size_t avail = p->end - p->start;
+
+        // Skip what has arrived of an oversize frame.
+        if (p->discarding > 0)
+        {
+            size_t skip = avail < p->discarding ? avail : p->discarding;
+            p->start += skip;
+            p->discarding -= skip;
+            if (p->discarding > 0)
+                return NULL;
+            avail -= skip;
+        }
+
+        if (avail < PROTO_HEADER_SIZE)
+            return NULL;
+
+        unsigned char *header = (unsigned char *)p->buf + p->start;
+        size_t payload = (size_t)header[2] << 8 | header[3];
+        if (payload > PROTO_MAX_PAYLOAD)
+        {
+            debug("Discarding oversize frame on fd %d", p->fd);
+            p->discarding = PROTO_HEADER_SIZE + payload;
+            continue;
+        }
+        if (avail < PROTO_HEADER_SIZE + payload)
+            return NULL;
+
+        char *data = p->buf + p->start + PROTO_HEADER_SIZE;
+        *op = header[0];
+        *len = payload;
+        p->start += PROTO_HEADER_SIZE + payload;
+
+        p->held = (unsigned char)p->buf[p->start];
+        p->buf[p->start] = '\0';
+        return data;
+    }
+}
+
+/*
+ * Move unconsumed input to the front of the buffer, and drop a line that
+ * fills all of it.
+ */
+static void make_room(PARSER *p)
+{
+    restore_held(p);
+
+    if (p->start > 0)
+    {
+        memmove(p->buf, p->buf + p->start, p->end - p->start);
+        p->end -= p->start;
+        p->start = 0;
+    }
+
+    // A frame never fills the buffer, as longer ones are skipped as they
+    // arrive.
+    if (p->end == PARSER_BUFSIZE && p->protocol != PROTO_BINARY)
+    {
+        // Line too long for the buffer: drop it up to the next EOL.
+        debug("Discarding overlong line on fd %d", p->fd);
+        p->discarding = 1;
+        p->end = 0;
+    }
+}
+
+/*
+ * Put back the byte overwritten by the terminator of the last frame.
+ */
+static void restore_held(PARSER *p)
+{
+    if (p->held >= 0)
+    {
+        p->buf[p->start] = p->held;
+        p->held = -1;
+    }
+}
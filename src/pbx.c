@@ -1,4 +1,24 @@
+/*
+ * PBX engine based on per-TU semaphores.  It is replaced by the lock-free
+ * engine in pbx_cas.c when built with "make ENGINE=cas" (PBX_LOCKFREE).
+ */
+#ifndef PBX_LOCKFREE
+
+#include <sys/eventfd.h>
+
 #include "server.h"
+#include "outq.h"
+#include "proto.h"
+#include "conf.h"
+#include "cdr.h"
+#include "pool.h"
+#include "registry.h"
+#include "shard.h"
+#include "handoff.h"
+#include "trunk.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "log.h"
 #include "debug.h"
 #include "pbx.h"
 #include "csapp.h"
@@ -7,18 +27,152 @@ struct tu
 {
     TU_STATE current_state;
     int number;
-    int calling;
+    int fd;
+    REGISTRY_HANDLE handle;
+    int unregistered;
+    int refs;
+    TU *peer;
+    CONF *conf;
+    CDR_LEG call;               // Part of the record of the call in progress
+    OUTQ *out;
+    int protocol;
+    int shard;                  // Lock domain, found from the extension
+    unsigned int dials;         // Dials to other shards made so far
+    unsigned int dialing;       // The one whose answer is awaited, or 0
     sem_t tu_mutex;
 };
 
+/*
+ * Locking scheme:
+ *
+ *   The TUs are divided among the shards of the registry of extensions,
+ *   each of which is a lock domain (see shard.h).  The registry's lock of
+ *   a shard is only held while a TU is being added, removed or looked up,
+ *   never across a transition.  A call looks its callee up before it locks
+ *   the caller.
+ *
+ *   tu_mutex protects the state of a single TU (current_state, peer, conf,
+ *   unregistered, protocol and dialing).  A transition involving two TUs
+ *   of the same shard locks both, always in increasing order of extension
+ *   number.  The locks of TUs of two different shards are never held
+ *   together: a transition involving a TU of another shard is made on the
+ *   TU of this one, and a message posted to the other shard makes the
+ *   other half (see deliver()).  A TU in a conference bridge is connected
+ *   with no peer; the bridge's locks are taken inside tu_mutex.  Output to
+ *   the client goes through the TU's outbound queue, which never blocks,
+ *   so no lock is held while waiting on a client.
+ *
+ *   The messages posted to a shard are handled in the order they were
+ *   posted, under the shard's drain_mutex, which is taken before tu_mutex
+ *   and never by a thread that holds a TU lock.
+ *
+ *   refs counts the references that keep a TU object alive: one for the
+ *   registry, one for each peer whose peer field points to it, one for
+ *   each message to or from it, and one for each lookup in progress.  The
+ *   object is given back to the pool of TUs when the count drops to 0.
+ */
+
+/*
+ * Calls across shards.
+ *
+ * Each TU of such a call keeps its own half of it, and the halves are
+ * kept in step by messages.  The messages between two TUs are handled in
+ * the order they were posted, so each finds its TU as the one before left
+ * it, unless a command on the TU itself came in between:
+ *
+ *   MSG_DIAL: the caller, in TU_DIAL_TONE, asks the callee to ring.  The
+ *     callee rings if it is on hook, and answers with MSG_RING, MSG_BUSY
+ *     or, if it has been unregistered, MSG_ERROR.  The caller stays in
+ *     TU_DIAL_TONE until the answer comes, and then goes to TU_RING_BACK,
+ *     TU_BUSY_SIGNAL or TU_ERROR, unless it has left TU_DIAL_TONE or
+ *     dialed again meanwhile, in which case a callee it made ring is hung
+ *     up.
+ *   MSG_ANSWER: the callee has picked up, and the caller is connected.
+ *   MSG_HANGUP: the sender has hung up or gone away, and the receiver, if
+ *     it is still the sender's peer, goes to TU_ON_HOOK (from TU_RINGING)
+ *     or TU_DIAL_TONE.
+ *   MSG_CHAT: a chat, delivered if the receiver is still connected to the
+ *     sender.
+ *
+ * The record of such a call (see cdr.h) is written by the caller, which
+ * copies the answer time sent with MSG_ANSWER into its own leg, and gets
+ * the flags of a hangup by the callee with MSG_HANGUP.  A caller that
+ * hangs up before it hears of the answer records the call as cancelled.
+ */
+#define MSG_DIAL 0
+#define MSG_RING 1
+#define MSG_BUSY 2
+#define MSG_ERROR 3
+#define MSG_ANSWER 4
+#define MSG_HANGUP 5
+#define MSG_CHAT 6
+
+struct msg
+{
+    struct msg *next;
+    int kind;                   // MSG_xxx
+    TU *to;
+    TU *from;
+    int shard;                  // Shard of the TU it is for
+    unsigned int dial;          // The caller's dialing, in a MSG_DIAL and its answer
+    int flags;                  // CDR_FLAG_xxx of a MSG_HANGUP
+    uint64_t answer;            // Answer time of a MSG_ANSWER
+    char *text;                 // Copy of the chat of a MSG_CHAT
+    size_t len;
+};
+
+/*
+ * Messages of a shard.  The inbox is a stack onto which messages are
+ * pushed without a lock, and which is emptied in one exchange, so each
+ * shard has a cache line of its own.
+ */
+struct domain
+{
+    struct msg *inbox;          // Messages posted, newest first
+    int doorbell;               // eventfd of the owner, or -1
+    sem_t drain_mutex;          // Held while the messages are handled
+} __attribute__((aligned(64)));
+
+/*
+ * Extension numbers are assigned by the registry and are independent of
+ * the client file descriptors, so the number of extensions is not limited
+ * by PBX_MAX_EXTENSIONS but by REGISTRY_MAX_SLOTS in each registry shard.
+ */
 struct pbx
 {
-    int num_registered_tu;
-    sem_t pbx_mutex;
-    TU *registered_tu[PBX_MAX_EXTENSIONS];
+    REGISTRY *registry;
+    int nshards;
+    struct domain *domains;     // One for each shard of the registry
 };
 
-int printStatus(TU *tu, char *msg);
+static pthread_once_t tu_pool_once = PTHREAD_ONCE_INIT;
+static POOL *tu_pool;
+static POOL *msg_pool;
+
+static __thread int owned = -1;         // Shard claimed by the calling thread
+static __thread uint64_t touched;       // Shards it has posted to whose messages it handles
+
+int printStatus(TU *tu);
+int printChat(TU *tu, const char *msg, size_t len);
+static void tu_ref(TU *tu);
+static void tu_unref(TU *tu);
+static TU *tu_lookup(PBX *pbx, int ext);
+static TU *lock_tu_and_peer(TU *tu);
+static void unlock_tu_and_peer(TU *tu, TU *peer);
+static void connect_peers(TU *tu, TU *peer);
+static void disconnect_peers(TU *tu, TU *peer);
+static void hangup_locked(TU *tu, TU *peer, int notify);
+static void hangup_remote(TU *tu, TU *peer, int flags);
+static struct msg *msg_new(int kind, TU *to, TU *from);
+static void post(struct msg *m);
+static void deliver(struct msg *m);
+static void dialed(TU *tu, TU *callee, struct msg *m);
+static void hung_up(TU *tu, TU *peer, int flags);
+static void drain(struct domain *d);
+static void flush(void);
+static void adopt_peer(PBX *pbx, TU *tu, int *peer_of, int max_ext);
+static void set_state(TU *tu, TU_STATE state);
+static void tu_pool_init(void);
 
 /*
  * Initialize a new PBX.
@@ -29,18 +183,27 @@ PBX *pbx_init()
 {
     debug("Entered pbx_init");
 
-    PBX *temp = (PBX *)Malloc(sizeof(PBX));
+    PBX *temp = (PBX *)Calloc(1, sizeof(PBX));
     debug("Size of pbs: %ld", sizeof(PBX));
 
     if (temp == NULL)
         return NULL;
 
-    Sem_init(&temp->pbx_mutex, 0, 1);
-    P(&temp->pbx_mutex);
+    temp->registry = registry_create();
+    temp->nshards = registry_shards(temp->registry);
+    // Calloc() does not honour the alignment of the domains.
+    if (posix_memalign((void **)&temp->domains, __alignof__(struct domain),
+                       temp->nshards * sizeof(struct domain)) != 0)
+        unix_error("posix_memalign error");
+    for (int s = 0; s < temp->nshards; s++)
+    {
+        temp->domains[s].inbox = NULL;
+        temp->domains[s].doorbell = -1;
+        Sem_init(&temp->domains[s].drain_mutex, 0, 1);
+    }
+    Pthread_once(&tu_pool_once, tu_pool_init);
 
-    temp->num_registered_tu = 0;
     debug("Exiting pbx_init");
-    V(&temp->pbx_mutex);
     return temp;
 }
 
@@ -58,6 +221,14 @@ void pbx_shutdown(PBX *pbx)
 {
     debug("Entered pbx_shutdown");
 
+    for (int s = 0; s < pbx->nshards; s++)
+    {
+        if (pbx->domains[s].doorbell >= 0)
+            close(pbx->domains[s].doorbell);
+        sem_destroy(&pbx->domains[s].drain_mutex);
+    }
+    Free(pbx->domains);
+    registry_destroy(pbx->registry);
     Free(pbx);
     pbx = NULL;
 
@@ -80,36 +251,48 @@ void pbx_shutdown(PBX *pbx)
 TU *pbx_register(PBX *pbx, int fd)
 {
     debug("Entered pbx_register | fd: %d", fd);
-    P(&pbx->pbx_mutex);
 
-    if (pbx->num_registered_tu >= PBX_MAX_EXTENSIONS || pbx->registered_tu[fd] != NULL || fd < 4)
+    if (fd < 0)
     {
-        V(&pbx->pbx_mutex);
-        fprintf(stderr, "ERROR: Invalid arguments for pbx_register. FD: %d", fd);
+        fprintf(stderr, "ERROR: Invalid arguments for pbx_register. FD: %d\n", fd);
         return NULL;
     }
 
-    TU *temp_tu = (TU *)Malloc(sizeof(TU));
-    if (temp_tu == NULL)
-        return NULL;
+    TU *temp_tu = pool_get(tu_pool);
 
     Sem_init(&temp_tu->tu_mutex, 0, 1);
-    P(&temp_tu->tu_mutex);
-
-    temp_tu->number = fd;
-    temp_tu->calling = -1;
+    temp_tu->fd = fd;
+    temp_tu->unregistered = 0;
+    temp_tu->refs = 1;
+    temp_tu->peer = NULL;
+    temp_tu->conf = NULL;
+    temp_tu->call = (CDR_LEG){0};
+    temp_tu->out = outq_create(fd);
+    temp_tu->protocol = PROTO_TEXT;
+    temp_tu->dials = 0;
+    temp_tu->dialing = 0;
     temp_tu->current_state = TU_ON_HOOK;
-    printStatus(temp_tu, "");
 
-    pbx->registered_tu[temp_tu->number] = temp_tu;
-    pbx->num_registered_tu++;
+    // Nobody can act on the TU until its ON HOOK notification has been sent.
+    LOCK(&temp_tu->tu_mutex, LOCK_CLASS_TU);
 
-    // debug("File descriptor   %d", temp_tu->number);
-    // debug("num_registered_tu %d", pbx->num_registered_tu);
+    if ((temp_tu->number = registry_insert(pbx->registry, temp_tu, &temp_tu->handle)) < 0)
+    {
+        UNLOCK(&temp_tu->tu_mutex);
+        outq_destroy(temp_tu->out);
+        sem_destroy(&temp_tu->tu_mutex);
+        pool_put(tu_pool, temp_tu);
+        fprintf(stderr, "ERROR: No free extension for FD: %d\n", fd);
+        return NULL;
+    }
+
+    temp_tu->shard = registry_shard(pbx->registry, temp_tu->number);
+    metrics_state_change(-1, TU_ON_HOOK);
+    log_info("event=register ext=%d fd=%d", temp_tu->number, fd);
+    printStatus(temp_tu);
 
     debug("Exiting pbx_register | tu: %d", temp_tu->number);
-    V(&temp_tu->tu_mutex);
-    V(&pbx->pbx_mutex);
+    UNLOCK(&temp_tu->tu_mutex);
 
     return temp_tu;
 }
@@ -118,6 +301,10 @@ TU *pbx_register(PBX *pbx, int fd)
  * Unregister a TU from a PBX.
  * This amounts to "unplugging a telephone unit from the PBX".
  *
+ * The TU is first removed from the registry, so that it can no longer be
+ * dialed, and then hung up so that any call in progress is torn down and
+ * the peer is notified.
+ *
  * @param pbx  The PBX.
  * @param tu  The TU to be unregistered.
  * This object is freed as a result of the call and must not be used again.
@@ -125,27 +312,28 @@ TU *pbx_register(PBX *pbx, int fd)
  */
 int pbx_unregister(PBX *pbx, TU *tu)
 {
-    debug("Entered pbx_unregister | tu: %d", tu->number);
+    if (tu == NULL)
+        return -1;
 
-    P(&pbx->pbx_mutex);
+    debug("Entered pbx_unregister | tu: %d", tu->number);
 
-    if (tu == NULL || pbx->registered_tu[tu->number] == NULL || pbx->num_registered_tu < 1)
-    {
-        V(&pbx->pbx_mutex);
+    if (registry_remove(pbx->registry, tu->number, tu) < 0)
         return -1;
-    }
 
-    P(&tu->tu_mutex);
-    
-    // debug("File descriptor   %d", tu->number);
-    pbx->registered_tu[tu->number] = NULL;
-    pbx->num_registered_tu--;
+    TU *peer = lock_tu_and_peer(tu);
+    tu->unregistered = 1;
+    hangup_locked(tu, peer, 0);
+    metrics_state_change(tu->current_state, -1);
+    log_info("event=unregister ext=%d", tu->number);
 
-    V(&tu->tu_mutex);
+    // The descriptor is closed by the caller once we return, so nothing may
+    // be sent on it after this point.
+    outq_destroy(tu->out);
+    tu->out = NULL;
+    unlock_tu_and_peer(tu, peer);
 
-    Free(tu);
-    // debug("num_registered_tu %d", pbx->num_registered_tu);
-    V(&pbx->pbx_mutex);
+    tu_unref(tu);
+    flush();
     debug("Exiting pbx_unregister");
 
     return 0;
@@ -162,30 +350,26 @@ int pbx_unregister(PBX *pbx, TU *tu)
  */
 int tu_fileno(TU *tu)
 {
-    debug("Entering tu_fileno | tu: %d", tu->number);
-
-    if (tu == NULL || pbx->registered_tu[tu->number] == NULL)
+    if (tu == NULL || tu->unregistered)
         return -1;
 
     debug("Returning from tu_fileno | tu: %d", tu->number);
-    return tu->number;
+    return tu->fd;
 }
 
 /*
  * Get the extension number for a TU.
  * This extension number is assigned by the PBX when a TU is registered
  * and it is used to identify a particular TU in calls to tu_dial().
- * The value returned might be the same as the value returned by tu_number(),
- * but is not necessarily so.
+ * Extensions are assigned by the registry and are unrelated to the value
+ * returned by tu_fileno().
  *
  * @param tu
  * @return the extension number, if any, otherwise -1.
  */
 int tu_extension(TU *tu)
 {
-    debug("Entering tu_extension | tu: %d", tu->number);
-
-    if (tu == NULL || pbx->registered_tu[tu->number] == NULL)
+    if (tu == NULL || tu->unregistered)
         return -1;
 
     debug("Returning from tu_extension | tu: %d", tu->number);
@@ -213,14 +397,15 @@ int tu_extension(TU *tu)
  */
 int tu_pickup(TU *tu)
 {
+    if (tu == NULL)
+        return -1;
+
     debug("Entering tu_pickup | tu: %d", tu->number);
-    P(&pbx->pbx_mutex);
-    P(&tu->tu_mutex);
+    TU *peer = lock_tu_and_peer(tu);
 
-    if (tu == NULL || pbx == NULL || pbx->registered_tu[tu->number] == NULL)
+    if (tu->unregistered)
     {
-        V(&tu->tu_mutex);
-        V(&pbx->pbx_mutex);
+        unlock_tu_and_peer(tu, peer);
         return -1;
     }
 
@@ -230,43 +415,37 @@ int tu_pickup(TU *tu)
     case TU_ON_HOOK:
         debug("Entering TU_ON_HOOK | tu: %d", tu->number);
 
-        tu->current_state = TU_DIAL_TONE;
-        printStatus(tu, "");
+        set_state(tu, TU_DIAL_TONE);
+        printStatus(tu);
         break;
 
     case TU_RINGING:
         debug("Entering TU_RINGING | tu: %d", tu->number);
 
-        tu->current_state = TU_CONNECTED;
-        printStatus(tu, "");
-
-        if (tu->number < tu->calling)
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-        else
+        cdr_answer(&tu->call);
+        set_state(tu, TU_CONNECTED);
+        printStatus(tu);
+        if (peer == NULL)
         {
-            V(&tu->tu_mutex);
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-            P(&tu->tu_mutex);
+            struct msg *m = msg_new(MSG_ANSWER, tu->peer, tu);
+            m->answer = tu->call.answer;
+            post(m);
+            break;
         }
-
-        pbx->registered_tu[tu->calling]->current_state = TU_CONNECTED;
-        pbx->registered_tu[tu->calling]->calling = tu->number;
-        printStatus(pbx->registered_tu[tu->calling], "");
-
-        V(&pbx->registered_tu[tu->calling]->tu_mutex);
-
+        set_state(peer, TU_CONNECTED);
+        printStatus(peer);
         break;
 
     default:
         debug("Entering default | tu: %d", tu->number);
         debug("tu state: %s  | TU: %d", tu_state_names[tu->current_state], tu->number);
 
-        printStatus(tu, "");
+        printStatus(tu);
         break;
     }
 
-    V(&tu->tu_mutex);
-    V(&pbx->pbx_mutex);
+    unlock_tu_and_peer(tu, peer);
+    flush();
     debug("Returning from tu_pickup | tu: %d", tu->number);
     return 0;
 }
@@ -300,110 +479,127 @@ int tu_pickup(TU *tu)
  */
 int tu_hangup(TU *tu)
 {
+    if (tu == NULL)
+        return -1;
+
     debug("Entering tu_hangup | tu: %d", tu->number);
-    P(&pbx->pbx_mutex);
-    P(&tu->tu_mutex);
-    int temp;
-    if (tu == NULL || pbx == NULL || pbx->registered_tu[tu->number] == NULL)
+    TU *peer = lock_tu_and_peer(tu);
+
+    if (tu->unregistered)
     {
-        V(&tu->tu_mutex);
-        V(&pbx->pbx_mutex);
+        unlock_tu_and_peer(tu, peer);
         return -1;
     }
 
+    hangup_locked(tu, peer, 1);
+
+    unlock_tu_and_peer(tu, peer);
+    flush();
+    debug("Returning from tu_hangup | tu: %d", tu->number);
+    return 0;
+}
+
+/*
+ * Perform the hangup transition on a TU whose lock (and whose peer's lock,
+ * if it has a peer in the same shard) is held by the caller.
+ *
+ * @param tu  The tu that is to be hung up.
+ * @param peer  The current peer of tu, or NULL if it has none or it is in
+ * another shard.
+ * @param notify  Nonzero if the client underlying tu is to be notified.
+ */
+static void hangup_locked(TU *tu, TU *peer, int notify)
+{
+    int flags = tu->unregistered ? CDR_FLAG_DISCONNECTED : 0;
+
+    if (peer == NULL && tu->peer != NULL)
+    {
+        hangup_remote(tu, tu->peer, flags);
+        if (notify)
+            printStatus(tu);
+        return;
+    }
+
     switch (tu->current_state)
     {
 
     case TU_CONNECTED:
         debug("TU_CONNECTED | tu: %d", tu->number);
-        tu->current_state = TU_ON_HOOK;
-        debug("TU_ON_HOOK | tu: %d", tu->number);
-        printStatus(tu, "");
-
-        if (tu->number < tu->calling)
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-        else
+        set_state(tu, TU_ON_HOOK);
+        if (tu->conf != NULL)
         {
-            V(&tu->tu_mutex);
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-            P(&tu->tu_mutex);
+            conf_leave(tu->conf, tu->number);
+            tu->conf = NULL;
+            break;
         }
-        
-        // debug("TU_CONNECTED: tu->incoming != -1");
-        pbx->registered_tu[tu->calling]->current_state = TU_DIAL_TONE;
-        pbx->registered_tu[tu->calling]->calling = -1;
-        printStatus(pbx->registered_tu[tu->calling], "");
-        temp = tu->calling;
-        tu->calling = -1;
-
-        V(&pbx->registered_tu[temp]->tu_mutex);
-
+        // The caller's leg has the extension it dialed; the callee's does not.
+        if (tu->call.callee == peer->number)
+            cdr_end(tu->number, &tu->call, &peer->call, CDR_ANSWERED, flags);
+        else
+            cdr_end(peer->number, &peer->call, &tu->call, CDR_ANSWERED, flags | CDR_FLAG_CALLEE_ENDED);
+        set_state(peer, TU_DIAL_TONE);
+        disconnect_peers(tu, peer);
         break;
 
     case TU_RING_BACK:
         debug("TU_RING_BACK | tu: %d", tu->number);
-        tu->current_state = TU_ON_HOOK;
-        printStatus(tu, "");
-
-        if (tu->number < tu->calling)
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-        else
-        {
-            V(&tu->tu_mutex);
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-            P(&tu->tu_mutex);
-        }
-        
-        // debug("I TU_RING_BACK: tu->incoming != -1");
-        pbx->registered_tu[tu->calling]->current_state = TU_ON_HOOK;
-        printStatus(pbx->registered_tu[tu->calling], "");
-        temp = tu->calling;
-        tu->calling = -1;
-
-        V(&pbx->registered_tu[temp]->tu_mutex);
-
+        cdr_end(tu->number, &tu->call, NULL, CDR_CANCELLED, flags);
+        set_state(tu, TU_ON_HOOK);
+        set_state(peer, TU_ON_HOOK);
+        disconnect_peers(tu, peer);
         break;
 
     case TU_RINGING:
         debug("TU_RINGING | tu: %d", tu->number);
-
-        tu->current_state = TU_ON_HOOK;
-        printStatus(tu, "");
-
-        if (tu->number < tu->calling)
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-        else
-        {
-            V(&tu->tu_mutex);
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-            P(&tu->tu_mutex);
-        }
-
-        pbx->registered_tu[tu->calling]->current_state = TU_DIAL_TONE;
-        printStatus(pbx->registered_tu[tu->calling], "");
-
-        V(&pbx->registered_tu[tu->calling]->tu_mutex);
-
+        cdr_end(peer->number, &peer->call, NULL, CDR_REJECTED, flags | CDR_FLAG_CALLEE_ENDED);
+        set_state(tu, TU_ON_HOOK);
+        set_state(peer, TU_DIAL_TONE);
+        disconnect_peers(tu, peer);
         break;
 
     case TU_DIAL_TONE:
     case TU_BUSY_SIGNAL:
     case TU_ERROR:
         debug("dial: tu state: %s | TU: %d", tu_state_names[tu->current_state], tu->number);
-        tu->current_state = TU_ON_HOOK;
-        printStatus(tu, "");
+        set_state(tu, TU_ON_HOOK);
+        peer = NULL;
         break;
 
     default:
         debug("default | tu: %d", tu->number);
-        printStatus(tu, "");
+        peer = NULL;
         break;
     }
 
-    V(&tu->tu_mutex);
-    V(&pbx->pbx_mutex);
-    debug("Returning from tu_hangup | tu: %d", tu->number);
-    return 0;
+    if (notify)
+        printStatus(tu);
+    if (peer != NULL)
+        printStatus(peer);
+}
+
+/*
+ * Hang up a locked TU whose peer is in another shard, and tell the peer.
+ * A caller records the call; a callee sends the flags of the record.
+ *
+ * @param peer  The current peer of tu.
+ * @param flags  CDR_FLAG_xxx.
+ */
+static void hangup_remote(TU *tu, TU *peer, int flags)
+{
+    if (tu->current_state == TU_RING_BACK)
+        cdr_end(tu->number, &tu->call, NULL, CDR_CANCELLED, flags);
+    else if (tu->current_state == TU_CONNECTED && tu->call.callee == peer->number)
+        cdr_end(tu->number, &tu->call, &tu->call, CDR_ANSWERED, flags);
+    else
+        flags |= CDR_FLAG_CALLEE_ENDED;
+    set_state(tu, TU_ON_HOOK);
+
+    struct msg *m = msg_new(MSG_HANGUP, peer, tu);
+    m->flags = flags;
+    post(m);
+
+    tu->peer = NULL;
+    tu_unref(peer);
 }
 
 /*
@@ -434,69 +630,122 @@ int tu_hangup(TU *tu)
  */
 int tu_dial(TU *tu, int ext)
 {
-    debug("Entered tu_dial | tu: %d | status: %s", tu->number, tu_state_names[tu->current_state]);
+    if (tu == NULL)
+        return -1;
+
+    debug("Entered tu_dial | tu: %d | ext: %d", tu->number, ext);
+
+    // The callee is looked up before any TU is locked, so that the lock of
+    // its registry shard is never taken while holding a TU lock.
+    TU *callee = tu_lookup(pbx, ext);
+
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
 
-    if (tu == NULL || ext < -1)
+    if (tu->unregistered)
+    {
+        UNLOCK(&tu->tu_mutex);
+        if (callee != NULL)
+            tu_unref(callee);
         return -1;
+    }
 
-    P(&pbx->pbx_mutex);
-    P(&tu->tu_mutex);
+    // A dial to another shard that has yet to be answered counts as
+    // leaving TU_DIAL_TONE.
+    if (tu->current_state != TU_DIAL_TONE || tu->dialing != 0)
+    {
+        printStatus(tu);
+        UNLOCK(&tu->tu_mutex);
+        if (callee != NULL)
+            tu_unref(callee);
+        return 0;
+    }
 
-    if (pbx->registered_tu[ext] == NULL && tu->current_state == TU_DIAL_TONE)
+    if (callee == NULL)
     {
         debug("tu->current_state = TU_ERROR | tu: %d", tu->number);
-        tu->current_state = TU_ERROR;
-        printStatus(tu, "");
+        cdr_failed(tu->number, ext, CDR_ERROR);
+        set_state(tu, TU_ERROR);
+        printStatus(tu);
+        UNLOCK(&tu->tu_mutex);
+        return 0;
     }
-    else if (tu->current_state == TU_DIAL_TONE)
+
+    if (callee == tu)
     {
-        debug("tu->current_state == TU_DIAL_TONE");
+        debug("tu->number == ext | tu: %d", tu->number);
+        cdr_failed(tu->number, ext, CDR_BUSY);
+        set_state(tu, TU_BUSY_SIGNAL);
+        printStatus(tu);
+        UNLOCK(&tu->tu_mutex);
+        tu_unref(callee);
+        return 0;
+    }
 
-        if (tu->number == ext)
-        {
-        }
-        else if (tu->number < ext)
-            P(&pbx->registered_tu[ext]->tu_mutex);
-        else
-        {
-            V(&tu->tu_mutex);
-            P(&pbx->registered_tu[ext]->tu_mutex);
-            P(&tu->tu_mutex);
-        }
+    // The shard of the callee is known from its extension, whereas its
+    // shard field may not be set yet if it is still being registered.
+    int shard = registry_shard(pbx->registry, ext);
+    if (shard != tu->shard)
+    {
+        if (++tu->dials == 0)
+            tu->dials = 1;
+        tu->dialing = tu->dials;
+        struct msg *m = msg_new(MSG_DIAL, callee, tu);
+        m->shard = shard;
+        m->dial = tu->dialing;
+        post(m);
+        UNLOCK(&tu->tu_mutex);
+        tu_unref(callee);
+        flush();
+        return 0;
+    }
 
-        debug("Exited editing the semaphores");
+    // If the lock order makes us drop this TU's lock, it may be hung up or
+    // unregistered meanwhile, so its state is checked again.
+    if (tu->number < callee->number)
+        LOCK(&callee->tu_mutex, LOCK_CLASS_TU);
+    else
+    {
+        UNLOCK(&tu->tu_mutex);
+        LOCK(&callee->tu_mutex, LOCK_CLASS_TU);
+        LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
 
-        if (tu->number == ext)
-        {
-            debug("tu->number == ext | tu: %d", tu->number);
-            tu->current_state = TU_BUSY_SIGNAL;
-            printStatus(tu, "");
-        }
-        if (pbx->registered_tu[ext]->current_state == TU_ON_HOOK)
-        {
-            debug("pbx->registered_tu[ext]->current_state == TU_ON_HOOK | tu: %d", ext);
-            tu->current_state = TU_RING_BACK;
-            tu->calling = ext;
-            printStatus(tu, "");
-            pbx->registered_tu[ext]->current_state = TU_RINGING;
-            pbx->registered_tu[ext]->calling = tu->number;
-            printStatus(pbx->registered_tu[ext], "");
-        }
-        else
+        if (tu->unregistered || tu->current_state != TU_DIAL_TONE || tu->dialing != 0)
         {
-            debug("In else condition | tu: %d", tu->number);
-            tu->current_state = TU_BUSY_SIGNAL;
-            printStatus(tu, "");
+            int ret = tu->unregistered ? -1 : 0;
+            if (ret == 0)
+                printStatus(tu);
+            unlock_tu_and_peer(tu, callee);
+            tu_unref(callee);
+            return ret;
         }
+    }
 
-        if (tu->number != ext)
-            V(&pbx->registered_tu[ext]->tu_mutex);
+    if (callee->unregistered)
+    {
+        cdr_failed(tu->number, ext, CDR_ERROR);
+        set_state(tu, TU_ERROR);
+        printStatus(tu);
+    }
+    else if (callee->current_state == TU_ON_HOOK)
+    {
+        debug("callee->current_state == TU_ON_HOOK | tu: %d", ext);
+        cdr_dial(&tu->call, ext);
+        set_state(tu, TU_RING_BACK);
+        set_state(callee, TU_RINGING);
+        connect_peers(tu, callee);
+        printStatus(tu);
+        printStatus(callee);
     }
     else
-        printStatus(tu, "");
+    {
+        debug("In else condition | tu: %d", tu->number);
+        cdr_failed(tu->number, ext, CDR_BUSY);
+        set_state(tu, TU_BUSY_SIGNAL);
+        printStatus(tu);
+    }
 
-    V(&tu->tu_mutex);
-    V(&pbx->pbx_mutex);
+    unlock_tu_and_peer(tu, callee);
+    tu_unref(callee);
 
     debug("Exiting tu_dial | tu: %d", tu->number);
     return 0;
@@ -517,107 +766,875 @@ int tu_dial(TU *tu, int ext)
  */
 int tu_chat(TU *tu, char *msg)
 {
-    debug("Entering tu_chat | tu: %d", tu->number);
+    return tu_chat_send(tu, msg != NULL ? msg : "", msg != NULL ? strlen(msg) : 0);
+}
 
-    P(&pbx->pbx_mutex);
-    P(&tu->tu_mutex);
+/*
+ * Chat with the length of the message given.
+ *
+ * @return 0 if the chat was sent, -1 if there is no call in progress.
+ */
+int tu_chat_send(TU *tu, const char *msg, size_t len)
+{
+    if (tu == NULL)
+        return -1;
 
-    if (tu == NULL || pbx == NULL || pbx->registered_tu[tu->number] == NULL)
+    debug("Entering tu_chat | tu: %d", tu->number);
+    TU *peer = lock_tu_and_peer(tu);
+
+    if (tu->unregistered)
     {
         debug("Returning from tu_chat with error");
-        V(&tu->tu_mutex);
-        V(&pbx->pbx_mutex);
+        unlock_tu_and_peer(tu, peer);
         return -1;
     }
 
     if (tu->current_state != TU_CONNECTED)
     {
         debug("Returning from tu_chat because status != TU_CONNECTED | tu: %d", tu->number);
-        printStatus(tu, "");
-        V(&tu->tu_mutex);
-        V(&pbx->pbx_mutex);
+        printStatus(tu);
+        unlock_tu_and_peer(tu, peer);
         return -1;
     }
+
+    if (tu->conf != NULL)
+        conf_chat(tu->conf, tu->number, msg, len);
+    else if (peer == NULL)
+    {
+        struct msg *m = msg_new(MSG_CHAT, tu->peer, tu);
+        m->text = Malloc(len > 0 ? len : 1);
+        memcpy(m->text, msg, len);
+        m->len = len;
+        post(m);
+    }
     else
+        printChat(peer, msg, len);
+    printStatus(tu);
+
+    unlock_tu_and_peer(tu, peer);
+    flush();
+    debug("Returning from tu_chat | tu: %d", tu->number);
+
+    return 0;
+}
+
+/*
+ * Join a TU to a conference bridge.  The TU is notified that it is
+ * connected before it joins, so that it gets no chat from the bridge
+ * before the notification.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_join(TU *tu, int number)
+{
+    if (tu == NULL)
+        return -1;
+
+    debug("Entered tu_join | tu: %d | bridge: %d", tu->number, number);
+
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+
+    if (tu->unregistered)
     {
-        debug("In the else statement | tu: %d", tu->number);
+        UNLOCK(&tu->tu_mutex);
+        return -1;
+    }
 
-        if (tu->number < tu->calling)
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-        else
+    if (tu->current_state == TU_DIAL_TONE && number >= 1 && number <= CONF_MAX_BRIDGE)
+    {
+        proto_send_state(tu->out, tu->protocol, TU_CONNECTED, number);
+        tu->conf = conf_join(number, tu->number, tu->out, tu->protocol);
+        set_state(tu, TU_CONNECTED);
+    }
+    else
+    {
+        if (tu->current_state == TU_DIAL_TONE)
+            set_state(tu, TU_ERROR);
+        printStatus(tu);
+    }
+
+    UNLOCK(&tu->tu_mutex);
+    debug("Exiting tu_join | tu: %d", tu->number);
+    return 0;
+}
+
+/*
+ * Start a chat to be relayed in parts.  The stream is opened under the
+ * locks of both TUs, so it is in order with the peer's notifications.  A
+ * peer in another shard is locked on its own, once the messages already
+ * posted to its shard have been handled, for the same reason.  Chats to a
+ * conference bridge are not relayed in parts, and are dropped.
+ *
+ * @return 0 if the stream is open, -1 if there is no call in progress.
+ */
+int tu_chat_open(TU *tu, CHAT_STREAM *s)
+{
+    if (tu == NULL)
+        return -1;
+
+    TU *peer = lock_tu_and_peer(tu);
+    int status = -1;
+
+    if (!tu->unregistered && tu->current_state == TU_CONNECTED && peer == NULL && tu->peer != NULL)
+    {
+        peer = tu->peer;
+        tu_ref(peer);
+        UNLOCK(&tu->tu_mutex);
+        drain(&pbx->domains[peer->shard]);
+        flush();
+
+        LOCK(&peer->tu_mutex, LOCK_CLASS_TU);
+        if (!peer->unregistered && peer->current_state == TU_CONNECTED && peer->peer == tu)
         {
-            V(&tu->tu_mutex);
-            P(&pbx->registered_tu[tu->calling]->tu_mutex);
-            P(&tu->tu_mutex);
+            s->peer = peer->number;
+            if (proto_chat_open(s, peer->out, peer->protocol) == 0)
+                status = 0;
+            else
+                proto_chat_close(s);
         }
+        UNLOCK(&peer->tu_mutex);
+        tu_unref(peer);
+
+        if (status < 0)
+        {
+            LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+            if (!tu->unregistered)
+                printStatus(tu);
+            UNLOCK(&tu->tu_mutex);
+        }
+        return status;
+    }
+
+    if (!tu->unregistered && tu->current_state == TU_CONNECTED && peer != NULL)
+    {
+        s->peer = peer->number;
+        if (proto_chat_open(s, peer->out, peer->protocol) == 0)
+            status = 0;
+        else
+            proto_chat_close(s);
+    }
+    if (status < 0 && !tu->unregistered)
+        printStatus(tu);
+
+    unlock_tu_and_peer(tu, peer);
+    return status;
+}
+
+/*
+ * Relay the next part of a chat.  No lock is held while it is sent, as
+ * that may wait for the peer to drain its output.
+ *
+ * @return 0 if the part was sent, -1 if it was dropped.
+ */
+int tu_chat_write(TU *tu, CHAT_STREAM *s, const char *data, size_t len)
+{
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+    int connected = !tu->unregistered && tu->current_state == TU_CONNECTED && tu->peer != NULL &&
+                    tu->peer->number == s->peer;
+    UNLOCK(&tu->tu_mutex);
+
+    if (!connected)
+        return -1;
+    return proto_chat_part(s, data, len);
+}
 
-        printStatus(pbx->registered_tu[tu->calling], msg);
+/*
+ * Finish a chat relayed in parts, and notify the TU of its current state.
+ *
+ * @return 0 if the TU is still connected, otherwise -1.
+ */
+int tu_chat_close(TU *tu, CHAT_STREAM *s)
+{
+    proto_chat_close(s);
 
-        V(&pbx->registered_tu[tu->calling]->tu_mutex);
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+    int status = !tu->unregistered && tu->current_state == TU_CONNECTED ? 0 : -1;
+    if (!tu->unregistered)
+        printStatus(tu);
+    UNLOCK(&tu->tu_mutex);
 
-        printStatus(tu, "CHAT");
+    return status;
+}
+
+/*
+ * Take a snapshot of a TU and stop output to its client.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_freeze(TU *tu, TU_SNAPSHOT *snap)
+{
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+
+    if (tu->unregistered)
+    {
+        UNLOCK(&tu->tu_mutex);
+        return -1;
     }
 
-    V(&tu->tu_mutex);
-    V(&pbx->pbx_mutex);
-    debug("Returning from tu_chat | tu: %d", tu->number);
+    snap->ext = tu->number;
+    snap->fd = tu->fd;
+    snap->state = tu->current_state;
+    snap->peer = tu->peer != NULL ? tu->peer->number : -1;
+    snap->bridge = tu->conf != NULL ? conf_number(tu->conf) : 0;
+    snap->call = tu->call;
+    snap->protocol = tu->protocol;
+    snap->output_len = outq_freeze(tu->out, &snap->output);
 
+    UNLOCK(&tu->tu_mutex);
     return 0;
 }
 
 /*
+ * Switch the notifications of a TU to another protocol, and notify its
+ * client of its current state in that protocol.
  *
- * Prints the status of the tu passed in.
- * 
- * @param tu  The tu printing the status.
- * @param msg  The message to print if it is a chat message.
- * @param status -1 if there was an error printing. 0 on Success.
+ * @return 0 if successful, -1 if the TU is not registered.
  */
-int printStatus(TU *tu, char *msg)
+int tu_set_protocol(TU *tu, int protocol)
 {
-    debug("TU: %d | tu state: %s | msg: %s", tu->number, tu_state_names[tu->current_state], msg);
+    char magic = PROTO_MAGIC;
 
-    int status = 0;
-    if (strcmp(msg, "") == 0)
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+
+    if (tu->unregistered)
     {
-        debug("In Regular print");
+        UNLOCK(&tu->tu_mutex);
+        return -1;
+    }
+
+    tu->protocol = protocol;
+    if (protocol == PROTO_BINARY)
+        outq_send(tu->out, &magic, 1);
+    printStatus(tu);
+
+    UNLOCK(&tu->tu_mutex);
+    return 0;
+}
+
+/*
+ * Get the state of a TU.
+ *
+ * @return the state, or -1 if the TU is not registered.
+ */
+int tu_state(TU *tu)
+{
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+    int state = tu->unregistered ? -1 : tu->current_state;
+    UNLOCK(&tu->tu_mutex);
+    return state;
+}
+
+/*
+ * Resume output to the client of a TU after an aborted handoff.
+ */
+void tu_thaw(TU *tu)
+{
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+    if (!tu->unregistered)
+        outq_thaw(tu->out);
+    UNLOCK(&tu->tu_mutex);
+}
 
-        switch (tu->current_state)
+/*
+ * Register TUs with the states recorded in a set of snapshots, then
+ * reconnect the peers among them.
+ *
+ * @return the number of TUs restored.
+ */
+int pbx_adopt(PBX *pbx, TU_SNAPSHOT *snaps, int n, TU **tus)
+{
+    int restored = 0;
+
+    debug("Entered pbx_adopt | snapshots: %d", n);
+
+    for (int i = 0; i < n; i++)
+    {
+        TU *tu = pool_get(tu_pool);
+
+        Sem_init(&tu->tu_mutex, 0, 1);
+        tu->fd = snaps[i].fd;
+        tu->unregistered = 0;
+        tu->refs = 1;
+        tu->peer = NULL;
+        tu->conf = NULL;
+        tu->call = snaps[i].call;
+        tu->protocol = snaps[i].protocol;
+        tu->dials = 0;
+        tu->dialing = 0;
+        tu->current_state = snaps[i].state;
+
+        if ((tu->number = registry_insert_at(pbx->registry, snaps[i].ext, tu, &tu->handle)) < 0)
         {
-        case TU_ON_HOOK:
-            debug("TU_ON_HOOK | TU: %d", tu->number);
-            status = dprintf(tu->number, "%s %d%s", tu_state_names[tu->current_state], tu->number, EOL);
-            break;
+            fprintf(stderr, "ERROR: Unable to restore extension %d\n", snaps[i].ext);
+            sem_destroy(&tu->tu_mutex);
+            pool_put(tu_pool, tu);
+            tus[i] = NULL;
+            continue;
+        }
+
+        tu->shard = registry_shard(pbx->registry, tu->number);
+        metrics_state_change(-1, tu->current_state);
+        tu->out = outq_create(tu->fd);
+        if (snaps[i].output_len > 0)
+            outq_send(tu->out, snaps[i].output, snaps[i].output_len);
+        if (tu->current_state == TU_CONNECTED && snaps[i].bridge > 0)
+            tu->conf = conf_join(snaps[i].bridge, tu->number, tu->out, tu->protocol);
+        tus[i] = tu;
+        restored++;
+    }
 
-        case TU_CONNECTED:
-            debug("TU_CONNECTED | TU: %d", tu->number);
+    int max_ext = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (tus[i] != NULL && tus[i]->number > max_ext)
+            max_ext = tus[i]->number;
+    }
 
-            if (tu->calling != -1)
-                status = dprintf(tu->number, "%s %d%s", tu_state_names[tu->current_state], tu->calling, EOL);
+    int *peer_of = Calloc(max_ext + 1, sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        if (tus[i] != NULL)
+            peer_of[tus[i]->number] = snaps[i].peer;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (tus[i] != NULL)
+            adopt_peer(pbx, tus[i], peer_of, max_ext);
+    }
+    Free(peer_of);
 
-            break;
+    debug("Exiting pbx_adopt | restored: %d", restored);
+    return restored;
+}
 
-        case TU_RINGING:
-        case TU_DIAL_TONE:
-        case TU_RING_BACK:
-        case TU_BUSY_SIGNAL:
-        case TU_ERROR:
-            debug("tu state: %s  | TU: %d", tu_state_names[tu->current_state], tu->number);
+/*
+ * Reconnect a restored TU with its peer, if the peer has been restored and
+ * its snapshot names this TU as its peer.  A TU whose peer is missing goes
+ * to the state it would be in had the peer unregistered, and is notified.
+ *
+ * @param peer_of  The peer recorded for each extension, indexed by extension.
+ * @param max_ext  The highest extension indexing peer_of.
+ */
+static void adopt_peer(PBX *pbx, TU *tu, int *peer_of, int max_ext)
+{
+    TU_STATE state = tu->current_state;
 
-            status = dprintf(tu->number, "%s%s", tu_state_names[tu->current_state], EOL);
-            break;
+    if ((state != TU_RINGING && state != TU_RING_BACK && state != TU_CONNECTED) || tu->peer != NULL ||
+        tu->conf != NULL)
+        return;
+
+    int ext = peer_of[tu->number];
+    if (ext > 0 && ext <= max_ext && ext != tu->number && peer_of[ext] == tu->number)
+    {
+        TU *peer = tu_lookup(pbx, ext);
+        if (peer != NULL)
+        {
+            if (peer->peer == NULL)
+                connect_peers(tu, peer);
+            tu_unref(peer);
         }
     }
-    else if (strcmp(msg, "CHAT") == 0)
+
+    if (tu->peer == NULL)
     {
-        debug("In print CHAT");
-        debug("tu state: %s  | TU: %d", tu_state_names[tu->current_state], tu->number);
-        if (tu->calling != -1)
-            status = dprintf(tu->number, "%s %d%s", tu_state_names[tu->current_state], pbx->registered_tu[tu->calling]->number, EOL);
+        debug("Peer of restored tu %d is missing", tu->number);
+        set_state(tu, state == TU_RINGING ? TU_ON_HOOK : TU_DIAL_TONE);
+        printStatus(tu);
     }
+}
 
-    else
-        status = dprintf(tu->number, "CHAT %s%s", msg, EOL);
+/*
+ * Get the shard of a TU.
+ *
+ * @return the shard, or -1 if the TU is not registered.
+ */
+int pbx_shard_of(PBX *pbx, TU *tu)
+{
+    return tu != NULL && !tu->unregistered ? tu->shard : -1;
+}
+
+/*
+ * Make the calling thread the owner of a shard, which it is told to
+ * handle the messages of through the doorbell returned.
+ *
+ * @return the shard's doorbell, or -1 if there is no such shard.
+ */
+int pbx_shard_claim(PBX *pbx, int shard)
+{
+    if (shard < 0 || shard >= pbx->nshards)
+        return -1;
+
+    struct domain *d = &pbx->domains[shard];
+    if (d->doorbell < 0)
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+        {
+            perror("eventfd");
+            return -1;
+        }
+        __atomic_store_n(&d->doorbell, fd, __ATOMIC_RELEASE);
+    }
+    owned = shard;
+
+    debug("Shard %d claimed", shard);
+    return d->doorbell;
+}
+
+/*
+ * Handle the messages posted to a shard, and those they cause to be
+ * posted to shards that this thread handles.
+ */
+void pbx_shard_run(PBX *pbx, int shard)
+{
+    if (shard >= 0 && shard < pbx->nshards && __atomic_load_n(&pbx->domains[shard].inbox, __ATOMIC_RELAXED) != NULL)
+        drain(&pbx->domains[shard]);
+    flush();
+}
+
+/*
+ * Handle every message posted to any shard, until none is left.
+ */
+void pbx_shard_drain_all(PBX *pbx)
+{
+    int busy = 1;
+
+    while (busy)
+    {
+        busy = 0;
+        for (int s = 0; s < pbx->nshards; s++)
+        {
+            if (__atomic_load_n(&pbx->domains[s].inbox, __ATOMIC_ACQUIRE) != NULL)
+            {
+                drain(&pbx->domains[s]);
+                busy = 1;
+            }
+        }
+    }
+    touched = 0;
+}
+
+/*
+ * Change the state of a locked TU, keeping the state gauges up to date and
+ * logging the start and end of calls.  The peer (or bridge) is linked
+ * before a call starts and unlinked after it ends.
+ */
+static void set_state(TU *tu, TU_STATE state)
+{
+    int peer = tu->peer != NULL ? tu->peer->number : -1;
+
+    if (tu->conf != NULL)
+    {
+        if (state == TU_CONNECTED && tu->current_state != TU_CONNECTED)
+            log_info("event=join ext=%d bridge=%d", tu->number, conf_number(tu->conf));
+        else if (state != TU_CONNECTED && tu->current_state == TU_CONNECTED)
+            log_info("event=leave ext=%d bridge=%d", tu->number, conf_number(tu->conf));
+    }
+    else if (state == TU_CONNECTED && tu->current_state != TU_CONNECTED)
+        log_info("event=connect ext=%d peer=%d", tu->number, peer);
+    else if (state != TU_CONNECTED && tu->current_state == TU_CONNECTED)
+        log_info("event=disconnect ext=%d peer=%d", tu->number, peer);
+
+    metrics_state_change(tu->current_state, state);
+    tu->current_state = state;
+    if (state != TU_DIAL_TONE)
+        tu->dialing = 0;
+}
+
+/*
+ * Create the pool of TU objects, shared by every PBX.
+ */
+static void tu_pool_init(void)
+{
+    tu_pool = pool_create("tu", sizeof(TU), __alignof__(TU), NULL);
+    msg_pool = pool_create("msg", sizeof(struct msg), __alignof__(struct msg), NULL);
+}
+
+/*
+ * Take an additional reference to a TU object.
+ */
+static void tu_ref(TU *tu)
+{
+    __atomic_fetch_add(&tu->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop a reference to a TU object, giving it back to the pool when the
+ * last one goes away.
+ */
+static void tu_unref(TU *tu)
+{
+    if (__atomic_sub_fetch(&tu->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        debug("Freeing tu: %d", tu->number);
+        sem_destroy(&tu->tu_mutex);
+        pool_put(tu_pool, tu);
+    }
+}
+
+/*
+ * Look up the TU registered at an extension.
+ *
+ * @return the TU, with a reference that must be released with tu_unref(),
+ * or NULL if no TU is registered at that extension.
+ */
+static TU *tu_lookup(PBX *pbx, int ext)
+{
+    return registry_lookup(pbx->registry, ext, (void (*)(void *))tu_ref);
+}
+
+/*
+ * Lock a TU together with its current peer, if any, respecting the
+ * increasing-extension lock order.  If the peer has to be locked first,
+ * the TU's lock is dropped and reacquired, and the peer relationship is
+ * rechecked since it may have changed in the meantime.  A peer in another
+ * shard is not locked.
+ *
+ * @return the locked peer, or NULL if the TU has no peer or its peer is in
+ * another shard.
+ */
+static TU *lock_tu_and_peer(TU *tu)
+{
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+
+    while (1)
+    {
+        TU *peer = tu->peer;
+        if (peer == NULL || peer->shard != tu->shard)
+            return NULL;
+
+        if (tu->number < peer->number)
+        {
+            LOCK(&peer->tu_mutex, LOCK_CLASS_TU);
+            return peer;
+        }
+
+        tu_ref(peer);
+        UNLOCK(&tu->tu_mutex);
+        LOCK(&peer->tu_mutex, LOCK_CLASS_TU);
+        LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+
+        if (tu->peer == peer)
+        {
+            tu_unref(peer);
+            return peer;
+        }
+
+        UNLOCK(&peer->tu_mutex);
+        tu_unref(peer);
+    }
+}
+
+/*
+ * Release the locks taken by lock_tu_and_peer().
+ */
+static void unlock_tu_and_peer(TU *tu, TU *peer)
+{
+    if (peer != NULL)
+        UNLOCK(&peer->tu_mutex);
+    UNLOCK(&tu->tu_mutex);
+}
+
+/*
+ * Make two locked TUs peers of each other.  Each holds a reference to the other.
+ */
+static void connect_peers(TU *tu, TU *peer)
+{
+    tu_ref(peer);
+    tu->peer = peer;
+    tu_ref(tu);
+    peer->peer = tu;
+}
+
+/*
+ * Break the peer relationship between two locked TUs.
+ * Neither reference can be the last one, since both TUs are still locked by
+ * a thread that holds its own reference to them.
+ */
+static void disconnect_peers(TU *tu, TU *peer)
+{
+    tu->peer = NULL;
+    peer->peer = NULL;
+    tu_unref(peer);
+    tu_unref(tu);
+}
+
+/*
+ * Make a message from one TU to another, which holds a reference to each.
+ */
+static struct msg *msg_new(int kind, TU *to, TU *from)
+{
+    struct msg *m = pool_get(msg_pool);
+
+    m->kind = kind;
+    tu_ref(to);
+    m->to = to;
+    tu_ref(from);
+    m->from = from;
+    m->shard = to->shard;
+    m->text = NULL;
+    return m;
+}
+
+/*
+ * Post a message to the shard of the TU it is for.  If the shard has an
+ * owner other than the calling thread, the owner is woken up when the
+ * message is the first in the inbox; otherwise the calling thread handles
+ * the message itself, in flush(), once it has released its locks.
+ */
+static void post(struct msg *m)
+{
+    int shard = m->shard;
+    struct domain *d = &pbx->domains[shard];
+    struct msg *head = __atomic_load_n(&d->inbox, __ATOMIC_RELAXED);
+
+    do
+        m->next = head;
+    while (!__atomic_compare_exchange_n(&d->inbox, &head, m, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    int doorbell = __atomic_load_n(&d->doorbell, __ATOMIC_ACQUIRE);
+    if (doorbell < 0 || shard == owned)
+        touched |= (uint64_t)1 << shard;
+    else if (head == NULL)
+    {
+        uint64_t one = 1;
+        if (write(doorbell, &one, sizeof(one)) < 0)
+            perror("post");
+    }
+}
+
+/*
+ * Handle a message, under the lock of the TU it is for.
+ */
+static void deliver(struct msg *m)
+{
+    TU *tu = m->to;
+
+    LOCK(&tu->tu_mutex, LOCK_CLASS_TU);
+
+    switch (m->kind)
+    {
+    case MSG_DIAL:
+    {
+        int answer = MSG_BUSY;
+        if (tu->unregistered)
+            answer = MSG_ERROR;
+        else if (tu->current_state == TU_ON_HOOK)
+        {
+            debug("Ringing tu: %d for tu: %d", tu->number, m->from->number);
+            tu_ref(m->from);
+            tu->peer = m->from;
+            set_state(tu, TU_RINGING);
+            printStatus(tu);
+            answer = MSG_RING;
+        }
+        struct msg *r = msg_new(answer, m->from, tu);
+        r->dial = m->dial;
+        post(r);
+        break;
+    }
+
+    case MSG_RING:
+    case MSG_BUSY:
+    case MSG_ERROR:
+        dialed(tu, m->from, m);
+        break;
+
+    case MSG_ANSWER:
+        if (!tu->unregistered && tu->current_state == TU_RING_BACK && tu->peer == m->from)
+        {
+            // The callee's answer time is kept in the caller's own leg,
+            // which is the one that records the call.
+            tu->call.answer = m->answer;
+            set_state(tu, TU_CONNECTED);
+            printStatus(tu);
+        }
+        break;
+
+    case MSG_HANGUP:
+        hung_up(tu, m->from, m->flags);
+        break;
+
+    case MSG_CHAT:
+        if (!tu->unregistered && tu->current_state == TU_CONNECTED && tu->peer == m->from)
+            printChat(tu, m->text, m->len);
+        break;
+    }
+
+    UNLOCK(&tu->tu_mutex);
+}
+
+/*
+ * Apply the answer to a dial to a TU in another shard to the locked TU
+ * that dialed.  If the TU has given up on that dial, a callee that the
+ * dial made ring is hung up.
+ */
+static void dialed(TU *tu, TU *callee, struct msg *m)
+{
+    if (tu->unregistered || tu->current_state != TU_DIAL_TONE || tu->dialing != m->dial)
+    {
+        if (m->kind == MSG_RING)
+            post(msg_new(MSG_HANGUP, callee, tu));
+        return;
+    }
+
+    switch (m->kind)
+    {
+    case MSG_RING:
+        cdr_dial(&tu->call, callee->number);
+        tu_ref(callee);
+        tu->peer = callee;
+        set_state(tu, TU_RING_BACK);
+        break;
+
+    case MSG_BUSY:
+        cdr_failed(tu->number, callee->number, CDR_BUSY);
+        set_state(tu, TU_BUSY_SIGNAL);
+        break;
+
+    default:
+        cdr_failed(tu->number, callee->number, CDR_ERROR);
+        set_state(tu, TU_ERROR);
+        break;
+    }
+    printStatus(tu);
+}
+
+/*
+ * Apply the hangup of a TU in another shard to its locked peer, if the TU
+ * still is its peer.
+ *
+ * @param flags  CDR_FLAG_xxx of the record, if the peer is the caller.
+ */
+static void hung_up(TU *tu, TU *peer, int flags)
+{
+    if (tu->peer != peer)
+        return;
+
+    switch (tu->current_state)
+    {
+    case TU_RINGING:
+        set_state(tu, TU_ON_HOOK);
+        break;
+
+    case TU_RING_BACK:
+        cdr_end(tu->number, &tu->call, NULL, CDR_REJECTED, flags);
+        set_state(tu, TU_DIAL_TONE);
+        break;
+
+    default:
+        if (tu->call.callee == peer->number)
+            cdr_end(tu->number, &tu->call, &tu->call, CDR_ANSWERED, flags);
+        set_state(tu, TU_DIAL_TONE);
+        break;
+    }
+
+    tu->peer = NULL;
+    tu_unref(peer);
+    printStatus(tu);
+}
+
+/*
+ * Handle the messages in a shard's inbox, in the order they were posted.
+ */
+static void drain(struct domain *d)
+{
+    LOCK(&d->drain_mutex, LOCK_CLASS_SHARD);
+
+    struct msg *m = __atomic_exchange_n(&d->inbox, NULL, __ATOMIC_ACQUIRE);
+    struct msg *fifo = NULL;
+    while (m != NULL)
+    {
+        struct msg *next = m->next;
+        m->next = fifo;
+        fifo = m;
+        m = next;
+    }
+
+    while (fifo != NULL)
+    {
+        struct msg *next = fifo->next;
+        deliver(fifo);
+        tu_unref(fifo->to);
+        tu_unref(fifo->from);
+        if (fifo->text != NULL)
+            Free(fifo->text);
+        pool_put(msg_pool, fifo);
+        fifo = next;
+    }
+
+    UNLOCK(&d->drain_mutex);
+}
+
+/*
+ * Handle the messages that the calling thread has posted to shards whose
+ * messages it handles, and those that they cause to be posted in turn.
+ * Called with no lock held.
+ */
+static void flush(void)
+{
+    while (touched != 0)
+    {
+        int shard = __builtin_ctzll(touched);
+        touched &= ~((uint64_t)1 << shard);
+        drain(&pbx->domains[shard]);
+    }
+}
+
+/*
+ *
+ * Prints the status of the tu passed in.
+ * 
+ * @param tu  The tu printing the status.
+ * @param status -1 if there was an error printing. 0 on Success.
+ */
+int printStatus(TU *tu)
+{
+    debug("TU: %d | tu state: %s", tu->number, tu_state_names[tu->current_state]);
+
+    int status = 0;
+    if (tu->out == NULL)
+        return -1;
+
+    switch (tu->current_state)
+    {
+    case TU_ON_HOOK:
+        status = proto_send_state(tu->out, tu->protocol, tu->current_state, tu->number);
+        break;
+
+    case TU_CONNECTED:
+        if (tu->peer != NULL)
+            status = proto_send_state(tu->out, tu->protocol, tu->current_state, tu->peer->number);
+        else if (tu->conf != NULL)
+            status = proto_send_state(tu->out, tu->protocol, tu->current_state, conf_number(tu->conf));
+        break;
+
+    default:
+        status = proto_send_state(tu->out, tu->protocol, tu->current_state, 0);
+        break;
+    }
 
     return status;
-}
\ No newline at end of file
+}
+
+/*
+ *
+ * Sends a chat message to the tu passed in.  This is kept apart from
+ * printStatus so that an empty chat is still delivered as a chat.
+ * 
+ * @param tu  The tu receiving the chat.
+ * @param msg  The message text.
+ * @param len  The length of the message.
+ * @param status -1 if there was an error printing. 0 on Success.
+ */
+int printChat(TU *tu, const char *msg, size_t len)
+{
+    debug("TU: %d | chat: %zu bytes", tu->number, len);
+
+    if (tu->out == NULL)
+        return -1;
+
+    return proto_send_chat(tu->out, tu->protocol, msg, len);
+}
+
+#endif
@@ -0,0 +1,1081 @@
+/*
+ * Lock-free PBX engine, selected with "make ENGINE=cas" (PBX_LOCKFREE).
+ * It implements the same interface as pbx.c, which is compiled out.
+ */
+#ifdef PBX_LOCKFREE
+
+#include <sched.h>
+
+#include "server.h"
+#include "outq.h"
+#include "proto.h"
+#include "conf.h"
+#include "cdr.h"
+#include "pool.h"
+#include "registry.h"
+#include "shard.h"
+#include "handoff.h"
+#include "trunk.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "log.h"
+#include "debug.h"
+#include "pbx.h"
+#include "csapp.h"
+
+/*
+ * The state of a TU and the extension of its peer are packed, together
+ * with a version number, into a single 64-bit word that is only ever
+ * changed with compare-and-swap:
+ *
+ *   bits 56-63  state (a TU_STATE value, or TU_UNREGISTERED)
+ *   bits 32-55  version, incremented by every change
+ *   bits  0-31  extension of the peer, or 0 if there is none, or minus
+ *               the number of the conference bridge joined
+ *
+ * Every successful CAS is followed by the publication of its new version:
+ * the notification it calls for is sent to the client and the version is
+ * stored in "published".  A thread only bases a CAS on a word whose
+ * version has been published (see tu_load()), so at most one version of a
+ * TU is ever unpublished and notifications are sent in the order of the
+ * changes.  Responses that change nothing and chats are sent the same way,
+ * by a CAS that only advances the version.
+ *
+ * A transition involving two TUs is committed by a CAS on one of them; the
+ * other is then brought into line by another CAS.  In between, the pair is
+ * half-updated, and any thread that finds it so completes it (see settle())
+ * before acting on either TU.  A CAS that fails because the word changed
+ * meanwhile simply causes the operation to be retried from the new state.
+ *
+ * The peer is identified by its extension, and the TU object registered at
+ * an extension is found with registry_peek(), without any lock.  TU objects
+ * therefore come from a pool (see pool.h), which never frees them and
+ * leaves an unregistered TU as it was until it is reused for a later
+ * registration, so a stale pointer always refers to some TU, and the
+ * version in its word tells whether it is still the TU it was.
+ *
+ * A TU joins and leaves a conference bridge only by its own commands, and
+ * no other thread changes the word of a TU in a bridge, which has no peer
+ * to settle with.  The bridge is joined after the CAS that connects the
+ * TU, and left before the CAS that hangs it up, so that no chat from the
+ * bridge is sent outside the call.
+ *
+ * The legs of a call's detail record (see cdr.h) are written only by
+ * their TU's own commands, before the CAS that commits the dial or the
+ * answer.  The command that ends a call copies both legs before its
+ * committing CAS, since the peer may start another call once this one is
+ * over, and only records them if the CAS succeeds.
+ */
+#define TU_UNREGISTERED (TU_ERROR + 1)
+
+#define WORD_STATE(w) ((int)((w) >> 56))
+#define WORD_VERSION(w) ((uint32_t)((w) >> 32) & 0xffffff)
+#define WORD_PEER(w) ((int)(uint32_t)(w))
+#define WORD_BRIDGE(w) (WORD_PEER(w) < 0 ? -WORD_PEER(w) : 0)
+#define MAKE_WORD(state, version, peer) \
+    ((uint64_t)(state) << 56 | (uint64_t)((version) & 0xffffff) << 32 | (uint32_t)(peer))
+
+#define SPINS_BEFORE_YIELD 64
+
+/*
+ * Kinds of notification published by a CAS.
+ */
+#define NOTIFY_NONE 0
+#define NOTIFY_STATE 1
+#define NOTIFY_CHAT 2
+#define NOTIFY_TEXT 3           // Switch to the text protocol, then notify the state
+#define NOTIFY_BINARY 4         // Switch to the binary protocol, then notify the state
+#define NOTIFY_STREAM 5         // Open a chat stream (see tu_chat_open())
+
+/*
+ * Record of a call that a TU is about to end.
+ */
+struct call_end
+{
+    int caller;
+    int outcome;
+    int flags;
+    CDR_LEG leg;                // The caller's
+    CDR_LEG callee_leg;
+};
+
+/*
+ * Message of a NOTIFY_CHAT.
+ */
+struct chat
+{
+    const char *msg;
+    size_t len;
+};
+
+struct tu
+{
+    uint64_t word;
+    uint32_t published;
+    int number;
+    int fd;
+    OUTQ *out;
+    int protocol;               // Changed only by publish(), in version order
+    CONF *conf;                 // Bridge joined, or NULL
+    CDR_LEG call;               // Part of the record of the call in progress
+} __attribute__((aligned(64)));
+
+struct pbx
+{
+    REGISTRY *registry;
+};
+
+static pthread_once_t tu_pool_once = PTHREAD_ONCE_INIT;
+static POOL *tu_pool;
+
+static void tu_pool_init(void);
+static void tu_init(void *obj);
+static uint64_t tu_load(TU *tu);
+static int tu_cas(TU *tu, uint64_t old, int state, int peer, int notify, void *arg);
+static int tu_touch(TU *tu, uint64_t old);
+static TU *tu_find(int ext, uint64_t *word);
+static uint64_t settle(TU *tu);
+static void settle_peer(int ext);
+static void leave(TU *tu);
+static void call_ending(TU *tu, uint64_t w, int flags, struct call_end *e);
+static void call_ended(struct call_end *e);
+static void publish(TU *tu, uint64_t word, int notify, void *arg);
+
+/*
+ * Initialize a new PBX.
+ *
+ * @return the newly initialized PBX, or NULL if initialization fails.
+ */
+PBX *pbx_init()
+{
+    debug("Entered pbx_init (lock-free engine)");
+
+    PBX *temp = (PBX *)Calloc(1, sizeof(PBX));
+    temp->registry = registry_create();
+    Pthread_once(&tu_pool_once, tu_pool_init);
+
+    return temp;
+}
+
+/*
+ * Shut down a pbx, freeing the PBX itself.  The TU objects stay in their
+ * pool.
+ *
+ * @param pbx  The PBX to be shut down.
+ */
+void pbx_shutdown(PBX *pbx)
+{
+    debug("Entered pbx_shutdown");
+
+    registry_destroy(pbx->registry);
+    Free(pbx);
+}
+
+/*
+ * Register a TU client with a PBX.
+ * The TU is assigned an extension number, initialized to the TU_ON_HOOK
+ * state, and the client is notified of its extension.
+ *
+ * @param pbx  The PBX.
+ * @param fd  File descriptor providing access to the underlying network client.
+ * @return A TU object representing the client TU, if registration succeeds, otherwise NULL.
+ */
+TU *pbx_register(PBX *pbx, int fd)
+{
+    debug("Entered pbx_register | fd: %d", fd);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid arguments for pbx_register. FD: %d\n", fd);
+        return NULL;
+    }
+
+    TU *tu = pool_get(tu_pool);
+    tu->fd = fd;
+    tu->out = outq_create(fd);
+    tu->protocol = PROTO_TEXT;
+    tu->conf = NULL;
+    tu->call = (CDR_LEG){0};
+
+    // Until its word leaves TU_UNREGISTERED, the TU cannot be dialed even
+    // though it can already be found in the registry.
+    int ext = registry_insert(pbx->registry, tu, NULL);
+    if (ext < 0)
+    {
+        outq_destroy(tu->out);
+        pool_put(tu_pool, tu);
+        fprintf(stderr, "ERROR: No free extension for FD: %d\n", fd);
+        return NULL;
+    }
+
+    __atomic_store_n(&tu->number, ext, __ATOMIC_RELEASE);
+    tu_cas(tu, tu_load(tu), TU_ON_HOOK, 0, NOTIFY_STATE, NULL);
+
+    debug("Exiting pbx_register | tu: %d", ext);
+    return tu;
+}
+
+/*
+ * Unregister a TU from a PBX.
+ * Any call in progress is torn down first, with the peer being notified,
+ * and the TU is then taken out of service and made available for reuse.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU to be unregistered; it must not be used again.
+ * @return 0 if unregistration succeeds, otherwise -1.
+ */
+int pbx_unregister(PBX *pbx, TU *tu)
+{
+    if (tu == NULL)
+        return -1;
+
+    debug("Entered pbx_unregister | tu: %d", tu->number);
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+
+        switch (WORD_STATE(w))
+        {
+        case TU_UNREGISTERED:
+            return -1;
+
+        case TU_RINGING:
+        case TU_RING_BACK:
+        case TU_CONNECTED:
+            if (WORD_BRIDGE(w) != 0)
+            {
+                leave(tu);
+                tu_cas(tu, w, TU_ON_HOOK, 0, NOTIFY_NONE, NULL);
+                continue;
+            }
+            struct call_end e;
+            call_ending(tu, w, CDR_FLAG_DISCONNECTED, &e);
+            if (tu_cas(tu, w, TU_ON_HOOK, 0, NOTIFY_NONE, NULL))
+            {
+                call_ended(&e);
+                settle_peer(WORD_PEER(w));
+            }
+            continue;
+
+        default:
+            if (!tu_cas(tu, w, TU_UNREGISTERED, 0, NOTIFY_NONE, NULL))
+                continue;
+        }
+        break;
+    }
+
+    // Nothing can change or publish the word from TU_UNREGISTERED, so the
+    // queue is no longer used by anyone.
+    registry_remove(pbx->registry, tu->number, tu);
+    outq_destroy(tu->out);
+    tu->out = NULL;
+    pool_put(tu_pool, tu);
+
+    debug("Exiting pbx_unregister");
+    return 0;
+}
+
+/*
+ * Get the file descriptor for the network connection underlying a TU.
+ *
+ * @return the underlying file descriptor, if any, otherwise -1.
+ */
+int tu_fileno(TU *tu)
+{
+    if (tu == NULL || WORD_STATE(__atomic_load_n(&tu->word, __ATOMIC_ACQUIRE)) == TU_UNREGISTERED)
+        return -1;
+    return tu->fd;
+}
+
+/*
+ * Get the extension number for a TU.
+ *
+ * @return the extension number, if any, otherwise -1.
+ */
+int tu_extension(TU *tu)
+{
+    if (tu == NULL || WORD_STATE(__atomic_load_n(&tu->word, __ATOMIC_ACQUIRE)) == TU_UNREGISTERED)
+        return -1;
+    return tu->number;
+}
+
+/*
+ * Take a TU receiver off-hook (i.e. pick up the handset).
+ * See pbx.h for the transitions performed.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_pickup(TU *tu)
+{
+    if (tu == NULL)
+        return -1;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+
+        switch (WORD_STATE(w))
+        {
+        case TU_UNREGISTERED:
+            return -1;
+
+        case TU_ON_HOOK:
+            if (tu_cas(tu, w, TU_DIAL_TONE, 0, NOTIFY_STATE, NULL))
+                return 0;
+            break;
+
+        case TU_RINGING:
+            // Committed here; the caller's side is completed by settle().
+            cdr_answer(&tu->call);
+            if (tu_cas(tu, w, TU_CONNECTED, WORD_PEER(w), NOTIFY_STATE, NULL))
+            {
+                settle_peer(WORD_PEER(w));
+                return 0;
+            }
+            break;
+
+        default:
+            if (tu_touch(tu, w))
+                return 0;
+            break;
+        }
+    }
+}
+
+/*
+ * Hang up a TU (i.e. replace the handset on the switchhook).
+ * See pbx.h for the transitions performed.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_hangup(TU *tu)
+{
+    if (tu == NULL)
+        return -1;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+
+        switch (WORD_STATE(w))
+        {
+        case TU_UNREGISTERED:
+            return -1;
+
+        case TU_RINGING:
+        case TU_RING_BACK:
+        case TU_CONNECTED:
+            if (WORD_BRIDGE(w) != 0)
+            {
+                leave(tu);
+                if (tu_cas(tu, w, TU_ON_HOOK, 0, NOTIFY_STATE, NULL))
+                    return 0;
+                break;
+            }
+            // Committed here; the peer is released by settle().
+            struct call_end e;
+            call_ending(tu, w, 0, &e);
+            if (tu_cas(tu, w, TU_ON_HOOK, 0, NOTIFY_STATE, NULL))
+            {
+                call_ended(&e);
+                settle_peer(WORD_PEER(w));
+                return 0;
+            }
+            break;
+
+        case TU_DIAL_TONE:
+        case TU_BUSY_SIGNAL:
+        case TU_ERROR:
+            if (tu_cas(tu, w, TU_ON_HOOK, 0, NOTIFY_STATE, NULL))
+                return 0;
+            break;
+
+        default:
+            if (tu_touch(tu, w))
+                return 0;
+            break;
+        }
+    }
+}
+
+/*
+ * Dial an extension on a TU.
+ * See pbx.h for the transitions performed.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_dial(TU *tu, int ext)
+{
+    if (tu == NULL)
+        return -1;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+        int state = WORD_STATE(w);
+
+        if (state == TU_UNREGISTERED)
+            return -1;
+
+        if (state != TU_DIAL_TONE)
+        {
+            if (tu_touch(tu, w))
+                return 0;
+            continue;
+        }
+
+        uint64_t cw;
+        TU *callee = tu_find(ext, &cw);
+
+        if (callee == NULL || WORD_STATE(cw) == TU_UNREGISTERED)
+        {
+            if (tu_cas(tu, w, TU_ERROR, 0, NOTIFY_STATE, NULL))
+            {
+                cdr_failed(tu->number, ext, CDR_ERROR);
+                return 0;
+            }
+            continue;
+        }
+
+        if (callee == tu || WORD_STATE(cw) != TU_ON_HOOK)
+        {
+            if (tu_cas(tu, w, TU_BUSY_SIGNAL, 0, NOTIFY_STATE, NULL))
+            {
+                cdr_failed(tu->number, ext, CDR_BUSY);
+                return 0;
+            }
+            continue;
+        }
+
+        // The call is committed by the callee starting to ring.  Only this
+        // thread or a thread completing the call for it can move the caller
+        // out of TU_DIAL_TONE, so if this CAS fails it was done for us.
+        cdr_dial(&tu->call, ext);
+        if (!tu_cas(callee, cw, TU_RINGING, tu->number, NOTIFY_STATE, NULL))
+            continue;
+        tu_cas(tu, w, TU_RING_BACK, ext, NOTIFY_STATE, NULL);
+        return 0;
+    }
+}
+
+/*
+ * "Chat" over a connection.
+ * If the TU is connected, the message is sent to the peer; in all cases the
+ * TU is notified of its current state.
+ *
+ * @return 0 if the chat was sent, -1 if there is no call in progress.
+ */
+int tu_chat(TU *tu, char *msg)
+{
+    return tu_chat_send(tu, msg != NULL ? msg : "", msg != NULL ? strlen(msg) : 0);
+}
+
+/*
+ * Chat with the length of the message given.
+ *
+ * @return 0 if the chat was sent, -1 if there is no call in progress.
+ */
+int tu_chat_send(TU *tu, const char *msg, size_t len)
+{
+    struct chat chat = {.msg = msg, .len = len};
+
+    if (tu == NULL)
+        return -1;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+        int state = WORD_STATE(w);
+
+        if (state == TU_UNREGISTERED)
+            return -1;
+
+        if (state != TU_CONNECTED)
+        {
+            if (tu_touch(tu, w))
+                return -1;
+            continue;
+        }
+
+        // Fanned out once the touch has succeeded, so a retry cannot send
+        // the chat to the bridge again.
+        if (WORD_BRIDGE(w) != 0)
+        {
+            if (!tu_touch(tu, w))
+                continue;
+            conf_chat(tu->conf, tu->number, msg, len);
+            return 0;
+        }
+
+        uint64_t pw;
+        TU *peer = tu_find(WORD_PEER(w), &pw);
+        if (peer == NULL || WORD_STATE(pw) != TU_CONNECTED || WORD_PEER(pw) != tu->number)
+            continue;
+
+        // Sent only while the peer is still connected to us.
+        if (!tu_cas(peer, pw, TU_CONNECTED, tu->number, NOTIFY_CHAT, &chat))
+            continue;
+
+        while (!tu_touch(tu, tu_load(tu)))
+            ;
+        return 0;
+    }
+}
+
+/*
+ * Join a TU to a conference bridge.  The CAS that connects the TU
+ * notifies it before it joins, so that it gets no chat from the bridge
+ * before the notification.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_join(TU *tu, int number)
+{
+    if (tu == NULL)
+        return -1;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+        int state = WORD_STATE(w);
+
+        if (state == TU_UNREGISTERED)
+            return -1;
+
+        if (state != TU_DIAL_TONE)
+        {
+            if (tu_touch(tu, w))
+                return 0;
+            continue;
+        }
+
+        if (number < 1 || number > CONF_MAX_BRIDGE)
+        {
+            if (tu_cas(tu, w, TU_ERROR, 0, NOTIFY_STATE, NULL))
+                return 0;
+            continue;
+        }
+
+        if (tu_cas(tu, w, TU_CONNECTED, -number, NOTIFY_STATE, NULL))
+        {
+            tu->conf = conf_join(number, tu->number, tu->out, tu->protocol);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Start a chat to be relayed in parts.  The stream is opened by a CAS on
+ * the peer, like a chat, so it is in order with the peer's notifications.
+ * Chats to a conference bridge are not relayed in parts, and are dropped.
+ *
+ * @return 0 if the stream is open, -1 if there is no call in progress.
+ */
+int tu_chat_open(TU *tu, CHAT_STREAM *s)
+{
+    if (tu == NULL)
+        return -1;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+        int state = WORD_STATE(w);
+
+        if (state == TU_UNREGISTERED)
+            return -1;
+
+        if (state != TU_CONNECTED || WORD_BRIDGE(w) != 0)
+        {
+            if (tu_touch(tu, w))
+                return -1;
+            continue;
+        }
+
+        uint64_t pw;
+        TU *peer = tu_find(WORD_PEER(w), &pw);
+        if (peer == NULL || WORD_STATE(pw) != TU_CONNECTED || WORD_PEER(pw) != tu->number)
+            continue;
+
+        s->token = 0;
+        s->peer = WORD_PEER(w);
+        if (!tu_cas(peer, pw, TU_CONNECTED, tu->number, NOTIFY_STREAM, s))
+            continue;
+
+        if (s->token != 0)
+            return 0;
+        while (!tu_touch(tu, tu_load(tu)))
+            ;
+        return -1;
+    }
+}
+
+/*
+ * Relay the next part of a chat, if the TU is still connected to the peer
+ * the stream was opened to.
+ *
+ * @return 0 if the part was sent, -1 if it was dropped.
+ */
+int tu_chat_write(TU *tu, CHAT_STREAM *s, const char *data, size_t len)
+{
+    uint64_t w = settle(tu);
+
+    if (WORD_STATE(w) != TU_CONNECTED || WORD_PEER(w) != s->peer)
+        return -1;
+    return proto_chat_part(s, data, len);
+}
+
+/*
+ * Finish a chat relayed in parts, and notify the TU of its current state.
+ *
+ * @return 0 if the TU is still connected, otherwise -1.
+ */
+int tu_chat_close(TU *tu, CHAT_STREAM *s)
+{
+    proto_chat_close(s);
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+
+        if (WORD_STATE(w) == TU_UNREGISTERED)
+            return -1;
+        if (tu_touch(tu, w))
+            return WORD_STATE(w) == TU_CONNECTED ? 0 : -1;
+    }
+}
+
+/*
+ * Take a snapshot of a TU and stop output to its client.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_freeze(TU *tu, TU_SNAPSHOT *snap)
+{
+    uint64_t w = settle(tu);
+
+    if (WORD_STATE(w) == TU_UNREGISTERED)
+        return -1;
+
+    snap->ext = tu->number;
+    snap->fd = tu->fd;
+    snap->state = WORD_STATE(w);
+    snap->peer = WORD_PEER(w) > 0 ? WORD_PEER(w) : -1;
+    snap->bridge = WORD_BRIDGE(w);
+    snap->call = tu->call;
+    snap->protocol = tu->protocol;
+    snap->output_len = outq_freeze(tu->out, &snap->output);
+    return 0;
+}
+
+/*
+ * Switch the notifications of a TU to another protocol, and notify its
+ * client of its current state in that protocol.  The switch is made by
+ * publish(), in order with the other notifications.
+ *
+ * @return 0 if successful, -1 if the TU is not registered.
+ */
+int tu_set_protocol(TU *tu, int protocol)
+{
+    int notify = protocol == PROTO_BINARY ? NOTIFY_BINARY : NOTIFY_TEXT;
+
+    while (1)
+    {
+        uint64_t w = settle(tu);
+
+        if (WORD_STATE(w) == TU_UNREGISTERED)
+            return -1;
+        if (tu_cas(tu, w, WORD_STATE(w), WORD_PEER(w), notify, NULL))
+            return 0;
+    }
+}
+
+/*
+ * Get the state of a TU, once any transition it is part of is complete.
+ *
+ * @return the state, or -1 if the TU is not registered.
+ */
+int tu_state(TU *tu)
+{
+    int state = WORD_STATE(settle(tu));
+    return state == TU_UNREGISTERED ? -1 : state;
+}
+
+/*
+ * Resume output to the client of a TU after an aborted handoff.
+ */
+void tu_thaw(TU *tu)
+{
+    if (WORD_STATE(tu_load(tu)) != TU_UNREGISTERED)
+        outq_thaw(tu->out);
+}
+
+/*
+ * Register TUs with the states recorded in a set of snapshots.  The peers
+ * are linked by extension, so the words are simply restored; settle()
+ * then brings each pair into line, which hangs up a TU whose peer is
+ * missing.
+ *
+ * @return the number of TUs restored.
+ */
+int pbx_adopt(PBX *pbx, TU_SNAPSHOT *snaps, int n, TU **tus)
+{
+    int restored = 0;
+
+    debug("Entered pbx_adopt | snapshots: %d", n);
+
+    for (int i = 0; i < n; i++)
+    {
+        TU *tu = pool_get(tu_pool);
+        tu->fd = snaps[i].fd;
+        tu->protocol = snaps[i].protocol;
+        tu->conf = NULL;
+        tu->call = snaps[i].call;
+
+        int ext = registry_insert_at(pbx->registry, snaps[i].ext, tu, NULL);
+        if (ext < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to restore extension %d\n", snaps[i].ext);
+            pool_put(tu_pool, tu);
+            tus[i] = NULL;
+            continue;
+        }
+
+        tu->out = outq_create(tu->fd);
+        if (snaps[i].output_len > 0)
+            outq_send(tu->out, snaps[i].output, snaps[i].output_len);
+
+        int peer = snaps[i].peer > 0 ? snaps[i].peer : 0;
+        if (snaps[i].state == TU_CONNECTED && snaps[i].bridge > 0)
+        {
+            peer = -snaps[i].bridge;
+            tu->conf = conf_join(snaps[i].bridge, ext, tu->out, tu->protocol);
+        }
+
+        __atomic_store_n(&tu->number, ext, __ATOMIC_RELEASE);
+        tu_cas(tu, tu_load(tu), snaps[i].state, peer, NOTIFY_NONE, NULL);
+        tus[i] = tu;
+        restored++;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (tus[i] != NULL)
+            settle(tus[i]);
+    }
+
+    debug("Exiting pbx_adopt | restored: %d", restored);
+    return restored;
+}
+
+/*
+ * Get the shard of a TU.
+ *
+ * @return the shard, or -1 if the TU is not registered.
+ */
+int pbx_shard_of(PBX *pbx, TU *tu)
+{
+    if (tu == NULL || WORD_STATE(tu_load(tu)) == TU_UNREGISTERED)
+        return -1;
+    return registry_shard(pbx->registry, tu->number);
+}
+
+/*
+ * Shards need no owner: a transition between TUs of different shards is
+ * made by CAS on both, like any other, and posts no message.
+ *
+ * @return -1.
+ */
+int pbx_shard_claim(PBX *pbx, int shard)
+{
+    return -1;
+}
+
+/*
+ * There are no messages to handle.
+ */
+void pbx_shard_run(PBX *pbx, int shard)
+{
+}
+
+/*
+ * There are no messages to handle.
+ */
+void pbx_shard_drain_all(PBX *pbx)
+{
+}
+
+/*
+ * Create the pool of TU objects, shared by every PBX.
+ */
+static void tu_pool_init(void)
+{
+    tu_pool = pool_create("tu", sizeof(TU), __alignof__(TU), tu_init);
+}
+
+/*
+ * Initialize a TU object when its slab is carved.  The pool leaves the
+ * word of an unregistered TU alone from then on, so its version keeps
+ * counting up across registrations.
+ */
+static void tu_init(void *obj)
+{
+    TU *tu = obj;
+    tu->word = MAKE_WORD(TU_UNREGISTERED, 0, 0);
+}
+
+/*
+ * Read the word of a TU once its latest version has been published.
+ */
+static uint64_t tu_load(TU *tu)
+{
+    for (int spins = 0;; spins++)
+    {
+        uint64_t w = __atomic_load_n(&tu->word, __ATOMIC_ACQUIRE);
+        if (WORD_VERSION(w) == __atomic_load_n(&tu->published, __ATOMIC_ACQUIRE))
+            return w;
+        if (spins >= SPINS_BEFORE_YIELD)
+            sched_yield();
+    }
+}
+
+/*
+ * Change the word of a TU from old to the given state and peer, and
+ * publish the change.
+ *
+ * @param notify  NOTIFY_STATE to send the new state to the client,
+ * NOTIFY_CHAT to send a chat instead, NOTIFY_STREAM to open a chat
+ * stream, or NOTIFY_NONE.
+ * @param arg  The struct chat of a NOTIFY_CHAT, or the CHAT_STREAM of a
+ * NOTIFY_STREAM.
+ * @return 1 if the word was changed, 0 if it no longer held old.
+ */
+static int tu_cas(TU *tu, uint64_t old, int state, int peer, int notify, void *arg)
+{
+    uint64_t new = MAKE_WORD(state, WORD_VERSION(old) + 1, peer);
+
+    if (!__atomic_compare_exchange_n(&tu->word, &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+
+    // TU_UNREGISTERED is outside the range of the state gauges.
+    metrics_state_change(WORD_STATE(old), state);
+    if (WORD_STATE(old) == TU_UNREGISTERED && state != TU_UNREGISTERED)
+        log_info("event=register ext=%d fd=%d", tu->number, tu->fd);
+    else if (state == TU_UNREGISTERED && WORD_STATE(old) != TU_UNREGISTERED)
+        log_info("event=unregister ext=%d", tu->number);
+    else if (state == TU_CONNECTED && WORD_STATE(old) != TU_CONNECTED && peer < 0)
+        log_info("event=join ext=%d bridge=%d", tu->number, -peer);
+    else if (state != TU_CONNECTED && WORD_STATE(old) == TU_CONNECTED && WORD_BRIDGE(old) != 0)
+        log_info("event=leave ext=%d bridge=%d", tu->number, WORD_BRIDGE(old));
+    else if (state == TU_CONNECTED && WORD_STATE(old) != TU_CONNECTED)
+        log_info("event=connect ext=%d peer=%d", tu->number, peer);
+    else if (state != TU_CONNECTED && WORD_STATE(old) == TU_CONNECTED)
+        log_info("event=disconnect ext=%d peer=%d", tu->number, WORD_PEER(old));
+    publish(tu, new, notify, arg);
+    return 1;
+}
+
+/*
+ * Notify a TU of its unchanged state.
+ *
+ * @return 1 if the notification was sent, 0 if the state changed meanwhile.
+ */
+static int tu_touch(TU *tu, uint64_t old)
+{
+    return tu_cas(tu, old, WORD_STATE(old), WORD_PEER(old), NOTIFY_STATE, NULL);
+}
+
+/*
+ * Find the TU registered at an extension and read its word.
+ *
+ * @return the TU, or NULL if no TU is registered at ext.
+ */
+static TU *tu_find(int ext, uint64_t *word)
+{
+    TU *tu = registry_peek(pbx->registry, ext);
+    if (tu == NULL)
+        return NULL;
+
+    // The word is read first: if the TU is reused for another extension
+    // after this, the version will have changed and a CAS will fail.
+    *word = tu_load(tu);
+    if (__atomic_load_n(&tu->number, __ATOMIC_ACQUIRE) != ext)
+        return NULL;
+    return tu;
+}
+
+/*
+ * Bring a TU and its peer into a consistent pair of states, completing
+ * any two-TU transition that has only been applied to one of them.
+ *
+ *   RINGING(P) with P in DIAL_TONE: P's dial has made us ring and has yet
+ *     to move P to RING_BACK, which is done here.
+ *   RING_BACK(P) with P CONNECTED to us: P has picked up, and we become
+ *     CONNECTED too.
+ *   CONNECTED(P) with P in RING_BACK to us: we have picked up, and P
+ *     becomes CONNECTED.
+ *   Otherwise, if P is not in the state matching ours, P has hung up or
+ *     gone away and we go to TU_ON_HOOK (from RINGING) or TU_DIAL_TONE.
+ *
+ * @return the word of the TU, whose peer (if any) is consistent with it.
+ */
+static uint64_t settle(TU *tu)
+{
+    while (1)
+    {
+        uint64_t w = tu_load(tu);
+        int state = WORD_STATE(w);
+
+        if ((state != TU_RINGING && state != TU_RING_BACK && state != TU_CONNECTED) || WORD_BRIDGE(w) != 0)
+            return w;
+
+        uint64_t pw = 0;
+        TU *peer = tu_find(WORD_PEER(w), &pw);
+        int pstate = peer != NULL ? WORD_STATE(pw) : TU_UNREGISTERED;
+        int linked = peer != NULL && WORD_PEER(pw) == tu->number;
+
+        // The two words are only a consistent view of one call if ours
+        // still holds once the peer's has been read.  Otherwise a stale
+        // word of ours could complete a transition of the peer's next call.
+        if (__atomic_load_n(&tu->word, __ATOMIC_ACQUIRE) != w)
+            continue;
+
+        switch (state)
+        {
+        case TU_RINGING:
+            if (linked && pstate == TU_RING_BACK)
+                return w;
+            if (pstate == TU_DIAL_TONE)
+                tu_cas(peer, pw, TU_RING_BACK, tu->number, NOTIFY_STATE, NULL);
+            else
+                tu_cas(tu, w, TU_ON_HOOK, 0, NOTIFY_STATE, NULL);
+            break;
+
+        case TU_RING_BACK:
+            if (linked && pstate == TU_RINGING)
+                return w;
+            if (linked && pstate == TU_CONNECTED)
+                tu_cas(tu, w, TU_CONNECTED, WORD_PEER(w), NOTIFY_STATE, NULL);
+            else
+                tu_cas(tu, w, TU_DIAL_TONE, 0, NOTIFY_STATE, NULL);
+            break;
+
+        default:
+            if (linked && pstate == TU_CONNECTED)
+                return w;
+            if (linked && pstate == TU_RING_BACK)
+                tu_cas(peer, pw, TU_CONNECTED, tu->number, NOTIFY_STATE, NULL);
+            else
+                tu_cas(tu, w, TU_DIAL_TONE, 0, NOTIFY_STATE, NULL);
+            break;
+        }
+    }
+}
+
+/*
+ * Take the record of the call that a TU in a two-party call is about to
+ * end, from both legs.
+ *
+ * @param w  The word of the TU on which the call is ended.
+ * @param flags  CDR_FLAG_xxx other than CDR_FLAG_CALLEE_ENDED.
+ */
+static void call_ending(TU *tu, uint64_t w, int flags, struct call_end *e)
+{
+    e->caller = 0;
+    if (!cdr_enabled)
+        return;
+
+    uint64_t pw;
+    TU *peer = tu_find(WORD_PEER(w), &pw);
+    CDR_LEG peer_leg = peer != NULL ? peer->call : (CDR_LEG){0};
+
+    switch (WORD_STATE(w))
+    {
+    case TU_RING_BACK:
+        *e = (struct call_end){.caller = tu->number, .outcome = CDR_CANCELLED, .flags = flags, .leg = tu->call};
+        break;
+    case TU_RINGING:
+        *e = (struct call_end){.caller = WORD_PEER(w), .outcome = CDR_REJECTED,
+                               .flags = flags | CDR_FLAG_CALLEE_ENDED, .leg = peer_leg};
+        break;
+    default:
+        // The caller's leg has the extension it dialed; the callee's does not.
+        if (tu->call.callee == WORD_PEER(w))
+            *e = (struct call_end){.caller = tu->number, .outcome = CDR_ANSWERED, .flags = flags,
+                                   .leg = tu->call, .callee_leg = peer_leg};
+        else
+            *e = (struct call_end){.caller = WORD_PEER(w), .outcome = CDR_ANSWERED,
+                                   .flags = flags | CDR_FLAG_CALLEE_ENDED, .leg = peer_leg,
+                                   .callee_leg = tu->call};
+        break;
+    }
+}
+
+/*
+ * Record a call ended by a successful CAS.
+ */
+static void call_ended(struct call_end *e)
+{
+    if (e->caller != 0)
+        cdr_end(e->caller, &e->leg, e->outcome == CDR_ANSWERED ? &e->callee_leg : NULL, e->outcome, e->flags);
+}
+
+/*
+ * Leave the conference bridge a TU has joined, if it is still in it.
+ */
+static void leave(TU *tu)
+{
+    if (tu->conf != NULL)
+    {
+        conf_leave(tu->conf, tu->number);
+        tu->conf = NULL;
+    }
+}
+
+/*
+ * Settle the TU at an extension, after a transition of its peer.
+ */
+static void settle_peer(int ext)
+{
+    uint64_t w;
+    TU *tu = tu_find(ext, &w);
+
+    if (tu != NULL)
+        settle(tu);
+}
+
+/*
+ * Send the notification for a new version of a TU's word and mark the
+ * version as published.
+ */
+static void publish(TU *tu, uint64_t word, int notify, void *arg)
+{
+    int state = WORD_STATE(word);
+
+    if (notify == NOTIFY_TEXT || notify == NOTIFY_BINARY)
+    {
+        char magic = PROTO_MAGIC;
+
+        tu->protocol = notify == NOTIFY_BINARY ? PROTO_BINARY : PROTO_TEXT;
+        if (tu->protocol == PROTO_BINARY)
+            outq_send(tu->out, &magic, 1);
+        notify = NOTIFY_STATE;
+    }
+
+    if (notify == NOTIFY_CHAT)
+    {
+        struct chat *chat = arg;
+        proto_send_chat(tu->out, tu->protocol, chat->msg, chat->len);
+    }
+    else if (notify == NOTIFY_STREAM && proto_chat_open(arg, tu->out, tu->protocol) < 0)
+    {
+        proto_chat_close(arg);
+    }
+    else if (notify == NOTIFY_STATE)
+        proto_send_state(tu->out, tu->protocol, state,
+                         state == TU_ON_HOOK ? tu->number : WORD_BRIDGE(word) ? WORD_BRIDGE(word) : WORD_PEER(word));
+
+    __atomic_store_n(&tu->published, WORD_VERSION(word), __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Pools of fixed-size objects (see pool.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "lockprof.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Free objects of one pool held by one thread.
+ */
+struct cache
+{
+    size_t n;
+    void *objs[POOL_CACHE_OBJECTS];
+};
+
+struct pool
+{
+    char *name;
+    size_t size;                // Rounded up to the alignment
+    size_t align;
+    void (*init)(void *obj);
+    int index;                  // Of the pool's cache in each thread
+    sem_t mutex;                // Protects the fields below
+    void **free;                // Shared list of free objects
+    size_t nfree;
+    size_t objects;             // Carved, and room in the free list
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static sem_t pools_mutex;
+static POOL *pools[POOL_MAX];
+static int npools;
+static size_t reserved;         // Connections for which pools are preallocated
+
+static __thread struct cache caches[POOL_MAX];
+static __thread int cached;
+
+static void pool_init(void);
+static void pool_retire(void *arg);
+static struct cache *pool_cache(POOL *p);
+static void pool_grow(POOL *p, size_t n);
+
+/*
+ * Create a pool, preallocated for the connections reserved so far.
+ */
+POOL *pool_create(char *name, size_t size, size_t align, void (*init)(void *obj))
+{
+    Pthread_once(&pool_once, pool_init);
+
+    POOL *p = Calloc(1, sizeof(POOL));
+    p->name = name;
+    p->align = align < sizeof(void *) ? sizeof(void *) : align;
+    p->size = (size + p->align - 1) & ~(p->align - 1);
+    p->init = init;
+    Sem_init(&p->mutex, 0, 1);
+
+    P(&pools_mutex);
+    if (npools == POOL_MAX)
+        app_error("Too many pools");
+    p->index = npools;
+    if (reserved > 0)
+        pool_grow(p, reserved);
+    __atomic_store_n(&pools[npools], p, __ATOMIC_RELEASE);
+    __atomic_store_n(&npools, npools + 1, __ATOMIC_RELEASE);
+    V(&pools_mutex);
+
+    debug("Created pool %s | size: %zu", name, p->size);
+    return p;
+}
+
+/*
+ * Get an object, from the calling thread's cache if it holds any, and
+ * otherwise by moving half a cache's worth from the shared list, which is
+ * first refilled with a new slab if it holds fewer.
+ */
+void *pool_get(POOL *p)
+{
+    struct cache *c = pool_cache(p);
+
+    if (c->n == 0)
+    {
+        LOCK(&p->mutex, LOCK_CLASS_FREELIST);
+        if (p->nfree < POOL_CACHE_OBJECTS / 2)
+            pool_grow(p, POOL_CACHE_OBJECTS / 2);
+        p->nfree -= POOL_CACHE_OBJECTS / 2;
+        memcpy(c->objs, p->free + p->nfree, POOL_CACHE_OBJECTS / 2 * sizeof(void *));
+        UNLOCK(&p->mutex);
+        c->n = POOL_CACHE_OBJECTS / 2;
+    }
+    return c->objs[--c->n];
+}
+
+/*
+ * Give an object back, to the calling thread's cache, which first moves
+ * half its objects to the shared list if it is full.
+ */
+void pool_put(POOL *p, void *obj)
+{
+    struct cache *c = pool_cache(p);
+
+    if (c->n == POOL_CACHE_OBJECTS)
+    {
+        c->n -= POOL_CACHE_OBJECTS / 2;
+        LOCK(&p->mutex, LOCK_CLASS_FREELIST);
+        memcpy(p->free + p->nfree, c->objs + c->n, POOL_CACHE_OBJECTS / 2 * sizeof(void *));
+        p->nfree += POOL_CACHE_OBJECTS / 2;
+        UNLOCK(&p->mutex);
+    }
+    c->objs[c->n++] = obj;
+}
+
+/*
+ * Preallocate the existing pools for the given number of connections, and
+ * remember it for the pools created later.
+ */
+void pool_reserve(size_t connections)
+{
+    Pthread_once(&pool_once, pool_init);
+
+    P(&pools_mutex);
+    reserved = connections;
+    for (int i = 0; i < npools; i++)
+    {
+        LOCK(&pools[i]->mutex, LOCK_CLASS_FREELIST);
+        if (pools[i]->objects < connections)
+            pool_grow(pools[i], connections - pools[i]->objects);
+        UNLOCK(&pools[i]->mutex);
+    }
+    V(&pools_mutex);
+}
+
+/*
+ * Print the objects of each pool.  Objects in the caches of threads are
+ * counted as in use.
+ */
+void pool_report(FILE *out)
+{
+    int n = __atomic_load_n(&npools, __ATOMIC_ACQUIRE);
+
+    fprintf(out, "%-12s %8s %10s %10s %12s\n", "pool", "size", "objects", "free", "bytes");
+    for (int i = 0; i < n; i++)
+    {
+        POOL *p = pools[i];
+        LOCK(&p->mutex, LOCK_CLASS_FREELIST);
+        fprintf(out, "%-12s %8zu %10zu %10zu %12zu\n", p->name, p->size, p->objects, p->nfree,
+                p->objects * p->size);
+        UNLOCK(&p->mutex);
+    }
+}
+
+static void pool_init(void)
+{
+    Sem_init(&pools_mutex, 0, 1);
+    if (pthread_key_create(&pool_key, pool_retire) != 0)
+        app_error("pthread_key_create error");
+}
+
+/*
+ * Thread-exit destructor: the objects in the thread's caches are given
+ * back to their pools.
+ */
+static void pool_retire(void *arg)
+{
+    struct cache *cs = arg;
+    int n = __atomic_load_n(&npools, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (cs[i].n == 0)
+            continue;
+        LOCK(&pools[i]->mutex, LOCK_CLASS_FREELIST);
+        memcpy(pools[i]->free + pools[i]->nfree, cs[i].objs, cs[i].n * sizeof(void *));
+        pools[i]->nfree += cs[i].n;
+        UNLOCK(&pools[i]->mutex);
+        cs[i].n = 0;
+    }
+}
+
+/*
+ * Get the calling thread's cache of a pool, arranging on the thread's
+ * first use of any pool for its caches to be given back when it exits.
+ */
+static struct cache *pool_cache(POOL *p)
+{
+    if (!cached)
+    {
+        cached = 1;
+        pthread_setspecific(pool_key, caches);
+    }
+    return &caches[p->index];
+}
+
+/*
+ * Carve a slab of at least n objects and add them to the shared list.
+ * The pool's mutex must be held.
+ */
+static void pool_grow(POOL *p, size_t n)
+{
+    size_t count = POOL_SLAB_BYTES / p->size;
+    if (count < n)
+        count = n;
+
+    char *slab = NULL;
+    if (posix_memalign((void **)&slab, p->align, count * p->size) != 0)
+        unix_error("posix_memalign error");
+    memset(slab, 0, count * p->size);
+
+    // The list has room for every object, so that objects given back
+    // never need it to grow.
+    p->free = Realloc(p->free, (p->objects + count) * sizeof(void *));
+    for (size_t i = 0; i < count; i++)
+    {
+        void *obj = slab + i * p->size;
+        if (p->init != NULL)
+            p->init(obj);
+        p->free[p->nfree++] = obj;
+    }
+    p->objects += count;
+
+    debug("Pool %s grew by %zu objects to %zu", p->name, count, p->objects);
+}
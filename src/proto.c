@@ -0,0 +1,217 @@
+#include <arpa/inet.h>
+
+#include "proto.h"
+#include "debug.h"
+#include "csapp.h"
+
+static void put_header(unsigned char *frame, int op, size_t len);
+static size_t line_length(const char *msg, size_t len);
+
+/*
+ * Send a state notification to a client.
+ *
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int proto_send_state(OUTQ *q, int protocol, TU_STATE state, int ext)
+{
+    if (protocol == PROTO_BINARY)
+    {
+        unsigned char frame[PROTO_HEADER_SIZE + 4];
+        uint32_t arg = htonl(state == TU_ON_HOOK || state == TU_CONNECTED ? ext : 0);
+
+        put_header(frame, PROTO_OP_STATE + state, sizeof(arg));
+        memcpy(frame + PROTO_HEADER_SIZE, &arg, sizeof(arg));
+        return outq_send(q, frame, sizeof(frame));
+    }
+
+    if (state == TU_ON_HOOK || state == TU_CONNECTED)
+        return outq_printf(q, "%s %d%s", tu_state_names[state], ext, EOL);
+    return outq_printf(q, "%s%s", tu_state_names[state], EOL);
+}
+
+/*
+ * Send a chat to a client.  The message is not copied unless it has to be
+ * queued; a binary message too long for one frame is sent in parts.
+ *
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int proto_send_chat(OUTQ *q, int protocol, const char *msg, size_t len)
+{
+    unsigned char header[PROTO_HEADER_SIZE];
+
+    if (protocol != PROTO_BINARY)
+    {
+        struct iovec iov[3] = {{.iov_base = "CHAT ", .iov_len = 5},
+                               {.iov_base = (char *)msg, .iov_len = line_length(msg, len)},
+                               {.iov_base = EOL, .iov_len = strlen(EOL)}};
+        return outq_sendv(q, iov, 3);
+    }
+
+    if (len > PROTO_MAX_NOTIFY)
+    {
+        CHAT_STREAM s = {.wait = 0};
+        if (proto_chat_open(&s, q, protocol) < 0)
+            return -1;
+        int status = proto_chat_part(&s, msg, len);
+        proto_chat_close(&s);
+        return status < 0 ? -1 : (int)len;
+    }
+
+    put_header(header, PROTO_OP_CHAT, len);
+    struct iovec iov[2] = {{.iov_base = header, .iov_len = PROTO_HEADER_SIZE},
+                           {.iov_base = (char *)msg, .iov_len = len}};
+    return outq_sendv(q, iov, 2);
+}
+
+/*
+ * Prepare a chat for sending to many clients.
+ */
+void proto_msg_init(PROTO_MSG *m, const char *msg, size_t len)
+{
+    m->msg = msg;
+    m->len = len;
+    m->encoded[PROTO_TEXT] = NULL;
+    m->encoded[PROTO_BINARY] = NULL;
+}
+
+/*
+ * Send a chat prepared with proto_msg_init() to a client, serializing it
+ * in the client's protocol the first time that protocol is needed.
+ *
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+int proto_send_msg(OUTQ *q, int protocol, PROTO_MSG *m)
+{
+    OUTQ_BUF *b;
+
+    protocol = protocol == PROTO_BINARY ? PROTO_BINARY : PROTO_TEXT;
+    if ((b = m->encoded[protocol]) != NULL)
+        return outq_send_buf(q, b);
+
+    if (protocol == PROTO_BINARY)
+    {
+        // Sent in parts, on a stream of the client's queue.
+        if (m->len > PROTO_MAX_NOTIFY)
+            return proto_send_chat(q, protocol, m->msg, m->len);
+
+        b = outq_buf_create(PROTO_HEADER_SIZE + m->len);
+        put_header((unsigned char *)b->data, PROTO_OP_CHAT, m->len);
+        memcpy(b->data + PROTO_HEADER_SIZE, m->msg, m->len);
+    }
+    else
+    {
+        size_t len = line_length(m->msg, m->len);
+
+        b = outq_buf_create(5 + len + strlen(EOL));
+        memcpy(b->data, "CHAT ", 5);
+        memcpy(b->data + 5, m->msg, len);
+        memcpy(b->data + 5 + len, EOL, strlen(EOL));
+    }
+
+    m->encoded[protocol] = b;
+    return outq_send_buf(q, b);
+}
+
+/*
+ * Drop the references to the serialized chat held by a PROTO_MSG.
+ */
+void proto_msg_release(PROTO_MSG *m)
+{
+    outq_buf_release(m->encoded[PROTO_TEXT]);
+    outq_buf_release(m->encoded[PROTO_BINARY]);
+    m->encoded[PROTO_TEXT] = NULL;
+    m->encoded[PROTO_BINARY] = NULL;
+}
+
+/*
+ * Open a chat stream to a client, sending the start of the message.
+ *
+ * @return 0 if successful, -1 if the client's connection has failed.
+ */
+int proto_chat_open(CHAT_STREAM *s, OUTQ *q, int protocol)
+{
+    unsigned char end[PROTO_HEADER_SIZE];
+
+    s->q = q;
+    s->protocol = protocol;
+    s->cut = 0;
+
+    if (protocol == PROTO_BINARY)
+    {
+        put_header(end, PROTO_OP_CHAT, 0);
+        s->token = outq_stream_open(q, end, sizeof(end));
+        return s->token != 0 ? 0 : -1;
+    }
+
+    s->token = outq_stream_open(q, EOL, strlen(EOL));
+    if (s->token == 0)
+        return -1;
+    struct iovec iov = {.iov_base = "CHAT ", .iov_len = 5};
+    return outq_stream_write(q, s->token, &iov, 1, s->wait);
+}
+
+/*
+ * Send the next part of a chat stream.  In the text protocol, everything
+ * after an end of line in the message is dropped.
+ *
+ * @return 0 if successful, -1 if the stream is closed or has failed.
+ */
+int proto_chat_part(CHAT_STREAM *s, const char *data, size_t len)
+{
+    unsigned char header[PROTO_HEADER_SIZE];
+
+    if (s->token == 0)
+        return -1;
+
+    if (s->protocol != PROTO_BINARY)
+    {
+        if (s->cut)
+            return 0;
+        size_t n = line_length(data, len);
+        s->cut = n < len;
+        struct iovec iov = {.iov_base = (char *)data, .iov_len = n};
+        return n > 0 ? outq_stream_write(s->q, s->token, &iov, 1, s->wait) : 0;
+    }
+
+    while (len > 0)
+    {
+        size_t n = len < PROTO_MAX_NOTIFY ? len : PROTO_MAX_NOTIFY;
+        put_header(header, PROTO_OP_CHAT_PART, n);
+        struct iovec iov[2] = {{.iov_base = header, .iov_len = PROTO_HEADER_SIZE},
+                               {.iov_base = (char *)data, .iov_len = n}};
+        if (outq_stream_write(s->q, s->token, iov, 2, s->wait) < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * End the message of a chat stream and close it.
+ */
+void proto_chat_close(CHAT_STREAM *s)
+{
+    if (s->token != 0)
+        outq_stream_close(s->q, s->token);
+    s->token = 0;
+}
+
+static void put_header(unsigned char *frame, int op, size_t len)
+{
+    frame[0] = op;
+    frame[1] = 0;
+    frame[2] = len >> 8;
+    frame[3] = len & 0xff;
+}
+
+/*
+ * Length of the part of a message before its first end of line, if any.
+ */
+static size_t line_length(const char *msg, size_t len)
+{
+    const char *cr = memchr(msg, '\r', len);
+    const char *lf = memchr(msg, '\n', cr != NULL ? (size_t)(cr - msg) : len);
+
+    return lf != NULL ? (size_t)(lf - msg) : cr != NULL ? (size_t)(cr - msg) : len;
+}
@@ -0,0 +1,352 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "reactor.h"
+#include "service.h"
+#include "parser.h"
+#include "metrics.h"
+#include "iostats.h"
+#include "lockprof.h"
+#include "pool.h"
+#include "registry.h"
+#include "shard.h"
+#include "debug.h"
+#include "pbx.h"
+#include "csapp.h"
+
+#define REACTOR_MAX_EVENTS 256
+
+/*
+ * Per-connection state owned by a reactor thread.
+ * The parser accumulates input until a complete line is available.
+ */
+struct conn
+{
+    int fd;
+    TU *tu;
+    struct conn *prev;
+    struct conn *next;
+    PARSER parser;
+};
+
+/*
+ * Each reactor keeps a list of its connections, for reactor_foreach().
+ * The list is protected by conns_mutex, since connections are added by
+ * the acceptor threads.  A reactor owns the PBX shard of the same number,
+ * if there is one, and its doorbell is registered with the reactor's
+ * epoll instance with the reactor itself as its data pointer.
+ */
+struct reactor
+{
+    int epfd;
+    int doorbell;
+    pthread_t tid;
+    sem_t conns_mutex;
+    struct conn *conns;
+};
+
+static struct reactor reactors[REACTOR_MAX_THREADS];
+static int num_reactors;
+static unsigned int next_reactor;
+static POOL *conn_pool;
+
+/*
+ * Pausing: pause_fd is an eventfd registered with every reactor's epoll
+ * instance (with a NULL data pointer).  While it is signalled, each
+ * reactor posts "parked" and waits on "resumed".
+ */
+static int pause_fd;
+static sem_t parked;
+static sem_t resumed;
+
+static struct reactor *next_in_turn(void);
+static int conn_attach(struct reactor *r, struct conn *conn);
+static void *reactor_loop(void *arg);
+static int conn_readable(struct conn *conn);
+static void conn_close(struct reactor *r, struct conn *conn);
+static void raise_fd_limit(void);
+
+/*
+ * Start the reactor threads.
+ *
+ * @param nthreads  Number of event-loop threads to start.
+ * @return 0 if the reactors were started, otherwise -1.
+ */
+int reactor_start(int nthreads)
+{
+    debug("Entered reactor_start | threads: %d", nthreads);
+
+    if (nthreads < 1 || nthreads > REACTOR_MAX_THREADS)
+        return -1;
+
+    raise_fd_limit();
+
+    if ((pause_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd");
+        return -1;
+    }
+    Sem_init(&parked, 0, 0);
+    Sem_init(&resumed, 0, 0);
+    conn_pool = pool_create("conn", sizeof(struct conn), __alignof__(struct conn), NULL);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if ((reactors[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, pause_fd, &ev) < 0)
+        {
+            perror("epoll");
+            return -1;
+        }
+        Sem_init(&reactors[i].conns_mutex, 0, 1);
+        Pthread_create(&reactors[i].tid, NULL, reactor_loop, &reactors[i]);
+    }
+    num_reactors = nthreads;
+
+    debug("Exiting reactor_start");
+    return 0;
+}
+
+/*
+ * Hand an accepted client connection to one of the reactor threads.
+ * Connections are distributed round-robin over the reactors, and the TU
+ * of each is registered in the shard of its reactor, which handles the
+ * messages for the TU (see shard.h).
+ *
+ * @param connfd  File descriptor of the accepted connection.
+ * @return 0 if the connection was accepted by a reactor, otherwise -1.
+ */
+int reactor_add(int connfd)
+{
+    struct reactor *r = next_in_turn();
+    struct conn *conn = pool_get(conn_pool);
+
+    conn->fd = connfd;
+    parser_init(&conn->parser, connfd);
+    registry_set_home(r - reactors);
+    uint64_t start = metrics_now();
+    conn->tu = pbx_register(pbx, connfd);
+    metrics_record(METRIC_REGISTER, start);
+    if (conn->tu == NULL)
+    {
+        pool_put(conn_pool, conn);
+        Close(connfd);
+        return -1;
+    }
+
+    return conn_attach(r, conn);
+}
+
+/*
+ * Hand a connection whose TU is already registered to the reactor thread
+ * that owns the TU's shard, resuming from the given parser state.
+ *
+ * @return 0 if the connection was accepted by a reactor, otherwise -1.
+ */
+int reactor_adopt(int connfd, TU *tu, PARSER *parser)
+{
+    struct conn *conn = pool_get(conn_pool);
+    int shard = pbx_shard_of(pbx, tu);
+
+    conn->fd = connfd;
+    conn->tu = tu;
+    conn->parser = *parser;
+    conn->parser.fd = connfd;
+
+    return conn_attach(shard >= 0 ? &reactors[shard % num_reactors] : next_in_turn(), conn);
+}
+
+/*
+ * Call a function for every connection serviced by the reactors.
+ *
+ * @return the number of connections visited.
+ */
+int reactor_foreach(reactor_visitor *visit, void *arg)
+{
+    int count = 0;
+
+    for (int i = 0; i < num_reactors; i++)
+    {
+        LOCK(&reactors[i].conns_mutex, LOCK_CLASS_CONNS);
+        for (struct conn *conn = reactors[i].conns; conn != NULL; conn = conn->next, count++)
+            visit(arg, conn->fd, conn->tu, &conn->parser);
+        UNLOCK(&reactors[i].conns_mutex);
+    }
+    return count;
+}
+
+/*
+ * Stop servicing connections, waiting until every reactor is parked.
+ */
+void reactor_pause(void)
+{
+    uint64_t one = 1;
+
+    if (write(pause_fd, &one, sizeof(one)) < 0)
+        perror("reactor_pause");
+    for (int i = 0; i < num_reactors; i++)
+        P(&parked);
+}
+
+/*
+ * Resume servicing connections.  The eventfd is reset before any reactor
+ * is released, so none of them sees it still signalled.
+ */
+void reactor_resume(void)
+{
+    uint64_t count;
+
+    if (read(pause_fd, &count, sizeof(count)) < 0)
+        perror("reactor_resume");
+    for (int i = 0; i < num_reactors; i++)
+        V(&resumed);
+}
+
+/*
+ * Get the next reactor in round-robin order.
+ */
+static struct reactor *next_in_turn(void)
+{
+    return &reactors[__atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED) % num_reactors];
+}
+
+/*
+ * Add a connection, whose TU is registered, to a reactor.  On failure the
+ * TU is unregistered and the connection closed.
+ */
+static int conn_attach(struct reactor *r, struct conn *conn)
+{
+    LOCK(&r->conns_mutex, LOCK_CLASS_CONNS);
+    conn->prev = NULL;
+    conn->next = r->conns;
+    if (r->conns != NULL)
+        r->conns->prev = conn;
+    r->conns = conn;
+    UNLOCK(&r->conns_mutex);
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        conn_close(r, conn);
+        return -1;
+    }
+
+    debug("Connection %d assigned to reactor %ld", conn->fd, r - reactors);
+    return 0;
+}
+
+/*
+ * Event loop run by each reactor thread.
+ */
+static void *reactor_loop(void *arg)
+{
+    struct reactor *r = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    // TUs registered by this thread, e.g. trunk proxies, are its own.
+    registry_set_home(r - reactors);
+    if ((r->doorbell = pbx_shard_claim(pbx, r - reactors)) >= 0)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = r};
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->doorbell, &ev) < 0)
+            perror("epoll_ctl");
+    }
+
+    while (1)
+    {
+        IOSTATS_COUNT(epoll_waits);
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct conn *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                V(&parked);
+                P(&resumed);
+                continue;
+            }
+            if (events[i].data.ptr == r)
+            {
+                uint64_t count;
+                if (read(r->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("read doorbell");
+                pbx_shard_run(pbx, r - reactors);
+                continue;
+            }
+            if (conn_readable(conn) < 0)
+                conn_close(r, conn);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read whatever is available on a connection and dispatch every complete
+ * command line it contains.
+ *
+ * @return 0 if the connection is still open, -1 on EOF or error.
+ */
+static int conn_readable(struct conn *conn)
+{
+    ssize_t n = parser_fill(&conn->parser);
+    if (n < 0 && errno == EAGAIN)
+        return 0;
+    if (n <= 0)
+        return -1;
+
+    pbx_dispatch_lines(conn->tu, &conn->parser);
+    return 0;
+}
+
+/*
+ * Remove a connection from its reactor, unregister its TU and close it.
+ */
+static void conn_close(struct reactor *r, struct conn *conn)
+{
+    debug("Closing connection %d", conn->fd);
+
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+    LOCK(&r->conns_mutex, LOCK_CLASS_CONNS);
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        r->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    UNLOCK(&r->conns_mutex);
+
+    pbx_dispatch_end(conn->tu, &conn->parser);
+    uint64_t start = metrics_now();
+    pbx_unregister(pbx, conn->tu);
+    metrics_record(METRIC_UNREGISTER, start);
+    Close(conn->fd);
+    pool_put(conn_pool, conn);
+}
+
+/*
+ * A reactor is expected to hold tens of thousands of connections, so lift
+ * the soft descriptor limit as far as the hard limit allows.
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
@@ -0,0 +1,405 @@
+#include "registry.h"
+#include "lockprof.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define NO_SLOT UINT32_MAX
+
+struct slot
+{
+    void *obj;
+    uint32_t gen;
+    uint32_t next_free;
+    uint32_t prev_free;
+};
+
+/*
+ * A shard holds the extensions whose index (extension number less
+ * REGISTRY_FIRST_EXTENSION) is congruent to its number modulo the number
+ * of shards.  Its slots are indexed locally, by the index divided by the
+ * number of shards.  Each shard has a cache line of its own for its lock.
+ */
+struct shard
+{
+    sem_t mutex;
+    int count;
+    int nchunks;
+    uint32_t free_head;
+    uint32_t free_tail;
+    struct slot *chunks[REGISTRY_MAX_CHUNKS];
+} __attribute__((aligned(64)));
+
+struct registry
+{
+    int nshards;
+    unsigned int next;          // Shard of the next registration without a home
+    struct shard shards[];
+};
+
+static int shards_per_registry = 1;
+static __thread int home = -1;
+
+static struct shard *shard_of(REGISTRY *r, int ext, uint32_t *local);
+static struct slot *slot_at(struct shard *sh, uint32_t local);
+static int grow(struct shard *sh);
+static void free_list_push(struct shard *sh, uint32_t local);
+static void free_list_unlink(struct shard *sh, uint32_t local);
+static int occupy(REGISTRY *r, struct shard *sh, uint32_t local, void *obj, REGISTRY_HANDLE *handle);
+
+/*
+ * Set the number of shards of the registries created from now on.
+ */
+void registry_set_shards(int shards)
+{
+    shards_per_registry = shards < 1 ? 1 : shards > REGISTRY_MAX_SHARDS ? REGISTRY_MAX_SHARDS : shards;
+}
+
+/*
+ * Make a shard the home of the calling thread's registrations.
+ */
+void registry_set_home(int shard)
+{
+    home = shard;
+}
+
+/*
+ * Create an empty registry.
+ */
+REGISTRY *registry_create(void)
+{
+    int n = shards_per_registry;
+    REGISTRY *r = NULL;
+
+    // Calloc() does not honour the alignment of the shards.
+    if (posix_memalign((void **)&r, __alignof__(struct shard), sizeof(REGISTRY) + n * sizeof(struct shard)) != 0)
+        unix_error("posix_memalign error");
+    memset(r, 0, sizeof(REGISTRY) + n * sizeof(struct shard));
+
+    r->nshards = n;
+    for (int s = 0; s < n; s++)
+    {
+        Sem_init(&r->shards[s].mutex, 0, 1);
+        r->shards[s].free_head = NO_SLOT;
+        r->shards[s].free_tail = NO_SLOT;
+    }
+    return r;
+}
+
+/*
+ * Free a registry.  Objects still registered are not freed.
+ */
+void registry_destroy(REGISTRY *r)
+{
+    for (int s = 0; s < r->nshards; s++)
+    {
+        for (int i = 0; i < r->shards[s].nchunks; i++)
+            Free(r->shards[s].chunks[i]);
+        sem_destroy(&r->shards[s].mutex);
+    }
+    Free(r);
+}
+
+/*
+ * Register an object at the next free extension of the calling thread's
+ * home shard, or of the next shard in turn if it has none.
+ */
+int registry_insert(REGISTRY *r, void *obj, REGISTRY_HANDLE *handle)
+{
+    int s = home >= 0 ? home % r->nshards
+                      : (int)(__atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED) % r->nshards);
+    struct shard *sh = &r->shards[s];
+
+    LOCK(&sh->mutex, LOCK_CLASS_REGISTRY);
+
+    if (sh->free_head == NO_SLOT && grow(sh) < 0)
+    {
+        UNLOCK(&sh->mutex);
+        return -1;
+    }
+
+    uint32_t local = sh->free_head;
+    free_list_unlink(sh, local);
+    int ext = occupy(r, sh, local, obj, handle);
+
+    UNLOCK(&sh->mutex);
+    return ext;
+}
+
+/*
+ * Register an object at a specific extension, if it is free.
+ *
+ * @return the extension number, or -1 if it is in use or out of range.
+ */
+int registry_insert_at(REGISTRY *r, int ext, void *obj, REGISTRY_HANDLE *handle)
+{
+    uint32_t local;
+    struct shard *sh = shard_of(r, ext, &local);
+
+    if (sh == NULL || local >= REGISTRY_MAX_SLOTS)
+        return -1;
+
+    LOCK(&sh->mutex, LOCK_CLASS_REGISTRY);
+
+    while (local >= (uint32_t)sh->nchunks * REGISTRY_CHUNK_SLOTS)
+    {
+        if (grow(sh) < 0)
+        {
+            UNLOCK(&sh->mutex);
+            return -1;
+        }
+    }
+
+    if (slot_at(sh, local)->obj != NULL)
+    {
+        UNLOCK(&sh->mutex);
+        return -1;
+    }
+
+    free_list_unlink(sh, local);
+    occupy(r, sh, local, obj, handle);
+
+    UNLOCK(&sh->mutex);
+    return ext;
+}
+
+/*
+ * Remove the registration of an object.  The slot's generation is advanced
+ * so that outstanding handles to the registration become stale.
+ *
+ * @return 0 if the object was removed, otherwise -1.
+ */
+int registry_remove(REGISTRY *r, int ext, void *obj)
+{
+    uint32_t local;
+    struct shard *sh = shard_of(r, ext, &local);
+
+    if (sh == NULL)
+        return -1;
+
+    LOCK(&sh->mutex, LOCK_CLASS_REGISTRY);
+
+    struct slot *s = slot_at(sh, local);
+    if (s == NULL || s->obj != obj || obj == NULL)
+    {
+        UNLOCK(&sh->mutex);
+        return -1;
+    }
+
+    __atomic_store_n(&s->obj, NULL, __ATOMIC_RELEASE);
+    s->gen++;
+    __atomic_sub_fetch(&sh->count, 1, __ATOMIC_RELAXED);
+    free_list_push(sh, local);
+
+    UNLOCK(&sh->mutex);
+    return 0;
+}
+
+/*
+ * Look up the object registered at an extension.
+ *
+ * @return the object, or NULL if the extension is not in use.
+ */
+void *registry_lookup(REGISTRY *r, int ext, void (*hold)(void *))
+{
+    uint32_t local;
+    struct shard *sh = shard_of(r, ext, &local);
+
+    if (sh == NULL)
+        return NULL;
+
+    LOCK(&sh->mutex, LOCK_CLASS_REGISTRY);
+
+    struct slot *s = slot_at(sh, local);
+    void *obj = s != NULL ? s->obj : NULL;
+    if (obj != NULL && hold != NULL)
+        hold(obj);
+
+    UNLOCK(&sh->mutex);
+    return obj;
+}
+
+/*
+ * Look up the object registered at an extension without taking the lock.
+ * Chunks are published after they are filled in, and never moved.
+ */
+void *registry_peek(REGISTRY *r, int ext)
+{
+    uint32_t local;
+    struct shard *sh = shard_of(r, ext, &local);
+
+    if (sh == NULL)
+        return NULL;
+
+    int nchunks = __atomic_load_n(&sh->nchunks, __ATOMIC_ACQUIRE);
+    if (local >= (uint32_t)nchunks * REGISTRY_CHUNK_SLOTS)
+        return NULL;
+    struct slot *chunk = sh->chunks[local / REGISTRY_CHUNK_SLOTS];
+    return __atomic_load_n(&chunk[local % REGISTRY_CHUNK_SLOTS].obj, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Look up the object for a handle.
+ *
+ * @return the object, or NULL if the handle is stale or invalid.
+ */
+void *registry_resolve(REGISTRY *r, REGISTRY_HANDLE handle, void (*hold)(void *))
+{
+    uint32_t gen = (uint32_t)(handle >> 32);
+    uint32_t local;
+    struct shard *sh = shard_of(r, registry_handle_extension(handle), &local);
+
+    if (sh == NULL)
+        return NULL;
+
+    LOCK(&sh->mutex, LOCK_CLASS_REGISTRY);
+
+    struct slot *s = slot_at(sh, local);
+    void *obj = s != NULL && s->gen == gen ? s->obj : NULL;
+    if (obj != NULL && hold != NULL)
+        hold(obj);
+
+    UNLOCK(&sh->mutex);
+    return obj;
+}
+
+/*
+ * Get the extension number designated by a handle.
+ */
+int registry_handle_extension(REGISTRY_HANDLE handle)
+{
+    return (int)(uint32_t)handle + REGISTRY_FIRST_EXTENSION;
+}
+
+/*
+ * Get the number of objects currently registered.
+ */
+int registry_count(REGISTRY *r)
+{
+    int count = 0;
+
+    for (int s = 0; s < r->nshards; s++)
+        count += __atomic_load_n(&r->shards[s].count, __ATOMIC_RELAXED);
+    return count;
+}
+
+/*
+ * Get the number of shards of a registry.
+ */
+int registry_shards(REGISTRY *r)
+{
+    return r->nshards;
+}
+
+/*
+ * Get the shard that holds an extension.
+ */
+int registry_shard(REGISTRY *r, int ext)
+{
+    if (ext < REGISTRY_FIRST_EXTENSION)
+        return -1;
+    return (int)((uint32_t)(ext - REGISTRY_FIRST_EXTENSION) % r->nshards);
+}
+
+/*
+ * Find the shard of an extension and the local index of its slot there.
+ *
+ * @return the shard, or NULL if the extension is below the first one.
+ */
+static struct shard *shard_of(REGISTRY *r, int ext, uint32_t *local)
+{
+    if (ext < REGISTRY_FIRST_EXTENSION)
+        return NULL;
+
+    uint32_t index = ext - REGISTRY_FIRST_EXTENSION;
+    *local = index / r->nshards;
+    return &r->shards[index % r->nshards];
+}
+
+/*
+ * Get the slot with a given local index in a shard, or NULL if the shard's
+ * table does not extend that far.
+ */
+static struct slot *slot_at(struct shard *sh, uint32_t local)
+{
+    if (local >= (uint32_t)sh->nchunks * REGISTRY_CHUNK_SLOTS)
+        return NULL;
+    return &sh->chunks[local / REGISTRY_CHUNK_SLOTS][local % REGISTRY_CHUNK_SLOTS];
+}
+
+/*
+ * Add a chunk of slots to a shard and put them on its free list.
+ *
+ * @return 0 on success, -1 if the shard is at its maximum size.
+ */
+static int grow(struct shard *sh)
+{
+    if (sh->nchunks == REGISTRY_MAX_CHUNKS)
+        return -1;
+
+    debug("Growing registry shard to %d chunks", sh->nchunks + 1);
+
+    uint32_t base = (uint32_t)sh->nchunks * REGISTRY_CHUNK_SLOTS;
+    struct slot *chunk = Calloc(REGISTRY_CHUNK_SLOTS, sizeof(struct slot));
+    sh->chunks[sh->nchunks] = chunk;
+    // Published last, for registry_peek().
+    __atomic_store_n(&sh->nchunks, sh->nchunks + 1, __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < REGISTRY_CHUNK_SLOTS; i++)
+    {
+        chunk[i].gen = 1;
+        free_list_push(sh, base + i);
+    }
+    return 0;
+}
+
+/*
+ * Append a slot to the tail of a shard's free list.
+ */
+static void free_list_push(struct shard *sh, uint32_t local)
+{
+    struct slot *s = slot_at(sh, local);
+
+    s->next_free = NO_SLOT;
+    s->prev_free = sh->free_tail;
+    if (sh->free_tail != NO_SLOT)
+        slot_at(sh, sh->free_tail)->next_free = local;
+    else
+        sh->free_head = local;
+    sh->free_tail = local;
+}
+
+/*
+ * Remove a slot from a shard's free list.
+ */
+static void free_list_unlink(struct shard *sh, uint32_t local)
+{
+    struct slot *s = slot_at(sh, local);
+
+    if (s->prev_free != NO_SLOT)
+        slot_at(sh, s->prev_free)->next_free = s->next_free;
+    else
+        sh->free_head = s->next_free;
+
+    if (s->next_free != NO_SLOT)
+        slot_at(sh, s->next_free)->prev_free = s->prev_free;
+    else
+        sh->free_tail = s->prev_free;
+}
+
+/*
+ * Store an object in a slot that has been taken off the free list.
+ *
+ * @return the extension number of the slot.
+ */
+static int occupy(REGISTRY *r, struct shard *sh, uint32_t local, void *obj, REGISTRY_HANDLE *handle)
+{
+    struct slot *s = slot_at(sh, local);
+    uint32_t index = local * r->nshards + (uint32_t)(sh - r->shards);
+
+    __atomic_store_n(&s->obj, obj, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&sh->count, 1, __ATOMIC_RELAXED);
+    if (handle != NULL)
+        *handle = (REGISTRY_HANDLE)s->gen << 32 | index;
+
+    return (int)index + REGISTRY_FIRST_EXTENSION;
+}
@@ -1,56 +1,385 @@
 #include "server.h"
+#include "service.h"
+#include "parser.h"
+#include "proto.h"
+#include "outq.h"
+#include "iostats.h"
+#include "metrics.h"
+#include "conf.h"
+#include "pool.h"
+#include "trunk.h"
 #include "debug.h"
 #include "pbx.h"
 #include "csapp.h"
 
+static int execute_command(TU *tu, int cmd, int ext,
+                           char *msg, size_t len);
+static void relay(TU *tu, PARSER *parser, char *data, size_t len, int last);
+
+/*
+ * Whether a chat relayed by this thread waits for the peer's queue to drain
+ * before each part.  Only a thread serving one client may block on another.
+ */
+static __thread int relay_waits;
+
+static pthread_once_t arg_pool_once = PTHREAD_ONCE_INIT;
+static POOL *arg_pool;
+
+static void arg_pool_init(void)
+{
+    arg_pool = pool_create("client_arg", sizeof(int), __alignof__(int), NULL);
+}
+
+/*
+ * Get the argument of pbx_client_service() for a connection.
+ */
+int *pbx_client_arg(int connfd)
+{
+    Pthread_once(&arg_pool_once, arg_pool_init);
+
+    int *connfdp = pool_get(arg_pool);
+    *connfdp = connfd;
+    return connfdp;
+}
+
 void *pbx_client_service(void *arg)
 {
     debug("Inside server.c");
 
     int connfd = *((int *)arg);
     Pthread_detach(pthread_self());
-    Free(arg);
+    pool_put(arg_pool, arg);
 
+    uint64_t start = metrics_now();
     TU *tu_client = pbx_register(pbx, connfd);
-    FILE *file = Fdopen(connfd, "r");
-    char command[MAXBUF];
-    int stat = -1;
+    metrics_record(METRIC_REGISTER, start);
+    if (tu_client == NULL)
+    {
+        Close(connfd);
+        return NULL;
+    }
+
+    PARSER parser;
+    parser_init(&parser, connfd);
+    relay_waits = 1;
+
+    while (parser_fill(&parser) > 0)
+        pbx_dispatch_lines(tu_client, &parser);
 
-    while (1)
+    debug("Exited the loop");
+    pbx_dispatch_end(tu_client, &parser);
+    start = metrics_now();
+    pbx_unregister(pbx, tu_client);
+    metrics_record(METRIC_UNREGISTER, start);
+    Close(connfd);
+
+    return NULL;
+}
+
+/*
+ * Parse a single command line received from a client.  The command is
+ * identified from its first character and length, so each line is
+ * examined only once.
+ *
+ * @param line  NUL-terminated command text, without the EOL sequence.
+ * @param len  Length of the command text.
+ * @param cmd  Set to the command that was recognized.
+ * @param arg  Set to the argument text of a dial, chat or join command.
+ * @return 0 if a command was recognized, otherwise -1.
+ */
+int pbx_parse_command(char *line, size_t len, int *cmd, char **arg)
+{
+    switch (line[0])
     {
-        strcpy(command, "");
-        fscanf(file, " %[^\r\n]s", command);
-        debug("String read: %s\n", command);
-        if (feof(file))
-            break;
+    case 'p':
+        if (len == 6 && memcmp(line, tu_command_names[TU_PICKUP_CMD], 6) == 0)
+        {
+            *cmd = TU_PICKUP_CMD;
+            return 0;
+        }
+        break;
 
-        if (strcmp(command, tu_command_names[TU_PICKUP_CMD]) == 0)
+    case 'h':
+        if (len == 6 && memcmp(line, tu_command_names[TU_HANGUP_CMD], 6) == 0)
         {
-            stat = tu_pickup(tu_client);
-            debug("tu_pickup status: %d", stat);
+            *cmd = TU_HANGUP_CMD;
+            return 0;
         }
-        else if (strcmp(command, tu_command_names[TU_HANGUP_CMD]) == 0)
+        break;
+
+    case 'd':
+        if (len >= 6 && memcmp(line, tu_command_names[TU_DIAL_CMD], 4) == 0)
         {
-            stat = tu_hangup(tu_client);
-            debug("tu_hangup status: %d", stat);
+            *cmd = TU_DIAL_CMD;
+            *arg = line + 4;
+            return 0;
         }
-        else if (strncmp(command, tu_command_names[TU_DIAL_CMD], 4) == 0 && strlen(command) >= 6)
+        break;
+
+    case 'c':
+        if (len >= 4 && memcmp(line, tu_command_names[TU_CHAT_CMD], 4) == 0)
         {
-            stat = tu_dial(tu_client, atoi(command + 4));
-            debug("tu_dial status: %d", stat);
+            *cmd = TU_CHAT_CMD;
+            *arg = len > 4 ? line + 5 : line + 4;
+            return 0;
         }
-        else if (strncmp(command, tu_command_names[TU_CHAT_CMD], 4) == 0)
+        break;
+
+    case 'j':
+        if (len >= 6 && memcmp(line, "join ", 5) == 0)
         {
-            stat = tu_chat(tu_client, command + 5);
-            debug("tu_chat status: %d", stat);
+            *cmd = TU_JOIN_CMD;
+            *arg = line + 5;
+            return 0;
         }
+        break;
     }
 
-    stat++;
+    return -1;
+}
 
-    debug("Exited the loop");
-    pbx_unregister(pbx, tu_client);
-    Fclose(file);
+/*
+ * Parse a single command line received from a client and carry it out
+ * on the given TU.
+ *
+ * @param tu  The TU on whose behalf the command is issued.
+ * @param line  NUL-terminated command text, without the EOL sequence.
+ * @param len  Length of the command text.
+ * @return the status of the tu_xxx function, or -1 if not recognized.
+ */
+int pbx_dispatch_command(TU *tu, char *line, size_t len)
+{
+    int cmd;
+    char *arg;
 
-    return NULL;
-}
\ No newline at end of file
+    IOSTATS_COUNT(commands);
+    if (pbx_parse_command(line, len, &cmd, &arg) < 0)
+        return -1;
+
+    // The number dialed is routed by the dial plan, if one is installed,
+    // possibly to a trunk.
+    int ext = cmd == TU_DIAL_CMD ? trunk_dial(tu, arg) : cmd == TU_JOIN_CMD ? atoi(arg) : 0;
+    return execute_command(tu, cmd, ext, arg, cmd == TU_CHAT_CMD ? len - (arg - line) : 0);
+}
+
+/*
+ * Carry out a single command frame of the binary protocol on the given TU.
+ *
+ * @param tu  The TU on whose behalf the command is issued.
+ * @param op  The opcode of the frame.
+ * @param payload  The payload, NUL-terminated.
+ * @param len  Length of the payload.
+ * @return the status of the tu_xxx function, or -1 if not recognized.
+ */
+int pbx_dispatch_frame(TU *tu, int op, char *payload, size_t len)
+{
+    uint32_t ext;
+
+    IOSTATS_COUNT(commands);
+    switch (op)
+    {
+    case PROTO_OP_PICKUP:
+        return execute_command(tu, TU_PICKUP_CMD, 0, NULL, 0);
+    case PROTO_OP_HANGUP:
+        return execute_command(tu, TU_HANGUP_CMD, 0, NULL, 0);
+    case PROTO_OP_DIAL:
+        if (len != sizeof(ext))
+            return -1;
+        memcpy(&ext, payload, sizeof(ext));
+        return execute_command(tu, TU_DIAL_CMD, trunk_dial_number(tu, (int)ntohl(ext)), NULL, 0);
+    case PROTO_OP_JOIN:
+        if (len != sizeof(ext))
+            return -1;
+        memcpy(&ext, payload, sizeof(ext));
+        return execute_command(tu, TU_JOIN_CMD, (int)ntohl(ext), NULL, 0);
+    case PROTO_OP_CHAT:
+        return execute_command(tu, TU_CHAT_CMD, 0, payload, len);
+    }
+
+    return -1;
+}
+
+/*
+ * Carry out every complete command buffered by a parser.  The commands
+ * are dispatched as one batch of output, so that the notifications they
+ * cause are sent with one call per connection.  The protocol of the
+ * connection is decided by the first byte received on it.
+ *
+ * A chat too long for the parser's buffer (a text line that fills it, or
+ * a message sent as CHAT_PART frames) is relayed to the peer as it is
+ * received, from the parser's buffer, rather than discarded.
+ *
+ * @param tu  The TU on whose behalf the commands are issued.
+ * @param parser  The parser holding the input from the TU's client.
+ */
+void pbx_dispatch_lines(TU *tu, PARSER *parser)
+{
+    char *line;
+    size_t len;
+    int op;
+
+    outq_batch_begin();
+
+    if (parser->protocol == PROTO_UNKNOWN && parser->end > parser->start)
+    {
+        if ((unsigned char)parser->buf[parser->start] == PROTO_MAGIC)
+        {
+            parser->start++;
+            parser->protocol = PROTO_BINARY;
+            tu_set_protocol(tu, PROTO_BINARY);
+            debug("Binary protocol on fd %d", parser->fd);
+        }
+        else
+        {
+            parser->protocol = PROTO_TEXT;
+        }
+    }
+
+    if (parser->protocol == PROTO_BINARY)
+    {
+        while ((line = parser_next_frame(parser, &op, &len)) != NULL)
+        {
+            if (op == PROTO_OP_CHAT_PART)
+                relay(tu, parser, line, len, 0);
+            else if (op == PROTO_OP_CHAT && parser->chat != NULL)
+                relay(tu, parser, line, len, 1);
+            else
+            {
+                pbx_dispatch_end(tu, parser);
+                pbx_dispatch_frame(tu, op, line, len);
+            }
+        }
+    }
+    else
+    {
+        int cmd;
+        char *arg;
+        int last;
+
+        for (;;)
+        {
+            if (parser->chat != NULL)
+            {
+                if ((line = parser_next_part(parser, &len, &last)) == NULL)
+                    break;
+                relay(tu, parser, line, len, last);
+            }
+            else if ((line = parser_next(parser, &len)) != NULL)
+            {
+                debug("String read: %s", line);
+                pbx_dispatch_command(tu, line, len);
+            }
+            else if ((line = parser_partial(parser, &len)) != NULL &&
+                     len > 4 &&
+                     pbx_parse_command(line, len, &cmd, &arg) == 0 &&
+                     cmd == TU_CHAT_CMD)
+            {
+                parser->start = arg - parser->buf;
+                relay(tu, parser, NULL, 0, 0);
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    outq_batch_end();
+}
+
+/*
+ * End a chat being relayed in parts, if any, as when the client's
+ * connection closes before the end of its message.
+ *
+ * @param tu  The TU on whose behalf the commands were issued.
+ * @param parser  The parser holding the input from the TU's client.
+ */
+void pbx_dispatch_end(TU *tu, PARSER *parser)
+{
+    if (parser->chat != NULL)
+        relay(tu, parser, NULL, 0, 1);
+}
+
+/*
+ * Relay the next part of a chat to the peer, starting the chat first if
+ * it is not under way.  Once the stream has failed, the rest of the
+ * message is dropped.
+ *
+ * @param data  The part, or NULL.
+ * @param len  Its length.
+ * @param last  Nonzero if the part ends the message.
+ */
+static void relay(TU *tu, PARSER *parser, char *data, size_t len, int last)
+{
+    CHAT_STREAM *s = parser->chat;
+
+    if (s == NULL)
+    {
+        s = Malloc(sizeof(CHAT_STREAM));
+        s->wait = relay_waits;
+        IOSTATS_COUNT(commands);
+        uint64_t start = metrics_now();
+        if (tu_chat_open(tu, s) < 0)
+            s->token = 0;
+        metrics_record(METRIC_CHAT, start);
+        debug("Relaying chat: %s", s->token ? "open" : "dropped");
+        parser->chat = s;
+    }
+
+    if (s->token != 0 && len > 0 && tu_chat_write(tu, s, data, len) < 0)
+        tu_chat_close(tu, s);
+
+    if (last)
+    {
+        if (s->token != 0)
+            tu_chat_close(tu, s);
+        Free(s);
+        parser->chat = NULL;
+    }
+}
+
+/*
+ * Carry out a command, whichever protocol it was received in.
+ *
+ * @param ext  The extension of a dial command, or the bridge of a join.
+ * @param msg  The message of a chat command.
+ * @param len  Its length.
+ * @return the status of the tu_xxx function.
+ */
+static int execute_command(TU *tu, int cmd, int ext,
+                           char *msg, size_t len)
+{
+    int stat = -1;
+
+    uint64_t start = metrics_now();
+    switch (cmd)
+    {
+    case TU_PICKUP_CMD:
+        stat = tu_pickup(tu);
+        metrics_record(METRIC_PICKUP, start);
+        debug("tu_pickup status: %d", stat);
+        break;
+    case TU_HANGUP_CMD:
+        stat = tu_hangup(tu);
+        metrics_record(METRIC_HANGUP, start);
+        debug("tu_hangup status: %d", stat);
+        break;
+    case TU_DIAL_CMD:
+        stat = tu_dial(tu, ext);
+        metrics_record(METRIC_DIAL, start);
+        debug("tu_dial status: %d", stat);
+        break;
+    case TU_CHAT_CMD:
+        stat = tu_chat_send(tu, msg, len);
+        metrics_record(METRIC_CHAT, start);
+        debug("tu_chat status: %d", stat);
+        break;
+    case TU_JOIN_CMD:
+        stat = tu_join(tu, ext);
+        metrics_record(METRIC_JOIN, start);
+        debug("tu_join status: %d", stat);
+        break;
+    }
+
+    return stat;
+}
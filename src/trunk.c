@@ -0,0 +1,730 @@
+#include <netinet/tcp.h>
+
+#include "trunk.h"
+#include "dialplan.h"
+#include "proto.h"
+#include "outq.h"
+#include "parser.h"
+#include "lockprof.h"
+#include "log.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define TRUNK_REF_SIZE 4
+#define TRUNK_MAX_DATA (PROTO_MAX_PAYLOAD - TRUNK_REF_SIZE)
+#define TRUNK_BUCKETS 4096          // Of the calls of an incoming trunk, by reference
+
+typedef struct link LINK;
+
+/*
+ * A call carried by a trunk, at one end.  Its proxy is registered with the
+ * descriptor OUTQ_VIRTUAL_FD + index, by which the sink finds the call.
+ *
+ * The notifications of the proxy are decoded by the sink, under the lock
+ * of the proxy's output queue, which is all that the decoder state and
+ * the flags set by the sink need.  The call is freed only by the thread
+ * serving its trunk, after its proxy is unregistered, so that the sink is
+ * done with it.
+ */
+typedef struct call
+{
+    int index;                  // In calls[]
+    uint32_t ref;               // Given by the switch that placed the call
+    int outgoing;               // Placed by this switch
+    LINK *link;
+    TU *proxy;
+    char digits[DIALPLAN_MAX_DIGITS + 1];  // Dialed on the other switch
+    int release_sent;           // RELEASE sent, or the call released here
+    // Set by the sink:
+    int binary;                 // PROTO_MAGIC seen
+    int setup_sent;
+    int alerted;
+    int answered;
+    unsigned char frame[PROTO_HEADER_SIZE + 4];  // Notification being decoded
+    size_t have;                // Bytes of it received, up to the payload
+    size_t remaining;           // Bytes of its payload to come
+    // Set by the thread serving the trunk:
+    int chatting;               // 1 while a chat stream is open, -1 if dropped
+    CHAT_STREAM chat;
+    struct call *prev;          // In the calls of the trunk
+    struct call *next;
+    struct call *next_ref;      // In its bucket, for an incoming trunk
+} CALL;
+
+/*
+ * A trunk, outgoing (connected by this switch, number > 0) or incoming
+ * (accepted on the trunk port, number 0).  It is served by a thread of its
+ * own, which reads and handles the messages from the other switch.
+ */
+struct link
+{
+    int number;
+    char *host;
+    char *port;
+    int fd;
+    OUTQ *out;
+    sem_t mutex;                // Protects up and the list of calls
+    int up;
+    CALL *calls;
+    CALL **by_ref;              // Buckets of the calls, for an incoming trunk
+    PARSER parser;
+};
+
+static pthread_once_t trunk_once = PTHREAD_ONCE_INIT;
+static LINK *links[TRUNK_MAX];
+static CALL *calls[TRUNK_MAX_CALLS];
+static sem_t slots_mutex;
+static int free_slots[TRUNK_MAX_CALLS];
+static int nfree;
+
+static void trunk_init(void);
+static void *trunk_accept_loop(void *arg);
+static void *trunk_connect_loop(void *arg);
+static void *trunk_incoming(void *arg);
+static void link_up(LINK *link, int fd);
+static void link_serve(LINK *link);
+static void link_down(LINK *link);
+static void link_message(LINK *link, int op, uint32_t ref, char *data, size_t len);
+static void call_setup(LINK *link, uint32_t ref, const char *digits, size_t len);
+static void call_chat(CALL *call, int op, const char *data, size_t len);
+static CALL *call_create(LINK *link, int outgoing, uint32_t ref, const char *digits, size_t len);
+static void call_destroy(CALL *call);
+static void call_release(CALL *call);
+static int trunk_send(LINK *link, int op, uint32_t ref, const void *data, size_t len);
+static void trunk_sink(int fd, const struct iovec *iov, int iovcnt);
+static void sink_decode(CALL *call, const unsigned char *data, size_t len);
+static void sink_state(CALL *call, int state);
+static void sink_release(CALL *call, int state);
+
+/*
+ * Set up the calls and take the output of the proxies.
+ */
+static void trunk_init(void)
+{
+    Sem_init(&slots_mutex, 0, 1);
+    for (int i = 0; i < TRUNK_MAX_CALLS; i++)
+        free_slots[i] = TRUNK_MAX_CALLS - 1 - i;
+    nfree = TRUNK_MAX_CALLS;
+    outq_set_sink(trunk_sink);
+}
+
+/*
+ * Accept incoming trunks on a port.
+ */
+int trunk_listen(char *port)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t tid;
+
+    Pthread_once(&trunk_once, trunk_init);
+
+    int sock = open_listenfd(port);
+    if (sock < 0)
+    {
+        fprintf(stderr, "Unable to listen for trunks on port %s\n", port);
+        return -1;
+    }
+    getsockname(sock, (struct sockaddr *)&addr, &addrlen);
+    int bound = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+
+    int *sockp = Malloc(sizeof(int));
+    *sockp = sock;
+    Pthread_create(&tid, NULL, trunk_accept_loop, sockp);
+    Pthread_detach(tid);
+
+    debug("Listening for trunks on port %d", bound);
+    return bound;
+}
+
+/*
+ * Connect an outgoing trunk, now and whenever the connection is lost.
+ */
+int trunk_connect(int number, char *host, char *port)
+{
+    pthread_t tid;
+
+    if (number < 1 || number >= TRUNK_MAX || links[number] != NULL)
+    {
+        fprintf(stderr, "Invalid or duplicate trunk number: %d\n", number);
+        return -1;
+    }
+    Pthread_once(&trunk_once, trunk_init);
+
+    LINK *link = Calloc(1, sizeof(LINK));
+    link->number = number;
+    link->host = host;
+    link->port = port;
+    link->fd = -1;
+    Sem_init(&link->mutex, 0, 1);
+    links[number] = link;
+
+    Pthread_create(&tid, NULL, trunk_connect_loop, link);
+    Pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * Get the extension for a TU to dial for a number dialed by its client,
+ * registering a proxy for a call on a trunk.
+ */
+int trunk_dial(TU *tu, const char *dialed)
+{
+    DIALPLAN_ROUTE route;
+    const char *rest = dialplan_resolve(dialed, &route);
+
+    if (route.kind != DIALPLAN_TRUNK)
+        return route.target;
+
+    LINK *link = route.target > 0 && route.target < TRUNK_MAX ? links[route.target] : NULL;
+    size_t len = strlen(rest);
+    if (link == NULL || len == 0 || len > DIALPLAN_MAX_DIGITS || tu_state(tu) != TU_DIAL_TONE)
+        return -1;
+
+    CALL *call = call_create(link, 1, 0, rest, len);
+    if (call == NULL)
+        return -1;
+
+    int ext = tu_extension(call->proxy);
+    log_info("event=trunk_call trunk=%d ext=%d proxy=%d digits=%s", link->number, tu_extension(tu), ext, call->digits);
+    return ext;
+}
+
+/*
+ * As trunk_dial(), for an extension number dialed in a binary frame.
+ */
+int trunk_dial_number(TU *tu, int number)
+{
+    char digits[16];
+
+    if (number < 0)
+        return number;
+    snprintf(digits, sizeof(digits), "%d", number);
+    return trunk_dial(tu, digits);
+}
+
+/*
+ * Thread function that accepts incoming trunks, each of which is served
+ * by a thread of its own.
+ */
+static void *trunk_accept_loop(void *arg)
+{
+    int sock = *(int *)arg;
+    pthread_t tid;
+
+    Free(arg);
+    while (1)
+    {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                log_warn("event=trunk_accept_error error=\"%s\"", strerror(errno));
+            continue;
+        }
+
+        LINK *link = Calloc(1, sizeof(LINK));
+        link->by_ref = Calloc(TRUNK_BUCKETS, sizeof(CALL *));
+        Sem_init(&link->mutex, 0, 1);
+        link_up(link, fd);
+        Pthread_create(&tid, NULL, trunk_incoming, link);
+        Pthread_detach(tid);
+    }
+    return NULL;
+}
+
+/*
+ * Thread function serving an incoming trunk until it fails.
+ */
+static void *trunk_incoming(void *arg)
+{
+    LINK *link = arg;
+
+    link_serve(link);
+    link_down(link);
+    sem_destroy(&link->mutex);
+    Free(link->by_ref);
+    Free(link);
+    return NULL;
+}
+
+/*
+ * Thread function serving an outgoing trunk, which is connected again
+ * whenever it fails.
+ */
+static void *trunk_connect_loop(void *arg)
+{
+    LINK *link = arg;
+    int logged = 0;
+
+    while (1)
+    {
+        int fd = open_clientfd(link->host, link->port);
+        if (fd < 0)
+        {
+            if (!logged)
+                log_warn("event=trunk_connect_failed trunk=%d host=%s port=%s", link->number, link->host, link->port);
+            logged = 1;
+            usleep(TRUNK_RETRY_MS * 1000);
+            continue;
+        }
+
+        logged = 0;
+        link_up(link, fd);
+        link_serve(link);
+        link_down(link);
+    }
+    return NULL;
+}
+
+/*
+ * Put a trunk in service on a connection.
+ */
+static void link_up(LINK *link, int fd)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    link->fd = fd;
+    link->out = outq_create(fd);
+    parser_init(&link->parser, fd);
+
+    LOCK(&link->mutex, LOCK_CLASS_TRUNK);
+    link->up = 1;
+    UNLOCK(&link->mutex);
+    log_info("event=trunk_up trunk=%d fd=%d", link->number, fd);
+}
+
+/*
+ * Read and handle the messages on a trunk until its connection fails.
+ */
+static void link_serve(LINK *link)
+{
+    char *data;
+    size_t len;
+    int op;
+
+    while (parser_fill(&link->parser) > 0)
+    {
+        while ((data = parser_next_frame(&link->parser, &op, &len)) != NULL)
+        {
+            if (len < TRUNK_REF_SIZE)
+            {
+                debug("Trunk %d: short frame, op %d", link->number, op);
+                continue;
+            }
+            uint32_t ref;
+            memcpy(&ref, data, TRUNK_REF_SIZE);
+            link_message(link, op, ntohl(ref), data + TRUNK_REF_SIZE, len - TRUNK_REF_SIZE);
+        }
+    }
+}
+
+/*
+ * Take a trunk out of service: its calls are released, which the TUs in
+ * them are notified of as if the other end had hung up.
+ */
+static void link_down(LINK *link)
+{
+    LOCK(&link->mutex, LOCK_CLASS_TRUNK);
+    link->up = 0;
+    CALL *list = link->calls;
+    link->calls = NULL;
+    UNLOCK(&link->mutex);
+
+    int released = 0;
+    while (list != NULL)
+    {
+        CALL *call = list;
+        list = call->next;
+        __atomic_store_n(&call->release_sent, 1, __ATOMIC_SEQ_CST);
+        call_release(call);
+        released++;
+    }
+    if (link->by_ref != NULL)
+        memset(link->by_ref, 0, TRUNK_BUCKETS * sizeof(CALL *));
+
+    // No proxy of the trunk is left to send on the queue.
+    outq_destroy(link->out);
+    link->out = NULL;
+    close(link->fd);
+    link->fd = -1;
+    log_warn("event=trunk_down trunk=%d calls=%d", link->number, released);
+}
+
+/*
+ * Handle a message from the other end of a trunk.
+ */
+static void link_message(LINK *link, int op, uint32_t ref, char *data, size_t len)
+{
+    CALL *call = NULL;
+
+    if (link->by_ref == NULL)
+    {
+        if (ref < TRUNK_MAX_CALLS)
+            call = __atomic_load_n(&calls[ref], __ATOMIC_ACQUIRE);
+        if (call != NULL && call->link != link)
+            call = NULL;
+    }
+    else if (op == TRUNK_OP_SETUP)
+    {
+        call_setup(link, ref, data, len);
+        return;
+    }
+    else
+    {
+        for (call = link->by_ref[ref % TRUNK_BUCKETS]; call != NULL && call->ref != ref; call = call->next_ref)
+            ;
+    }
+
+    if (call == NULL)
+    {
+        debug("Trunk %d: no call for reference %u, op %d", link->number, ref, op);
+        return;
+    }
+
+    switch (op)
+    {
+    case TRUNK_OP_ALERT:
+        debug("Trunk %d: call %u alerting", link->number, ref);
+        break;
+    case TRUNK_OP_ANSWER:
+        if (!__atomic_load_n(&call->release_sent, __ATOMIC_SEQ_CST))
+            tu_pickup(call->proxy);
+        break;
+    case TRUNK_OP_CHAT:
+    case TRUNK_OP_CHAT_PART:
+        call_chat(call, op, data, len);
+        break;
+    case TRUNK_OP_RELEASE:
+        // A RELEASE that crosses ours stands for RELEASED.
+        if (!__atomic_exchange_n(&call->release_sent, 1, __ATOMIC_SEQ_CST))
+            trunk_send(link, TRUNK_OP_RELEASED, ref, NULL, 0);
+        log_info("event=trunk_release trunk=%d ref=%u cause=%s", link->number, ref,
+                 len > 0 && (unsigned char)data[0] <= TU_ERROR ? tu_state_names[(unsigned char)data[0]] : "none");
+        call_destroy(call);
+        break;
+    case TRUNK_OP_RELEASED:
+        call_destroy(call);
+        break;
+    default:
+        debug("Trunk %d: unknown op %d", link->number, op);
+        break;
+    }
+}
+
+/*
+ * Set up a call from the other end of an incoming trunk: a proxy picks up
+ * and dials the number, as a client of this switch would.
+ */
+static void call_setup(LINK *link, uint32_t ref, const char *digits, size_t len)
+{
+    unsigned char cause = TU_ERROR;
+
+    CALL *call = len > 0 && len <= DIALPLAN_MAX_DIGITS ? call_create(link, 0, ref, digits, len) : NULL;
+    if (call == NULL)
+    {
+        trunk_send(link, TRUNK_OP_RELEASE, ref, &cause, 1);
+        return;
+    }
+
+    CALL **bucket = &link->by_ref[ref % TRUNK_BUCKETS];
+    call->next_ref = *bucket;
+    *bucket = call;
+
+    log_info("event=trunk_setup ref=%u proxy=%d digits=%s", ref, tu_extension(call->proxy), call->digits);
+    tu_pickup(call->proxy);
+    tu_dial(call->proxy, trunk_dial(call->proxy, call->digits));
+}
+
+/*
+ * Relay a chat, or part of one, from the other end of a call to the TU
+ * connected to its proxy.  A chat in parts is relayed as they arrive, on a
+ * chat stream, so that its length is not bounded.
+ */
+static void call_chat(CALL *call, int op, const char *data, size_t len)
+{
+    if (op == TRUNK_OP_CHAT && call->chatting == 0)
+    {
+        tu_chat_send(call->proxy, data, len);
+        return;
+    }
+
+    if (call->chatting == 0)
+    {
+        // The thread of a trunk must not wait on any one client.
+        call->chat.wait = 0;
+        call->chatting = tu_chat_open(call->proxy, &call->chat) == 0 ? 1 : -1;
+    }
+    if (call->chatting > 0 && len > 0)
+        tu_chat_write(call->proxy, &call->chat, data, len);
+    if (op == TRUNK_OP_CHAT)
+    {
+        if (call->chatting > 0)
+            tu_chat_close(call->proxy, &call->chat);
+        call->chatting = 0;
+    }
+}
+
+/*
+ * Create a call on a trunk and register its proxy.
+ *
+ * @param outgoing  Whether the call is placed by this switch, in which
+ * case its reference is its index.
+ * @return the call, or NULL if the trunk is down or no call can be added.
+ */
+static CALL *call_create(LINK *link, int outgoing, uint32_t ref, const char *digits, size_t len)
+{
+    LOCK(&slots_mutex, LOCK_CLASS_TRUNK);
+    int index = nfree > 0 ? free_slots[--nfree] : -1;
+    UNLOCK(&slots_mutex);
+    if (index < 0)
+    {
+        log_warn("event=trunk_full trunk=%d", link->number);
+        return NULL;
+    }
+
+    CALL *call = Calloc(1, sizeof(CALL));
+    call->index = index;
+    call->ref = outgoing ? (uint32_t)index : ref;
+    call->outgoing = outgoing;
+    call->link = link;
+    memcpy(call->digits, digits, len);
+    call->digits[len] = '\0';
+    __atomic_store_n(&calls[index], call, __ATOMIC_RELEASE);
+
+    if ((call->proxy = pbx_register(pbx, OUTQ_VIRTUAL_FD + index)) == NULL)
+    {
+        call_release(call);
+        return NULL;
+    }
+    tu_set_protocol(call->proxy, PROTO_BINARY);
+
+    LOCK(&link->mutex, LOCK_CLASS_TRUNK);
+    int up = link->up;
+    if (up)
+    {
+        call->next = link->calls;
+        if (link->calls != NULL)
+            link->calls->prev = call;
+        link->calls = call;
+    }
+    UNLOCK(&link->mutex);
+
+    if (!up)
+    {
+        call_release(call);
+        return NULL;
+    }
+    return call;
+}
+
+/*
+ * Take a call off its trunk and release it.
+ */
+static void call_destroy(CALL *call)
+{
+    LINK *link = call->link;
+
+    LOCK(&link->mutex, LOCK_CLASS_TRUNK);
+    if (call->prev != NULL)
+        call->prev->next = call->next;
+    else
+        link->calls = call->next;
+    if (call->next != NULL)
+        call->next->prev = call->prev;
+    UNLOCK(&link->mutex);
+
+    if (link->by_ref != NULL)
+    {
+        CALL **p = &link->by_ref[call->ref % TRUNK_BUCKETS];
+        while (*p != call)
+            p = &(*p)->next_ref;
+        *p = call->next_ref;
+    }
+
+    call_release(call);
+}
+
+/*
+ * Unregister the proxy of a call, which hangs up the TU connected to it,
+ * and free the call.
+ */
+static void call_release(CALL *call)
+{
+    if (call->proxy != NULL)
+    {
+        if (call->chatting > 0)
+            tu_chat_close(call->proxy, &call->chat);
+        pbx_unregister(pbx, call->proxy);
+    }
+
+    __atomic_store_n(&calls[call->index], NULL, __ATOMIC_RELEASE);
+    LOCK(&slots_mutex, LOCK_CLASS_TRUNK);
+    free_slots[nfree++] = call->index;
+    UNLOCK(&slots_mutex);
+    Free(call);
+}
+
+/*
+ * Send a message on a trunk.
+ *
+ * @param data  What follows the reference in the payload.
+ * @param len  Its length, at most TRUNK_MAX_DATA.
+ * @return the number of bytes sent or queued, or -1 on failure.
+ */
+static int trunk_send(LINK *link, int op, uint32_t ref, const void *data, size_t len)
+{
+    unsigned char header[PROTO_HEADER_SIZE + TRUNK_REF_SIZE];
+    uint32_t nref = htonl(ref);
+
+    header[0] = op;
+    header[1] = 0;
+    header[2] = (len + TRUNK_REF_SIZE) >> 8;
+    header[3] = (len + TRUNK_REF_SIZE) & 0xff;
+    memcpy(header + PROTO_HEADER_SIZE, &nref, TRUNK_REF_SIZE);
+
+    struct iovec iov[2] = {{.iov_base = header, .iov_len = sizeof(header)},
+                           {.iov_base = (void *)data, .iov_len = len}};
+    return outq_sendv(link->out, iov, len > 0 ? 2 : 1);
+}
+
+/*
+ * Sink taking the output of the proxies, which is decoded into messages
+ * to the other ends of their calls.
+ */
+static void trunk_sink(int fd, const struct iovec *iov, int iovcnt)
+{
+    int index = fd - OUTQ_VIRTUAL_FD;
+    CALL *call = index < TRUNK_MAX_CALLS ? __atomic_load_n(&calls[index], __ATOMIC_ACQUIRE) : NULL;
+
+    if (call == NULL)
+        return;
+    for (int i = 0; i < iovcnt; i++)
+        sink_decode(call, iov[i].iov_base, iov[i].iov_len);
+}
+
+/*
+ * Decode the notifications of a proxy, in the binary protocol after the
+ * text sent before it was switched.  Chats are passed on as they are
+ * decoded, in parts that fit a frame.
+ */
+static void sink_decode(CALL *call, const unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (!call->binary)
+        {
+            const unsigned char *magic = memchr(data, PROTO_MAGIC, len);
+            if (magic == NULL)
+                return;
+            call->binary = 1;
+            len -= magic + 1 - data;
+            data = magic + 1;
+            continue;
+        }
+
+        if (call->have < PROTO_HEADER_SIZE)
+        {
+            size_t n = PROTO_HEADER_SIZE - call->have < len ? PROTO_HEADER_SIZE - call->have : len;
+            memcpy(call->frame + call->have, data, n);
+            call->have += n;
+            data += n;
+            len -= n;
+            if (call->have < PROTO_HEADER_SIZE)
+                return;
+
+            call->remaining = (size_t)call->frame[2] << 8 | call->frame[3];
+            if (call->remaining == 0)
+            {
+                if (call->frame[0] == PROTO_OP_CHAT)
+                    trunk_send(call->link, TRUNK_OP_CHAT, call->ref, NULL, 0);
+                call->have = 0;
+            }
+            continue;
+        }
+
+        int op = call->frame[0];
+        size_t n = call->remaining < len ? call->remaining : len;
+        if (op == PROTO_OP_CHAT || op == PROTO_OP_CHAT_PART)
+        {
+            if (n > TRUNK_MAX_DATA)
+                n = TRUNK_MAX_DATA;
+            call->remaining -= n;
+            trunk_send(call->link, op == PROTO_OP_CHAT && call->remaining == 0 ? TRUNK_OP_CHAT : TRUNK_OP_CHAT_PART,
+                       call->ref, data, n);
+        }
+        else
+        {
+            size_t room = sizeof(call->frame) - call->have;
+            memcpy(call->frame + call->have, data, n < room ? n : room);
+            call->have += n < room ? n : room;
+            call->remaining -= n;
+            if (call->remaining == 0 && op >= PROTO_OP_STATE && op <= PROTO_OP_STATE + TU_ERROR)
+                sink_state(call, op - PROTO_OP_STATE);
+        }
+        data += n;
+        len -= n;
+        if (call->remaining == 0)
+            call->have = 0;
+    }
+}
+
+/*
+ * Pass on a change of state of a proxy, as its call progresses at this
+ * end.  The same state may be notified again, e.g. after a chat.
+ */
+static void sink_state(CALL *call, int state)
+{
+    if (call->outgoing)
+    {
+        // Rung by the caller: place the call.
+        if (state == TU_RINGING && !call->setup_sent)
+        {
+            call->setup_sent = 1;
+            trunk_send(call->link, TRUNK_OP_SETUP, call->ref, call->digits, strlen(call->digits));
+        }
+        else if ((state == TU_ON_HOOK || state == TU_DIAL_TONE) && call->setup_sent)
+            sink_release(call, state);
+        return;
+    }
+
+    switch (state)
+    {
+    case TU_RING_BACK:
+        if (!call->alerted)
+        {
+            call->alerted = 1;
+            trunk_send(call->link, TRUNK_OP_ALERT, call->ref, NULL, 0);
+        }
+        break;
+    case TU_CONNECTED:
+        if (!call->answered)
+        {
+            call->answered = 1;
+            trunk_send(call->link, TRUNK_OP_ANSWER, call->ref, NULL, 0);
+        }
+        break;
+    case TU_BUSY_SIGNAL:
+    case TU_ERROR:
+        sink_release(call, state);
+        break;
+    case TU_DIAL_TONE:
+        // The callee has hung up, or stopped ringing.
+        if (call->alerted)
+            sink_release(call, state);
+        break;
+    }
+}
+
+/*
+ * Release a call from this end, unless it has been released already.  The
+ * proxy stays registered until the other end has released the call too.
+ *
+ * @param state  The state of the proxy that ended the call.
+ */
+static void sink_release(CALL *call, int state)
+{
+    unsigned char cause = state;
+
+    if (!__atomic_exchange_n(&call->release_sent, 1, __ATOMIC_SEQ_CST))
+        trunk_send(call->link, TRUNK_OP_RELEASE, call->ref, &cause, 1);
+}
@@ -0,0 +1,613 @@
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "listener.h"
+#include "service.h"
+#include "parser.h"
+#include "outq.h"
+#include "iostats.h"
+#include "metrics.h"
+#include "pool.h"
+#include "registry.h"
+#include "shard.h"
+#include "debug.h"
+#include "pbx.h"
+#include "csapp.h"
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUFFERS 256       // Buffers provided for receiving, a power of 2
+#define URING_BUFFER_SIZE 4096
+#define URING_BGID 0
+
+/*
+ * Delay after which a ring waiting for completions checks its deferred
+ * closes again (see defer_close()).
+ */
+#define URING_CLOSE_POLL_NS 1000000
+
+/*
+ * Size of the send requests kept in a pool; a larger one is allocated.
+ */
+#define URING_SEND_POOLED 512
+
+/*
+ * The low bits of the user data of a request tell what it is for; the rest
+ * is a pointer to a struct conn (recv) or struct send (send).
+ */
+#define TAG_RECV 0
+#define TAG_SEND 1
+#define TAG_ACCEPT 2
+#define TAG_DOORBELL 3          // Poll of the doorbell of the ring's shard
+#define TAG_MASK 3
+
+/*
+ * Per-connection state owned by a ring thread.
+ */
+struct conn
+{
+    int fd;
+    TU *tu;
+    PARSER parser;
+};
+
+/*
+ * Output handed over by an output queue, being sent by the kernel.
+ */
+struct send
+{
+    OUTQ *q;
+    size_t len;
+    char data[];
+};
+
+/*
+ * A descriptor waiting to be closed.  A send request for it may have been
+ * prepared by another ring before its connection was unregistered, and
+ * closing it before that ring submits the request would let the request
+ * reach whatever connection reuses the descriptor.  It is closed once
+ * every ring has submitted all it had prepared when it was deferred.
+ */
+struct closing
+{
+    int fd;
+    unsigned tails[URING_MAX_THREADS];
+    struct closing *next;
+};
+
+struct ring
+{
+    int fd;
+    int listenfd;
+    pthread_t tid;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned sq_tail;           // Local copy of *sq_ktail
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    struct io_uring_sqe *sqes;
+    unsigned cq_mask;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned buf_tail;
+    struct closing *closing;
+    int doorbell;               // Of the PBX shard of the same number, or -1
+};
+
+static struct ring rings[URING_MAX_THREADS];
+static int num_rings;
+static __thread struct ring *local_ring;
+static POOL *conn_pool;
+static POOL *send_pool;
+static POOL *closing_pool;
+
+/*
+ * Every ring reads the submission queues of the others (see struct
+ * closing), so none of them starts serving until they are all set up.
+ */
+static sem_t ready;
+static sem_t started;
+static int setup_failed;
+
+static void *ring_loop(void *arg);
+static int ring_setup(struct ring *r);
+static int ring_enter(struct ring *r, unsigned wait, int timeout);
+static struct io_uring_sqe *ring_sqe(struct ring *r);
+static void ring_push(struct ring *r);
+static void arm_accept(struct ring *r);
+static void arm_recv(struct ring *r, struct conn *conn);
+static void arm_doorbell(struct ring *r);
+static void handle_completion(struct ring *r, struct io_uring_cqe *cqe);
+static void conn_open(struct ring *r, int fd);
+static int conn_received(struct ring *r, struct conn *conn, struct io_uring_cqe *cqe);
+static void conn_close(struct ring *r, struct conn *conn);
+static void recycle_buffer(struct ring *r, unsigned bid);
+static void submit_send(OUTQ *q, int fd, const void *data, size_t len);
+static void defer_close(struct ring *r, int fd);
+static void run_closes(struct ring *r);
+static void raise_fd_limit(void);
+
+/*
+ * Open the listening sockets and start the ring threads.
+ *
+ * @return the port number being listened on, or -1 on failure.
+ */
+int uring_start(char *port, int nthreads)
+{
+    int fds[URING_MAX_THREADS];
+
+    debug("Entered uring_start | port: %s | threads: %d", port, nthreads);
+
+    if (nthreads < 1 || nthreads > URING_MAX_THREADS)
+        return -1;
+
+    raise_fd_limit();
+
+    int bound = listener_open(port, nthreads, fds);
+    if (bound < 0)
+        return -1;
+
+    Sem_init(&ready, 0, 0);
+    Sem_init(&started, 0, 0);
+    conn_pool = pool_create("conn", sizeof(struct conn), __alignof__(struct conn), NULL);
+    send_pool = pool_create("uring_send", URING_SEND_POOLED, __alignof__(struct send), NULL);
+    closing_pool = pool_create("closing", sizeof(struct closing), __alignof__(struct closing), NULL);
+    num_rings = nthreads;
+    for (int i = 0; i < nthreads; i++)
+    {
+        rings[i].listenfd = fds[i];
+        Pthread_create(&rings[i].tid, NULL, ring_loop, &rings[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        P(&ready);
+    for (int i = 0; i < nthreads; i++)
+        V(&started);
+
+    if (setup_failed)
+    {
+        fprintf(stderr, "Unable to set up io_uring\n");
+        return -1;
+    }
+
+    debug("Exiting uring_start | port: %d", bound);
+    return bound;
+}
+
+/*
+ * Event loop run by each ring thread.  Every pass submits what the last
+ * one prepared and waits for completions in a single system call, then
+ * handles the completions as one batch of output.
+ */
+static void *ring_loop(void *arg)
+{
+    struct ring *r = arg;
+
+    if (ring_setup(r) < 0)
+        __atomic_store_n(&setup_failed, 1, __ATOMIC_RELAXED);
+    V(&ready);
+    P(&started);
+    if (__atomic_load_n(&setup_failed, __ATOMIC_RELAXED))
+        return NULL;
+
+    local_ring = r;
+    outq_set_submitter(submit_send);
+    // The TUs of a ring's connections are registered in its own shard,
+    // whose messages it handles.
+    registry_set_home(r - rings);
+    arm_accept(r);
+    if ((r->doorbell = pbx_shard_claim(pbx, r - rings)) >= 0)
+        arm_doorbell(r);
+
+    while (1)
+    {
+        ring_enter(r, 1, r->closing != NULL);
+        run_closes(r);
+
+        unsigned head = *r->cq_khead;
+        unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+
+        outq_batch_begin();
+        for (; head != tail; head++)
+            handle_completion(r, &r->cqes[head & r->cq_mask]);
+        __atomic_store_n(r->cq_khead, head, __ATOMIC_RELEASE);
+        outq_batch_end();
+    }
+
+    return NULL;
+}
+
+/*
+ * Create the calling thread's ring, map its queues and provide it with
+ * receive buffers.  The ring is set up for a single submitting thread
+ * whose completions are only processed when it waits for them, if the
+ * kernel supports that.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int ring_setup(struct ring *r)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+    if ((r->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params)) < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_CQ_ENTRIES;
+        r->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    }
+    if (r->fd < 0)
+    {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *queues = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (queues == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        return -1;
+    }
+
+    r->sq_entries = params.sq_entries;
+    r->sq_mask = *(unsigned *)(queues + params.sq_off.ring_mask);
+    r->sq_khead = (unsigned *)(queues + params.sq_off.head);
+    r->sq_ktail = (unsigned *)(queues + params.sq_off.tail);
+    r->sq_tail = *r->sq_ktail;
+    r->cq_mask = *(unsigned *)(queues + params.cq_off.ring_mask);
+    r->cq_khead = (unsigned *)(queues + params.cq_off.head);
+    r->cq_ktail = (unsigned *)(queues + params.cq_off.tail);
+    r->cqes = (struct io_uring_cqe *)(queues + params.cq_off.cqes);
+
+    // Submission queue entries are always used in order.
+    unsigned *array = (unsigned *)(queues + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    r->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buf_ring == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        return -1;
+    }
+    struct io_uring_buf_reg reg = {.ring_addr = (uintptr_t)r->buf_ring, .ring_entries = URING_BUFFERS,
+                                   .bgid = URING_BGID};
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        perror("io_uring_register");
+        return -1;
+    }
+    r->bufs = Malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    for (unsigned bid = 0; bid < URING_BUFFERS; bid++)
+        recycle_buffer(r, bid);
+
+    return 0;
+}
+
+/*
+ * Submit every request prepared, and wait for completions.
+ *
+ * @param wait  Number of completions to wait for.
+ * @param timeout  Whether to give up waiting after URING_CLOSE_POLL_NS.
+ * @return the number of requests submitted, or -1 on error.
+ */
+static int ring_enter(struct ring *r, unsigned wait, int timeout)
+{
+    struct __kernel_timespec ts = {.tv_nsec = URING_CLOSE_POLL_NS};
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    unsigned pending = r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+
+    if (timeout)
+        flags |= IORING_ENTER_EXT_ARG;
+
+    IOSTATS_COUNT(enters);
+    int n = syscall(__NR_io_uring_enter, r->fd, pending, wait, flags, timeout ? &arg : NULL, sizeof(arg));
+    if (n < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+        perror("io_uring_enter");
+    return n;
+}
+
+/*
+ * Get the next free submission queue entry, submitting what is queued if
+ * there is none.  The entry is cleared.
+ */
+static struct io_uring_sqe *ring_sqe(struct ring *r)
+{
+    while (r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) == r->sq_entries)
+        ring_enter(r, 0, 0);
+
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Queue the entry obtained from ring_sqe() for submission.  The tail is
+ * published at once, so that other rings see it when they defer a close.
+ */
+static void ring_push(struct ring *r)
+{
+    r->sq_tail++;
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(struct ring *r)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+    ring_push(r);
+}
+
+static void arm_recv(struct ring *r, struct conn *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t)conn | TAG_RECV;
+    ring_push(r);
+}
+
+static void arm_doorbell(struct ring *r)
+{
+    struct io_uring_sqe *sqe = ring_sqe(r);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->doorbell;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TAG_DOORBELL;
+    ring_push(r);
+}
+
+static void handle_completion(struct ring *r, struct io_uring_cqe *cqe)
+{
+    void *data = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+
+    switch (cqe->user_data & TAG_MASK)
+    {
+    case TAG_ACCEPT:
+        if (cqe->res >= 0)
+            conn_open(r, cqe->res);
+        else
+            debug("accept: %s", strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            arm_accept(r);
+        break;
+
+    case TAG_DOORBELL:
+    {
+        uint64_t count;
+        if (read(r->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("read doorbell");
+        pbx_shard_run(pbx, r - rings);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            arm_doorbell(r);
+        break;
+    }
+
+    case TAG_RECV:
+        if (conn_received(r, data, cqe) < 0)
+            conn_close(r, data);
+        break;
+
+    case TAG_SEND:
+    {
+        struct send *send = data;
+        outq_sent(send->q, send->len, cqe->res);
+        if (sizeof(struct send) + send->len <= URING_SEND_POOLED)
+            pool_put(send_pool, send);
+        else
+            Free(send);
+        break;
+    }
+    }
+}
+
+/*
+ * Register an accepted connection and start receiving from it.
+ */
+static void conn_open(struct ring *r, int fd)
+{
+    // As with the acceptor threads (see listener.c), output is already
+    // batched into whole messages.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    struct conn *conn = pool_get(conn_pool);
+    conn->fd = fd;
+    parser_init(&conn->parser, fd);
+    uint64_t start = metrics_now();
+    conn->tu = pbx_register(pbx, fd);
+    metrics_record(METRIC_REGISTER, start);
+    if (conn->tu == NULL)
+    {
+        pool_put(conn_pool, conn);
+        Close(fd);
+        return;
+    }
+
+    debug("Connection %d assigned to ring %ld", fd, r - rings);
+    arm_recv(r, conn);
+}
+
+/*
+ * Dispatch every complete command in the data received on a connection,
+ * and give the buffer back to the kernel.
+ *
+ * @return 0 if the connection is still open, -1 on EOF or error.
+ */
+static int conn_received(struct ring *r, struct conn *conn, struct io_uring_cqe *cqe)
+{
+    if (cqe->res == -ENOBUFS)
+    {
+        // Every buffer was in use; those handled since have been given back.
+        arm_recv(r, conn);
+        return 0;
+    }
+    if (cqe->res <= 0)
+        return -1;
+
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *data = r->bufs + bid * URING_BUFFER_SIZE;
+    size_t left = cqe->res;
+
+    while (left > 0)
+    {
+        size_t n = parser_feed(&conn->parser, data, left);
+        data += n;
+        left -= n;
+        pbx_dispatch_lines(conn->tu, &conn->parser);
+    }
+    recycle_buffer(r, bid);
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_recv(r, conn);
+    return 0;
+}
+
+/*
+ * Unregister the TU of a connection whose receive has ended, and close it
+ * once that is safe.
+ */
+static void conn_close(struct ring *r, struct conn *conn)
+{
+    debug("Closing connection %d", conn->fd);
+
+    pbx_dispatch_end(conn->tu, &conn->parser);
+    uint64_t start = metrics_now();
+    pbx_unregister(pbx, conn->tu);
+    metrics_record(METRIC_UNREGISTER, start);
+    defer_close(r, conn->fd);
+    pool_put(conn_pool, conn);
+}
+
+/*
+ * Give a receive buffer back to the kernel.
+ */
+static void recycle_buffer(struct ring *r, unsigned bid)
+{
+    struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uintptr_t)(r->bufs + bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Output submitter of the ring threads (see outq_set_submitter()).  The
+ * request is prepared on the calling thread's ring, under the queue's
+ * mutex, so it is always prepared before the queue can be destroyed.
+ */
+static void submit_send(OUTQ *q, int fd, const void *data, size_t len)
+{
+    struct ring *r = local_ring;
+    struct send *send;
+    if (sizeof(struct send) + len <= URING_SEND_POOLED)
+        send = pool_get(send_pool);
+    else
+        send = Malloc(sizeof(struct send) + len);
+
+    send->q = q;
+    send->len = len;
+    memcpy(send->data, data, len);
+
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)send->data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t)send | TAG_SEND;
+    ring_push(r);
+}
+
+/*
+ * Close a descriptor once no ring can still have a request for it that it
+ * has not submitted.  The connection's queue has been destroyed, so no
+ * request for it is prepared from now on.
+ */
+static void defer_close(struct ring *r, int fd)
+{
+    struct closing *c = pool_get(closing_pool);
+
+    c->fd = fd;
+    for (int i = 0; i < num_rings; i++)
+        c->tails[i] = __atomic_load_n(rings[i].sq_ktail, __ATOMIC_ACQUIRE);
+    c->next = r->closing;
+    r->closing = c;
+}
+
+/*
+ * Close the descriptors whose requests have all been submitted.
+ */
+static void run_closes(struct ring *r)
+{
+    struct closing **prev = &r->closing;
+
+    while (*prev != NULL)
+    {
+        struct closing *c = *prev;
+        int i;
+
+        for (i = 0; i < num_rings; i++)
+        {
+            if ((int)(__atomic_load_n(rings[i].sq_khead, __ATOMIC_ACQUIRE) - c->tails[i]) < 0)
+                break;
+        }
+        if (i < num_rings)
+        {
+            prev = &c->next;
+            continue;
+        }
+
+        Close(c->fd);
+        *prev = c->next;
+        pool_put(closing_pool, c);
+    }
+}
+
+/*
+ * Like the reactors, the rings are expected to hold tens of thousands of
+ * connections.
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "workload.h"
+#include "parser.h"
+#include "pbx.h"
+#include "debug.h"
+
+/*
+ * Longest wait for a notification before a call is given up as failed.
+ */
+#define WORKLOAD_TIMEOUT_MS 5000
+
+struct client
+{
+    int fd;
+    int ext;
+    PARSER parser;
+};
+
+/*
+ * One pair of clients, and what its thread measured.
+ */
+struct pair
+{
+    pthread_t tid;
+    int port;
+    long calls;                 // To make
+    long made;
+    int failed;
+    double cpu;                 // CPU time of the thread, in seconds
+    struct client caller;
+    struct client callee;
+};
+
+/*
+ * One step of a call: a command sent by one side, and the notification
+ * then expected by each side, or -1 for none.  A command of NULL dials
+ * the callee.
+ */
+static const struct
+{
+    int by_callee;
+    const char *cmd;
+    int caller_state;
+    int callee_state;
+} steps[] = {
+    {0, "pickup\r\n", TU_DIAL_TONE, -1},
+    {0, NULL, TU_RING_BACK, TU_RINGING},
+    {1, "pickup\r\n", TU_CONNECTED, TU_CONNECTED},
+    {0, "chat hello\r\n", TU_CONNECTED, -1},
+    {1, "chat hello yourself\r\n", -1, TU_CONNECTED},
+    {0, "hangup\r\n", TU_ON_HOOK, TU_DIAL_TONE},
+    {1, "hangup\r\n", -1, TU_ON_HOOK},
+};
+
+static void *pair_thread(void *arg);
+static int client_connect(struct client *c, int port);
+static int client_expect(struct client *c, int state);
+static double process_cpu(void);
+static double thread_cpu(void);
+static double now(void);
+
+/*
+ * Run the workload and report on it.
+ */
+int workload_run(int port, long calls, FILE *out)
+{
+    struct pair *pairs = calloc(WORKLOAD_PAIRS, sizeof(struct pair));
+    if (pairs == NULL)
+        return -1;
+
+    double cpu = process_cpu(), start = now();
+    for (int i = 0; i < WORKLOAD_PAIRS; i++)
+    {
+        pairs[i].port = port;
+        pairs[i].calls = calls / WORKLOAD_PAIRS + (i < calls % WORKLOAD_PAIRS);
+        if (pthread_create(&pairs[i].tid, NULL, pair_thread, &pairs[i]) != 0)
+        {
+            pairs[i].failed = 1;
+            pairs[i].calls = 0;
+        }
+    }
+
+    long made = 0;
+    int failed = 0;
+    double client_cpu = 0.0;
+    for (int i = 0; i < WORKLOAD_PAIRS; i++)
+    {
+        if (pairs[i].calls > 0)
+            pthread_join(pairs[i].tid, NULL);
+        made += pairs[i].made;
+        failed += pairs[i].failed;
+        client_cpu += pairs[i].cpu;
+    }
+    double elapsed = now() - start;
+    cpu = process_cpu() - cpu - client_cpu;
+    free(pairs);
+
+    fprintf(out, "%10.0f calls/sec %10.2f us CPU/call  (%ld calls in %.2f s",
+            made / elapsed, made > 0 ? cpu / made * 1e6 : 0.0, made, elapsed);
+    if (failed > 0)
+        fprintf(out, ", %d pairs failed", failed);
+    fprintf(out, ")\n");
+    return failed > 0 ? -1 : 0;
+}
+
+/*
+ * Make the calls of one pair, checking every notification.
+ */
+static void *pair_thread(void *arg)
+{
+    struct pair *p = arg;
+    char dial[32];
+
+    if (client_connect(&p->caller, p->port) < 0 || client_connect(&p->callee, p->port) < 0)
+    {
+        p->failed = 1;
+        return NULL;
+    }
+    snprintf(dial, sizeof(dial), "dial %d\r\n", p->callee.ext);
+
+    while (p->made < p->calls && !p->failed)
+    {
+        for (int i = 0; i < sizeof(steps) / sizeof(steps[0]) && !p->failed; i++)
+        {
+            const char *cmd = steps[i].cmd != NULL ? steps[i].cmd : dial;
+            struct client *c = steps[i].by_callee ? &p->callee : &p->caller;
+            size_t len = strlen(cmd);
+
+            if (write(c->fd, cmd, len) != len ||
+                (steps[i].caller_state >= 0 && client_expect(&p->caller, steps[i].caller_state) < 0) ||
+                (steps[i].callee_state >= 0 && client_expect(&p->callee, steps[i].callee_state) < 0))
+                p->failed = 1;
+        }
+        p->made += !p->failed;
+    }
+
+    if (p->failed)
+        debug("Workload pair of %d and %d failed after %ld calls", p->caller.ext, p->callee.ext, p->made);
+    close(p->caller.fd);
+    close(p->callee.fd);
+    p->cpu = thread_cpu();
+    return NULL;
+}
+
+/*
+ * Connect a client and read its ON HOOK greeting, which gives its
+ * extension.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int client_connect(struct client *c, int port)
+{
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(c->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        close(c->fd);
+        return -1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    parser_init(&c->parser, c->fd);
+    return client_expect(c, TU_ON_HOOK);
+}
+
+/*
+ * Read the next notification of a client, which must be of the given
+ * state.  Chats are skipped.
+ *
+ * @return 0 if it was, -1 if it was not or none arrived.
+ */
+static int client_expect(struct client *c, int state)
+{
+    size_t name_len = strlen(tu_state_names[state]);
+    char *line;
+    size_t len;
+
+    while (1)
+    {
+        while ((line = parser_next(&c->parser, &len)) == NULL)
+        {
+            struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+            if (poll(&pfd, 1, WORKLOAD_TIMEOUT_MS) <= 0 || parser_fill(&c->parser) <= 0)
+                return -1;
+        }
+        if (strncmp(line, "CHAT", 4) != 0)
+            break;
+    }
+    if (strncmp(line, tu_state_names[state], name_len) != 0)
+        return -1;
+    if (state == TU_ON_HOOK)
+        c->ext = atoi(line + name_len);
+    return 0;
+}
+
+/*
+ * User and system time of the process, in seconds.
+ */
+static double process_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * CPU time of the calling thread, in seconds.
+ */
+static double thread_cpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
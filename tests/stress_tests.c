@@ -0,0 +1,643 @@
+/*
+ * Concurrency stress and throughput tests.
+ *
+ * Each test starts the server in its own process, listening on an
+ * ephemeral loopback port, and connects clients to it.  The stress tests
+ * drive hundreds of clients with random commands chosen with the tester's
+ * action table (util/tester_tables.h), check every notification against
+ * the tester's expected next states and, once the traffic has stopped,
+ * check that the clients pair up: both ends of a call connected to each
+ * other, and every TU in RING BACK ringing the TU it dialed, which no
+ * other TU rings.
+ *
+ * The throughput test sets up and tears down calls between pairs of
+ * clients for PERF_SECONDS and fails if the rate of calls falls more than
+ * a threshold below the baseline recorded in tests/perf_baseline.  The
+ * baseline shipped is a conservative floor, well below the rate of any
+ * machine the suite runs on, which only catches a large regression; a
+ * machine's own rate is recorded as its baseline by a run with
+ * PBX_PERF_RECORD=1.  The environment can override the baseline file
+ * (PBX_PERF_BASELINE) and the threshold (PBX_PERF_THRESHOLD, a fraction,
+ * default 0.3).  Without a baseline file the test is skipped, unless
+ * PBX_PERF_REQUIRED is set, as it should be in CI, in which case it fails.
+ * The test is disabled in the ThreadSanitizer build ("make tsan").
+ *
+ * The tests should be run one at a time (bin/pbx_tests -j1), so that the
+ * throughput measured is not that of a machine shared with other tests.
+ */
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "service.h"
+#include "reactor.h"
+#include "listener.h"
+#include "parser.h"
+#include "log.h"
+#include "../util/tester_tables.h"
+
+#define STRESS_CLIENTS 256
+#define STRESS_DRIVERS 8
+#define STRESS_SECONDS 3
+#define RESPONSE_TIMEOUT_MS 2000    // Longest wait for the response to a command
+#define QUIET_MS 200                // Silence after which all notifications are in
+
+#define PERF_PAIRS 16
+#define PERF_SECONDS 2
+#define PERF_BASELINE "tests/perf_baseline"
+#define PERF_THRESHOLD 0.3
+
+#ifdef __SANITIZE_THREAD__
+#define PERF_DISABLED 1
+#else
+#define PERF_DISABLED 0
+#endif
+
+#define ENGINE_THREADS 0
+#define ENGINE_REACTOR 1
+
+/*
+ * A client, and its model of the state of its TU, as told by the
+ * notifications it received.
+ */
+struct client
+{
+    int fd;
+    int ext;
+    int state;
+    int peer;                   // Extension notified with CONNECTED
+    int dialed;                 // Extension last dialed
+    int callee;                 // Extension dialed when RING BACK was entered
+    int last;                   // Command awaiting its response, or DELAY_COMMAND
+    int expected;               // Next states, as in next_states
+    int awaiting;
+    PARSER parser;
+};
+
+/*
+ * The clients driven by one thread.
+ */
+struct driver
+{
+    pthread_t tid;
+    struct client *clients;
+    int n;
+    unsigned seed;
+    double deadline;
+    long commands;
+    long calls;
+    long errors;
+    char error[128];            // The first error
+};
+
+static struct client *clients;
+static int nclients;
+static int missing_ext;         // An extension that is not registered
+
+static int start_server(int engine);
+static int spawn_client(int connfd);
+static void connect_client(struct client *c, int port);
+static void send_command(struct client *c, int cmd, int ext, struct driver *d);
+static int serve(struct client *cs, int n, int timeout_ms, struct driver *d);
+static void client_line(struct client *c, char *line, struct driver *d);
+static int parse_state(char *line);
+static void *drive(void *arg);
+static void drain(struct driver *d);
+static void check_pairs(struct driver *d);
+static void fail(struct driver *d, const char *fmt, ...);
+static void stress(int engine);
+static int expect(struct client *c, int state);
+static void *call_pair(void *arg);
+static double now(void);
+
+Test(stress, threads_engine, .timeout = 60)
+{
+    stress(ENGINE_THREADS);
+}
+
+Test(stress, reactor_engine, .timeout = 60)
+{
+    stress(ENGINE_REACTOR);
+}
+
+/*
+ * Run random traffic on STRESS_CLIENTS clients for STRESS_SECONDS, then
+ * check that the clients pair up, then hang them all up and check that
+ * they are on hook.
+ */
+static void stress(int engine)
+{
+    struct driver drivers[STRESS_DRIVERS], end = {0};
+    int port = start_server(engine);
+
+    nclients = STRESS_CLIENTS;
+    clients = calloc(nclients, sizeof(struct client));
+    cr_assert_not_null(clients);
+    for (int i = 0; i < nclients; i++)
+    {
+        connect_client(&clients[i], port);
+        if (clients[i].ext >= missing_ext)
+            missing_ext = clients[i].ext + 1;
+    }
+
+    int per_driver = nclients / STRESS_DRIVERS;
+    double deadline = now() + STRESS_SECONDS;
+    for (int t = 0; t < STRESS_DRIVERS; t++)
+    {
+        drivers[t] = (struct driver){.clients = clients + t * per_driver, .n = per_driver, .seed = t + 1,
+                                     .deadline = deadline};
+        cr_assert_eq(pthread_create(&drivers[t].tid, NULL, drive, &drivers[t]), 0);
+    }
+    long commands = 0, calls = 0;
+    for (int t = 0; t < STRESS_DRIVERS; t++)
+    {
+        pthread_join(drivers[t].tid, NULL);
+        cr_assert_eq(drivers[t].errors, 0, "driver %d: %s", t, drivers[t].error);
+        commands += drivers[t].commands;
+        calls += drivers[t].calls;
+    }
+    cr_log_info("%ld commands, %ld calls in %d s", commands, calls, STRESS_SECONDS);
+    cr_expect_gt(calls, 0, "no call was connected");
+
+    drain(&end);
+    check_pairs(&end);
+    cr_assert_eq(end.errors, 0, "%ld errors after the traffic: %s", end.errors, end.error);
+
+    for (int i = 0; i < nclients; i++)
+        send_command(&clients[i], TU_HANGUP_CMD, 0, &end);
+    drain(&end);
+    for (int i = 0; i < nclients; i++)
+    {
+        if (clients[i].state != TU_ON_HOOK || clients[i].awaiting)
+            fail(&end, "ext %d in state %s after hanging up", clients[i].ext, tu_state_names[clients[i].state]);
+    }
+    cr_assert_eq(end.errors, 0, "%ld errors after hanging up: %s", end.errors, end.error);
+
+    for (int i = 0; i < nclients; i++)
+        close(clients[i].fd);
+    free(clients);
+}
+
+/*
+ * Issue random commands on the clients of a driver until the deadline,
+ * and then wait for the responses to those in progress.
+ */
+static void *drive(void *arg)
+{
+    struct driver *d = arg;
+    int stopping = 0;
+
+    while (d->errors == 0)
+    {
+        int awaiting = 0;
+        stopping = stopping || now() >= d->deadline;
+        for (int i = 0; i < d->n; i++)
+        {
+            struct client *c = &d->clients[i];
+            if (!c->awaiting && !stopping)
+            {
+                int cmd;
+                do
+                {
+                    double r = (double)rand_r(&d->seed) / RAND_MAX, p = 0.0;
+                    for (cmd = 0; cmd < DELAY_COMMAND; cmd++)
+                    {
+                        p += action_probs[c->state][cmd];
+                        if (r <= p)
+                            break;
+                    }
+                } while (cmd == DELAY_COMMAND);
+
+                // Now and then dial oneself, or an extension nobody has.
+                int odds = rand_r(&d->seed) % 32;
+                int ext = odds == 0 ? c->ext : odds == 1 ? missing_ext : clients[rand_r(&d->seed) % nclients].ext;
+                send_command(c, cmd, ext, d);
+                d->commands++;
+            }
+            awaiting += c->awaiting;
+        }
+        if (stopping && awaiting == 0)
+            break;
+        if (serve(d->clients, d->n, RESPONSE_TIMEOUT_MS, d) == 0)
+            fail(d, "no response within %d ms", RESPONSE_TIMEOUT_MS);
+    }
+    return NULL;
+}
+
+/*
+ * Serve all clients until every command has been answered and no
+ * notification has arrived for QUIET_MS.
+ */
+static void drain(struct driver *d)
+{
+    double give_up = now() + RESPONSE_TIMEOUT_MS / 1000.0;
+
+    while (d->errors == 0)
+    {
+        if (serve(clients, nclients, QUIET_MS, d) > 0)
+            continue;
+        int awaiting = 0;
+        for (int i = 0; i < nclients; i++)
+            awaiting += clients[i].awaiting;
+        if (awaiting == 0)
+            break;
+        if (now() >= give_up)
+        {
+            fail(d, "%d commands unanswered", awaiting);
+            break;
+        }
+    }
+}
+
+/*
+ * Check that the models of the clients pair up.  No notification may be
+ * in transit.
+ */
+static void check_pairs(struct driver *d)
+{
+    int *ringers = calloc(missing_ext, sizeof(int));
+    int *index = malloc(missing_ext * sizeof(int));
+
+    cr_assert(ringers != NULL && index != NULL);
+    memset(index, -1, missing_ext * sizeof(int));
+    for (int i = 0; i < nclients; i++)
+        index[clients[i].ext] = i;
+
+    for (int i = 0; i < nclients; i++)
+    {
+        struct client *c = &clients[i];
+        if (c->state == TU_CONNECTED)
+        {
+            int p = c->peer > 0 && c->peer < missing_ext ? index[c->peer] : -1;
+            if (p < 0 || clients[p].state != TU_CONNECTED || clients[p].peer != c->ext)
+                fail(d, "ext %d CONNECTED %d, which is not connected back", c->ext, c->peer);
+        }
+        else if (c->state == TU_RING_BACK)
+        {
+            int p = c->callee > 0 && c->callee < missing_ext ? index[c->callee] : -1;
+            if (p < 0 || clients[p].state != TU_RINGING)
+                fail(d, "ext %d in RING BACK to %d, which is not ringing", c->ext, c->callee);
+            else
+                ringers[p]++;
+        }
+    }
+    for (int i = 0; i < nclients; i++)
+    {
+        if (clients[i].state == TU_RINGING && ringers[i] != 1)
+            fail(d, "ext %d RINGING, rung by %d TUs", clients[i].ext, ringers[i]);
+    }
+    free(ringers);
+    free(index);
+}
+
+/*
+ * Read the notifications that arrive on any of the given clients within
+ * the timeout, and check them.
+ *
+ * @return the number of clients that received any, 0 on timeout.
+ */
+static int serve(struct client *cs, int n, int timeout_ms, struct driver *d)
+{
+    struct pollfd pfds[n];
+    char *line;
+    size_t len;
+
+    for (int i = 0; i < n; i++)
+        pfds[i] = (struct pollfd){.fd = cs[i].fd, .events = POLLIN};
+    int ready = poll(pfds, n, timeout_ms);
+    if (ready < 0)
+    {
+        fail(d, "poll: %s", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < n && ready > 0; i++)
+    {
+        if (pfds[i].revents == 0)
+            continue;
+        if (parser_fill(&cs[i].parser) <= 0)
+        {
+            fail(d, "ext %d: connection closed", cs[i].ext);
+            return -1;
+        }
+        while ((line = parser_next(&cs[i].parser, &len)) != NULL)
+            client_line(&cs[i], line, d);
+    }
+    return ready;
+}
+
+/*
+ * Check a notification received by a client against its model, as the
+ * tester does, and update the model.
+ */
+static void client_line(struct client *c, char *line, struct driver *d)
+{
+    int new = parse_state(line);
+
+    if (new == NUM_STATES)
+    {
+        if (c->state != TU_CONNECTED)
+            fail(d, "ext %d: \"%s\" in state %s", c->ext, line, tu_state_names[c->state]);
+        return;
+    }
+    if (new < 0 || !(c->expected & (1 << new | 1 << (new + RESYNC))))
+    {
+        fail(d, "ext %d: unexpected \"%s\" in state %s", c->ext, line, tu_state_names[c->state]);
+        return;
+    }
+
+    int arg = atoi(line + strlen(tu_state_names[new]));
+    if (new == TU_ON_HOOK && arg != c->ext)
+        fail(d, "ext %d: \"%s\"", c->ext, line);
+    if (new == TU_CONNECTED)
+        c->peer = arg;
+    if (new == TU_RING_BACK && c->state != TU_RING_BACK)
+        c->callee = c->dialed;
+    if (new == TU_CONNECTED && c->state == TU_RING_BACK)
+        d->calls++;
+    c->state = new;
+
+    if (c->expected & 1 << new)
+    {
+        c->awaiting = 0;
+        c->last = DELAY_COMMAND;
+        c->expected = next_states[new][DELAY_COMMAND];
+    }
+    else
+    {
+        c->expected = next_states[new][c->last];
+    }
+}
+
+/*
+ * Send a command on behalf of a client, which then awaits its response.
+ */
+static void send_command(struct client *c, int cmd, int ext, struct driver *d)
+{
+    char buf[32];
+    int n;
+
+    if (cmd == TU_PICKUP_CMD)
+        n = snprintf(buf, sizeof(buf), "pickup\r\n");
+    else if (cmd == TU_HANGUP_CMD)
+        n = snprintf(buf, sizeof(buf), "hangup\r\n");
+    else if (cmd == TU_DIAL_CMD)
+        n = snprintf(buf, sizeof(buf), "dial %d\r\n", ext);
+    else
+        n = snprintf(buf, sizeof(buf), "chat stress\r\n");
+
+    if (cmd == TU_DIAL_CMD)
+        c->dialed = ext;
+    c->last = cmd;
+    c->expected = next_states[c->state][cmd];
+    c->awaiting = 1;
+    if (write(c->fd, buf, n) != n)
+        fail(d, "ext %d: write: %s", c->ext, strerror(errno));
+}
+
+static int parse_state(char *line)
+{
+    for (int i = 0; i < NUM_STATES; i++)
+    {
+        if (strncmp(line, tu_state_names[i], strlen(tu_state_names[i])) == 0)
+            return i;
+    }
+    return strncmp(line, "CHAT", 4) == 0 ? NUM_STATES : -1;
+}
+
+/*
+ * Record an error of a driver, keeping the message of the first.
+ */
+static void fail(struct driver *d, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (d->errors++ > 0)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(d->error, sizeof(d->error), fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Connect a client and read its ON HOOK greeting.
+ */
+static void connect_client(struct client *c, int port)
+{
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_geq(c->fd, 0, "socket: %s", strerror(errno));
+    cr_assert_eq(connect(c->fd, (struct sockaddr *)&sa, sizeof(sa)), 0, "connect: %s", strerror(errno));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    parser_init(&c->parser, c->fd);
+
+    c->state = TU_ON_HOOK;
+    cr_assert_eq(expect(c, TU_ON_HOOK), 0, "no ON HOOK on connecting");
+    c->last = DELAY_COMMAND;
+    c->expected = next_states[TU_ON_HOOK][DELAY_COMMAND];
+}
+
+/*
+ * Start the server in this process, on an ephemeral port.
+ *
+ * @return the port.
+ */
+static int start_server(int engine)
+{
+    struct rlimit rl;
+
+    // Both ends of every connection are in this process.
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    log_set_level(LOG_LEVEL_WARN);
+    pbx = pbx_init();
+    int port;
+    if (engine == ENGINE_REACTOR)
+        port = reactor_start(2) < 0 ? -1 : listener_start("0", 1, reactor_add);
+    else
+        port = listener_start("0", 1, spawn_client);
+    cr_assert_gt(port, 0, "the server did not start");
+    return port;
+}
+
+/*
+ * Take on a connection with a thread of its own, as the server does by
+ * default.
+ */
+static int spawn_client(int connfd)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, pbx_client_service, pbx_client_arg(connfd)) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * A pair of clients that call each other in a loop.
+ */
+struct pair
+{
+    pthread_t tid;
+    struct client a;
+    struct client b;
+    double deadline;
+    long calls;
+    int failed;                 // State not notified when expected, or -1
+};
+
+Test(perf, calls_per_second, .timeout = 60, .disabled = PERF_DISABLED)
+{
+    struct pair *pairs = calloc(PERF_PAIRS, sizeof(struct pair));
+    int port = start_server(ENGINE_THREADS);
+    char *path = getenv("PBX_PERF_BASELINE") ? getenv("PBX_PERF_BASELINE") : PERF_BASELINE;
+    double threshold = getenv("PBX_PERF_THRESHOLD") ? atof(getenv("PBX_PERF_THRESHOLD")) : PERF_THRESHOLD;
+
+    for (int i = 0; i < PERF_PAIRS; i++)
+    {
+        connect_client(&pairs[i].a, port);
+        connect_client(&pairs[i].b, port);
+    }
+
+    double start = now();
+    for (int i = 0; i < PERF_PAIRS; i++)
+    {
+        pairs[i].deadline = start + PERF_SECONDS;
+        pairs[i].failed = -1;
+        cr_assert_eq(pthread_create(&pairs[i].tid, NULL, call_pair, &pairs[i]), 0);
+    }
+    long calls = 0;
+    for (int i = 0; i < PERF_PAIRS; i++)
+    {
+        pthread_join(pairs[i].tid, NULL);
+        cr_assert_eq(pairs[i].failed, -1, "pair %d: no %s", i, tu_state_names[pairs[i].failed]);
+        calls += pairs[i].calls;
+    }
+    free(pairs);
+    double rate = calls / (now() - start);
+    cr_log_info("%.0f calls/sec", rate);
+
+    if (getenv("PBX_PERF_RECORD") != NULL)
+    {
+        FILE *f = fopen(path, "w");
+        cr_assert_not_null(f, "%s: %s", path, strerror(errno));
+        fprintf(f, "%.0f\n", rate);
+        fclose(f);
+        return;
+    }
+
+    double baseline;
+    FILE *f = fopen(path, "r");
+    if (f == NULL && errno == ENOENT && getenv("PBX_PERF_REQUIRED") == NULL)
+    {
+        cr_log_warn("%s: no baseline; record one with PBX_PERF_RECORD=1", path);
+#ifdef cr_skip_test
+        cr_skip_test("no baseline");
+#endif
+        return;
+    }
+    cr_assert_not_null(f, "%s: %s", path, strerror(errno));
+    cr_assert_eq(fscanf(f, "%lf", &baseline), 1, "%s: no baseline", path);
+    fclose(f);
+    cr_assert_geq(rate, baseline * (1 - threshold), "%.0f calls/sec is more than %.0f%% below the baseline of %.0f",
+                  rate, threshold * 100, baseline);
+}
+
+/*
+ * Set up and tear down calls from one client of a pair to the other until
+ * the deadline, checking every notification.
+ */
+static void *call_pair(void *arg)
+{
+    static const struct
+    {
+        int caller;             // Whether the command is sent by the caller
+        char *cmd;
+        int caller_state;       // Notified to the caller, or -1
+        int callee_state;       // Notified to the callee, or -1
+    } steps[] = {
+        {1, "pickup\r\n", TU_DIAL_TONE, -1},
+        {1, NULL, TU_RING_BACK, TU_RINGING},
+        {0, "pickup\r\n", TU_CONNECTED, TU_CONNECTED},
+        {1, "hangup\r\n", TU_ON_HOOK, TU_DIAL_TONE},
+        {0, "hangup\r\n", -1, TU_ON_HOOK},
+    };
+    struct pair *p = arg;
+    char dial[32];
+
+    snprintf(dial, sizeof(dial), "dial %d\r\n", p->b.ext);
+    while (now() < p->deadline)
+    {
+        for (int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+        {
+            char *cmd = steps[i].cmd != NULL ? steps[i].cmd : dial;
+            struct client *c = steps[i].caller ? &p->a : &p->b;
+            if (write(c->fd, cmd, strlen(cmd)) != strlen(cmd))
+                p->failed = steps[i].caller ? steps[i].caller_state : steps[i].callee_state;
+            else if (steps[i].caller_state >= 0 && expect(&p->a, steps[i].caller_state) < 0)
+                p->failed = steps[i].caller_state;
+            else if (steps[i].callee_state >= 0 && expect(&p->b, steps[i].callee_state) < 0)
+                p->failed = steps[i].callee_state;
+            if (p->failed >= 0)
+                return NULL;
+        }
+        p->calls++;
+    }
+    return NULL;
+}
+
+/*
+ * Read the next notification of a client, which must be of the given
+ * state.  A client's ON HOOK greeting sets its extension.  Called from
+ * threads other than the test's, so it does not assert.
+ *
+ * @return 0 if the notification was of the state, -1 otherwise.
+ */
+static int expect(struct client *c, int state)
+{
+    char *line;
+    size_t len;
+
+    while ((line = parser_next(&c->parser, &len)) == NULL)
+    {
+        struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+        if (poll(&pfd, 1, RESPONSE_TIMEOUT_MS) <= 0 || parser_fill(&c->parser) <= 0)
+            return -1;
+    }
+    if (parse_state(line) != state)
+        return -1;
+    c->state = state;
+    if (state == TU_ON_HOOK)
+        c->ext = atoi(line + strlen(tu_state_names[state]));
+    return 0;
+}
+
+/*
+ * Monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
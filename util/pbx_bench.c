@@ -0,0 +1,2693 @@
+/*
+ * In-process benchmarks for the PBX module.
+ *
+ * The benchmarks link directly against the server objects and drive the
+ * tu_xxx functions from multiple threads, using file descriptors open on
+ * /dev/null in place of network connections.
+ *
+ * Usage: pbx_bench -b <benchmark> [-t <max threads>] [-n <iterations>] [-l <period>]
+ *
+ * With -l, one in every <period> lock acquisitions is profiled, and the
+ * lock profile is printed when the benchmark ends.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <malloc.h>
+#include <dirent.h>
+
+#include "pbx.h"
+#include "outq.h"
+#include "iostats.h"
+#include "parser.h"
+#include "service.h"
+#include "reactor.h"
+#include "uring.h"
+#include "listener.h"
+#include "handoff.h"
+#include "lockprof.h"
+#include "log.h"
+#include "proto.h"
+#include "conf.h"
+#include "cdr.h"
+#include "pool.h"
+#include "dialplan.h"
+#include "trunk.h"
+#include "registry.h"
+#include "shard.h"
+#include "tester_tables.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ITERATIONS 100000
+#define PAIRS_PER_THREAD 4
+#define CONTEND_TIMEOUT_MS 5000
+
+struct benchmark
+{
+    char *name;
+    char *description;
+    void (*run)(int max_threads, int iterations);
+};
+
+static void bench_calls(int max_threads, int iterations);
+static void bench_contend(int max_threads, int iterations);
+static void bench_stall(int max_threads, int iterations);
+static void bench_parser(int max_threads, int iterations);
+static void bench_storm(int max_threads, int iterations);
+static void bench_batch(int max_threads, int iterations);
+static void bench_handoff(int max_threads, int iterations);
+static void bench_log(int max_threads, int iterations);
+static void bench_proto(int max_threads, int iterations);
+static void bench_uring(int max_threads, int iterations);
+static void bench_chat(int max_threads, int iterations);
+static void bench_conf(int max_threads, int iterations);
+static void bench_cdr(int max_threads, int iterations);
+static void bench_alloc(int max_threads, int iterations);
+static void bench_dialplan(int max_threads, int iterations);
+static void bench_trunk(int max_threads, int iterations);
+static void bench_shard(int max_threads, int iterations);
+
+static struct benchmark benchmarks[] = {
+    {"calls", "call setup/teardown throughput vs. thread count, disjoint TU pairs, per-TU vs. global lock", bench_calls},
+    {"contend", "random commands on TUs that all dial each other, checked like the tester", bench_contend},
+    {"stall", "call latency of other extensions while one client stops reading", bench_stall},
+    {"parser", "command parsing throughput, buffered parser vs. stdio fscanf", bench_parser},
+    {"storm", "time for -n clients connecting at once to all be registered, vs. acceptors", bench_storm},
+    {"batch", "system calls per command, notifications batched per read vs. sent per command", bench_batch},
+    {"handoff", "hot restart of a server with -n clients in calls; checks that the calls survive", bench_handoff},
+    {"log", "log calls/sec vs. thread count and command latency, synchronous vs. asynchronous log", bench_log},
+    {"proto", "command throughput and bytes per command, text vs. binary protocol", bench_proto},
+    {"uring", "system calls and CPU time per call, thread per connection vs. reactor vs. io_uring", bench_uring},
+    {"chat", "sustained chat bandwidth between connected pairs vs. message size, for each engine", bench_chat},
+    {"conf", "conference fan-out cost and memory per member, shared buffer vs. copy per member", bench_conf},
+    {"cdr", "call detail records/sec vs. thread count, and command latency with records on and off", bench_cdr},
+    {"alloc", "heap allocations per call, registration and bridge chat once the pools are warm", bench_alloc},
+    {"dialplan", "dial plan lookups/sec and bytes per route vs. routes, and lookups during plan swaps", bench_dialplan},
+    {"trunk", "call setup latency between two switches joined by a trunk vs. within one switch", bench_trunk},
+    {"shard", "call setups/sec vs. thread count, one shard vs. one per thread, within and across shards", bench_shard},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*
+ * Every heap allocation made by the process is counted, by wrapping the
+ * allocator's entry points, so that the alloc benchmark can check that
+ * none is made in steady state.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(align, size);
+    return *ptr != NULL ? 0 : ENOMEM;
+}
+
+static void usage(void);
+static double now(void);
+static TU *register_dummy(void);
+static void print_latencies(char *label, double *samples, int n);
+
+int main(int argc, char *argv[])
+{
+    char *name = NULL;
+    int max_threads = DEFAULT_THREADS;
+    int iterations = DEFAULT_ITERATIONS;
+    int lock_period = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "b:t:n:l:")) != EOF)
+    {
+        switch (option)
+        {
+        case 'b':
+            name = optarg;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'l':
+            lock_period = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (name == NULL || max_threads < 1 || iterations < 1 || lock_period < 0)
+        usage();
+
+    lockprof_set_period(lock_period);
+
+    for (int i = 0; i < NUM_BENCHMARKS; i++)
+    {
+        if (strcmp(name, benchmarks[i].name) == 0)
+        {
+            benchmarks[i].run(max_threads, iterations);
+            if (lock_period > 0)
+                lockprof_report(stdout);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    usage();
+    return EXIT_FAILURE;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pbx_bench -b <benchmark> [-t <max threads>] [-n <iterations>] [-l <period>]\n");
+    for (int i = 0; i < NUM_BENCHMARKS; i++)
+        fprintf(stderr, "  %-10s %s\n", benchmarks[i].name, benchmarks[i].description);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Register a TU whose notifications are discarded.
+ */
+static TU *register_dummy(void)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    TU *tu;
+
+    if (fd < 0 || (tu = pbx_register(pbx, fd)) == NULL)
+    {
+        fprintf(stderr, "Unable to register a TU (fd %d)\n", fd);
+        exit(EXIT_FAILURE);
+    }
+    return tu;
+}
+
+/*
+ * Print percentiles of a set of latency samples (in seconds) in microseconds.
+ */
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(char *label, double *samples, int n)
+{
+    qsort(samples, n, sizeof(double), compare_doubles);
+    printf("%-12s n=%-8d p50=%8.1fus p99=%8.1fus p99.9=%8.1fus max=%8.1fus\n", label, n,
+           samples[n / 2] * 1e6, samples[(int)(n * 0.99)] * 1e6,
+           samples[(int)(n * 0.999)] * 1e6, samples[n - 1] * 1e6);
+}
+
+/*
+ * Call throughput: each thread owns PAIRS_PER_THREAD pairs of TUs and
+ * repeatedly places a complete call between each pair (pickup, dial,
+ * answer, chat, hang up both ends).  Since no two threads ever touch the
+ * same TU, throughput should grow with the number of threads unless the
+ * PBX serializes unrelated calls.  For comparison, the calls are also made
+ * with one global mutex held around each tu_xxx call, as the PBX did
+ * before transitions locked only the TUs involved.
+ */
+struct calls_arg
+{
+    TU *tus[2 * PAIRS_PER_THREAD];
+    int iterations;
+    int global;
+};
+
+static pthread_mutex_t calls_global = PTHREAD_MUTEX_INITIALIZER;
+
+#define CALLS_OP(ca, op)                               \
+    do                                                 \
+    {                                                  \
+        if ((ca)->global)                              \
+            pthread_mutex_lock(&calls_global);         \
+        op;                                            \
+        if ((ca)->global)                              \
+            pthread_mutex_unlock(&calls_global);       \
+    } while (0)
+
+static void *calls_thread(void *arg)
+{
+    struct calls_arg *ca = arg;
+
+    for (int i = 0; i < ca->iterations; i++)
+    {
+        TU *caller = ca->tus[2 * (i % PAIRS_PER_THREAD)];
+        TU *callee = ca->tus[2 * (i % PAIRS_PER_THREAD) + 1];
+
+        CALLS_OP(ca, tu_pickup(caller));
+        CALLS_OP(ca, tu_dial(caller, tu_extension(callee)));
+        CALLS_OP(ca, tu_pickup(callee));
+        CALLS_OP(ca, tu_chat(caller, "benchmark"));
+        CALLS_OP(ca, tu_hangup(caller));
+        CALLS_OP(ca, tu_hangup(callee));
+    }
+    return NULL;
+}
+
+static double calls_rate(int threads, int global, pthread_t *tids, struct calls_arg *args)
+{
+    double start = now();
+    for (int t = 0; t < threads; t++)
+    {
+        args[t].global = global;
+        pthread_create(&tids[t], NULL, calls_thread, &args[t]);
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    return (double)threads * args[0].iterations / (now() - start);
+}
+
+static void bench_calls(int max_threads, int iterations)
+{
+    pthread_t tids[max_threads];
+    struct calls_arg args[max_threads];
+
+    pbx = pbx_init();
+    for (int t = 0; t < max_threads; t++)
+    {
+        for (int i = 0; i < 2 * PAIRS_PER_THREAD; i++)
+            args[t].tus[i] = register_dummy();
+        args[t].iterations = iterations;
+    }
+
+    printf("%8s %14s %14s %14s %14s\n", "threads", "calls/sec", "calls/sec/thr", "global lock", "global/thr");
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double rate = calls_rate(threads, 0, tids, args);
+        double global = calls_rate(threads, 1, tids, args);
+        printf("%8d %14.0f %14.0f %14.0f %14.0f\n", threads, rate, rate / threads, global, global / threads);
+    }
+}
+
+/*
+ * Contention stress test: each thread drives one TU, connected over a
+ * socket pair, with random commands chosen from the tester's action table
+ * (without its delays), dialing the TUs of the other threads.  Every
+ * notification is checked against the tester's table of expected next
+ * states, so this exercises the two-TU transitions racing against each
+ * other as hard as possible.  Any unexpected notification, or a command
+ * not answered within CONTEND_TIMEOUT_MS, is counted as an error and
+ * makes the benchmark fail.
+ */
+struct contend_arg
+{
+    TU *tu;
+    int client;
+    unsigned int seed;
+    int iterations;
+    int *exts;
+    int nexts;
+    long calls;
+    long errors;
+};
+
+static int contend_parse(char *msg)
+{
+    for (int i = 0; i < NUM_STATES; i++)
+    {
+        if (strncmp(msg, tu_state_names[i], strlen(tu_state_names[i])) == 0)
+            return i;
+    }
+    return strncmp(msg, "CHAT", 4) == 0 ? NUM_STATES : -1;
+}
+
+static void *contend_thread(void *arg)
+{
+    struct contend_arg *ca = arg;
+    PARSER parser;
+    TU_STATE state = TU_ON_HOOK;
+    int expected = 1 << TU_ON_HOOK;
+    int last = TU_HANGUP_CMD;
+    int awaiting = 1;
+    char *line;
+    size_t len;
+
+    parser_init(&parser, ca->client);
+
+    for (int i = 0; i <= ca->iterations;)
+    {
+        if (!awaiting)
+        {
+            int cmd;
+            do
+            {
+                double r = (double)rand_r(&ca->seed) / RAND_MAX, p = 0.0;
+                for (cmd = 0; cmd < DELAY_COMMAND; cmd++)
+                {
+                    p += action_probs[state][cmd];
+                    if (r <= p)
+                        break;
+                }
+            } while (cmd == DELAY_COMMAND);
+
+            if (i++ == ca->iterations)
+                break;
+
+            if (cmd == TU_PICKUP_CMD)
+                tu_pickup(ca->tu);
+            else if (cmd == TU_HANGUP_CMD)
+                tu_hangup(ca->tu);
+            else if (cmd == TU_DIAL_CMD)
+                tu_dial(ca->tu, ca->exts[rand_r(&ca->seed) % ca->nexts]);
+            else
+                tu_chat(ca->tu, "stress");
+            expected = next_states[state][cmd];
+            last = cmd;
+            awaiting = 1;
+        }
+
+        if ((line = parser_next(&parser, &len)) == NULL)
+        {
+            struct pollfd pfd = {.fd = ca->client, .events = POLLIN};
+            if (poll(&pfd, 1, CONTEND_TIMEOUT_MS) <= 0 || parser_fill(&parser) <= 0)
+            {
+                fprintf(stderr, "TU %d: no response in state %s\n", tu_extension(ca->tu), tu_state_names[state]);
+                ca->errors++;
+                return NULL;
+            }
+            continue;
+        }
+
+        int new = contend_parse(line);
+        if (new == NUM_STATES && state == TU_CONNECTED)
+            continue;
+        if (new < 0 || new == NUM_STATES || !(expected & (1 << new | 1 << (new + RESYNC))))
+        {
+            fprintf(stderr, "TU %d: unexpected \"%s\" in state %s\n", tu_extension(ca->tu), line, tu_state_names[state]);
+            ca->errors++;
+            return NULL;
+        }
+
+        if (state == TU_RING_BACK && new == TU_CONNECTED)
+            ca->calls++;
+        state = new;
+        if (expected & 1 << new)
+            awaiting = 0;
+        else
+            expected = next_states[new][last];
+    }
+    return NULL;
+}
+
+static void bench_contend(int max_threads, int iterations)
+{
+    pthread_t tids[max_threads];
+    struct contend_arg args[max_threads];
+    int exts[max_threads];
+    long errors = 0;
+
+    pbx = pbx_init();
+
+    printf("%8s %14s %14s %10s\n", "threads", "commands/sec", "calls/sec", "errors");
+    for (int threads = 2; threads <= max_threads; threads *= 2)
+    {
+        for (int t = 0; t < threads; t++)
+        {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+            {
+                perror("socketpair");
+                exit(EXIT_FAILURE);
+            }
+            args[t] = (struct contend_arg){.client = sv[1], .seed = t + 1, .iterations = iterations,
+                                           .exts = exts, .nexts = threads};
+            args[t].tu = pbx_register(pbx, sv[0]);
+            exts[t] = tu_extension(args[t].tu);
+        }
+
+        double start = now();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&tids[t], NULL, contend_thread, &args[t]);
+        long calls = 0, round_errors = 0;
+        for (int t = 0; t < threads; t++)
+        {
+            pthread_join(tids[t], NULL);
+            calls += args[t].calls;
+            round_errors += args[t].errors;
+        }
+        double elapsed = now() - start;
+
+        printf("%8d %14.0f %14.0f %10ld\n", threads, (double)threads * iterations / elapsed,
+               calls / elapsed, round_errors);
+        errors += round_errors;
+
+        for (int t = 0; t < threads; t++)
+        {
+            int fd = tu_fileno(args[t].tu);
+            pbx_unregister(pbx, args[t].tu);
+            close(fd);
+            close(args[t].client);
+        }
+    }
+
+    if (errors > 0)
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Stalled reader: one TU is connected over a socket pair whose other end is
+ * never read, and its peer keeps chatting to it.  Meanwhile, other threads
+ * place calls among their own TUs, and also dial the stalled TU (which
+ * must return a busy signal).  The latency of those calls shows whether
+ * the stalled client holds up the rest of the switch; the stalled client
+ * should be disconnected once its queued output reaches the high-water mark.
+ */
+struct stall_arg
+{
+    TU *tus[2];
+    int stalled_ext;
+    int iterations;
+    double *latencies;
+};
+
+static volatile int stall_disconnected;
+
+static void *stall_service(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[64];
+
+    // Stand-in for the client service thread: it sees EOF when the PBX
+    // shuts the connection down, and then unregisters the TU.
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    stall_disconnected = 1;
+    return NULL;
+}
+
+static void *stall_chatter(void *arg)
+{
+    TU *tu = arg;
+    char msg[1024];
+
+    memset(msg, 'x', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\0';
+    while (!stall_disconnected && tu_chat(tu, msg) == 0)
+        ;
+    return NULL;
+}
+
+static void *stall_caller(void *arg)
+{
+    struct stall_arg *sa = arg;
+
+    for (int i = 0; i < sa->iterations; i++)
+    {
+        double start = now();
+        tu_pickup(sa->tus[0]);
+        tu_dial(sa->tus[0], tu_extension(sa->tus[1]));
+        tu_pickup(sa->tus[1]);
+        tu_hangup(sa->tus[0]);
+        tu_hangup(sa->tus[1]);
+        tu_pickup(sa->tus[0]);
+        tu_dial(sa->tus[0], sa->stalled_ext);
+        tu_hangup(sa->tus[0]);
+        sa->latencies[i] = now() - start;
+    }
+    return NULL;
+}
+
+static void bench_stall(int max_threads, int iterations)
+{
+    int sv[2];
+    int size = 4096;
+    pthread_t service, chatter, tids[max_threads];
+    struct stall_arg args[max_threads];
+
+    pbx = pbx_init();
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    TU *stalled = pbx_register(pbx, sv[0]);
+    TU *talker = register_dummy();
+    int stalled_ext = tu_extension(stalled);
+    tu_pickup(talker);
+    tu_dial(talker, stalled_ext);
+    tu_pickup(stalled);
+
+    for (int t = 0; t < max_threads; t++)
+    {
+        args[t].tus[0] = register_dummy();
+        args[t].tus[1] = register_dummy();
+        args[t].stalled_ext = stalled_ext;
+        args[t].iterations = iterations;
+        args[t].latencies = malloc(iterations * sizeof(double));
+    }
+
+    pthread_create(&service, NULL, stall_service, &sv[0]);
+    pthread_create(&chatter, NULL, stall_chatter, talker);
+    for (int t = 0; t < max_threads; t++)
+        pthread_create(&tids[t], NULL, stall_caller, &args[t]);
+    for (int t = 0; t < max_threads; t++)
+        pthread_join(tids[t], NULL);
+
+    printf("stalled client %s (high-water mark %d bytes)\n",
+           stall_disconnected ? "was disconnected" : "is still connected", OUTQ_DEFAULT_HIGH_WATER);
+
+    double *all = malloc((size_t)max_threads * iterations * sizeof(double));
+    for (int t = 0; t < max_threads; t++)
+        memcpy(all + (size_t)t * iterations, args[t].latencies, iterations * sizeof(double));
+    print_latencies("call cycle", all, max_threads * iterations);
+
+    if (stall_disconnected)
+    {
+        pthread_join(chatter, NULL);
+        pbx_unregister(pbx, stalled);
+    }
+}
+
+/*
+ * Parser throughput: a stream of commands is parsed from a file, once with
+ * the stdio/fscanf loop and strcmp chain that the service loop used to
+ * use, and once with the buffered parser and pbx_parse_command().
+ * Only parsing is measured; the commands are not carried out.
+ */
+static int legacy_classify(char *command)
+{
+    if (strcmp(command, tu_command_names[TU_PICKUP_CMD]) == 0)
+        return TU_PICKUP_CMD;
+    else if (strcmp(command, tu_command_names[TU_HANGUP_CMD]) == 0)
+        return TU_HANGUP_CMD;
+    else if (strncmp(command, tu_command_names[TU_DIAL_CMD], 4) == 0 && strlen(command) >= 6)
+        return atoi(command + 4) >= 0 ? TU_DIAL_CMD : -1;
+    else if (strncmp(command, tu_command_names[TU_CHAT_CMD], 4) == 0)
+        return TU_CHAT_CMD;
+    return -1;
+}
+
+static void bench_parser(int max_threads, int iterations)
+{
+    static char *lines[] = {"pickup\r\n", "dial 1234\r\n", "chat how are you doing today?\r\n", "hangup\r\n"};
+    char path[] = "/tmp/pbx_bench_XXXXXX";
+    int fd = mkstemp(path);
+    size_t bytes = 0;
+
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+
+    FILE *out = fdopen(dup(fd), "w");
+    for (int i = 0; i < iterations; i++)
+        bytes += fprintf(out, "%s", lines[i % 4]);
+    fclose(out);
+
+    // stdio path
+    lseek(fd, 0, SEEK_SET);
+    FILE *in = fdopen(dup(fd), "r");
+    char command[8192];
+    int recognized = 0;
+    double start = now();
+    while (1)
+    {
+        strcpy(command, "");
+        if (fscanf(in, " %[^\r\n]s", command) < 0 && feof(in))
+            break;
+        if (legacy_classify(command) >= 0)
+            recognized++;
+    }
+    double legacy = now() - start;
+    fclose(in);
+
+    // buffered parser path
+    lseek(fd, 0, SEEK_SET);
+    PARSER *parser = malloc(sizeof(PARSER));
+    int parsed = 0;
+    parser_init(parser, fd);
+    start = now();
+    while (parser_fill(parser) > 0)
+    {
+        char *line, *arg;
+        size_t len;
+        int cmd;
+
+        while ((line = parser_next(parser, &len)) != NULL)
+        {
+            if (pbx_parse_command(line, len, &cmd, &arg) == 0)
+                parsed++;
+        }
+    }
+    double buffered = now() - start;
+
+    printf("%d commands, %zu bytes\n", iterations, bytes);
+    printf("%-10s %12.0f commands/sec (%d recognized)\n", "fscanf", recognized / legacy, recognized);
+    printf("%-10s %12.0f commands/sec (%d recognized)\n", "parser", parsed / buffered, parsed);
+    close(fd);
+}
+
+/*
+ * Registration storm: a server is forked with 1, 2, 4, ... acceptor threads
+ * (and as many reactor threads), and the given number of clients connect to
+ * it all at once, as after a network outage.  The recovery time is the time
+ * until every client has received its ON HOOK greeting.
+ */
+#define STORM_TIMEOUT 60.0
+
+static pid_t storm_server(int acceptors, int *port)
+{
+    int pipefd[2];
+    pid_t pid;
+
+    if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+    {
+        perror("storm_server");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        close(pipefd[0]);
+        pbx = pbx_init();
+        if (reactor_start(acceptors) < 0 || (*port = listener_start("0", acceptors, reactor_add)) < 0)
+            exit(EXIT_FAILURE);
+        if (write(pipefd[1], port, sizeof(*port)) != sizeof(*port))
+            exit(EXIT_FAILURE);
+        while (1)
+            pause();
+    }
+
+    close(pipefd[1]);
+    if (read(pipefd[0], port, sizeof(*port)) != sizeof(*port))
+    {
+        fprintf(stderr, "Server failed to start\n");
+        exit(EXIT_FAILURE);
+    }
+    close(pipefd[0]);
+    return pid;
+}
+
+static void bench_storm(int max_threads, int iterations)
+{
+    struct rlimit rl;
+    int clients = iterations;
+    int *fds = malloc(clients * sizeof(int));
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    printf("%10s %10s %10s %10s %12s\n", "acceptors", "clients", "ok", "failed", "recovery ms");
+    for (int acceptors = 1; acceptors <= max_threads; acceptors *= 2)
+    {
+        int port;
+        pid_t pid = storm_server(acceptors, &port);
+        int epfd = epoll_create1(0);
+        int done = 0, failed = 0;
+        struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+        inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+
+        double start = now();
+        for (int i = 0; i < clients; i++)
+        {
+            fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fds[i] < 0 || (connect(fds[i], (struct sockaddr *)&sa, sizeof(sa)) < 0 && errno != EINPROGRESS))
+            {
+                failed++;
+                continue;
+            }
+            struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+        }
+
+        while (done + failed < clients && now() - start < STORM_TIMEOUT)
+        {
+            struct epoll_event events[256];
+            int n = epoll_wait(epfd, events, 256, 100);
+            for (int e = 0; e < n; e++)
+            {
+                char buf[64];
+                int i = events[e].data.u32;
+                ssize_t len = read(fds[i], buf, sizeof(buf) - 1);
+                if (len > 0)
+                {
+                    buf[len] = '\0';
+                    if (strstr(buf, tu_state_names[TU_ON_HOOK]) == buf)
+                        done++;
+                    else
+                        failed++;
+                }
+                else if (len == 0 || errno != EAGAIN)
+                    failed++;
+                else
+                    continue;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], NULL);
+            }
+        }
+        double elapsed = now() - start;
+
+        printf("%10d %10d %10d %10d %12.1f\n", acceptors, clients, done, clients - done, elapsed * 1e3);
+
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        for (int i = 0; i < clients; i++)
+            if (fds[i] >= 0)
+                close(fds[i]);
+        close(epfd);
+    }
+    free(fds);
+}
+
+/*
+ * Feed a script of commands to a TU through its connection and carry
+ * them out, either as one batch or sending each notification as it is
+ * produced.
+ */
+static void batch_feed(int client, PARSER *parser, TU *tu, char *script, int batched)
+{
+    if (write(client, script, strlen(script)) < 0)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    parser_fill(parser);
+
+    if (batched)
+    {
+        pbx_dispatch_lines(tu, parser);
+        return;
+    }
+
+    char *line;
+    size_t len;
+    while ((line = parser_next(parser, &len)) != NULL)
+        pbx_dispatch_command(tu, line, len);
+}
+
+/*
+ * Discard the notifications received by a client.
+ */
+static void batch_drain(int client)
+{
+    char buf[4096];
+    while (recv(client, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+/*
+ * A call between two TUs driven through socket pairs, in which each
+ * client sends its commands for a step of the call in one write: the
+ * caller picks up and dials, the callee answers, the caller chats and
+ * hangs up, and the callee hangs up.  The number of system calls made
+ * by the server per command is reported with notifications batched per
+ * read and with each notification sent as soon as it is produced.
+ */
+static void bench_batch(int max_threads, int iterations)
+{
+    int a[2], b[2];
+    char dial[64];
+
+    pbx = pbx_init();
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, b) < 0)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    TU *caller = pbx_register(pbx, a[0]);
+    TU *callee = pbx_register(pbx, b[0]);
+    static PARSER caller_parser, callee_parser;
+    parser_init(&caller_parser, a[0]);
+    parser_init(&callee_parser, b[0]);
+    snprintf(dial, sizeof(dial), "pickup\r\ndial %d\r\n", tu_extension(callee));
+
+    printf("%-12s %10s %10s %10s %14s %14s\n", "mode", "commands", "reads", "sends", "syscalls/cmd", "commands/sec");
+    for (int batched = 0; batched <= 1; batched++)
+    {
+        IOSTATS before, after;
+        iostats_snapshot(&before);
+        double start = now();
+
+        for (int i = 0; i < iterations; i++)
+        {
+            batch_feed(a[1], &caller_parser, caller, dial, batched);
+            batch_feed(b[1], &callee_parser, callee, "pickup\r\n", batched);
+            batch_feed(a[1], &caller_parser, caller, "chat one\r\nchat two\r\nchat three\r\nhangup\r\n", batched);
+            batch_feed(b[1], &callee_parser, callee, "hangup\r\n", batched);
+            batch_drain(a[1]);
+            batch_drain(b[1]);
+        }
+
+        double elapsed = now() - start;
+        iostats_snapshot(&after);
+        uint64_t commands = after.commands - before.commands;
+        uint64_t reads = after.reads - before.reads;
+        uint64_t sends = after.sends - before.sends;
+        uint64_t syscalls = reads + sends + after.epoll_ctls - before.epoll_ctls;
+
+        printf("%-12s %10llu %10llu %10llu %14.2f %14.0f\n", batched ? "per read" : "per command",
+               (unsigned long long)commands, (unsigned long long)reads, (unsigned long long)sends,
+               (double)syscalls / commands, commands / elapsed);
+    }
+}
+
+/*
+ * Hot restart: a server is forked with -t reactor threads and -n clients
+ * connect to it.  Most pairs of clients are put in a call and the rest are
+ * left ringing, and one client has sent half a command line.  A second
+ * server is then forked that takes over from the first, and the time the
+ * handoff takes is reported.  Every call is then checked through the new
+ * server: chats must go both ways, ringing calls must be answerable, the
+ * half command must complete, new clients must be accepted, and hanging
+ * up must release the peer.  Any failure makes the benchmark fail.
+ */
+#define HANDOFF_RINGING_EVERY 4
+
+struct hclient
+{
+    int fd;
+    int ext;
+    size_t len;
+    char buf[256];
+};
+
+static int failures;
+
+/*
+ * Fork a reactor-based server.  If takeover is given, the server takes
+ * over from the one listening at that path; otherwise it listens on an
+ * ephemeral port.  If listen_path is given, the server listens there for
+ * a successor.  The child reports one value back: the port it listens on,
+ * or the time in milliseconds its takeover took.
+ */
+static pid_t handoff_server(int threads, char *listen_path, char *takeover, double *report)
+{
+    int pipefd[2];
+    pid_t pid;
+
+    if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+    {
+        perror("handoff_server");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        // Drop the benchmark's ends of the client connections, which would
+        // otherwise count against the server's descriptor limit.
+        for (int fd = 3; fd < sysconf(_SC_OPEN_MAX); fd++)
+        {
+            if (fd != pipefd[1])
+                close(fd);
+        }
+
+        pbx = pbx_init();
+        if (reactor_start(threads) < 0)
+            exit(EXIT_FAILURE);
+
+        double value;
+        if (takeover != NULL)
+        {
+            int fds[LISTENER_MAX_ACCEPTORS];
+            double start = now();
+            int n = handoff_receive(takeover, fds, LISTENER_MAX_ACCEPTORS);
+            if (n < 0 || listener_adopt(fds, n, reactor_add) < 0)
+                exit(EXIT_FAILURE);
+            value = (now() - start) * 1e3;
+        }
+        else if ((value = listener_start("0", 1, reactor_add)) < 0)
+            exit(EXIT_FAILURE);
+
+        if (listen_path != NULL && handoff_listen(listen_path) < 0)
+            exit(EXIT_FAILURE);
+        if (write(pipefd[1], &value, sizeof(value)) != sizeof(value))
+            exit(EXIT_FAILURE);
+        while (1)
+            pause();
+    }
+
+    close(pipefd[1]);
+    if (read(pipefd[0], report, sizeof(*report)) != sizeof(*report))
+    {
+        fprintf(stderr, "Server failed to start\n");
+        exit(EXIT_FAILURE);
+    }
+    close(pipefd[0]);
+    return pid;
+}
+
+static void hclient_send(struct hclient *c, char *cmd)
+{
+    if (write(c->fd, cmd, strlen(cmd)) != strlen(cmd))
+        failures++;
+}
+
+/*
+ * Read the next notification for a client and check that it starts with
+ * the expected text.
+ *
+ * @return the notification (valid until the next call), or NULL on failure.
+ */
+static char *hclient_expect(struct hclient *c, char *expected)
+{
+    static char line[sizeof(c->buf)];
+    char *eol;
+
+    while ((eol = memchr(c->buf, '\n', c->len)) == NULL)
+    {
+        struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+        ssize_t n;
+        if (c->len == sizeof(c->buf) || poll(&pfd, 1, CONTEND_TIMEOUT_MS) <= 0 ||
+            (n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len)) <= 0)
+        {
+            fprintf(stderr, "Client %d: no \"%s\"\n", c->ext, expected);
+            failures++;
+            return NULL;
+        }
+        c->len += n;
+    }
+
+    size_t n = eol + 1 - c->buf;
+    memcpy(line, c->buf, n);
+    line[n > 1 && line[n - 2] == '\r' ? n - 2 : n - 1] = '\0';
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+
+    if (strncmp(line, expected, strlen(expected)) != 0)
+    {
+        fprintf(stderr, "Client %d: \"%s\" instead of \"%s\"\n", c->ext, line, expected);
+        failures++;
+        return NULL;
+    }
+    return line;
+}
+
+static void hclient_connect(struct hclient *c, int port)
+{
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+
+    c->len = 0;
+    c->ext = -1;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(c->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    // Commands are sent one at a time, so Nagle would only add latency.
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    char *greeting = hclient_expect(c, tu_state_names[TU_ON_HOOK]);
+    if (greeting != NULL)
+        c->ext = atoi(greeting + strlen(tu_state_names[TU_ON_HOOK]));
+}
+
+static void bench_handoff(int max_threads, int iterations)
+{
+    struct rlimit rl;
+    char path[64], cmd[64];
+    double port, handoff_ms;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int pairs = iterations / 2;
+    if (pairs > ((int)rl.rlim_cur - 64) / 2)
+        pairs = ((int)rl.rlim_cur - 64) / 2;
+    struct hclient *a = calloc(pairs, sizeof(struct hclient));
+    struct hclient *b = calloc(pairs, sizeof(struct hclient));
+
+    snprintf(path, sizeof(path), "/tmp/pbx_bench_handoff.%d", getpid());
+    pid_t old = handoff_server(max_threads, path, NULL, &port);
+
+    for (int i = 0; i < pairs; i++)
+    {
+        hclient_connect(&a[i], port);
+        hclient_connect(&b[i], port);
+    }
+
+    // Pairs whose index is a multiple of HANDOFF_RINGING_EVERY are left
+    // ringing; the others are connected.
+    for (int i = 0; i < pairs; i++)
+    {
+        snprintf(cmd, sizeof(cmd), "pickup\r\ndial %d\r\n", b[i].ext);
+        hclient_send(&a[i], cmd);
+        hclient_expect(&a[i], tu_state_names[TU_DIAL_TONE]);
+        hclient_expect(&a[i], tu_state_names[TU_RING_BACK]);
+        hclient_expect(&b[i], tu_state_names[TU_RINGING]);
+        if (i % HANDOFF_RINGING_EVERY == 0)
+            continue;
+        hclient_send(&b[i], "pickup\r\n");
+        hclient_expect(&b[i], tu_state_names[TU_CONNECTED]);
+        hclient_expect(&a[i], tu_state_names[TU_CONNECTED]);
+    }
+    hclient_send(&a[pairs - 1], "chat before ");
+    usleep(100000);
+
+    double start = now();
+    pid_t new = handoff_server(max_threads, NULL, path, &handoff_ms);
+    double ready = now() - start;
+    if (waitpid(old, NULL, 0) != old)
+        failures++;
+    double exited = now() - start;
+
+    hclient_send(&a[pairs - 1], "and after\r\n");
+    hclient_expect(&b[pairs - 1], "CHAT before and after");
+    hclient_expect(&a[pairs - 1], tu_state_names[TU_CONNECTED]);
+
+    for (int i = 0; i < pairs; i++)
+    {
+        if (i % HANDOFF_RINGING_EVERY == 0)
+        {
+            hclient_send(&b[i], "pickup\r\n");
+            hclient_expect(&b[i], tu_state_names[TU_CONNECTED]);
+            hclient_expect(&a[i], tu_state_names[TU_CONNECTED]);
+        }
+        hclient_send(&a[i], "chat ping\r\n");
+        hclient_expect(&b[i], "CHAT ping");
+        hclient_expect(&a[i], tu_state_names[TU_CONNECTED]);
+        hclient_send(&b[i], "chat pong\r\n");
+        hclient_expect(&a[i], "CHAT pong");
+        hclient_expect(&b[i], tu_state_names[TU_CONNECTED]);
+    }
+
+    struct hclient late;
+    hclient_connect(&late, port);
+
+    for (int i = 0; i < pairs; i++)
+    {
+        hclient_send(&a[i], "hangup\r\n");
+        hclient_expect(&a[i], tu_state_names[TU_ON_HOOK]);
+        hclient_expect(&b[i], tu_state_names[TU_DIAL_TONE]);
+    }
+
+    printf("%10s %8s %12s %12s %12s %10s\n", "clients", "threads", "handoff ms", "ready ms", "old exit ms", "failures");
+    printf("%10d %8d %12.1f %12.1f %12.1f %10d\n", 2 * pairs, max_threads, handoff_ms, ready * 1e3,
+           exited * 1e3, failures);
+
+    kill(new, SIGKILL);
+    waitpid(new, NULL, 0);
+    unlink(path);
+    for (int i = 0; i < pairs; i++)
+    {
+        close(a[i].fd);
+        close(b[i].fd);
+    }
+    close(late.fd);
+    free(a);
+    free(b);
+
+    if (failures > 0)
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Logging: the rate at which threads can log INFO records, and the latency
+ * of call commands with their INFO events logged, first written
+ * synchronously to stderr (as debug() used to be) and then through the
+ * asynchronous log.  Both write to /dev/null, so this measures the cost
+ * to the thread logging and not that of the device.  Asynchronous records
+ * that find their ring full are dropped; their share is reported.
+ */
+struct log_arg
+{
+    int iterations;
+};
+
+static void *log_thread(void *arg)
+{
+    struct log_arg *la = arg;
+
+    for (int i = 0; i < la->iterations; i++)
+        log_info("event=bench i=%d of=%d", i, la->iterations);
+    return NULL;
+}
+
+/*
+ * Measure the rate of log calls for each number of threads up to
+ * max_threads, and the share of records dropped.
+ */
+static void log_rates(int max_threads, int iterations, double *rates, double *dropped)
+{
+    pthread_t tids[max_threads];
+    struct log_arg arg = {iterations};
+
+    for (int threads = 1, i = 0; threads <= max_threads; threads *= 2, i++)
+    {
+        uint64_t before = log_dropped();
+        double start = now();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&tids[t], NULL, log_thread, &arg);
+        for (int t = 0; t < threads; t++)
+            pthread_join(tids[t], NULL);
+        rates[i] = (double)threads * iterations / (now() - start);
+        dropped[i] = (double)(log_dropped() - before) / ((double)threads * iterations);
+    }
+}
+
+/*
+ * Time each command of iterations calls between two TUs.
+ */
+static void log_latencies(char *label, TU *caller, TU *callee, double *samples, int iterations)
+{
+    int n = 0;
+
+    for (int i = 0; i < iterations; i++)
+    {
+        double t0 = now();
+        tu_pickup(caller);
+        double t1 = now();
+        tu_dial(caller, tu_extension(callee));
+        double t2 = now();
+        tu_pickup(callee);
+        double t3 = now();
+        tu_chat(caller, "benchmark");
+        double t4 = now();
+        tu_hangup(caller);
+        double t5 = now();
+        tu_hangup(callee);
+        double t6 = now();
+
+        samples[n++] = t1 - t0;
+        samples[n++] = t2 - t1;
+        samples[n++] = t3 - t2;
+        samples[n++] = t4 - t3;
+        samples[n++] = t5 - t4;
+        samples[n++] = t6 - t5;
+    }
+    print_latencies(label, samples, n);
+}
+
+static void bench_log(int max_threads, int iterations)
+{
+    int devnull = open("/dev/null", O_WRONLY);
+    int saved_stderr = dup(STDERR_FILENO);
+    double *samples = malloc(6 * (size_t)iterations * sizeof(double));
+    double sync_rates[32], sync_dropped[32], async_rates[32], async_dropped[32];
+
+    if (devnull < 0 || saved_stderr < 0 || samples == NULL)
+    {
+        perror("bench_log");
+        exit(EXIT_FAILURE);
+    }
+
+    pbx = pbx_init();
+    TU *caller = register_dummy();
+    TU *callee = register_dummy();
+
+    // Until log_start(), records are written to stderr as they are logged,
+    // and the log can only be made asynchronous once, so everything
+    // synchronous is measured first.
+    dup2(devnull, STDERR_FILENO);
+    printf("command latency (6 commands per call)\n");
+    log_set_level(LOG_LEVEL_OFF);
+    log_latencies("off", caller, callee, samples, iterations);
+    log_set_level(LOG_LEVEL_INFO);
+    log_latencies("sync info", caller, callee, samples, iterations);
+    log_rates(max_threads, iterations, sync_rates, sync_dropped);
+
+    log_start(devnull, LOG_LEVEL_INFO);
+    log_latencies("async info", caller, callee, samples, iterations);
+    log_rates(max_threads, iterations, async_rates, async_dropped);
+    log_flush();
+
+    printf("\n%8s %14s %14s %14s %10s\n", "threads", "sync logs/s", "async logs/s", "async kept/s",
+           "dropped");
+    for (int threads = 1, i = 0; threads <= max_threads; threads *= 2, i++)
+        printf("%8d %14.0f %14.0f %14.0f %9.1f%%\n", threads, sync_rates[i], async_rates[i],
+               async_rates[i] * (1 - async_dropped[i]), 100.0 * async_dropped[i]);
+
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    free(samples);
+}
+
+/*
+ * Protocols: the call of the batch benchmark, driven through socket pairs
+ * in the text protocol and then in the binary protocol.  The commands of
+ * each step are sent in one write and carried out as one batch, so the
+ * time is spent parsing commands, carrying them out and formatting the
+ * notifications.  The bytes each protocol takes per command are reported
+ * along with the throughput.
+ */
+struct proto_client
+{
+    int fd;
+    TU *tu;
+    PARSER parser;
+    size_t received;
+};
+
+/*
+ * Append a binary command frame to a script.
+ */
+static size_t proto_frame(char *script, size_t len, int op, const void *payload, size_t size)
+{
+    unsigned char *frame = (unsigned char *)script + len;
+
+    frame[0] = op;
+    frame[1] = 0;
+    frame[2] = size >> 8;
+    frame[3] = size & 0xff;
+    memcpy(frame + PROTO_HEADER_SIZE, payload, size);
+    return len + PROTO_HEADER_SIZE + size;
+}
+
+static void proto_feed(struct proto_client *c, char *script, size_t len)
+{
+    if (write(c->fd, script, len) < 0)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    parser_fill(&c->parser);
+    pbx_dispatch_lines(c->tu, &c->parser);
+}
+
+static void proto_drain(struct proto_client *c)
+{
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        c->received += n;
+}
+
+static void bench_proto(int max_threads, int iterations)
+{
+    static struct proto_client caller, callee;
+    char scripts[4][256];
+    size_t lens[4];
+    int a[2], b[2];
+
+    pbx = pbx_init();
+
+    printf("%-8s %12s %12s %12s %14s\n", "protocol", "commands", "bytes in", "bytes out", "commands/sec");
+    for (int protocol = PROTO_TEXT; protocol <= PROTO_BINARY; protocol++)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, b) < 0)
+        {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        caller = (struct proto_client){.fd = a[1], .tu = pbx_register(pbx, a[0])};
+        callee = (struct proto_client){.fd = b[1], .tu = pbx_register(pbx, b[0])};
+        parser_init(&caller.parser, a[0]);
+        parser_init(&callee.parser, b[0]);
+        int ext = tu_extension(callee.tu);
+
+        if (protocol == PROTO_TEXT)
+        {
+            lens[0] = snprintf(scripts[0], sizeof(scripts[0]), "pickup\r\ndial %d\r\n", ext);
+            lens[1] = snprintf(scripts[1], sizeof(scripts[1]), "pickup\r\n");
+            lens[2] = snprintf(scripts[2], sizeof(scripts[2]), "chat one\r\nchat two\r\nchat three\r\nhangup\r\n");
+            lens[3] = snprintf(scripts[3], sizeof(scripts[3]), "hangup\r\n");
+        }
+        else
+        {
+            uint32_t dial = htonl(ext);
+            char magic = PROTO_MAGIC;
+
+            proto_feed(&caller, &magic, 1);
+            proto_feed(&callee, &magic, 1);
+            lens[0] = proto_frame(scripts[0], 0, PROTO_OP_PICKUP, NULL, 0);
+            lens[0] = proto_frame(scripts[0], lens[0], PROTO_OP_DIAL, &dial, sizeof(dial));
+            lens[1] = proto_frame(scripts[1], 0, PROTO_OP_PICKUP, NULL, 0);
+            lens[2] = proto_frame(scripts[2], 0, PROTO_OP_CHAT, "one", 3);
+            lens[2] = proto_frame(scripts[2], lens[2], PROTO_OP_CHAT, "two", 3);
+            lens[2] = proto_frame(scripts[2], lens[2], PROTO_OP_CHAT, "three", 5);
+            lens[2] = proto_frame(scripts[2], lens[2], PROTO_OP_HANGUP, NULL, 0);
+            lens[3] = proto_frame(scripts[3], 0, PROTO_OP_HANGUP, NULL, 0);
+        }
+        proto_drain(&caller);
+        proto_drain(&callee);
+        caller.received = callee.received = 0;
+
+        IOSTATS before, after;
+        iostats_snapshot(&before);
+        double start = now();
+
+        for (int i = 0; i < iterations; i++)
+        {
+            proto_feed(&caller, scripts[0], lens[0]);
+            proto_feed(&callee, scripts[1], lens[1]);
+            proto_feed(&caller, scripts[2], lens[2]);
+            proto_feed(&callee, scripts[3], lens[3]);
+            proto_drain(&caller);
+            proto_drain(&callee);
+        }
+
+        double elapsed = now() - start;
+        iostats_snapshot(&after);
+        uint64_t commands = after.commands - before.commands;
+        size_t sent = (lens[0] + lens[1] + lens[2] + lens[3]) * (size_t)iterations;
+
+        printf("%-8s %12llu %12.1f %12.1f %14.0f\n", protocol == PROTO_TEXT ? "text" : "binary",
+               (unsigned long long)commands, (double)sent / commands,
+               (double)(caller.received + callee.received) / commands, commands / elapsed);
+
+        pbx_unregister(pbx, caller.tu);
+        pbx_unregister(pbx, callee.tu);
+        close(a[0]);
+        close(a[1]);
+        close(b[0]);
+        close(b[1]);
+    }
+}
+
+/*
+ * Client service engines: a server is forked with each engine, serving
+ * -t pairs of clients over TCP, and each pair makes -n / -t calls, all
+ * pairs in lockstep (every pair sends its next command before any waits
+ * for the notifications).  Each call is a pickup and dial, an answer, a
+ * chat and both hangups.  The server reports the system calls it made
+ * (see iostats.h) and the CPU time it used, per call.
+ */
+#define ENGINE_THREADS 0
+#define ENGINE_REACTOR 1
+#define ENGINE_URING 2
+
+struct engine_report
+{
+    IOSTATS stats;
+    double cpu;                 // User and system time, in seconds
+};
+
+static int engine_spawn(int connfd)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, pbx_client_service, pbx_client_arg(connfd)) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Fork a server with the given engine, which reports its port through
+ * the reply pipe, and a report each time a byte is written to it.
+ */
+static pid_t engine_server(int engine, int *port, int *request, int *reply)
+{
+    int down[2], up[2];
+    pid_t pid;
+
+    // The child must not flush what the parent has printed.
+    fflush(stdout);
+    if (pipe(down) < 0 || pipe(up) < 0 || (pid = fork()) < 0)
+    {
+        perror("engine_server");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        close(down[1]);
+        close(up[0]);
+        pbx = pbx_init();
+        if (engine == ENGINE_URING)
+            *port = uring_start("0", 1);
+        else if (engine == ENGINE_REACTOR)
+            *port = reactor_start(1) < 0 ? -1 : listener_start("0", 1, reactor_add);
+        else
+            *port = listener_start("0", 1, engine_spawn);
+        if (*port < 0 || write(up[1], port, sizeof(*port)) != sizeof(*port))
+            _exit(EXIT_FAILURE);
+
+        char c;
+        while (read(down[0], &c, 1) == 1)
+        {
+            struct engine_report report;
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            iostats_snapshot(&report.stats);
+            report.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+            if (write(up[1], &report, sizeof(report)) != sizeof(report))
+                _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(down[0]);
+    close(up[1]);
+    if (read(up[0], port, sizeof(*port)) != sizeof(*port))
+    {
+        fprintf(stderr, "Server failed to start\n");
+        exit(EXIT_FAILURE);
+    }
+    *request = down[1];
+    *reply = up[0];
+    return pid;
+}
+
+static void engine_report(int request, int reply, struct engine_report *report)
+{
+    if (write(request, "r", 1) != 1 || read(reply, report, sizeof(*report)) != sizeof(*report))
+    {
+        fprintf(stderr, "Server failed to report\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_uring(int max_threads, int iterations)
+{
+    static char *names[] = {"threads", "reactor", "io_uring"};
+    int pairs = max_threads;
+    int calls = iterations / pairs > 0 ? iterations / pairs : 1;
+    struct hclient *a = calloc(pairs, sizeof(struct hclient));
+    struct hclient *b = calloc(pairs, sizeof(struct hclient));
+    char cmd[64];
+
+    printf("%d pairs, %d calls\n", pairs, calls * pairs);
+    printf("%-10s %12s %14s %18s %12s\n", "engine", "calls/sec", "syscalls/call", "cpu ms/1000 calls", "failures");
+    for (int engine = ENGINE_THREADS; engine <= ENGINE_URING; engine++)
+    {
+        struct engine_report before, after;
+        int port, request, reply;
+        pid_t pid = engine_server(engine, &port, &request, &reply);
+
+        failures = 0;
+        for (int i = 0; i < pairs; i++)
+        {
+            hclient_connect(&a[i], port);
+            hclient_connect(&b[i], port);
+        }
+
+        engine_report(request, reply, &before);
+        double start = now();
+
+        for (int n = 0; n < calls && failures == 0; n++)
+        {
+            for (int i = 0; i < pairs; i++)
+            {
+                snprintf(cmd, sizeof(cmd), "pickup\r\ndial %d\r\n", b[i].ext);
+                hclient_send(&a[i], cmd);
+            }
+            for (int i = 0; i < pairs; i++)
+            {
+                hclient_expect(&a[i], tu_state_names[TU_DIAL_TONE]);
+                hclient_expect(&a[i], tu_state_names[TU_RING_BACK]);
+                hclient_expect(&b[i], tu_state_names[TU_RINGING]);
+                hclient_send(&b[i], "pickup\r\n");
+            }
+            for (int i = 0; i < pairs; i++)
+            {
+                hclient_expect(&b[i], tu_state_names[TU_CONNECTED]);
+                hclient_expect(&a[i], tu_state_names[TU_CONNECTED]);
+                hclient_send(&a[i], "chat hello\r\n");
+            }
+            for (int i = 0; i < pairs; i++)
+            {
+                hclient_expect(&b[i], "CHAT hello");
+                hclient_expect(&a[i], tu_state_names[TU_CONNECTED]);
+                hclient_send(&a[i], "hangup\r\n");
+            }
+            for (int i = 0; i < pairs; i++)
+            {
+                hclient_expect(&a[i], tu_state_names[TU_ON_HOOK]);
+                hclient_expect(&b[i], tu_state_names[TU_DIAL_TONE]);
+                hclient_send(&b[i], "hangup\r\n");
+            }
+            for (int i = 0; i < pairs; i++)
+                hclient_expect(&b[i], tu_state_names[TU_ON_HOOK]);
+        }
+
+        double elapsed = now() - start;
+        engine_report(request, reply, &after);
+        double total = (double)calls * pairs;
+        uint64_t syscalls = (after.stats.reads + after.stats.sends + after.stats.epoll_ctls +
+                             after.stats.epoll_waits + after.stats.enters) -
+                            (before.stats.reads + before.stats.sends + before.stats.epoll_ctls +
+                             before.stats.epoll_waits + before.stats.enters);
+
+        printf("%-10s %12.0f %14.2f %18.1f %12d\n", names[engine], total / elapsed, syscalls / total,
+               (after.cpu - before.cpu) * 1e3 / total * 1000, failures);
+
+        for (int i = 0; i < pairs; i++)
+        {
+            close(a[i].fd);
+            close(b[i].fd);
+        }
+        close(request);
+        close(reply);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        if (failures > 0)
+            exit(EXIT_FAILURE);
+    }
+    free(a);
+    free(b);
+}
+
+/*
+ * Chat bandwidth: a server is forked with each engine, and -t pairs of
+ * clients connected over TCP chat without pause, the caller of each pair
+ * sending messages of a given size as fast as the server takes them, and
+ * its peer reading them.  Each pair sends at most -n / -t messages, and
+ * at most CHAT_VOLUME bytes.  A sender keeps at most CHAT_WINDOW bytes that
+ * its peer has not received in flight, as the event engines do not stop
+ * reading a sender whose peer falls behind, but drop the peer once its
+ * output queue is over the high-water mark.  Every byte received is
+ * checked against the messages sent, so a message cut, dropped or mixed
+ * with another makes the benchmark fail.
+ */
+#define CHAT_VOLUME (4 << 20)
+#define CHAT_WINDOW (OUTQ_DEFAULT_HIGH_WATER / 4)
+#define CHAT_TIMEOUT_MS 10000
+
+struct chat_arg
+{
+    struct hclient *a;          // Sender
+    struct hclient *b;          // Receiver
+    char *cmd;                  // "chat <message>\r\n"
+    char *line;                 // "CHAT <message>\r\n", as the peer gets it
+    size_t line_len;            // Length of either
+    long messages;
+    int failed;
+};
+
+/*
+ * Send the messages of one pair and read what both of its clients
+ * receive, until the peer has had every message and the sender a reply to
+ * each chat.
+ */
+static void *chat_pair(void *arg)
+{
+    struct chat_arg *c = arg;
+    long sent = 0, replies = 0;
+    size_t offset = 0;          // In the command being sent
+    size_t received = 0;        // Bytes received by the peer
+    size_t expected = c->line_len * c->messages;
+    char buf[65536];
+
+    fcntl(c->a->fd, F_SETFL, O_NONBLOCK);
+    while (!c->failed && (received < expected || replies < c->messages))
+    {
+        int more = sent < c->messages && sent * c->line_len + offset < received + CHAT_WINDOW;
+        struct pollfd pfd[2] = {
+            {.fd = c->a->fd, .events = POLLIN | (more ? POLLOUT : 0)},
+            {.fd = c->b->fd, .events = POLLIN},
+        };
+        if (poll(pfd, 2, CHAT_TIMEOUT_MS) <= 0)
+        {
+            fprintf(stderr, "Client %d: chat stalled\n", c->a->ext);
+            c->failed = 1;
+            break;
+        }
+
+        if (pfd[0].revents & POLLOUT)
+        {
+            size_t len = c->line_len - offset;
+            size_t room = received + CHAT_WINDOW - (sent * c->line_len + offset);
+            ssize_t n = write(c->a->fd, c->cmd + offset, len < room ? len : room);
+            if (n < 0 && errno != EAGAIN)
+                c->failed = 1;
+            if (n > 0 && (offset += n) == c->line_len)
+            {
+                offset = 0;
+                sent++;
+            }
+        }
+
+        if (pfd[0].revents & POLLIN)
+        {
+            ssize_t n = read(c->a->fd, buf, sizeof(buf));
+            if (n <= 0 && !(n < 0 && errno == EAGAIN))
+                c->failed = 1;
+            for (ssize_t i = 0; i < n; i++)
+                replies += buf[i] == '\n';
+        }
+
+        if (pfd[1].revents & POLLIN)
+        {
+            ssize_t n = read(c->b->fd, buf, sizeof(buf));
+            if (n <= 0)
+                c->failed = 1;
+            for (ssize_t i = 0; i < n;)
+            {
+                size_t at = received % c->line_len;
+                size_t run = c->line_len - at < (size_t)(n - i) ? c->line_len - at : (size_t)(n - i);
+                if (received + run > expected || memcmp(buf + i, c->line + at, run) != 0)
+                {
+                    fprintf(stderr, "Client %d: chat garbled at byte %zu\n", c->b->ext, received);
+                    c->failed = 1;
+                    break;
+                }
+                i += run;
+                received += run;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void bench_chat(int max_threads, int iterations)
+{
+    static char *names[] = {"threads", "reactor", "io_uring"};
+    static size_t sizes[] = {100, 4096, 65536, 1 << 20};
+    int pairs = max_threads;
+    struct hclient *a = calloc(pairs, sizeof(struct hclient));
+    struct hclient *b = calloc(pairs, sizeof(struct hclient));
+    struct chat_arg *args = calloc(pairs, sizeof(struct chat_arg));
+    pthread_t *tids = calloc(pairs, sizeof(pthread_t));
+    char cmd[64];
+
+    printf("%d pairs, up to %d messages or %d MB per pair\n", pairs, iterations / pairs, CHAT_VOLUME >> 20);
+    printf("%-10s %10s %12s %10s %16s %10s\n", "engine", "size", "messages/sec", "MB/sec", "cpu ms/100 MB", "failures");
+    fflush(stdout);
+    for (int engine = ENGINE_THREADS; engine <= ENGINE_URING; engine++)
+    {
+        for (int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+        {
+            struct engine_report before, after;
+            int port, request, reply;
+            pid_t pid = engine_server(engine, &port, &request, &reply);
+            long messages = iterations / pairs;
+
+            if (messages > CHAT_VOLUME / sizes[k])
+                messages = CHAT_VOLUME / sizes[k];
+            if (messages < 1)
+                messages = 1;
+
+            failures = 0;
+            for (int i = 0; i < pairs; i++)
+            {
+                hclient_connect(&a[i], port);
+                hclient_connect(&b[i], port);
+                snprintf(cmd, sizeof(cmd), "pickup\r\ndial %d\r\n", b[i].ext);
+                hclient_send(&a[i], cmd);
+                hclient_expect(&a[i], tu_state_names[TU_DIAL_TONE]);
+                hclient_expect(&a[i], tu_state_names[TU_RING_BACK]);
+                hclient_expect(&b[i], tu_state_names[TU_RINGING]);
+                hclient_send(&b[i], "pickup\r\n");
+                hclient_expect(&b[i], tu_state_names[TU_CONNECTED]);
+                hclient_expect(&a[i], tu_state_names[TU_CONNECTED]);
+            }
+            if (failures > 0)
+                exit(EXIT_FAILURE);
+
+            char *line = malloc(sizes[k] + 7);
+            memcpy(line, "CHAT ", 5);
+            for (size_t j = 0; j < sizes[k]; j++)
+                line[5 + j] = 'a' + j % 26;
+            memcpy(line + 5 + sizes[k], "\r\n", 2);
+            char *chat = malloc(sizes[k] + 7);
+            memcpy(chat, "chat", 4);
+            memcpy(chat + 4, line + 4, sizes[k] + 3);
+
+            engine_report(request, reply, &before);
+            double start = now();
+            for (int i = 0; i < pairs; i++)
+            {
+                args[i] = (struct chat_arg){.a = &a[i], .b = &b[i], .cmd = chat, .line = line,
+                                            .line_len = sizes[k] + 7, .messages = messages};
+                pthread_create(&tids[i], NULL, chat_pair, &args[i]);
+            }
+            for (int i = 0; i < pairs; i++)
+            {
+                pthread_join(tids[i], NULL);
+                failures += args[i].failed;
+            }
+            double elapsed = now() - start;
+            engine_report(request, reply, &after);
+
+            double total = (double)messages * pairs;
+            double mb = total * sizes[k] / (1 << 20);
+            printf("%-10s %10zu %12.0f %10.1f %16.1f %10d\n", names[engine], sizes[k], total / elapsed,
+                   mb / elapsed, (after.cpu - before.cpu) * 1e3 / mb * 100, failures);
+            fflush(stdout);
+
+            for (int i = 0; i < pairs; i++)
+            {
+                close(a[i].fd);
+                close(b[i].fd);
+            }
+            free(line);
+            free(chat);
+            close(request);
+            close(reply);
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            if (failures > 0)
+                exit(EXIT_FAILURE);
+        }
+    }
+    free(a);
+    free(b);
+    free(args);
+    free(tids);
+}
+
+/*
+ * Conference fan-out: a chat of CONF_MESSAGE bytes is sent to every member
+ * of bridges of increasing size, one message per batch of output as when
+ * a command is dispatched.  The fan-out is done three ways: formatting
+ * and sending a copy per member with proto_send_chat(), as a call does;
+ * serializing the message once and sending it from a shared buffer with
+ * proto_send_msg(); and through the PBX, with tu_chat_send() from a member
+ * of a bridge that the other TUs have joined.  About -n deliveries are
+ * timed for each size, to members whose output goes to /dev/null.
+ *
+ * Memory is measured as the growth of the heap.  The memory queued per
+ * member is measured with members that have fallen behind (socket pairs
+ * whose buffers are full), to which one message is fanned out, so that
+ * every member must keep it.  The memory of a bridge member is measured
+ * as TUs join the bridge.
+ */
+#define CONF_MESSAGE 100
+
+/*
+ * Bytes of heap in use.
+ */
+static long heap_used(void)
+{
+    return mallinfo2().uordblks;
+}
+
+/*
+ * Fan a message out to a set of queues.
+ *
+ * @param shared  Whether the message is serialized once and shared.
+ */
+static void conf_fanout(OUTQ **queues, int n, char *msg, int shared)
+{
+    PROTO_MSG m;
+
+    if (shared)
+    {
+        proto_msg_init(&m, msg, CONF_MESSAGE);
+        for (int i = 0; i < n; i++)
+            proto_send_msg(queues[i], PROTO_TEXT, &m);
+        proto_msg_release(&m);
+    }
+    else
+    {
+        for (int i = 0; i < n; i++)
+            proto_send_chat(queues[i], PROTO_TEXT, msg, CONF_MESSAGE);
+    }
+}
+
+/*
+ * Fan a message out to members that have fallen behind.
+ *
+ * @return the bytes of heap held per member until the message is sent.
+ */
+static double conf_backlog(int n, char *msg, int shared)
+{
+    int (*pairs)[2] = calloc(n, sizeof(int[2]));
+    OUTQ **queues = calloc(n, sizeof(OUTQ *));
+    int size = 4096;
+    char fill[4096] = {0};
+
+    for (int i = 0; i < n; i++)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) < 0)
+        {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(pairs[i][0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        while (send(pairs[i][0], fill, sizeof(fill), MSG_DONTWAIT) > 0)
+            ;
+        queues[i] = outq_create(pairs[i][0]);
+    }
+
+    long before = heap_used();
+    conf_fanout(queues, n, msg, shared);
+    long held = heap_used() - before;
+
+    for (int i = 0; i < n; i++)
+    {
+        outq_destroy(queues[i]);
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+    free(pairs);
+    free(queues);
+    return (double)held / n;
+}
+
+static void bench_conf(int max_threads, int iterations)
+{
+    static int sizes[] = {10, 100, 1000};
+    static char *modes[] = {"copy", "shared", "bridge"};
+    char msg[CONF_MESSAGE];
+
+    pbx = pbx_init();
+    memset(msg, 'x', sizeof(msg));
+
+    printf("%d-byte messages, about %d deliveries per size\n", CONF_MESSAGE, iterations);
+    printf("%-8s %-8s %12s %12s %16s %16s\n", "members", "fan-out", "messages/sec", "ns/delivery",
+           "queued B/member", "bridge B/member");
+    for (int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        int n = sizes[k];
+        int messages = iterations / (n - 1) > 0 ? iterations / (n - 1) : 1;
+        int *fds = calloc(n, sizeof(int));
+        OUTQ **queues = calloc(n, sizeof(OUTQ *));
+        TU **tus = calloc(n, sizeof(TU *));
+
+        for (int i = 0; i < n; i++)
+        {
+            if ((fds[i] = open("/dev/null", O_WRONLY)) < 0)
+            {
+                perror("open");
+                exit(EXIT_FAILURE);
+            }
+            queues[i] = outq_create(fds[i]);
+        }
+
+        // The sender is not sent its own message, so the others get n - 1.
+        for (int shared = 0; shared <= 1; shared++)
+        {
+            double start = now();
+            for (int j = 0; j < messages; j++)
+            {
+                outq_batch_begin();
+                conf_fanout(queues, n - 1, msg, shared);
+                outq_batch_end();
+            }
+            double elapsed = now() - start;
+
+            printf("%-8d %-8s %12.0f %12.1f %16.1f %16s\n", n, modes[shared], messages / elapsed,
+                   elapsed * 1e9 / ((double)messages * (n - 1)), conf_backlog(n - 1, msg, shared), "-");
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            tus[i] = pbx_register(pbx, fds[i]);
+            tu_pickup(tus[i]);
+        }
+        long joined = heap_used();
+        for (int i = 0; i < n; i++)
+            tu_join(tus[i], k + 1);
+        joined = heap_used() - joined;
+
+        double start = now();
+        for (int j = 0; j < messages; j++)
+        {
+            outq_batch_begin();
+            tu_chat_send(tus[0], msg, CONF_MESSAGE);
+            outq_batch_end();
+        }
+        double elapsed = now() - start;
+
+        printf("%-8d %-8s %12.0f %12.1f %16s %16.1f\n", n, modes[2], messages / elapsed,
+               elapsed * 1e9 / ((double)messages * (n - 1)), "-", (double)joined / n);
+        fflush(stdout);
+
+        for (int i = 0; i < n; i++)
+        {
+            tu_hangup(tus[i]);
+            pbx_unregister(pbx, tus[i]);
+            outq_destroy(queues[i]);
+            close(fds[i]);
+        }
+        free(fds);
+        free(queues);
+        free(tus);
+    }
+}
+
+/*
+ * Call detail records: the latency of call commands without and with
+ * records, and the rate at which threads can stage records, written to
+ * files in a temporary directory that are rotated every MiB.  The rate at
+ * which records reach the files includes the final flush; records that
+ * find their thread's ring full are dropped and their share is reported.
+ * The records in the files are counted at the end and must match the
+ * number written.
+ */
+struct cdr_arg
+{
+    int iterations;
+};
+
+static void *cdr_thread(void *arg)
+{
+    struct cdr_arg *ca = arg;
+    CDR_RECORD r = {.caller = 1, .callee = 2, .outcome = CDR_ANSWERED};
+
+    for (int i = 0; i < ca->iterations; i++)
+    {
+        r.setup = r.answer = r.hangup = i + 1;
+        cdr_write(&r);
+    }
+    return NULL;
+}
+
+/*
+ * Count the records in the files of a directory.
+ */
+static uint64_t cdr_count(char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    uint64_t count = 0;
+    char path[PATH_MAX];
+
+    while (d != NULL && (e = readdir(d)) != NULL)
+    {
+        CDR_RECORD r;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        FILE *f = e->d_name[0] == '.' ? NULL : fopen(path, "r");
+        if (f == NULL)
+            continue;
+        fseek(f, sizeof(CDR_HEADER), SEEK_SET);
+        while (fread(&r, sizeof(r), 1, f) == 1 && r.outcome != 0)
+            count++;
+        fclose(f);
+    }
+    if (d != NULL)
+        closedir(d);
+    return count;
+}
+
+static void bench_cdr(int max_threads, int iterations)
+{
+    char dir[] = "/tmp/pbx_cdr.XXXXXX";
+    char path[PATH_MAX];
+    double *samples = malloc(6 * (size_t)iterations * sizeof(double));
+    pthread_t tids[max_threads];
+    struct cdr_arg arg = {iterations};
+
+    if (samples == NULL || mkdtemp(dir) == NULL)
+    {
+        perror("bench_cdr");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, sizeof(path), "%s/cdr", dir);
+
+    pbx = pbx_init();
+    TU *caller = register_dummy();
+    TU *callee = register_dummy();
+
+    log_set_level(LOG_LEVEL_OFF);
+    printf("command latency (6 commands per call)\n");
+    log_latencies("cdr off", caller, callee, samples, iterations);
+    if (cdr_start(path, 1 << 20) < 0)
+        exit(EXIT_FAILURE);
+    log_latencies("cdr on", caller, callee, samples, iterations);
+    cdr_flush();
+
+    printf("\n%8s %14s %14s %10s\n", "threads", "staged/s", "written/s", "dropped");
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        uint64_t dropped = cdr_dropped();
+        uint64_t written = cdr_written();
+        double start = now();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&tids[t], NULL, cdr_thread, &arg);
+        for (int t = 0; t < threads; t++)
+            pthread_join(tids[t], NULL);
+        double staged = now() - start;
+        cdr_flush();
+        double flushed = now() - start;
+        double total = (double)threads * iterations;
+        printf("%8d %14.0f %14.0f %9.1f%%\n", threads, total / staged, (cdr_written() - written) / flushed,
+               100.0 * (cdr_dropped() - dropped) / total);
+    }
+
+    // The writer alone: bursts of half a ring, each flushed and synced
+    // before the next, so that none are dropped.
+    CDR_RECORD r = {.caller = 1, .callee = 2, .outcome = CDR_ANSWERED};
+    uint64_t dropped = cdr_dropped();
+    double start = now();
+    for (int i = 0; i < iterations;)
+    {
+        for (int j = 0; j < CDR_RING_RECORDS / 2 && i < iterations; j++, i++)
+        {
+            r.setup = r.answer = r.hangup = i + 1;
+            cdr_write(&r);
+        }
+        cdr_flush();
+    }
+    printf("\nwriter: %.0f records/s in flushes of %d, %.1f%% dropped\n", iterations / (now() - start),
+           CDR_RING_RECORDS / 2, 100.0 * (cdr_dropped() - dropped) / iterations);
+
+    uint64_t counted = cdr_count(dir);
+    printf("%llu records written, %llu in the files\n", (unsigned long long)cdr_written(),
+           (unsigned long long)counted);
+
+    // The current file is still open; it is removed along with the others.
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL)
+    {
+        if (e->d_name[0] != '.')
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+    }
+    if (d != NULL)
+        closedir(d);
+    rmdir(dir);
+    free(samples);
+
+    if (counted != cdr_written())
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Allocations: the heap allocations made by calls between two TUs, by
+ * registering and unregistering a TU, and by chats in a bridge of 8
+ * members, counted over -n of each once as many have been made to warm
+ * the pools.  Fails if any is made in steady state.
+ */
+struct alloc_case
+{
+    char *name;
+    void (*run)(TU **tus);
+};
+
+static void alloc_call(TU **tus)
+{
+    tu_pickup(tus[0]);
+    tu_dial(tus[0], tu_extension(tus[1]));
+    tu_pickup(tus[1]);
+    tu_chat(tus[0], "benchmark");
+    tu_hangup(tus[0]);
+    tu_hangup(tus[1]);
+}
+
+static void alloc_register(TU **tus)
+{
+    TU *tu = pbx_register(pbx, tu_fileno(tus[0]));
+    pbx_unregister(pbx, tu);
+}
+
+static void alloc_bridge(TU **tus)
+{
+    outq_batch_begin();
+    tu_chat(tus[2], "benchmark");
+    outq_batch_end();
+}
+
+static void bench_alloc(int max_threads, int iterations)
+{
+    static struct alloc_case cases[] = {
+        {"call", alloc_call},
+        {"register", alloc_register},
+        {"bridge chat", alloc_bridge},
+    };
+    TU *tus[10];
+    int failures = 0;
+
+    pbx = pbx_init();
+    for (int i = 0; i < 10; i++)
+        tus[i] = register_dummy();
+    for (int i = 2; i < 10; i++)
+    {
+        tu_pickup(tus[i]);
+        tu_join(tus[i], 1);
+    }
+
+    printf("%-12s %14s %14s %14s\n", "operation", "warm-up allocs", "allocs/op", "ns/op");
+    for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        uint64_t before = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+        for (int i = 0; i < iterations; i++)
+            cases[c].run(tus);
+        uint64_t warm = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - before;
+
+        before = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+        double start = now();
+        for (int i = 0; i < iterations; i++)
+            cases[c].run(tus);
+        double elapsed = now() - start;
+        uint64_t steady = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - before;
+
+        printf("%-12s %14llu %14.3f %14.0f\n", cases[c].name, (unsigned long long)warm,
+               (double)steady / iterations, elapsed * 1e9 / iterations);
+        if (steady > 0)
+            failures++;
+    }
+    pool_report(stdout);
+
+    if (failures > 0)
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Dial plan: plans of 1K to 1M routes of 7 digits, one in 16 of them to a
+ * group, plus 100 prefix routes to trunks, are compiled and measured:
+ * time to compile, memory per route, and lookups/sec of the routes in a
+ * random order, directly and then through the installed plan from
+ * several threads.  Every route is checked to resolve as it should.
+ * Last, -n/1000 plans are installed one after the other while threads keep
+ * dialing, checking that every number dialed resolves all along.
+ */
+#define DIALPLAN_BENCH_PREFIXES 100
+#define DIALPLAN_BENCH_SWAP_ROUTES 10000
+
+struct dialplan_arg
+{
+    char (*numbers)[8];
+    int *expected;              // Extension of each number, -1 for a group
+    int routes;
+    int lookups;
+    volatile int *stop;
+    long done;
+    long wrong;
+};
+
+/*
+ * Number and extension of a route; the numbers are distinct as 7919 is
+ * prime to 10^7.
+ */
+static void dialplan_route(int i, char *number, int *ext)
+{
+    snprintf(number, 8, "%07u", (unsigned)((i * 7919UL + 1234567) % 10000000));
+    *ext = i % 16 == 0 ? -1 : i % 100000 + 16;
+}
+
+static char *dialplan_text(int routes, size_t *len)
+{
+    size_t size = (size_t)routes * 32 + DIALPLAN_BENCH_PREFIXES * 32;
+    char *text = malloc(size), number[8];
+    int ext;
+
+    *len = 0;
+    for (int i = 0; i < routes; i++)
+    {
+        dialplan_route(i, number, &ext);
+        if (ext < 0)
+            *len += sprintf(text + *len, "%s group 1 2 3\n", number);
+        else
+            *len += sprintf(text + *len, "%s ext %d\n", number, ext);
+    }
+    for (int i = 0; i < DIALPLAN_BENCH_PREFIXES; i++)
+        *len += sprintf(text + *len, "9%02d* trunk %d\n", i, i);
+    return text;
+}
+
+static void *dialplan_thread(void *arg)
+{
+    struct dialplan_arg *da = arg;
+    unsigned seed = (unsigned)(uintptr_t)&da;
+
+    for (int i = 0; i < da->lookups || (da->stop != NULL && !*da->stop); i++)
+    {
+        int r = rand_r(&seed) % da->routes;
+        int ext = dialplan_extension(da->numbers[r]);
+        if (da->expected[r] >= 0 ? ext != da->expected[r] : ext < 1 || ext > 3)
+            da->wrong++;
+        da->done++;
+    }
+    return NULL;
+}
+
+static void bench_dialplan(int max_threads, int iterations)
+{
+    static int sizes[] = {1000, 10000, 100000, 1000000};
+    int largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char (*numbers)[8] = malloc((size_t)largest * sizeof(*numbers));
+    int *expected = malloc((size_t)largest * sizeof(int));
+    int *order = malloc((size_t)iterations * sizeof(int));
+    pthread_t tids[max_threads];
+    struct dialplan_arg args[max_threads];
+    long wrong = 0;
+    unsigned seed = 1;
+
+    for (int i = 0; i < largest; i++)
+        dialplan_route(i, numbers[i], &expected[i]);
+
+    printf("%8s %10s %12s %10s %12s %14s", "routes", "compile", "bytes", "bytes/rt", "lookup ns", "lookups/s");
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+        printf(" %10s%-3d", "threads ", threads);
+    printf("\n");
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int routes = sizes[s];
+        size_t len, count;
+        char *text = dialplan_text(routes, &len);
+        DIALPLAN_ROUTE route;
+
+        double start = now();
+        DIALPLAN *plan = dialplan_compile(text, len);
+        double compile = now() - start;
+        free(text);
+        if (plan == NULL)
+            exit(EXIT_FAILURE);
+        size_t bytes = dialplan_footprint(plan, &count);
+
+        // Every route, and a number under each prefix.
+        for (int i = 0; i < routes; i++)
+        {
+            if (dialplan_lookup(plan, numbers[i], 7, &route) < 0 || route.matched != 7 ||
+                (expected[i] >= 0 ? route.kind != DIALPLAN_EXTENSION || route.target != expected[i]
+                                  : route.kind != DIALPLAN_GROUP))
+                wrong++;
+        }
+        for (int i = 0; i < DIALPLAN_BENCH_PREFIXES; i++)
+        {
+            char number[16];
+            snprintf(number, sizeof(number), "9%02d12345678", i);
+            if (dialplan_lookup(plan, number, strlen(number), &route) < 0 || route.kind != DIALPLAN_TRUNK ||
+                route.target != i || route.matched != 3)
+                wrong++;
+        }
+
+        for (int i = 0; i < iterations; i++)
+            order[i] = rand_r(&seed) % routes;
+        start = now();
+        for (int i = 0; i < iterations; i++)
+            dialplan_lookup(plan, numbers[order[i]], 7, &route);
+        double elapsed = now() - start;
+        printf("%8zu %9.1fms %12zu %10.1f %12.1f %14.0f", count, compile * 1e3, bytes, (double)bytes / count,
+               elapsed * 1e9 / iterations, iterations / elapsed);
+
+        // Through the installed plan, as the server dials.
+        dialplan_install(plan);
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+        {
+            start = now();
+            for (int t = 0; t < threads; t++)
+            {
+                args[t] = (struct dialplan_arg){numbers, expected, routes, iterations, NULL, 0, 0};
+                pthread_create(&tids[t], NULL, dialplan_thread, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+            {
+                pthread_join(tids[t], NULL);
+                wrong += args[t].wrong;
+            }
+            printf(" %13.0f", (double)threads * iterations / (now() - start));
+        }
+        printf("\n");
+        dialplan_install(NULL);
+    }
+
+    // Swaps under load: the same routes, compiled again each time.
+    size_t len;
+    char *text = dialplan_text(DIALPLAN_BENCH_SWAP_ROUTES, &len);
+    int swaps = iterations / 1000 > 0 ? iterations / 1000 : 1;
+    volatile int stop = 0;
+    long done = 0;
+
+    dialplan_install(dialplan_compile(text, len));
+    for (int t = 0; t < max_threads; t++)
+    {
+        args[t] = (struct dialplan_arg){numbers, expected, DIALPLAN_BENCH_SWAP_ROUTES, 0, &stop, 0, 0};
+        pthread_create(&tids[t], NULL, dialplan_thread, &args[t]);
+    }
+    double start = now(), installing = 0.0, longest = 0.0;
+    for (int i = 0; i < swaps; i++)
+    {
+        DIALPLAN *plan = dialplan_compile(text, len);
+        double before = now();
+        dialplan_install(plan);
+        double took = now() - before;
+        installing += took;
+        if (took > longest)
+            longest = took;
+    }
+    double elapsed = now() - start;
+    stop = 1;
+    for (int t = 0; t < max_threads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        done += args[t].done;
+        wrong += args[t].wrong;
+    }
+    dialplan_install(NULL);
+    free(text);
+    printf("\nswaps: %d plans of %d routes under %d threads, install mean %.1f us max %.1f us, %.0f lookups/s\n",
+           swaps, DIALPLAN_BENCH_SWAP_ROUTES, max_threads, installing * 1e6 / swaps, longest * 1e6, done / elapsed);
+    printf("%ld lookups resolved wrongly\n", wrong);
+
+    free(numbers);
+    free(expected);
+    free(order);
+    if (wrong > 0)
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Trunking: call setup latency between two switches, each a forked server,
+ * joined by a trunk, against that of calls within one switch.  The near
+ * switch routes numbers starting with 9 to the trunk, and its clients call
+ * a client of the far switch through it and one of their own directly,
+ * one call at a time.  For each call, the time from dialing to the callee
+ * ringing, from its answer to the caller being connected, and from the
+ * caller's hangup to the callee getting dial tone, is measured at the
+ * clients.
+ */
+#define TRUNK_BENCH_CALLS_PER 50    // Iterations per call measured
+#define TRUNK_BENCH_UP_TRIES 500    // Attempts to call before the trunk is up
+
+static pid_t trunk_server(int threads, int trunk_port, int *ports)
+{
+    static char port[16];
+    int pipefd[2];
+    pid_t pid;
+
+    if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+    {
+        perror("trunk_server");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        close(pipefd[0]);
+        pbx = pbx_init();
+        ports[1] = 0;
+        if (trunk_port == 0)
+        {
+            if ((ports[1] = trunk_listen("0")) < 0)
+                exit(EXIT_FAILURE);
+        }
+        else
+        {
+            char *plan = "9* trunk 1\n";
+            dialplan_install(dialplan_compile(plan, strlen(plan)));
+            snprintf(port, sizeof(port), "%d", trunk_port);
+            if (trunk_connect(1, "127.0.0.1", port) < 0)
+                exit(EXIT_FAILURE);
+        }
+        if (reactor_start(threads) < 0 || (ports[0] = listener_start("0", 1, reactor_add)) < 0)
+            exit(EXIT_FAILURE);
+        if (write(pipefd[1], ports, 2 * sizeof(int)) != 2 * sizeof(int))
+            exit(EXIT_FAILURE);
+        while (1)
+            pause();
+    }
+
+    close(pipefd[1]);
+    if (read(pipefd[0], ports, 2 * sizeof(int)) != 2 * sizeof(int))
+    {
+        fprintf(stderr, "Server failed to start\n");
+        exit(EXIT_FAILURE);
+    }
+    close(pipefd[0]);
+    return pid;
+}
+
+/*
+ * Place calls from a caller to a callee, measuring each.
+ *
+ * @param number  The number dialed.
+ */
+static void trunk_calls(struct hclient *caller, struct hclient *callee, char *number, int calls,
+                        double *ring, double *answer, double *release)
+{
+    char cmd[64];
+
+    snprintf(cmd, sizeof(cmd), "dial %s\r\n", number);
+    for (int i = 0; i < calls; i++)
+    {
+        hclient_send(caller, "pickup\r\n");
+        hclient_expect(caller, tu_state_names[TU_DIAL_TONE]);
+
+        double start = now();
+        hclient_send(caller, cmd);
+        hclient_expect(callee, tu_state_names[TU_RINGING]);
+        ring[i] = now() - start;
+        hclient_expect(caller, tu_state_names[TU_RING_BACK]);
+
+        start = now();
+        hclient_send(callee, "pickup\r\n");
+        hclient_expect(caller, tu_state_names[TU_CONNECTED]);
+        answer[i] = now() - start;
+        hclient_expect(callee, tu_state_names[TU_CONNECTED]);
+
+        start = now();
+        hclient_send(caller, "hangup\r\n");
+        hclient_expect(callee, tu_state_names[TU_DIAL_TONE]);
+        release[i] = now() - start;
+        hclient_expect(caller, tu_state_names[TU_ON_HOOK]);
+        hclient_send(callee, "hangup\r\n");
+        hclient_expect(callee, tu_state_names[TU_ON_HOOK]);
+
+        if (failures > 0)
+            break;
+    }
+}
+
+static void bench_trunk(int max_threads, int iterations)
+{
+    int calls = iterations / TRUNK_BENCH_CALLS_PER > 0 ? iterations / TRUNK_BENCH_CALLS_PER : 1;
+    double *ring = malloc(calls * sizeof(double));
+    double *answer = malloc(calls * sizeof(double));
+    double *release = malloc(calls * sizeof(double));
+    int far_ports[2], near_ports[2];
+    struct hclient caller, local, remote;
+    char number[16];
+
+    pid_t far = trunk_server(max_threads, 0, far_ports);
+    pid_t near = trunk_server(max_threads, far_ports[1], near_ports);
+    hclient_connect(&caller, near_ports[0]);
+    hclient_connect(&local, near_ports[0]);
+    hclient_connect(&remote, far_ports[0]);
+
+    // Until the trunk is up, calls on it fail.
+    snprintf(number, sizeof(number), "9%d", remote.ext);
+    int up = 0;
+    for (int i = 0; i < TRUNK_BENCH_UP_TRIES && !up && failures == 0; i++)
+    {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "pickup\r\ndial %s\r\n", number);
+        hclient_send(&caller, cmd);
+        hclient_expect(&caller, tu_state_names[TU_DIAL_TONE]);
+        char *line = hclient_expect(&caller, "");
+        up = line != NULL && strncmp(line, tu_state_names[TU_RING_BACK], strlen(tu_state_names[TU_RING_BACK])) == 0;
+        hclient_send(&caller, "hangup\r\n");
+        hclient_expect(&caller, tu_state_names[TU_ON_HOOK]);
+        if (up)
+            hclient_expect(&remote, tu_state_names[TU_RINGING]);
+        else
+            usleep(10000);
+    }
+    if (up)
+        hclient_expect(&remote, tu_state_names[TU_ON_HOOK]);
+    else
+    {
+        fprintf(stderr, "Trunk not up\n");
+        failures++;
+    }
+
+    printf("%d calls, one at a time, %d reactor threads per switch\n", calls, max_threads);
+    if (failures == 0)
+    {
+        char local_number[16];
+        snprintf(local_number, sizeof(local_number), "%d", local.ext);
+        trunk_calls(&caller, &local, local_number, calls, ring, answer, release);
+        print_latencies("local ring", ring, calls);
+        print_latencies("local answer", answer, calls);
+        print_latencies("local hangup", release, calls);
+    }
+    if (failures == 0)
+    {
+        trunk_calls(&caller, &remote, number, calls, ring, answer, release);
+        print_latencies("trunk ring", ring, calls);
+        print_latencies("trunk answer", answer, calls);
+        print_latencies("trunk hangup", release, calls);
+    }
+    printf("%d failures\n", failures);
+
+    kill(near, SIGKILL);
+    kill(far, SIGKILL);
+    waitpid(near, NULL, 0);
+    waitpid(far, NULL, 0);
+    close(caller.fd);
+    close(local.fd);
+    close(remote.fd);
+    free(ring);
+    free(answer);
+    free(release);
+    if (failures > 0)
+        exit(EXIT_FAILURE);
+}
+
+/*
+ * Sharding: each thread owns a shard of the PBX (see shard.h), in which a
+ * pair of TUs is registered for it, and places calls between them
+ * (pickup, dial, answer, hang up both ends) as fast as it can, handling
+ * the messages posted to its shard as it goes.  With a single shard, every
+ * dial looks its callee up under the same registry lock; with a shard per
+ * thread, each thread's calls take only locks of their own shard.  Calls
+ * within the thread's shard are compared with calls to a TU registered in
+ * the next thread's shard, which are made by messages between the owners
+ * of the two shards: the caller waits for the callee's shard to make the
+ * callee ring, and for its own shard to hear of the answer.
+ */
+struct shard_arg
+{
+    int home;
+    int fds[2];
+    int iterations;
+    TU *caller;
+    TU *callee;
+};
+
+static int shard_running;
+
+/*
+ * Handle the messages of a thread's shard until a TU is in a given state.
+ */
+static void shard_wait(int home, TU *tu, TU_STATE state)
+{
+    while (tu_state(tu) != (int)state)
+    {
+        pbx_shard_run(pbx, home);
+        sched_yield();
+    }
+}
+
+static void *shard_thread(void *arg)
+{
+    struct shard_arg *sa = arg;
+
+    pbx_shard_claim(pbx, sa->home);
+    for (int i = 0; i < sa->iterations; i++)
+    {
+        tu_pickup(sa->caller);
+        tu_dial(sa->caller, tu_extension(sa->callee));
+        shard_wait(sa->home, sa->callee, TU_RINGING);
+        tu_pickup(sa->callee);
+        shard_wait(sa->home, sa->caller, TU_CONNECTED);
+        tu_hangup(sa->caller);
+        tu_hangup(sa->callee);
+        pbx_shard_run(pbx, sa->home);
+    }
+
+    // The other threads' calls may still need this shard's messages.
+    __atomic_sub_fetch(&shard_running, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&shard_running, __ATOMIC_ACQUIRE) > 0)
+    {
+        pbx_shard_run(pbx, sa->home);
+        sched_yield();
+    }
+    return NULL;
+}
+
+static double shard_rate(int threads, int shards, int cross, int iterations, struct shard_arg *args)
+{
+    pthread_t tids[threads];
+
+    registry_set_shards(shards);
+    pbx = pbx_init();
+
+    for (int t = 0; t < threads; t++)
+    {
+        args[t].home = t % shards;
+        args[t].iterations = iterations;
+        registry_set_home(t % shards);
+        args[t].caller = pbx_register(pbx, args[t].fds[0]);
+        registry_set_home((t + cross) % shards);
+        args[t].callee = pbx_register(pbx, args[t].fds[1]);
+        if (args[t].caller == NULL || args[t].callee == NULL)
+        {
+            fprintf(stderr, "Unable to register a TU\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    registry_set_home(-1);
+
+    shard_running = threads;
+    double start = now();
+    for (int t = 0; t < threads; t++)
+        pthread_create(&tids[t], NULL, shard_thread, &args[t]);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    double rate = (double)threads * iterations / (now() - start);
+
+    pbx_shard_drain_all(pbx);
+    for (int t = 0; t < threads; t++)
+    {
+        pbx_unregister(pbx, args[t].caller);
+        pbx_unregister(pbx, args[t].callee);
+    }
+    pbx_shard_drain_all(pbx);
+    pbx_shutdown(pbx);
+    return rate;
+}
+
+static void bench_shard(int max_threads, int iterations)
+{
+    struct shard_arg args[max_threads];
+
+    for (int t = 0; t < max_threads; t++)
+    {
+        args[t].fds[0] = open("/dev/null", O_WRONLY);
+        args[t].fds[1] = open("/dev/null", O_WRONLY);
+    }
+
+    printf("%8s %14s %14s %14s %14s %14s\n", "threads", "1 shard", "shard/thread", "calls/sec/thr", "cross-shard",
+           "cross/thr");
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double single = shard_rate(threads, 1, 0, iterations, args);
+        double sharded = shard_rate(threads, threads, 0, iterations, args);
+        if (threads == 1)
+        {
+            // There is no other shard to call.
+            printf("%8d %14.0f %14.0f %14.0f %14s %14s\n", threads, single, sharded, sharded, "-", "-");
+            continue;
+        }
+        double cross = shard_rate(threads, threads, 1, iterations, args);
+        printf("%8d %14.0f %14.0f %14.0f %14.0f %14.0f\n", threads, single, sharded, sharded / threads, cross,
+               cross / threads);
+    }
+
+    registry_set_shards(1);
+    for (int t = 0; t < max_threads; t++)
+    {
+        close(args[t].fds[0]);
+        close(args[t].fds[1]);
+    }
+}
@@ -0,0 +1,309 @@
+/*
+ * Reader of the call detail records written by the PBX server with -c
+ * (see cdr.h).
+ *
+ * Prints the records of the given files, oldest file first if they are
+ * named as the server rotates them, one call per line:
+ *
+ *   2026-10-17T12:00:00.123456 caller=4 callee=5 outcome=answered ring_ms=12.3 talk_s=4.567 ended_by=callee
+ *
+ * With -s, prints a summary instead: the number of calls of each outcome,
+ * the answer ratio, ring and talk times, the peak number of calls in
+ * progress at once and the busiest hour.
+ *
+ * Usage: pbx_cdr [-s] <file>...
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cdr.h"
+
+#define NUM_OUTCOMES (CDR_ERROR + 1)
+#define NS_PER_HOUR (3600ULL * 1000000000)
+
+static char *outcome_names[NUM_OUTCOMES] = {
+    [CDR_ANSWERED] "answered",
+    [CDR_CANCELLED] "cancelled",
+    [CDR_REJECTED] "rejected",
+    [CDR_BUSY] "busy",
+    [CDR_ERROR] "error",
+};
+
+/*
+ * Accumulated by the summary.
+ */
+struct summary
+{
+    uint64_t records;
+    uint64_t outcomes[NUM_OUTCOMES];
+    uint64_t disconnected;
+    double ring_ns;             // Total time to answer of answered calls
+    double talk_ns;             // Total time connected
+    uint64_t first;             // Earliest setup
+    uint64_t last;              // Latest hangup
+    uint64_t *events;           // Setups and hangups of the calls that rang, tagged in bit 0
+    size_t nevents;
+    size_t cap;
+};
+
+static void usage(void);
+static int read_file(char *path, int summarize, struct summary *s);
+static void print_record(const CDR_RECORD *r);
+static void add_record(struct summary *s, const CDR_RECORD *r);
+static void print_summary(struct summary *s);
+static void format_time(char *buf, size_t len, uint64_t ns);
+static int compare_paths(const void *a, const void *b);
+static int compare_events(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+    int summarize = 0;
+    int option;
+    struct summary s = {.first = UINT64_MAX};
+
+    while ((option = getopt(argc, argv, "s")) != EOF)
+    {
+        switch (option)
+        {
+        case 's':
+            summarize = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc)
+        usage();
+
+    qsort(argv + optind, argc - optind, sizeof(char *), compare_paths);
+
+    int status = EXIT_SUCCESS;
+    for (int i = optind; i < argc; i++)
+    {
+        if (read_file(argv[i], summarize, &s) < 0)
+            status = EXIT_FAILURE;
+    }
+
+    if (summarize)
+        print_summary(&s);
+    return status;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pbx_cdr [-s] <file>...\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Print or summarize the records of one file, up to the first unused
+ * record.
+ *
+ * @return 0 if successful, -1 if the file is not a call detail record file.
+ */
+static int read_file(char *path, int summarize, struct summary *s)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size < sizeof(CDR_HEADER))
+    {
+        fprintf(stderr, "%s: not a call detail record file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(path);
+        return -1;
+    }
+
+    CDR_HEADER *h = (CDR_HEADER *)map;
+    if (memcmp(h->magic, CDR_MAGIC, sizeof(h->magic)) != 0 || h->record_size != sizeof(CDR_RECORD) ||
+        h->header_size > st.st_size)
+    {
+        fprintf(stderr, "%s: not a call detail record file\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    size_t n = (st.st_size - h->header_size) / sizeof(CDR_RECORD);
+    const CDR_RECORD *records = (const CDR_RECORD *)(map + h->header_size);
+    for (size_t i = 0; i < n && records[i].outcome != 0; i++)
+    {
+        if (summarize)
+            add_record(s, &records[i]);
+        else
+            print_record(&records[i]);
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
+
+static void print_record(const CDR_RECORD *r)
+{
+    char stamp[40];
+
+    format_time(stamp, sizeof(stamp), r->setup);
+    printf("%s caller=%d callee=%d outcome=%s", stamp, r->caller, r->callee,
+           r->outcome < NUM_OUTCOMES ? outcome_names[r->outcome] : "unknown");
+    if (r->outcome == CDR_ANSWERED)
+        printf(" ring_ms=%.1f talk_s=%.3f", (r->answer - r->setup) / 1e6, (r->hangup - r->answer) / 1e9);
+    else if (r->outcome == CDR_CANCELLED || r->outcome == CDR_REJECTED)
+        printf(" ring_ms=%.1f", (r->hangup - r->setup) / 1e6);
+    if (r->outcome <= CDR_REJECTED)
+        printf(" ended_by=%s", r->flags & CDR_FLAG_CALLEE_ENDED ? "callee" : "caller");
+    if (r->flags & CDR_FLAG_DISCONNECTED)
+        printf(" disconnected=1");
+    printf("\n");
+}
+
+static void add_record(struct summary *s, const CDR_RECORD *r)
+{
+    s->records++;
+    if (r->outcome < NUM_OUTCOMES)
+        s->outcomes[r->outcome]++;
+    if (r->flags & CDR_FLAG_DISCONNECTED)
+        s->disconnected++;
+    if (r->outcome == CDR_ANSWERED)
+    {
+        s->ring_ns += r->answer - r->setup;
+        s->talk_ns += r->hangup - r->answer;
+    }
+    if (r->setup < s->first)
+        s->first = r->setup;
+    if (r->hangup > s->last)
+        s->last = r->hangup;
+
+    // A call occupies the switch from its setup to its hangup; the tag
+    // orders a hangup before a setup at the same time.
+    if (r->outcome <= CDR_REJECTED)
+    {
+        if (s->nevents + 2 > s->cap)
+        {
+            s->cap = s->cap ? 2 * s->cap : 4096;
+            s->events = realloc(s->events, s->cap * sizeof(uint64_t));
+        }
+        s->events[s->nevents++] = r->setup << 1 | 1;
+        s->events[s->nevents++] = r->hangup << 1;
+    }
+}
+
+static void print_summary(struct summary *s)
+{
+    char stamp[40];
+
+    if (s->records == 0)
+    {
+        printf("no calls\n");
+        return;
+    }
+
+    format_time(stamp, sizeof(stamp), s->first);
+    printf("%llu calls from %s", (unsigned long long)s->records, stamp);
+    format_time(stamp, sizeof(stamp), s->last);
+    printf(" to %s\n", stamp);
+    for (int o = CDR_ANSWERED; o < NUM_OUTCOMES; o++)
+        printf("  %-10s %12llu %6.1f%%\n", outcome_names[o], (unsigned long long)s->outcomes[o],
+               100.0 * s->outcomes[o] / s->records);
+    printf("  %-10s %12llu\n", "disconnected", (unsigned long long)s->disconnected);
+
+    uint64_t answered = s->outcomes[CDR_ANSWERED];
+    uint64_t rang = answered + s->outcomes[CDR_CANCELLED] + s->outcomes[CDR_REJECTED];
+    if (rang > 0)
+        printf("answer ratio %.1f%% of calls that rang\n", 100.0 * answered / rang);
+    if (answered > 0)
+        printf("ring time %.1f ms mean, talk time %.3f s mean, %.1f s total\n", s->ring_ns / answered / 1e6,
+               s->talk_ns / answered / 1e9, s->talk_ns / 1e9);
+
+    // Peak calls in progress, and the hour in which most calls were set up.
+    qsort(s->events, s->nevents, sizeof(uint64_t), compare_events);
+    long current = 0, peak = 0;
+    uint64_t peak_at = 0, hour = 0, hour_calls = 0, busiest = 0, busiest_calls = 0;
+    for (size_t i = 0; i < s->nevents; i++)
+    {
+        uint64_t t = s->events[i] >> 1;
+        if (!(s->events[i] & 1))
+        {
+            current--;
+            continue;
+        }
+        if (++current > peak)
+        {
+            peak = current;
+            peak_at = t;
+        }
+        if (t / NS_PER_HOUR != hour)
+        {
+            hour = t / NS_PER_HOUR;
+            hour_calls = 0;
+        }
+        if (++hour_calls > busiest_calls)
+        {
+            busiest_calls = hour_calls;
+            busiest = hour;
+        }
+    }
+    if (peak > 0)
+    {
+        format_time(stamp, sizeof(stamp), peak_at);
+        printf("peak %ld calls in progress at %s\n", peak, stamp);
+        format_time(stamp, sizeof(stamp), busiest * NS_PER_HOUR);
+        printf("busiest hour from %.13s:00 with %llu calls that rang\n", stamp, (unsigned long long)busiest_calls);
+    }
+    free(s->events);
+}
+
+/*
+ * Format a time as 2026-10-17T12:00:00.123456 (UTC).
+ */
+static void format_time(char *buf, size_t len, uint64_t ns)
+{
+    time_t secs = ns / 1000000000;
+    struct tm tm;
+    char stamp[32];
+
+    gmtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf, len, "%s.%06u", stamp, (unsigned)(ns % 1000000000 / 1000));
+}
+
+/*
+ * Rotated files ("<path>.<time>") sort by the time they were started, and
+ * before the current file ("<path>").
+ */
+static int compare_paths(const void *a, const void *b)
+{
+    const char *pa = *(char *const *)a, *pb = *(char *const *)b;
+    size_t la = strlen(pa), lb = strlen(pb);
+
+    if (la < lb && strncmp(pa, pb, la) == 0)
+        return 1;
+    if (lb < la && strncmp(pa, pb, lb) == 0)
+        return -1;
+    return strcmp(pa, pb);
+}
+
+static int compare_events(const void *a, const void *b)
+{
+    uint64_t ea = *(const uint64_t *)a, eb = *(const uint64_t *)b;
+    return ea < eb ? -1 : ea > eb ? 1 : 0;
+}
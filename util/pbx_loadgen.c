@@ -0,0 +1,602 @@
+/*
+ * Load generator for the PBX server.
+ *
+ * Simulates many TUs from a single process.  Each simulated TU holds its
+ * own connection to the server and is driven by the same action table as
+ * the tester; every state notification it receives is checked against the
+ * tester's table of expected next states.  All connections are served by a
+ * single event loop, and delays are scheduled as timers rather than slept,
+ * so notifications keep being read while a TU is idle.
+ *
+ * Usage: pbx_loadgen -p <port> [-h <host>] [-n <TUs>] [-t <seconds>]
+ *                    [-d <microseconds>] [-x <min extension> -y <max extension>]
+ *                    [-s <seed>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "parser.h"
+#include "csapp.h"
+#include "tester_tables.h"
+
+#define DEFAULT_TUS 1000
+#define DEFAULT_SECONDS 10
+#define DEFAULT_DELAY 1000      // Basic delay time in microseconds
+#define DRAIN_SECONDS 2         // Time allowed for outstanding responses at the end
+#define MAX_EVENTS 256
+
+/*
+ * Latency histogram with log-linear buckets: each power of two is split
+ * into HIST_SUB_BUCKETS buckets, which keeps the relative error of a
+ * reported percentile below 1/HIST_SUB_BUCKETS at any magnitude.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/*
+ * State of one simulated TU, corresponding to the globals of the tester.
+ */
+struct sim_tu
+{
+    int fd;
+    int ext;
+    TU_STATE state;
+    int expected;
+    int resync;
+    int last_command;
+    int awaiting;               // A command has been sent and not yet answered
+    int delaying;               // Waiting on the timer list
+    int closed;
+    uint64_t sent_at;
+    uint64_t wake_at;
+    struct sim_tu *next_timer;
+    PARSER *parser;
+};
+
+static struct
+{
+    uint64_t commands;
+    uint64_t calls;
+    uint64_t chats;
+    uint64_t resyncs;
+    uint64_t unexpected;
+    uint64_t bad_chats;
+    uint64_t unrecognized;
+    uint64_t disconnects;
+    uint64_t send_failures;
+    uint64_t unanswered;
+} stats;
+
+static struct histogram latency;
+
+static struct sim_tu *tus;
+static int num_tus;
+static int *extensions;
+static int num_extensions;
+static int min_ext = -1, max_ext = -1;
+static uint64_t basic_delay = DEFAULT_DELAY * 1000ULL;
+static int stopping;
+
+// Delays all have the same length, so a FIFO list is ordered by deadline.
+static struct sim_tu *timers_head, *timers_tail;
+
+static void usage(void);
+static uint64_t now_ns(void);
+static void raise_fd_limit(void);
+static int connect_all(char *host, char *port, int epfd);
+static void tu_readable(struct sim_tu *tu);
+static void handle_message(struct sim_tu *tu, char *msg);
+static void next_action(struct sim_tu *tu);
+static void send_command(struct sim_tu *tu, int cmd);
+static void tu_fail(struct sim_tu *tu, uint64_t *counter);
+static void run_timers(uint64_t t);
+static int choose_action(TU_STATE state);
+static int parse_message(char *msg);
+static char *unparse_state_set(int set);
+static void hist_record(struct histogram *h, uint64_t value);
+static uint64_t hist_percentile(struct histogram *h, double p);
+
+int main(int argc, char *argv[])
+{
+    char *host = "localhost";
+    char *port = NULL;
+    int seconds = DEFAULT_SECONDS;
+    int option;
+
+    num_tus = DEFAULT_TUS;
+    while ((option = getopt(argc, argv, "h:p:n:t:d:x:y:s:")) != EOF)
+    {
+        switch (option)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'n':
+            num_tus = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'd':
+            basic_delay = atoll(optarg) * 1000ULL;
+            break;
+        case 'x':
+            min_ext = atoi(optarg);
+            break;
+        case 'y':
+            max_ext = atoi(optarg);
+            break;
+        case 's':
+            srandom(atoi(optarg));
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (port == NULL || num_tus < 1 || seconds < 1 || (min_ext < 0) != (max_ext < 0) || min_ext > max_ext)
+        usage();
+
+    raise_fd_limit();
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        unix_error("epoll_create1 error");
+
+    tus = Calloc(num_tus, sizeof(struct sim_tu));
+    extensions = Calloc(num_tus, sizeof(int));
+    if (connect_all(host, port, epfd) < 0)
+        exit(EXIT_FAILURE);
+
+    uint64_t start = now_ns();
+    uint64_t end = start + seconds * 1000000000ULL;
+    uint64_t drain_end = end + DRAIN_SECONDS * 1000000000ULL;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1)
+    {
+        uint64_t t = now_ns();
+        if (!stopping && t >= end)
+            stopping = 1;
+        if (stopping)
+        {
+            int outstanding = 0;
+            for (int i = 0; i < num_tus && !outstanding; i++)
+                outstanding = tus[i].awaiting && !tus[i].closed;
+            if (!outstanding || t >= drain_end)
+                break;
+        }
+
+        uint64_t wake = stopping ? drain_end : end;
+        if (timers_head != NULL && timers_head->wake_at < wake)
+            wake = timers_head->wake_at;
+        int timeout = wake > t ? (wake - t + 999999) / 1000000 : 0;
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_wait error");
+
+        for (int i = 0; i < n; i++)
+            tu_readable(events[i].data.ptr);
+        run_timers(now_ns());
+    }
+
+    double elapsed = (end - start) / 1e9;
+    for (int i = 0; i < num_tus; i++)
+    {
+        if (tus[i].awaiting && !tus[i].closed)
+            stats.unanswered++;
+    }
+
+    uint64_t errors = stats.unexpected + stats.bad_chats + stats.unrecognized +
+                      stats.disconnects + stats.send_failures + stats.unanswered;
+
+    printf("TUs %d, %.1f s, basic delay %llu us\n", num_tus, elapsed,
+           (unsigned long long)(basic_delay / 1000));
+    printf("commands     %10llu  %10.0f/sec\n", (unsigned long long)stats.commands, stats.commands / elapsed);
+    printf("calls        %10llu  %10.0f/sec\n", (unsigned long long)stats.calls, stats.calls / elapsed);
+    printf("chats        %10llu\n", (unsigned long long)stats.chats);
+    printf("resyncs      %10llu\n", (unsigned long long)stats.resyncs);
+    printf("latency      n=%-8llu p50=%8.1fus p99=%8.1fus p99.9=%8.1fus max=%8.1fus\n",
+           (unsigned long long)latency.count, hist_percentile(&latency, 0.5) / 1e3,
+           hist_percentile(&latency, 0.99) / 1e3, hist_percentile(&latency, 0.999) / 1e3,
+           latency.max / 1e3);
+    printf("errors       %10llu  (unexpected state %llu, chat when not connected %llu, "
+           "unrecognized %llu, disconnected %llu, send failed %llu, unanswered %llu)\n",
+           (unsigned long long)errors, (unsigned long long)stats.unexpected,
+           (unsigned long long)stats.bad_chats, (unsigned long long)stats.unrecognized,
+           (unsigned long long)stats.disconnects, (unsigned long long)stats.send_failures,
+           (unsigned long long)stats.unanswered);
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pbx_loadgen -p <port> [-h <host>] [-n <TUs>] [-t <seconds>] "
+                    "[-d <microseconds>] "
+                    "[-x <min extension> -y <max extension>] [-s <seed>]\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Each simulated TU needs a descriptor, so lift the soft descriptor limit
+ * as far as the hard limit allows.
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * Connect all the simulated TUs and wait for each of them to be assigned
+ * an extension, so that every TU can be dialed once the load starts.
+ */
+static int connect_all(char *host, char *port, int epfd)
+{
+    for (int i = 0; i < num_tus; i++)
+    {
+        struct sim_tu *tu = &tus[i];
+
+        if ((tu->fd = open_clientfd(host, port)) < 0)
+        {
+            fprintf(stderr, "Unable to connect TU %d to %s:%s: %s\n", i, host, port, strerror(errno));
+            return -1;
+        }
+        fcntl(tu->fd, F_SETFL, fcntl(tu->fd, F_GETFL) | O_NONBLOCK);
+
+        tu->ext = -1;
+        tu->state = TU_ON_HOOK;
+        tu->expected = 1 << TU_ON_HOOK;
+        tu->last_command = TU_HANGUP_CMD;
+        tu->parser = Malloc(sizeof(PARSER));
+        parser_init(tu->parser, tu->fd);
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = tu};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tu->fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+
+    // The load is held back (by treating every TU as stopping) until all
+    // the greetings have arrived.
+    stopping = 1;
+    uint64_t deadline = now_ns() + 30 * 1000000000ULL;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (num_extensions < num_tus)
+    {
+        if (now_ns() > deadline)
+        {
+            fprintf(stderr, "Only %d of %d TUs were registered\n", num_extensions, num_tus);
+            return -1;
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++)
+            tu_readable(events[i].data.ptr);
+    }
+    stopping = 0;
+
+    for (int i = 0; i < num_tus; i++)
+        next_action(&tus[i]);
+    return 0;
+}
+
+/*
+ * Read and handle whatever notifications are available from the server.
+ */
+static void tu_readable(struct sim_tu *tu)
+{
+    if (tu->closed)
+        return;
+
+    ssize_t n = parser_fill(tu->parser);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n <= 0)
+    {
+        fprintf(stderr, "TU %d: disconnected by server\n", tu->ext);
+        tu_fail(tu, &stats.disconnects);
+        return;
+    }
+
+    char *line;
+    size_t len;
+    while (!tu->closed && (line = parser_next(tu->parser, &len)) != NULL)
+        handle_message(tu, line);
+}
+
+/*
+ * Handle a notification from the server, checking that the state it
+ * reports is one of those expected given the last command sent.
+ * This follows the logic of the tester, including resynchronization
+ * when a command has crossed an asynchronous notification in transit.
+ */
+static void handle_message(struct sim_tu *tu, char *msg)
+{
+    int new = parse_message(msg);
+
+    if (new < 0)
+    {
+        fprintf(stderr, "TU %d: unrecognized message: %s\n", tu->ext, msg);
+        tu_fail(tu, &stats.unrecognized);
+        return;
+    }
+
+    if (new == NUM_STATES)
+    {
+        if (tu->state != TU_CONNECTED)
+        {
+            fprintf(stderr, "TU %d: chat received when not in state %s\n",
+                    tu->ext, tu_state_names[TU_CONNECTED]);
+            tu_fail(tu, &stats.bad_chats);
+            return;
+        }
+        stats.chats++;
+        return;
+    }
+
+    if (tu->ext < 0 && new == TU_ON_HOOK)
+    {
+        tu->ext = atoi(msg + strlen(tu_state_names[TU_ON_HOOK]));
+        extensions[num_extensions++] = tu->ext;
+    }
+
+    if (1 << new & tu->expected)
+    {
+        tu->resync = 0;
+    }
+    else if (1 << (new + RESYNC) & tu->expected)
+    {
+        tu->resync = 1;
+        stats.resyncs++;
+    }
+    else
+    {
+        fprintf(stderr, "TU %d: new state %s is not in expected set %s\n",
+                tu->ext, tu_state_names[new], unparse_state_set(tu->expected));
+        tu_fail(tu, &stats.unexpected);
+        return;
+    }
+
+    if (tu->state == TU_RING_BACK && new == TU_CONNECTED)
+        stats.calls++;
+    tu->state = new;
+
+    if (tu->resync)
+    {
+        tu->expected = next_states[new][tu->last_command];
+        return;
+    }
+
+    if (tu->awaiting)
+    {
+        hist_record(&latency, now_ns() - tu->sent_at);
+        tu->awaiting = 0;
+    }
+    next_action(tu);
+}
+
+/*
+ * Choose and carry out the next action of a TU.  A delay puts the TU on
+ * the timer list; until it expires, the only notifications expected are
+ * asynchronous ones.
+ */
+static void next_action(struct sim_tu *tu)
+{
+    int cmd = DELAY_COMMAND;
+
+    if (!stopping)
+        cmd = choose_action(tu->state);
+
+    tu->expected = next_states[tu->state][cmd];
+    tu->last_command = cmd;
+
+    if (cmd == DELAY_COMMAND)
+    {
+        if (stopping || tu->delaying)
+            return;
+        tu->delaying = 1;
+        tu->wake_at = now_ns() + basic_delay;
+        tu->next_timer = NULL;
+        if (timers_tail != NULL)
+            timers_tail->next_timer = tu;
+        else
+            timers_head = tu;
+        timers_tail = tu;
+        return;
+    }
+
+    send_command(tu, cmd);
+}
+
+/*
+ * Send a command to the server on behalf of a TU.
+ */
+static void send_command(struct sim_tu *tu, int cmd)
+{
+    char buf[64];
+    int len;
+
+    if (cmd == TU_DIAL_CMD)
+    {
+        int ext = min_ext >= 0 ? min_ext + random() % (max_ext - min_ext + 1)
+                               : extensions[random() % num_extensions];
+        len = snprintf(buf, sizeof(buf), "%s %d%s", tu_command_names[cmd], ext, EOL);
+    }
+    else
+    {
+        len = snprintf(buf, sizeof(buf), "%s%s", tu_command_names[cmd], EOL);
+    }
+
+    if (write(tu->fd, buf, len) != len)
+    {
+        fprintf(stderr, "TU %d: unable to send command: %s\n", tu->ext, strerror(errno));
+        tu_fail(tu, &stats.send_failures);
+        return;
+    }
+
+    stats.commands++;
+    tu->awaiting = 1;
+    tu->sent_at = now_ns();
+}
+
+/*
+ * Count an error against a TU and drop its connection.  The other TUs
+ * carry on, so a single failure does not end the run.
+ */
+static void tu_fail(struct sim_tu *tu, uint64_t *counter)
+{
+    (*counter)++;
+    tu->closed = 1;
+    tu->awaiting = 0;
+    close(tu->fd);
+}
+
+/*
+ * Wake the TUs whose delay has expired.
+ */
+static void run_timers(uint64_t t)
+{
+    while (timers_head != NULL && timers_head->wake_at <= t)
+    {
+        struct sim_tu *tu = timers_head;
+        timers_head = tu->next_timer;
+        if (timers_head == NULL)
+            timers_tail = NULL;
+
+        tu->delaying = 0;
+        if (!tu->closed)
+            next_action(tu);
+    }
+}
+
+/*
+ * Choose a random action based on the current state.
+ */
+static int choose_action(TU_STATE state)
+{
+    double r = (double)random() / RAND_MAX;
+    double p = 0.0;
+
+    for (int i = 0; i < NUM_COMMANDS; i++)
+    {
+        p += action_probs[state][i];
+        if (r <= p)
+            return i;
+    }
+    return DELAY_COMMAND;
+}
+
+/*
+ * Parse a message from the PBX.
+ *
+ * @return the new state, NUM_STATES for a chat, or -1 if not recognized.
+ */
+static int parse_message(char *msg)
+{
+    for (int i = 0; i < NUM_STATES; i++)
+    {
+        if (strncmp(msg, tu_state_names[i], strlen(tu_state_names[i])) == 0)
+            return i;
+    }
+    if (strncmp(msg, "CHAT", 4) == 0)
+        return NUM_STATES;
+    return -1;
+}
+
+/*
+ * Construct a string representation of an expected state bitmap.
+ */
+static char *unparse_state_set(int set)
+{
+    static char buf[100];
+
+    strcpy(buf, "{ ");
+    for (int i = 0; i < NUM_STATES; i++)
+    {
+        if (set & (1 << i) || set & (1 << (i + RESYNC)))
+        {
+            strcat(buf, tu_state_names[i]);
+            if (set & (1 << (i + RESYNC)))
+                strcat(buf, "*");
+            strcat(buf, " ");
+        }
+    }
+    strcat(buf, "}");
+    return buf;
+}
+
+static void hist_record(struct histogram *h, uint64_t value)
+{
+    int index = value;
+
+    if (value >= HIST_SUB_BUCKETS)
+    {
+        int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        index = (shift + 1) * HIST_SUB_BUCKETS + (int)(value >> shift) - HIST_SUB_BUCKETS;
+    }
+
+    h->buckets[index]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+/*
+ * Get the lower bound of the bucket that contains the given percentile.
+ */
+static uint64_t hist_percentile(struct histogram *h, double p)
+{
+    uint64_t rank = h->count * p;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+        {
+            if (i < HIST_SUB_BUCKETS)
+                return i;
+            int shift = i / HIST_SUB_BUCKETS - 1;
+            return (uint64_t)(i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) << shift;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,478 @@
+/*
+ * Socket-free simulator of the PBX.
+ *
+ * Drives the PBX engine in-process, with no server and no connections:
+ * the output of every TU is taken by a sink (see outq_set_sink()) that
+ * decodes its notifications in the binary protocol and keeps a model of
+ * the TU's state from them.  Each thread owns a set of TUs and issues
+ * random commands on them, chosen with the tester's action table, as fast
+ * as the engine takes them.
+ *
+ * Every notification is checked as it arrives: the transition it reports
+ * must be a legal one, the extension notified with ON HOOK must be the
+ * TU's own and that notified with CONNECTED another TU's, and a chat may
+ * only arrive in a call.  Every few thousand commands the threads meet,
+ * and while they wait the pairs are checked: a TU connected to another
+ * must be the peer of that TU, and a TU in RING BACK must be ringing the
+ * TU it dialed, which is rung by no other.  At the end every TU is hung up
+ * and must be on hook.
+ *
+ * With -d, the PBX is split into that many shards, over which the TUs
+ * are dealt out in turn, so that most calls are between TUs of different
+ * shards, and are made by the messages between the shards (see shard.h).
+ * No thread owns a shard, so the messages are handled by the threads that
+ * post them, before their commands return.
+ *
+ * Prints the rate of commands and the number of violations found, and
+ * exits with failure status if there were any.
+ *
+ * Usage: pbx_sim [-t <threads>] [-n <TUs per thread>] [-s <seconds>]
+ *                [-c <commands between checks>] [-S <seed>] [-d <shards>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "proto.h"
+#include "outq.h"
+#include "registry.h"
+#include "log.h"
+#include "csapp.h"
+#include "tester_tables.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_TUS 64
+#define DEFAULT_SECONDS 5
+#define DEFAULT_CHECK 10000
+#define MAX_REPORTED 10         // Violations printed; the rest are only counted
+
+/*
+ * The descriptor given to the PBX for the TU of index i.  It is never
+ * opened, as the sink takes all output.
+ */
+#define SIM_FD_BASE OUTQ_VIRTUAL_FD
+
+/*
+ * Commands that dial the caller's own extension, and an extension that is
+ * not registered, out of SIM_DIAL_ODDS.
+ */
+#define SIM_DIAL_ODDS 32
+
+/*
+ * Model of one TU, as told by its notifications.  It is updated by the
+ * sink, with the TU's output queue locked, and read by the owning thread
+ * to choose commands and by the checks while all threads wait.
+ */
+struct sim_tu
+{
+    TU *tu;
+    int ext;
+    int state;                  // TU_STATE last notified
+    int arg;                    // Extension notified with it
+    int dialed;                 // Extension last dialed, set by the owner
+    int callee;                 // Extension rung, as of entering RING BACK
+    int binary;                 // PROTO_MAGIC received
+    unsigned char frame[PROTO_HEADER_SIZE + 4];
+    size_t have;                // Bytes of the current frame received
+    uint64_t notifications;
+    uint64_t chats;
+    uint64_t calls;
+} __attribute__((aligned(64)));
+
+struct sim_thread
+{
+    pthread_t tid;
+    int first;                  // Index of the first TU owned
+    unsigned seed;
+    uint64_t commands;
+} __attribute__((aligned(64)));
+
+static struct sim_tu *tus;
+static int ntus;
+static int *index_of;           // Index of the TU at each extension, or -1
+static int max_ext;
+static int missing_ext;         // An extension that is not registered
+static int per_thread;
+static int check_every;
+static double deadline;
+static int stop;
+static pthread_barrier_t barrier;
+static uint64_t checks;
+static uint64_t violations;
+
+/*
+ * Notifications that may follow each state, whatever the last command: the
+ * union of the tester's expected next states, in the normal case and when
+ * crossing in transit.
+ */
+static int legal_next[NUM_STATES];
+
+static void usage(void);
+static void sim_sink(int fd, const struct iovec *iov, int iovcnt);
+static void sim_byte(struct sim_tu *s, unsigned char c);
+static void sim_frame(struct sim_tu *s);
+static void *sim_thread(void *arg);
+static void sim_command(struct sim_tu *s, unsigned *seed);
+static void check_pairs(void);
+static void violation(const char *fmt, ...);
+static int lookup(int ext);
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    int threads = DEFAULT_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    unsigned seed = time(NULL);
+    int shards = 1;
+    int option;
+
+    per_thread = DEFAULT_TUS;
+    check_every = DEFAULT_CHECK;
+    while ((option = getopt(argc, argv, "t:n:s:c:S:d:")) != EOF)
+    {
+        switch (option)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            per_thread = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'c':
+            check_every = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            shards = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (threads < 1 || per_thread < 1 || seconds < 1 || check_every < 1 || shards < 1 ||
+        shards > REGISTRY_MAX_SHARDS)
+        usage();
+
+    for (int state = 0; state < NUM_STATES; state++)
+    {
+        for (int cmd = 0; cmd < NUM_COMMANDS; cmd++)
+            legal_next[state] |= next_states[state][cmd] | next_states[state][cmd] >> RESYNC;
+    }
+
+    // The PBX logs every call; only its warnings are of interest here.
+    log_set_level(LOG_LEVEL_WARN);
+    outq_set_sink(sim_sink);
+    registry_set_shards(shards);
+    pbx = pbx_init();
+
+    ntus = threads * per_thread;
+    tus = Calloc(ntus, sizeof(struct sim_tu));
+    for (int i = 0; i < ntus; i++)
+    {
+        if ((tus[i].tu = pbx_register(pbx, SIM_FD_BASE + i)) == NULL)
+        {
+            fprintf(stderr, "Unable to register %d TUs\n", ntus);
+            exit(EXIT_FAILURE);
+        }
+        tus[i].ext = tu_extension(tus[i].tu);
+        tus[i].state = TU_ON_HOOK;
+        tus[i].arg = tus[i].ext;
+        if (tus[i].ext > max_ext)
+            max_ext = tus[i].ext;
+    }
+    missing_ext = max_ext + 1;
+    index_of = Malloc((max_ext + 1) * sizeof(int));
+    memset(index_of, -1, (max_ext + 1) * sizeof(int));
+    for (int i = 0; i < ntus; i++)
+    {
+        index_of[tus[i].ext] = i;
+        tu_set_protocol(tus[i].tu, PROTO_BINARY);
+    }
+
+    printf("%d threads, %d TUs, %d shards, seed %u\n", threads, ntus, shards, seed);
+
+    struct sim_thread *ts = Calloc(threads, sizeof(struct sim_thread));
+    pthread_barrier_init(&barrier, NULL, threads);
+    double start = now();
+    deadline = start + seconds;
+    for (int t = 0; t < threads; t++)
+    {
+        ts[t].first = t * per_thread;
+        ts[t].seed = seed + t;
+        Pthread_create(&ts[t].tid, NULL, sim_thread, &ts[t]);
+    }
+    uint64_t commands = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        Pthread_join(ts[t].tid, NULL);
+        commands += ts[t].commands;
+    }
+    double elapsed = now() - start;
+
+    // Nobody dials any more, so a TU hung up stays on hook.
+    for (int i = 0; i < ntus; i++)
+        tu_hangup(tus[i].tu);
+    for (int i = 0; i < ntus; i++)
+    {
+        if (tus[i].state != TU_ON_HOOK)
+            violation("ext %d in state %s after hanging up", tus[i].ext, tu_state_names[tus[i].state]);
+    }
+
+    uint64_t notifications = 0, chats = 0, calls = 0;
+    for (int i = 0; i < ntus; i++)
+    {
+        notifications += tus[i].notifications;
+        chats += tus[i].chats;
+        calls += tus[i].calls;
+        pbx_unregister(pbx, tus[i].tu);
+    }
+    pbx_shutdown(pbx);
+
+    printf("%llu commands in %.2f s: %.0f commands/sec\n", (unsigned long long)commands, elapsed,
+           commands / elapsed);
+    printf("%llu notifications, %llu chats, %llu calls connected\n", (unsigned long long)notifications,
+           (unsigned long long)chats, (unsigned long long)calls);
+    printf("%llu checks, %llu violations\n", (unsigned long long)checks, (unsigned long long)violations);
+    return violations == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pbx_sim [-t <threads>] [-n <TUs per thread>] [-s <seconds>] "
+                    "[-c <commands between checks>] [-S <seed>] [-d <shards>]\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Take the output of a TU.
+ */
+static void sim_sink(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct sim_tu *s = &tus[fd - SIM_FD_BASE];
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const unsigned char *p = iov[i].iov_base;
+        for (size_t j = 0; j < iov[i].iov_len; j++)
+            sim_byte(s, p[j]);
+    }
+}
+
+/*
+ * Decode one byte of output: text up to PROTO_MAGIC is skipped, and the
+ * frames after it are collected, keeping the first 4 bytes of a payload.
+ */
+static void sim_byte(struct sim_tu *s, unsigned char c)
+{
+    if (!s->binary)
+    {
+        s->binary = c == PROTO_MAGIC;
+        return;
+    }
+
+    if (s->have < sizeof(s->frame))
+        s->frame[s->have] = c;
+    s->have++;
+    if (s->have >= PROTO_HEADER_SIZE && s->have == PROTO_HEADER_SIZE + (s->frame[2] << 8 | s->frame[3]))
+        sim_frame(s);
+}
+
+/*
+ * Check a frame received by a TU against its model, and update the model.
+ */
+static void sim_frame(struct sim_tu *s)
+{
+    int op = s->frame[0];
+    size_t len = s->have - PROTO_HEADER_SIZE;
+
+    s->have = 0;
+    if (op == PROTO_OP_CHAT || op == PROTO_OP_CHAT_PART)
+    {
+        s->chats++;
+        if (s->state != TU_CONNECTED)
+            violation("ext %d: chat in state %s", s->ext, tu_state_names[s->state]);
+        return;
+    }
+    if (op < PROTO_OP_STATE || op >= PROTO_OP_STATE + NUM_STATES || len != 4)
+    {
+        violation("ext %d: unexpected frame %#x of %zu bytes", s->ext, op, len);
+        return;
+    }
+
+    int new = op - PROTO_OP_STATE;
+    uint32_t arg;
+    memcpy(&arg, s->frame + PROTO_HEADER_SIZE, sizeof(arg));
+    arg = ntohl(arg);
+
+    s->notifications++;
+    if (!(legal_next[s->state] & 1 << new))
+        violation("ext %d: %s after %s", s->ext, tu_state_names[new], tu_state_names[s->state]);
+    if (new == TU_ON_HOOK && arg != s->ext)
+        violation("ext %d: ON HOOK %u", s->ext, arg);
+    if (new == TU_CONNECTED && (arg == s->ext || lookup(arg) < 0))
+        violation("ext %d: CONNECTED %u", s->ext, arg);
+
+    if (new == TU_RING_BACK && s->state != TU_RING_BACK)
+        s->callee = __atomic_load_n(&s->dialed, __ATOMIC_RELAXED);
+    if (new == TU_CONNECTED && s->state == TU_RING_BACK)
+        s->calls++;
+    __atomic_store_n(&s->state, new, __ATOMIC_RELAXED);
+    s->arg = arg;
+}
+
+/*
+ * Issue commands on the TUs of one thread until the deadline, meeting the
+ * other threads every check_every commands for the pairs to be checked.
+ */
+static void *sim_thread(void *arg)
+{
+    struct sim_thread *t = arg;
+
+    while (1)
+    {
+        for (int i = 0; i < check_every; i++)
+            sim_command(&tus[t->first + rand_r(&t->seed) % per_thread], &t->seed);
+        t->commands += check_every;
+
+        if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        {
+            check_pairs();
+            if (now() >= deadline)
+                stop = 1;
+        }
+        pthread_barrier_wait(&barrier);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Issue a random command on a TU, as the tester would in the TU's state,
+ * without delays.  Dials go to a random TU, or now and then to the TU
+ * itself or to an extension that is not registered.
+ */
+static void sim_command(struct sim_tu *s, unsigned *seed)
+{
+    int state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+    int cmd;
+
+    do
+    {
+        double r = (double)rand_r(seed) / RAND_MAX, p = 0.0;
+        for (cmd = 0; cmd < DELAY_COMMAND; cmd++)
+        {
+            p += action_probs[state][cmd];
+            if (r <= p)
+                break;
+        }
+    } while (cmd == DELAY_COMMAND);
+
+    if (cmd == TU_PICKUP_CMD)
+    {
+        tu_pickup(s->tu);
+    }
+    else if (cmd == TU_HANGUP_CMD)
+    {
+        tu_hangup(s->tu);
+    }
+    else if (cmd == TU_DIAL_CMD)
+    {
+        int odds = rand_r(seed) % SIM_DIAL_ODDS;
+        int ext = odds == 0 ? s->ext : odds == 1 ? missing_ext : tus[rand_r(seed) % ntus].ext;
+        __atomic_store_n(&s->dialed, ext, __ATOMIC_RELAXED);
+        tu_dial(s->tu, ext);
+    }
+    else
+    {
+        tu_chat(s->tu, "sim");
+    }
+}
+
+/*
+ * Check that the models of the TUs pair up.  Called while no command is
+ * in progress.
+ */
+static void check_pairs(void)
+{
+    static int *ringers;
+
+    if (ringers == NULL)
+        ringers = Malloc(ntus * sizeof(int));
+    memset(ringers, 0, ntus * sizeof(int));
+    checks++;
+
+    for (int i = 0; i < ntus; i++)
+    {
+        struct sim_tu *s = &tus[i];
+        if (s->state == TU_CONNECTED)
+        {
+            int p = lookup(s->arg);
+            if (p < 0 || tus[p].state != TU_CONNECTED || tus[p].arg != s->ext)
+                violation("ext %d CONNECTED %d, which is %s %d", s->ext, s->arg,
+                          p < 0 ? "unknown" : tu_state_names[tus[p].state], p < 0 ? 0 : tus[p].arg);
+        }
+        else if (s->state == TU_RING_BACK)
+        {
+            int p = lookup(s->callee);
+            if (p < 0 || tus[p].state != TU_RINGING)
+                violation("ext %d in RING BACK to %d, which is %s", s->ext, s->callee,
+                          p < 0 ? "unknown" : tu_state_names[tus[p].state]);
+            else
+                ringers[p]++;
+        }
+    }
+    for (int i = 0; i < ntus; i++)
+    {
+        if (tus[i].state == TU_RINGING && ringers[i] != 1)
+            violation("ext %d RINGING, rung by %d TUs", tus[i].ext, ringers[i]);
+    }
+}
+
+/*
+ * Count a violation, and print it if it is one of the first.
+ */
+static void violation(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (__atomic_fetch_add(&violations, 1, __ATOMIC_RELAXED) >= MAX_REPORTED)
+        return;
+    va_start(ap, fmt);
+    flockfile(stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+    va_end(ap);
+}
+
+/*
+ * Get the index of the TU registered at an extension, or -1.
+ */
+static int lookup(int ext)
+{
+    return ext >= 0 && ext <= max_ext ? index_of[ext] : -1;
+}
+
+/*
+ * Monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
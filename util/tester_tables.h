@@ -0,0 +1,134 @@
+#ifndef TESTER_TABLES_H
+#define TESTER_TABLES_H
+
+/*
+ * Tables that drive the simulated TUs of the tester and of the load
+ * generator.  They are included by both programs so that the load
+ * generator checks the server against exactly the same expectations
+ * as the tester.
+ */
+
+#include "pbx.h"
+
+/*
+ * Action table for the tester.
+ * The entries specify the probabilities of the possible actions that
+ * can be taken from a state.  There are small probabilities for taking
+ * "senseless" actions, in order to exercise edge cases.
+ */
+
+#define NUM_STATES 7
+#define NUM_COMMANDS 5
+#define DELAY_COMMAND (NUM_COMMANDS-1)
+
+static double action_probs[NUM_STATES][NUM_COMMANDS] = {
+//		  TU_PICKUP_CMD   TU_HANGUP_CMD   TU_DIAL_CMD   TU_CHAT_CMD   DELAY
+[TU_ON_HOOK]     {     0.1,            0.01,          0.01,         0.01,      0.87  },
+[TU_RINGING]     {     0.5,            0.01,          0.01,         0.01,      0.47  },
+[TU_DIAL_TONE]   {     0.01,           0.1,           0.67,         0.01,      0.2   },
+[TU_RING_BACK]   {     0.01,           0.1,           0.01,         0.01,      0.87  },
+[TU_BUSY_SIGNAL] {     0.01,           0.87,          0.01,         0.01,      0.1   },
+[TU_CONNECTED]   {     0.01,           0.1,           0.01,         0.1,       0.78  },
+[TU_ERROR]       {     0.01,           0.87,          0.01,         0.01,      0.1   }
+};
+
+/*
+ * Table of expected next states.
+ * Each entry is a bitmap that specifies a set of possible next states, given
+ * the current state and the last command that was issued.
+ *
+ * An issue that this tester has to handle is that commands to the server can
+ * "cross in transit" asynchronous state-change notifications coming back from the server.
+ * If we are currently in the TU_ON_HOOK state and we send a TU_PICKUP_CMD, it might
+ * be that the TU_PICKUP_CMD crosses in transit a TU_RINGING notification being sent
+ * back to us.  What we will see is a next-state notification of TU_RINGING, rather
+ * than the TU_DIAL_TONE notification that we would otherwise expect.
+ *
+ * To handle this, there are two classes of expected states encoded in each entry of
+ * the table.  The "normal case" encodes a TU_STATE s as the bit value 1<<s, and it
+ * indicates a state that we would expect to see if there were no "crossing in transit".
+ * The "abnormal case" encodes additional states that we might see when messages
+ * cross in transit.  These are encoded as 1<<(s+RESYNC), where RESYNC is larger than
+ * any TU_STATE value.  When we receive a state notification, it is checked against
+ * the expected state bitmap.  If we find that state among the "normal case" states,
+ * then nothing special happens and we proceed on to selecting the next command to send.
+ * On the other hand, if we find that state among the "abnormal case" states, then
+ * a "resync" flag is set and we do not immediately select a new command to send.
+ * Instead, we assume that what we have just received is an asynchronous state-change
+ * notification that crossed in transit our last command, and that the response to
+ * our last command is still forthcoming.  In this situation, we redetermine the set
+ * of expected events based on the new state, but the last command that we sent.
+ * When we finally do receive a "normal case" response, then the resynchronization is
+ * over and we proceed to send another command.
+ *
+ * A deficiency in the current implementation is that there ought to be a timeout after
+ * which we declare failure if a resynchronization has not completed within a short
+ * period of time.
+ *
+ * Another deficiency at the moment is that the tester tests that "bad things don't happen",
+ * but it doesn't really check that "good things do happen" (e.g. that calls get connected).
+ *
+ * One other deficiency is in the treatment of delays.  When the action chosen from a state
+ * is to delay, the delays will continue until a non-delay action is chosen, without reading
+ * any notifications from the server until the delay period is over.  It would be better if
+ * the arrival of notifications from the server was checked after each basic delay, but that
+ * would further complicate the program and it has not been implemented at this time.
+ */
+
+#define RESYNC NUM_STATES
+
+static int next_states[NUM_STATES][NUM_COMMANDS] = {
+  [TU_ON_HOOK] {
+      1<<TU_DIAL_TONE | 1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC),    // TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_HANGUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_DIAL_CMD
+      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_CHAT_CMD
+      1<<(TU_ON_HOOK+RESYNC) | 1<<(TU_RINGING+RESYNC)                       // DELAY
+  },
+  [TU_RINGING] {
+      1<<TU_CONNECTED | 1<<(TU_ON_HOOK+RESYNC) | 1<<(TU_RINGING+RESYNC),    // TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_HANGUP_CMD
+      1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_DIAL_CMD
+      1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_CHAT_CMD
+      1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC)                       // DELAY
+  },
+  [TU_DIAL_TONE] {
+      1<<TU_DIAL_TONE,                                                      // TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_DIAL_TONE+RESYNC),                             // TU_HANGUP_CMD
+      1<<TU_RING_BACK | 1<<TU_BUSY_SIGNAL | 1<<TU_ERROR
+                      | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_DIAL_CMD
+      1<<TU_DIAL_TONE,                                                      // TU_CHAT_CMD
+      1<<(TU_DIAL_TONE+RESYNC)                                              // DELAY
+  },
+  [TU_RING_BACK] {
+      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC)
+                    | 1<<(TU_RING_BACK+RESYNC),                             // TU_HANGUP_CMD
+      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_DIAL_CMD
+      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_CHAT_CMD
+      1<<(TU_RING_BACK+RESYNC) | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC) // DELAY
+  },
+  [TU_BUSY_SIGNAL] {
+      1<<TU_BUSY_SIGNAL,                                                    // TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_BUSY_SIGNAL+RESYNC),                           // TU_HANGUP_CMD
+      1<<TU_BUSY_SIGNAL,                                                    // TU_DIAL_CMD
+      1<<TU_BUSY_SIGNAL,                                                    // TU_CHAT_CMD
+      1<<(TU_BUSY_SIGNAL+RESYNC)                                            // DELAY
+  },
+  [TU_CONNECTED] {
+      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),// TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),  // TU_HANGUP_CMD
+      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_DIAL_CMD
+      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_CHAT_CMD
+      1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC)                   // DELAY
+  },
+  [TU_ERROR] {
+      1<<TU_ERROR,                                                          // TU_PICKUP_CMD
+      1<<TU_ON_HOOK | 1<<(TU_ERROR+RESYNC),                                 // TU_HANGUP_CMD
+      1<<TU_ERROR,                                                          // TU_DIAL_CMD
+      1<<TU_ERROR,                                                          // TU_CHAT_CMD
+      1<<(TU_ERROR+RESYNC)                                                  // DELAY
+  }
+};
+
+#endif